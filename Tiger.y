@@ -12,6 +12,9 @@ extern void ProcessTree(YYSTYPE tree);
 
 static IdTracker idProvider;
 
+// Parser stack grows as needed for nesting up to this depth
+#define YYMAXDEPTH 10000000
+
 %}
 
 %token SYM_COMMA
@@ -122,13 +125,13 @@ index_expression: lvalue SYM_OPENBRACKET expression SYM_CLOSEBRACKET {
 
 sequence_2plus: expression SYM_SEMICOLON expression {
                   Syntax::ExpressionList *s = new Syntax::ExpressionList;
-                  s->prepend($3);
-                  s->prepend($1);
+                  s->append($1);
+                  s->append($3);
                   $$ = s;
               }
-              | expression SYM_SEMICOLON sequence_2plus {
-                  Syntax::ExpressionList *s = (Syntax::ExpressionList *)$3;
-                  s->prepend($1);
+              | sequence_2plus SYM_SEMICOLON expression {
+                  Syntax::ExpressionList *s = (Syntax::ExpressionList *)$1;
+                  s->append($3);
                   $$ = s;
               }
 
@@ -137,12 +140,12 @@ sequence: {$$ = new Syntax::ExpressionList();}
 
 sequence_nonempty: expression {
                      Syntax::ExpressionList *s = new Syntax::ExpressionList();
-                     s->prepend($1);
+                     s->append($1);
                      $$ = s;
                  }
-                 | expression SYM_SEMICOLON sequence_nonempty {
-                     Syntax::ExpressionList *s = (Syntax::ExpressionList *)$3;
-                     s->prepend($1);
+                 | sequence_nonempty SYM_SEMICOLON expression {
+                     Syntax::ExpressionList *s = (Syntax::ExpressionList *)$1;
+                     s->append($3);
                      $$ = s;
                  }
               
@@ -155,12 +158,12 @@ commasequence: {$$ = new Syntax::ExpressionList;}
 
 commasequence_nonempty: expression {
                           Syntax::ExpressionList *s = new Syntax::ExpressionList();
-                          s->prepend($1);
+                          s->append($1);
                           $$ = s;
                       }
-                      | expression SYM_COMMA commasequence_nonempty {
-                          Syntax::ExpressionList *s = (Syntax::ExpressionList *)$3;
-                          s->prepend($1);
+                      | commasequence_nonempty SYM_COMMA expression {
+                          Syntax::ExpressionList *s = (Syntax::ExpressionList *)$1;
+                          s->append($3);
                           $$ = s;
                       }
 
@@ -173,19 +176,19 @@ fieldlist: {$$ = new Syntax::ExpressionList;}
 
 fieldlist_nonempty: SYM_ID SYM_EQUAL expression {
                       Syntax::ExpressionList *s = new Syntax::ExpressionList;
-                      s->prepend(new Syntax::BinaryOp(SYM_ASSIGN, $1, $3));
+                      s->append(new Syntax::BinaryOp(SYM_ASSIGN, $1, $3));
                       $$ = s;
                   }
-                  | SYM_ID SYM_EQUAL expression SYM_COMMA fieldlist_nonempty {
-                      Syntax::ExpressionList *s = (Syntax::ExpressionList *)$5;
-                      s->prepend(new Syntax::BinaryOp(SYM_ASSIGN, $1, $3));
+                  | fieldlist_nonempty SYM_COMMA SYM_ID SYM_EQUAL expression {
+                      Syntax::ExpressionList *s = (Syntax::ExpressionList *)$1;
+                      s->append(new Syntax::BinaryOp(SYM_ASSIGN, $3, $5));
                       $$ = s;
                   }
 
 declarations: {$$ = new Syntax::ExpressionList;}
-            | declaration declarations {
-                Syntax::ExpressionList *s = (Syntax::ExpressionList *)$2;
-                s->prepend($1);
+            | declarations declaration {
+                Syntax::ExpressionList *s = (Syntax::ExpressionList *)$1;
+                s->append($2);
                 $$ = s;
             }
 
@@ -204,12 +207,12 @@ fieldsdec: {$$ = new Syntax::ExpressionList;}
 
 fieldsdec_nonempty: SYM_ID SYM_COLON SYM_ID {
                       Syntax::ExpressionList *s = new Syntax::ExpressionList;
-                      s->prepend(new Syntax::ParameterDeclaration(idProvider.getId(), $1, $3));
+                      s->append(new Syntax::ParameterDeclaration(idProvider.getId(), $1, $3));
                       $$ = s;
                   }
-                  | SYM_ID SYM_COLON SYM_ID SYM_COMMA fieldsdec_nonempty {
-                      Syntax::ExpressionList *s = (Syntax::ExpressionList *)$5;
-                      s->prepend(new Syntax::ParameterDeclaration(idProvider.getId(), $1, $3));
+                  | fieldsdec_nonempty SYM_COMMA SYM_ID SYM_COLON SYM_ID {
+                      Syntax::ExpressionList *s = (Syntax::ExpressionList *)$1;
+                      s->append(new Syntax::ParameterDeclaration(idProvider.getId(), $3, $5));
                       $$ = s;
                   }
 
@@ -0,0 +1,52 @@
+#include "arena.h"
+#include <stdlib.h>
+#include "errormsg.h"
+
+enum {
+	ARENA_ALIGNMENT = 16,
+	MAX_CHUNK_SIZE = 1024*1024
+};
+
+Arena::Arena(size_t _chunk_size) : chunk_size(_chunk_size),
+	initial_chunk_size(_chunk_size), current(NULL), left(0), allocated(0)
+{
+}
+
+Arena::~Arena()
+{
+	release();
+}
+
+void *Arena::allocate(size_t size)
+{
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	if (size > left) {
+		size_t new_size = chunk_size;
+		if (size > new_size)
+			new_size = size;
+		// Small arenas stay small, big ones need few chunks
+		if (chunk_size < MAX_CHUNK_SIZE)
+			chunk_size *= 2;
+		current = (char *)malloc(new_size);
+		if (current == NULL)
+			Error::fatalError("Out of memory");
+		chunks.push_back(current);
+		left = new_size;
+	}
+	void *result = current;
+	current += size;
+	left -= size;
+	allocated += size;
+	return result;
+}
+
+void Arena::release()
+{
+	for (size_t i = 0; i < chunks.size(); i++)
+		free(chunks[i]);
+	chunks.clear();
+	chunk_size = initial_chunk_size;
+	current = NULL;
+	left = 0;
+	allocated = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <vector>
+#include <stddef.h>
+
+/**
+ * Bump allocator: memory is handed out from large chunks and is only
+ * returned all at once by release() or the destructor
+ */
+class Arena {
+private:
+	std::vector<char *> chunks;
+	/**
+	 * Doubles with every new chunk up to a limit
+	 */
+	size_t chunk_size, initial_chunk_size;
+	char *current;
+	size_t left;
+	size_t allocated;
+	
+	Arena(const Arena &);
+	Arena &operator=(const Arena &);
+public:
+	Arena(size_t _chunk_size = 64*1024);
+	~Arena();
+	
+	void *allocate(size_t size);
+	
+	/**
+	 * Free everything allocated so far, the arena stays usable
+	 */
+	void release();
+	
+	/**
+	 * Bytes handed out since the last release
+	 */
+	size_t getAllocatedSize() const {return allocated;}
+};
+
+#endif
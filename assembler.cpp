@@ -5,22 +5,25 @@
 
 namespace Asm {
 
-Instruction::Instruction(const std::string &_notation,
-	bool _reg_to_reg_assign)
-		: notation(_notation), label(NULL),
-		is_reg_to_reg_assign(_reg_to_reg_assign)
+Instruction::Instruction(int _opcode, const Operand &operand0,
+	const Operand &operand1)
+		: opcode(_opcode), label(NULL), is_reg_to_reg_assign(false)
 {
+	operands[0] = operand0;
+	operands[1] = operand1;
 	destinations.resize(1);
 	destinations[0] = NULL;
 }
 
 
-Instruction::Instruction(const std::string &_notation, int ninput,
-	IR::VirtualRegister **inputs,
+Instruction::Instruction(int _opcode, const Operand &operand0,
+	const Operand &operand1, int ninput, IR::VirtualRegister **inputs,
 	int noutput, IR::VirtualRegister **outputs, int ndest,
 	IR::Label **_destinations, bool _reg_to_reg_assign) :
-		notation(_notation), label(NULL), is_reg_to_reg_assign(_reg_to_reg_assign)
+		opcode(_opcode), label(NULL), is_reg_to_reg_assign(_reg_to_reg_assign)
 {
+	operands[0] = operand0;
+	operands[1] = operand1;
 	this->outputs.resize(noutput);
 	for (int i = 0; i < noutput; i++)
 		this->outputs[i] = outputs[i];
@@ -37,67 +40,529 @@ Instruction::Instruction(const std::string &_notation, int ninput,
 	}
 }
 
-Assembler::Assembler(IR::IREnvironment *ir_env)
-	: IRenvironment(ir_env), DebugPrinter("assembler.log")
-{
-	expr_templates.resize((int)IR::IR_EXPR_MAX);
-	for (int i = 0; i < IR::IR_EXPR_MAX; i++) {
-		if (i == (int)IR::IR_BINARYOP)
-			expr_templates[i] = new TemplateOpKindKindMap(IR::BINOP_MAX);
-		else
-			expr_templates[i] = new TemplateList;
+Operand *Instruction::findInputOperand(int number)
+{
+	for (int i = 0; i < MAX_OPERANDS; i++)
+		if (operands[i].usesInput(number))
+			return &operands[i];
+	return NULL;
+}
+
+Operand *Instruction::findOutputOperand(int number)
+{
+	for (int i = 0; i < MAX_OPERANDS; i++)
+		if ((operands[i].kind == OPERAND_REGISTER) && operands[i].is_output &&
+				(operands[i].reg == number))
+			return &operands[i];
+	return NULL;
+}
+
+bool TemplateMatcher::Pattern::operator<(const Pattern &other) const
+{
+	if (kind != other.kind)
+		return kind < other.kind;
+	if (sub != other.sub)
+		return sub < other.sub;
+	if (child[0] != other.child[0])
+		return child[0] < other.child[0];
+	return child[1] < other.child[1];
+}
+
+TemplateMatcher::TemplateMatcher() : register_pattern(-1), compiled(false)
+{
+}
+
+void TemplateMatcher::addTemplate(int code, IR::Expression *expr)
+{
+	assert(! compiled);
+	templates.push_back(InstructionTemplate(code, expr));
+}
+
+void TemplateMatcher::addTemplate(int code, IR::Statement *statm)
+{
+	assert(! compiled);
+	templates.push_back(InstructionTemplate(code, statm));
+}
+
+int TemplateMatcher::addPattern(IR::Expression *templ)
+{
+	Pattern pattern;
+	pattern.kind = templ->kind;
+	pattern.sub = 0;
+	pattern.child[0] = pattern.child[1] = -1;
+	switch (templ->kind) {
+		case IR::IR_INTEGER:
+			pattern.sub = IR::ToIntegerExpression(templ)->value;
+			break;
+		case IR::IR_LABELADDR:
+		case IR::IR_REGISTER:
+			break;
+		case IR::IR_BINARYOP:
+			pattern.sub = IR::ToBinaryOpExpression(templ)->operation;
+			pattern.child[0] = addPattern(IR::ToBinaryOpExpression(templ)->left);
+			pattern.child[1] = addPattern(IR::ToBinaryOpExpression(templ)->right);
+			break;
+		case IR::IR_MEMORY:
+			pattern.child[0] = addPattern(IR::ToMemoryExpression(templ)->address);
+			break;
+		case IR::IR_FUN_CALL:
+			pattern.child[0] = addPattern(IR::ToCallExpression(templ)->function);
+			break;
+		default:
+			Error::fatalError("Strange expression template kind");
+	}
+	
+	std::map<Pattern, int>::iterator existing = pattern_ids.find(pattern);
+	if (existing != pattern_ids.end())
+		return existing->second;
+	patterns.push_back(pattern);
+	pattern_ids[pattern] = patterns.size()-1;
+	if ((pattern.kind == IR::IR_INTEGER) && (pattern.sub != 0)) {
+		bool known = false;
+		for (size_t i = 0; i < integer_values.size(); i++)
+			if (integer_values[i] == pattern.sub)
+				known = true;
+		if (! known)
+			integer_values.push_back(pattern.sub);
+	}
+	return patterns.size()-1;
+}
+
+int TemplateMatcher::integerClass(int value) const
+{
+	for (size_t i = 0; i < integer_values.size(); i++)
+		if (integer_values[i] == value)
+			return i+1;
+	return 0;
+}
+
+int TemplateMatcher::expressionSignature(IR::Expression *expression) const
+{
+	int base = expression_signature_base[expression->kind];
+	switch (expression->kind) {
+		case IR::IR_INTEGER:
+			return base + integerClass(IR::ToIntegerExpression(expression)->value);
+		case IR::IR_BINARYOP:
+			return base + IR::ToBinaryOpExpression(expression)->operation;
+		default:
+			return base;
+	}
+}
+
+int TemplateMatcher::statementSignature(IR::Statement *statement) const
+{
+	int base = statement_signature_base[statement->kind];
+	if (statement->kind == IR::IR_COND_JUMP)
+		return base + IR::ToCondJumpStatement(statement)->comparison;
+	else
+		return base;
+}
+
+void TemplateMatcher::addRelevantPattern(Signature &signature, int position,
+	int pattern, int &slot)
+{
+	std::vector<int> &relevant = signature.relevant[position];
+	for (slot = 0; slot < (int)relevant.size(); slot++)
+		if (relevant[slot] == pattern)
+			return;
+	relevant.push_back(pattern);
+}
+
+void TemplateMatcher::addCandidate(InstructionTemplate *templ)
+{
+	Candidate candidate;
+	candidate.templ = templ;
+	candidate.pattern[0] = candidate.pattern[1] = -1;
+	candidate.slot[0] = candidate.slot[1] = -1;
+	int signature_index;
+	
+	if (templ->code->kind == IR::CODE_EXPRESSION) {
+		IR::Expression *expr = ((IR::ExpressionCode *)templ->code)->exp;
+		candidate.pattern[0] = addPattern(expr);
+		if (expr->kind == IR::IR_INTEGER) {
+			// A template for one value is tried for that value's class only,
+			// a template for any value for every class
+			for (int c = 0; c <= (int)integer_values.size(); c++)
+				if ((IR::ToIntegerExpression(expr)->value == 0) ||
+						(c == integerClass(IR::ToIntegerExpression(expr)->value)))
+					signatures[expression_signature_base[IR::IR_INTEGER] + c].
+						candidates.push_back(candidate);
+			return;
+		}
+		signature_index = expressionSignature(expr);
+	} else {
+		IR::Statement *statm = ((IR::StatementCode *)templ->code)->statm;
+		signature_index = statementSignature(statm);
+		Signature &signature = signatures[signature_index];
+		IR::Expression *children[2] = {NULL, NULL};
+		switch (statm->kind) {
+			case IR::IR_MOVE:
+				children[0] = IR::ToMoveStatement(statm)->to;
+				children[1] = IR::ToMoveStatement(statm)->from;
+				break;
+			case IR::IR_JUMP:
+				children[0] = IR::ToJumpStatement(statm)->dest;
+				break;
+			case IR::IR_COND_JUMP:
+				children[0] = IR::ToCondJumpStatement(statm)->left;
+				children[1] = IR::ToCondJumpStatement(statm)->right;
+				break;
+			case IR::IR_LABEL:
+				break;
+			default:
+				Error::fatalError("Strange statement template kind");
+		}
+		for (int i = 0; i < signature.arity; i++) {
+			candidate.pattern[i] = addPattern(children[i]);
+			addRelevantPattern(signature, i, candidate.pattern[i],
+				candidate.slot[i]);
+		}
+	}
+	signatures[signature_index].candidates.push_back(candidate);
+}
+
+void TemplateMatcher::compile()
+{
+	// Patterns first, since integer value classes determine signatures
+	for (std::deque<InstructionTemplate>::iterator templ = templates.begin();
+			templ != templates.end(); templ++)
+		if ((*templ).code->kind == IR::CODE_EXPRESSION)
+			addPattern(((IR::ExpressionCode *)(*templ).code)->exp);
+		else {
+			IR::Statement *statm = ((IR::StatementCode *)(*templ).code)->statm;
+			if (statm->kind == IR::IR_MOVE) {
+				addPattern(IR::ToMoveStatement(statm)->to);
+				addPattern(IR::ToMoveStatement(statm)->from);
+			} else if (statm->kind == IR::IR_JUMP)
+				addPattern(IR::ToJumpStatement(statm)->dest);
+			else if (statm->kind == IR::IR_COND_JUMP) {
+				addPattern(IR::ToCondJumpStatement(statm)->left);
+				addPattern(IR::ToCondJumpStatement(statm)->right);
+			}
+		}
+	IR::RegisterExpression register_templ(NULL);
+	register_pattern = addPattern(&register_templ);
+	
+	expression_signature_base.resize(IR::IR_EXPR_MAX);
+	for (int kind = 0; kind < IR::IR_EXPR_MAX; kind++) {
+		expression_signature_base[kind] = signatures.size();
+		int count = 1, arity = 0;
+		if (kind == IR::IR_INTEGER)
+			count = integer_values.size()+1;
+		else if (kind == IR::IR_BINARYOP) {
+			count = IR::BINOP_MAX;
+			arity = 2;
+		} else if ((kind == IR::IR_MEMORY) || (kind == IR::IR_FUN_CALL))
+			arity = 1;
+		signatures.resize(signatures.size() + count);
+		for (int i = 0; i < count; i++)
+			signatures[expression_signature_base[kind] + i].arity = arity;
+	}
+	statement_signature_base.resize(IR::IR_STAT_MAX);
+	for (int kind = 0; kind < IR::IR_STAT_MAX; kind++) {
+		statement_signature_base[kind] = signatures.size();
+		int count = 1, arity = 0;
+		if (kind == IR::IR_COND_JUMP) {
+			count = IR::COMPOP_MAX;
+			arity = 2;
+		} else if (kind == IR::IR_MOVE)
+			arity = 2;
+		else if (kind == IR::IR_JUMP)
+			arity = 1;
+		signatures.resize(signatures.size() + count);
+		for (int i = 0; i < count; i++) {
+			signatures[statement_signature_base[kind] + i].arity = arity;
+			signatures[statement_signature_base[kind] + i].exact_destination =
+				kind == IR::IR_MOVE;
+		}
+	}
+	
+	// Patterns rooted at each expression signature
+	for (int p = 0; p < (int)patterns.size(); p++) {
+		if (p == register_pattern)
+			continue;
+		Pattern &pattern = patterns[p];
+		int first = expression_signature_base[pattern.kind], last = first;
+		if (pattern.kind == IR::IR_INTEGER) {
+			if (pattern.sub == 0)
+				last = first + integer_values.size();
+			else
+				first = last = first + integerClass(pattern.sub);
+		} else if (pattern.kind == IR::IR_BINARYOP)
+			first = last = first + pattern.sub;
+		for (int sig = first; sig <= last; sig++) {
+			RootedPattern rooted;
+			rooted.pattern = p;
+			rooted.slot[0] = rooted.slot[1] = -1;
+			for (int i = 0; i < signatures[sig].arity; i++)
+				addRelevantPattern(signatures[sig], i, pattern.child[i],
+					rooted.slot[i]);
+			signatures[sig].rooted.push_back(rooted);
+		}
+	}
+	
+	for (std::deque<InstructionTemplate>::iterator templ = templates.begin();
+			templ != templates.end(); templ++)
+		addCandidate(&(*templ));
+	compiled = true;
+}
+
+int TemplateMatcher::project(Signature &signature, int position, int state)
+{
+	std::vector<int> &cache = signature.projection_of_state[position];
+	if (cache.size() <= (size_t)state)
+		cache.resize(states.size(), NOT_COMPUTED);
+	if (cache[state] == NOT_COMPUTED) {
+		const std::vector<int> &relevant = signature.relevant[position];
+		std::vector<int> projection(relevant.size());
+		for (size_t i = 0; i < relevant.size(); i++)
+			projection[i] = states[state].counts[relevant[i]];
+		std::map<std::vector<int>, int>::iterator existing =
+			signature.projection_ids[position].find(projection);
+		if (existing != signature.projection_ids[position].end())
+			cache[state] = existing->second;
+		else {
+			cache[state] = signature.projections[position].size();
+			signature.projection_ids[position][projection] = cache[state];
+			signature.projections[position].push_back(projection);
+		}
+	}
+	return cache[state];
+}
+
+int &TemplateMatcher::transition(Signature &signature, int *projections)
+{
+	std::vector<std::vector<int> > &table = signature.transitions;
+	if (table.size() <= (size_t)projections[0])
+		table.resize(projections[0]+1);
+	std::vector<int> &row = table[projections[0]];
+	if (row.size() <= (size_t)projections[1])
+		row.resize(projections[1]+1, NOT_COMPUTED);
+	return row[projections[1]];
+}
+
+int TemplateMatcher::makeState(int signature_index, int *projections)
+{
+	Signature &signature = signatures[signature_index];
+	std::vector<int> key(patterns.size() + 1, -1);
+	key[0] = signature_index;
+	int *counts = &key[1];
+	
+	// Register template matches anything, other nodes get computed separately
+	counts[register_pattern] =
+		(signature_index == expression_signature_base[IR::IR_REGISTER]) ? 1 : 0;
+	for (size_t r = 0; r < signature.rooted.size(); r++) {
+		const RootedPattern &rooted = signature.rooted[r];
+		int count = 1;
+		for (int i = 0; i < signature.arity; i++) {
+			int child_count =
+				signature.projections[i][projections[i]][rooted.slot[i]];
+			if (child_count < 0) {
+				count = -1;
+				break;
+			}
+			count += child_count;
+		}
+		counts[rooted.pattern] = count;
+	}
+	
+	std::map<std::vector<int>, int>::iterator existing = state_ids.find(key);
+	if (existing != state_ids.end())
+		return existing->second;
+	
+	if (states.size() >= MAX_STATES)
+		Error::fatalError("Too many instruction template matcher states");
+	states.push_back(State());
+	State &state = states.back();
+	state.signature = signature_index;
+	state.counts.assign(key.begin()+1, key.end());
+	state.best = NULL;
+	int best_nodecount = -1;
+	for (size_t c = 0; c < signature.candidates.size(); c++) {
+		int nodecount = state.counts[signature.candidates[c].pattern[0]];
+		if (nodecount > best_nodecount) {
+			best_nodecount = nodecount;
+			state.best = signature.candidates[c].templ;
+		}
+	}
+	state_ids[key] = states.size()-1;
+	return states.size()-1;
+}
+
+int TemplateMatcher::chooseStatementTemplate(Signature &signature,
+	int *projections)
+{
+	int best = NO_TEMPLATE;
+	int best_nodecount = -1;
+	for (size_t c = 0; c < signature.candidates.size(); c++) {
+		const Candidate &candidate = signature.candidates[c];
+		int nodecount = 1;
+		for (int i = 0; i < signature.arity; i++) {
+			int child_count =
+				signature.projections[i][projections[i]][candidate.slot[i]];
+			if (child_count < 0) {
+				nodecount = -1;
+				break;
+			}
+			nodecount += child_count;
+		}
+		if (signature.exact_destination && (nodecount >= 0) &&
+				(candidate.pattern[0] == register_pattern) &&
+				(signature.projections[0][projections[0]][candidate.slot[0]] == 0))
+			nodecount = -1;
+		if (nodecount > best_nodecount) {
+			best_nodecount = nodecount;
+			best = c;
+		}
 	}
+	return best;
+}
+
+void TemplateMatcher::computeTables()
+{
+	assert(compiled);
+	// Go over every combination of child states until no new states
+	// appear, after that matching only reads the tables
+	size_t known_states;
+	do {
+		known_states = states.size();
+		for (int sig = expression_signature_base[0];
+				sig < statement_signature_base[0]; sig++) {
+			Signature &signature = signatures[sig];
+			for (int i = 0; i < signature.arity; i++)
+				for (size_t s = 0; s < states.size(); s++)
+					project(signature, i, s);
+			int projections[2];
+			int count0 = (signature.arity > 0) ? signature.projections[0].size() : 1;
+			int count1 = (signature.arity > 1) ? signature.projections[1].size() : 1;
+			for (projections[0] = 0; projections[0] < count0; projections[0]++)
+				for (projections[1] = 0; projections[1] < count1; projections[1]++)
+					if (transition(signature, projections) == NOT_COMPUTED) {
+						int state = makeState(sig, projections);
+						transition(signature, projections) = state;
+					}
+		}
+	} while (states.size() != known_states);
 	
-	statm_templates.resize((int)IR::IR_STAT_MAX);
-	for (int i = 0; i < IR::IR_STAT_MAX; i++) {
-		if (i == (int)IR::IR_COND_JUMP)
-			statm_templates[i] = new TemplateOpKindKindMap(IR::COMPOP_MAX);
-		else
-			statm_templates[i] = new TemplateList;
+	for (size_t sig = statement_signature_base[0]; sig < signatures.size(); sig++) {
+		Signature &signature = signatures[sig];
+		for (int i = 0; i < signature.arity; i++)
+			for (size_t s = 0; s < states.size(); s++)
+				project(signature, i, s);
+		int projections[2];
+		int count0 = (signature.arity > 0) ? signature.projections[0].size() : 1;
+		int count1 = (signature.arity > 1) ? signature.projections[1].size() : 1;
+		for (projections[0] = 0; projections[0] < count0; projections[0]++)
+			for (projections[1] = 0; projections[1] < count1; projections[1]++)
+				if (transition(signature, projections) == NOT_COMPUTED)
+					transition(signature, projections) =
+						chooseStatementTemplate(signature, projections);
 	}
 }
 
-std::list<InstructionTemplate> *Assembler::getTemplatesList(IR::Expression *expr)
+/**
+ * Children of the expression that matching looks into, returns how many
+ */
+static int MatchedChildren(IR::Expression *expression, IR::Expression **children)
 {
-	if (expr->kind == IR::IR_BINARYOP) {
-		IR::BinaryOpExpression *binop = IR::ToBinaryOpExpression(expr);
-		return ((TemplateOpKindKindMap *)expr_templates[(int)expr->kind])->
-			getList((int)binop->operation/*, (int)binop->left->kind, (int)binop->right->kind*/);
-	} else
-		return & ((TemplateList *)expr_templates[(int)expr->kind])->list;
+	switch (expression->kind) {
+		case IR::IR_BINARYOP:
+			children[0] = IR::ToBinaryOpExpression(expression)->left;
+			children[1] = IR::ToBinaryOpExpression(expression)->right;
+			return 2;
+		case IR::IR_MEMORY:
+			children[0] = IR::ToMemoryExpression(expression)->address;
+			return 1;
+		case IR::IR_FUN_CALL:
+			children[0] = IR::ToCallExpression(expression)->function;
+			return 1;
+		default:
+			return 0;
+	}
 }
 
-std::list<InstructionTemplate> *Assembler::getTemplatesList(IR::Statement *statm)
+int TemplateMatcher::label(IR::Expression *expression)
 {
-	if ((statm->kind == IR::IR_COND_JUMP) /*|| (statm->kind = IR::IR_MOVE)*/) {
-		int op, kind1, kind2;
-// 		if (statm->kind == IR::IR_COND_JUMP) {
-			IR::CondJumpStatement *cj = IR::ToCondJumpStatement(statm);
-			op = (int)cj->comparison;
-			kind1 = (int)cj->left->kind;
-			kind2 = (int)cj->right->kind;
-// 		} else {
-// 			IR::MoveStatement *m = IR::ToMoveStatement(statm);
-// 			op = 0;
-// 			kind1 = (int)m->to->kind;
-// 			kind2 = (int)m->from->kind;
-// 		}
-		return ((TemplateOpKindKindMap *)statm_templates[(int)statm->kind])->
-			getList(op/*, kind1, kind2*/);
-	} else
-		return & ((TemplateList *)statm_templates[(int)statm->kind])->list;
+	// Children get their states before their parents. The stack is
+	// explicit since expressions may be nested as deep as the program.
+	std::vector<IR::Expression *> pending(1, expression);
+	while (! pending.empty()) {
+		IR::Expression *node = pending.back();
+		if (node->match_state >= 0) {
+			pending.pop_back();
+			continue;
+		}
+		IR::Expression *children[2];
+		int child_count = MatchedChildren(node, children);
+		bool children_done = true;
+		for (int i = child_count-1; i >= 0; i--)
+			if (children[i]->match_state < 0) {
+				pending.push_back(children[i]);
+				children_done = false;
+			}
+		if (! children_done)
+			continue;
+		pending.pop_back();
+		
+		int signature_index = expressionSignature(node);
+		Signature &signature = signatures[signature_index];
+		int projections[2] = {0, 0};
+		for (int i = 0; i < child_count; i++)
+			projections[i] = project(signature, i, children[i]->match_state);
+		int state = transition(signature, projections);
+		if (state == NOT_COMPUTED) {
+			state = makeState(signature_index, projections);
+			transition(signature, projections) = state;
+		}
+		node->match_state = state;
+	}
+	return expression->match_state;
 }
 
-void Assembler::addTemplate(int code, IR::Expression *expr)
+InstructionTemplate *TemplateMatcher::findTemplate(IR::Expression *expression)
 {
-	std::list<InstructionTemplate> *list = getTemplatesList(expr);
-	list->push_back(InstructionTemplate(code, expr));
+	assert(compiled);
+	return states[label(expression)].best;
 }
 
-void Assembler::addTemplate(int code, IR::Statement *statm)
+InstructionTemplate *TemplateMatcher::findTemplate(IR::Statement *statement)
+{
+	assert(compiled);
+	IR::Expression *children[2] = {NULL, NULL};
+	switch (statement->kind) {
+		case IR::IR_MOVE:
+			children[0] = IR::ToMoveStatement(statement)->to;
+			children[1] = IR::ToMoveStatement(statement)->from;
+			break;
+		case IR::IR_JUMP:
+			children[0] = IR::ToJumpStatement(statement)->dest;
+			break;
+		case IR::IR_COND_JUMP:
+			children[0] = IR::ToCondJumpStatement(statement)->left;
+			children[1] = IR::ToCondJumpStatement(statement)->right;
+			break;
+		default:
+			break;
+	}
+	
+	Signature &signature = signatures[statementSignature(statement)];
+	int projections[2] = {0, 0};
+	for (int i = 0; i < signature.arity; i++)
+		projections[i] = project(signature, i, label(children[i]));
+	int choice = transition(signature, projections);
+	if (choice == NOT_COMPUTED) {
+		choice = chooseStatementTemplate(signature, projections);
+		transition(signature, projections) = choice;
+	}
+	if (choice == NO_TEMPLATE)
+		return NULL;
+	else
+		return signature.candidates[choice].templ;
+}
+
+Assembler::Assembler(IR::IREnvironment *ir_env)
+	: DebugPrinter("assembler.log"), IRenvironment(ir_env), matcher(NULL)
 {
-	std::list<InstructionTemplate> *list = getTemplatesList(statm);
-	list->push_back(InstructionTemplate(code, statm));
 }
 
 bool Assembler::MatchMoveDestination(IR::Expression *expression, IR::Expression *templ,
@@ -162,7 +627,7 @@ bool Assembler::MatchExpression(IR::Expression *expression, IR::Expression *temp
 				*template_instantiation = call_inst;
 			}
 			if (children != NULL) {
-				for (std::list<IR::Expression *>::iterator arg =
+				for (IR::ExpressionList::iterator arg =
 					call_expr->arguments.begin(); arg != call_expr->arguments.end();
 					arg++) {
 					children->push_back(TemplateChildInfo(NULL, *arg));
@@ -281,77 +746,43 @@ bool Assembler::MatchStatement(IR::Statement *statement, IR::Statement *templ,
 	}
 }
 
-void Assembler::FindExpressionTemplate(IR::Expression* expression,
-	InstructionTemplate* &templ)
-{
-	std::list<InstructionTemplate> *templates = getTemplatesList(expression);
-	int best_nodecount = -1;
-	templ = NULL;
-	for (std::list<InstructionTemplate>::iterator cur_templ = templates->begin();
-			cur_templ  != templates->end(); cur_templ ++) {
-		assert((*cur_templ ).code->kind == IR::CODE_EXPRESSION);
-		IR::Expression *templ_exp = ((IR::ExpressionCode *) (*cur_templ ).code)->exp;
-		int nodecount = 0;
-		std::list<IR::Expression *> current_children;
-		if (MatchExpression(expression, templ_exp, nodecount)) {
-			if (nodecount > best_nodecount) {
-				best_nodecount = nodecount;
-				templ = &(*cur_templ);
-			}
-		}
-	}
-}
-
-void Assembler::FindStatementTemplate(IR::Statement* statement,
-	InstructionTemplate* &templ)
-{
-	std::list<InstructionTemplate> *templates = getTemplatesList(statement);
-	int best_nodecount = -1;
-	templ = NULL;
-
-	for (std::list<InstructionTemplate>::iterator cur_templ = templates->begin();
-			cur_templ != templates->end(); cur_templ++) {
-		assert((*cur_templ).code->kind == IR::CODE_STATEMENT);
-		IR::Statement *templ_statm = ((IR::StatementCode *) (*cur_templ).code)->statm;
-		int nodecount = 0;
-		std::list<IR::Expression *> current_children;
-		if (MatchStatement(statement, templ_statm, nodecount)) {
-			if (nodecount > best_nodecount) {
-				best_nodecount = nodecount;
-				templ = &(*cur_templ);
-			}
-		}
-	}
-}
-
 void Assembler::translateExpression(IR::Expression* expression,
 	IR::AbstractFrame *frame, IR::VirtualRegister* value_storage, 
 	Instructions& result)
 {
-	if (expression->kind == IR::IR_STAT_EXP_SEQ) {
-		IR::StatExpSequence *statexp = IR::ToStatExpSequence(expression);
-		translateStatement(statexp->stat, frame, result);
-		translateExpression(statexp->exp, frame, value_storage, result);
-	} else {
-		InstructionTemplate *templ;
-		FindExpressionTemplate(expression, templ);
-		if (templ == NULL)
-			Error::fatalError("Failed to find expression template");
-		
-		std::list<TemplateChildInfo> children;
-		IR::Expression *template_instantiation;
-		assert(templ->code->kind == IR::CODE_EXPRESSION);
-		int nodecount = 0;
-		MatchExpression(expression, ((IR::ExpressionCode *)templ->code)->exp,
-			nodecount, &children, &template_instantiation);
-		for (std::list<TemplateChildInfo>::iterator child = children.begin();
-				child != children.end(); child++)
-			translateExpression((*child).expression, frame, (*child).value_storage,
-				result);
-		translateExpressionTemplate(template_instantiation, frame, value_storage,
-			children, result);
-		
-		IR::DestroyExpression(template_instantiation);
+	// Expressions glued to a template are translated before it. The stack
+	// is explicit since they may be nested as deep as the program, and a
+	// deque since references to its elements must stay valid.
+	std::deque<PendingExpression> pending;
+	pending.push_back(PendingExpression(expression, value_storage));
+	while (! pending.empty()) {
+		PendingExpression &top = pending.back();
+		if (top.template_instantiation == NULL) {
+			while (top.expression->kind == IR::IR_STAT_EXP_SEQ) {
+				IR::StatExpSequence *statexp = IR::ToStatExpSequence(top.expression);
+				translateStatement(statexp->stat, frame, result);
+				top.expression = statexp->exp;
+			}
+			InstructionTemplate *templ = matcher->findTemplate(top.expression);
+			if (templ == NULL)
+				Error::fatalError("Failed to find expression template");
+			assert(templ->code->kind == IR::CODE_EXPRESSION);
+			int nodecount = 0;
+			MatchExpression(top.expression, ((IR::ExpressionCode *)templ->code)->exp,
+				nodecount, &top.children, &top.template_instantiation);
+			top.next_child = top.children.begin();
+		}
+		if (top.next_child != top.children.end()) {
+			TemplateChildInfo &child = *top.next_child;
+			top.next_child++;
+			pending.push_back(PendingExpression(child.expression,
+				child.value_storage));
+			continue;
+		}
+		translateExpressionTemplate(top.template_instantiation, frame,
+			top.value_storage, top.children, result);
+		IR::DestroyExpression(top.template_instantiation);
+		pending.pop_back();
 	}
 }
 
@@ -360,15 +791,14 @@ void Assembler::translateStatement(IR::Statement* statement,
 {
 	if (statement->kind == IR::IR_STAT_SEQ) {
 		IR::StatementSequence *seq = IR::ToStatementSequence(statement);
-		for (std::list<IR::Statement *>::iterator statm = seq->statements.begin();
+		for (IR::StatementList::iterator statm = seq->statements.begin();
 				statm != seq->statements.end(); statm++)
 			 translateStatement(*statm, frame, result);
 	} else if (statement->kind == IR::IR_EXP_IGNORE_RESULT) {
 		translateExpression(IR::ToExpressionStatement(statement)->exp, 
 			frame, NULL, result);
 	} else {
-		InstructionTemplate *templ;
-		FindStatementTemplate(statement, templ);
+		InstructionTemplate *templ = matcher->findTemplate(statement);
 		if (templ == NULL)
 			Error::fatalError("Failed to find statement template");
 		
@@ -401,107 +831,126 @@ IR::VirtualRegister *MapRegister(const IR::RegisterMap *register_map,
 		return reg;
 }
 
-void Assembler::outputCode(FILE* output, const std::list<Instructions>& code,
+void MachineCode::append(const MachineCode &code)
+{
+	size_t base = bytes.size();
+	bytes.insert(bytes.end(), code.bytes.begin(), code.bytes.end());
+	for (size_t i = 0; i < code.labels.size(); i++)
+		labels.push_back(LabelPosition(code.labels[i].label,
+			base + code.labels[i].offset));
+	for (size_t i = 0; i < code.references.size(); i++) {
+		references.push_back(code.references[i]);
+		references.back().offset += base;
+	}
+}
+
+bool Assembler::isRedundantMove(const Instruction &inst,
 	const IR::RegisterMap *register_map)
 {
-	std::string header;
-	getCodeSectionHeader(header);
-	fwrite(header.c_str(), header.size(), 1, output);
-	if ((header.size() > 0) && (header[header.size()-1] != '\n'))
-		fputc('\n', output);
-	
-	for (std::list<Instructions>::const_iterator chunk = code.begin();
-			chunk != code.end(); chunk++) {
-		int line = 0;
-		for (Instructions::const_iterator inst = (*chunk).begin();
-				inst != (*chunk).end(); inst++, line++) {
-			const std::string &s = (*inst).notation;
-			
-			if ((*inst).is_reg_to_reg_assign) {
-				assert((*inst).inputs.size() == 1);
-				assert((*inst).outputs.size() == 1);
-				if (MapRegister(register_map, (*inst).inputs[0])->getIndex() ==
-						MapRegister(register_map, (*inst).outputs[0])->getIndex())
-					continue;
-			}
-			int len = 0;
-			if ((s.size() > 0) && (s[s.size()-1] != ':')) {
-				fputs("    ", output);
-				len += 4;
-			}
-		
-			int i = 0;
-			while (i < s.size()) {
-				if (s[i] != '&') {
-					fputc(s[i], output);
-					len++;
-					i++;
-				} else {
-					i++;
-					if (i+1 < s.size()) {
-						int arg_index = s[i+1] - '0';
-						const std::vector<IR::VirtualRegister *> *registers;
-						
-						if (s[i] == 'i')
-							registers = &(*inst).inputs;
-						else if (s[i] == 'o')
-							registers = &(*inst).outputs;
-						else
-							Error::fatalError("Misformed instruction");
-						
-						if (arg_index > (*registers).size())
-							Error::fatalError("Misformed instruction");
-						else {
-							IR::VirtualRegister *reg =
-								MapRegister(register_map, (*registers)[arg_index]);
-							fprintf(output, "%s", reg->getName().c_str());
-							len += reg->getName().size();
-						}
-						i += 2;
-					}
-				}
-			}
-			for (int i = 0; i < 35-len; i++)
-				fputc(' ', output);
-			fprintf(output, " # %2d ", line);
-			if ((*inst).is_reg_to_reg_assign)
-				fprintf(output, "MOVE ");
-			bool use_reg = false;
-			if ((*inst).inputs.size() > 0) {
-				use_reg = true;
-				fprintf(output, "<- ");
-				for (int i = 0; i < (*inst).inputs.size(); i++)
-					fprintf(output, "%s ", (*inst).inputs[i]->getName().c_str());
-			}
-			if ((*inst).outputs.size() > 0) {
-				use_reg = true;
-				fprintf(output, "-> ");
-				for (int i = 0; i < (*inst).outputs.size(); i++)
-					fprintf(output, "%s ", (*inst).outputs[i]->getName().c_str());
-			}
-			if (! use_reg)
-				fprintf(output, "no register use");
-			fputc('\n', output);
+	if (! inst.is_reg_to_reg_assign)
+		return false;
+	assert(inst.inputs.size() == 1);
+	assert(inst.outputs.size() == 1);
+	return MapRegister(register_map, inst.inputs[0])->getIndex() ==
+		MapRegister(register_map, inst.outputs[0])->getIndex();
+}
+
+void Assembler::outputCodeHeader(std::string &output)
+{
+	size_t start = output.size();
+	getCodeSectionHeader(output);
+	if ((output.size() > start) && (output[output.size()-1] != '\n'))
+		output += '\n';
+}
+
+/**
+ * Number of the instruction and the registers it uses
+ */
+static void AnnotateInstruction(std::string &output, const Instruction &inst,
+	int line)
+{
+	output += " # ";
+	if (line < 10)
+		output += ' ';
+	output += IntToStr(line);
+	output += ' ';
+	if (inst.is_reg_to_reg_assign)
+		output += "MOVE ";
+	if (inst.inputs.size() > 0) {
+		output += "<- ";
+		for (size_t i = 0; i < inst.inputs.size(); i++) {
+			output += inst.inputs[i]->getName();
+			output += ' ';
+		}
+	}
+	if (inst.outputs.size() > 0) {
+		output += "-> ";
+		for (size_t i = 0; i < inst.outputs.size(); i++) {
+			output += inst.outputs[i]->getName();
+			output += ' ';
+		}
+	}
+	if ((inst.inputs.size() == 0) && (inst.outputs.size() == 0))
+		output += "no register use";
+}
+
+void Assembler::outputInstructions(std::string &output, const Instructions &code,
+	const IR::RegisterMap *register_map, bool annotate)
+{
+	int line = 0;
+	for (Instructions::const_iterator inst = code.begin();
+			inst != code.end(); inst++, line++) {
+		if (isRedundantMove(*inst, register_map))
+			continue;
+		size_t start = output.size();
+		output += "    ";
+		formatInstruction(*inst, register_map, output);
+		// Labels are not indented
+		if ((output.size() == start + 4) || (output[output.size()-1] == ':'))
+			output.erase(start, 4);
+		if (annotate) {
+			int len = output.size() - start;
+			if (len < 35)
+				output.append(35 - len, ' ');
+			AnnotateInstruction(output, *inst, line);
 		}
+		output += '\n';
 	}
 }
 
-void Assembler::outputBlobs(FILE* output, const std::list< IR::Blob >& blobs)
+void Assembler::outputBlobs(std::string &output, const std::list< IR::Blob >& blobs)
 {
 	Instructions content;
 	for (std::list<IR::Blob>::const_iterator blob = blobs.begin();
 			blob != blobs.end(); blob++)
 		translateBlob(*blob, content);
 	
-	std::string header;
-	getBlobSectionHeader(header);
-	fwrite(header.c_str(), header.size(), 1, output);
-	if ((header.size() > 0) && (header[header.size()-1] != '\n'))
-		fputc('\n', output);
+	size_t start = output.size();
+	getBlobSectionHeader(output);
+	if ((output.size() > start) && (output[output.size()-1] != '\n'))
+		output += '\n';
 	
 	for (std::list<Instruction>::const_iterator inst = content.begin();
-			inst != content.end(); inst++)
-		fprintf(output, "%s\n", (*inst).notation.c_str());
+			inst != content.end(); inst++) {
+		formatInstruction(*inst, NULL, output);
+		output += '\n';
+	}
+}
+
+void Assembler::encodeBlobs(const std::list<IR::Blob> &blobs,
+	MachineCode &result)
+{
+	Instructions content;
+	for (std::list<IR::Blob>::const_iterator blob = blobs.begin();
+			blob != blobs.end(); blob++)
+		translateBlob(*blob, content);
+	encodeInstructions(content, NULL, result);
+}
+
+void Assembler::prepareForThreads()
+{
+	// The matcher is shared, and computing on first use writes its tables
+	matcher->computeTables();
 }
 
 void Assembler::translateFunctionBody(IR::Code* code, IR::Label *fcn_label,
@@ -4,6 +4,8 @@
 #include "intermediate.h"
 #include "translate_utils.h"
 #include "debugprint.h"
+#include <map>
+#include <deque>
 
 namespace Asm {
 
@@ -24,57 +26,285 @@ struct InstructionTemplate {
 	{}
 };
 
-enum TemplateListKind {
-	TL_LIST,
-	TL_OP_KIND_KIND_MAP,
-};
-
-class TemplateStorage {
+/**
+ * Bottom-up tree matching automaton compiled from the templates.
+ * 
+ * Every expression node is labeled with a state that tells which template
+ * subtrees (patterns) match it and with what node count. The state is
+ * found in one table lookup from the node's signature (kind plus
+ * operation or integer value class) and its children's states, so the
+ * best template for a node is known without trying templates one by one.
+ * 
+ * Transition tables are indexed by projections of the child states on the
+ * patterns that matter at that child position, and are filled on first use.
+ */
+class TemplateMatcher {
+private:
+	enum {NO_TEMPLATE = -2, NOT_COMPUTED = -1};
+	/**
+	 * Far more than the x86-64 templates reach, protects against a
+	 * template set whose states multiply without end
+	 */
+	enum {MAX_STATES = 16384};
+	
+	struct Pattern {
+		int kind;
+		/**
+		 * Operation for binary operations, value for integers (0 matches
+		 * any integer)
+		 */
+		int sub;
+		int child[2];
+		
+		bool operator<(const Pattern &other) const;
+	};
+	
+	/**
+	 * Pattern rooted at the node together with where its children's
+	 * patterns are in the child state projections
+	 */
+	struct RootedPattern {
+		int pattern;
+		int slot[2];
+	};
+	
+	struct Candidate {
+		InstructionTemplate *templ;
+		/**
+		 * Root pattern for expressions, child patterns for statements
+		 */
+		int pattern[2];
+		int slot[2];
+	};
+	
+	struct Signature {
+		int arity;
+		/**
+		 * Move destination must be of the template's kind, a register
+		 * template doesn't take other expressions there
+		 */
+		bool exact_destination;
+		std::vector<Candidate> candidates;
+		std::vector<RootedPattern> rooted;
+		/**
+		 * Patterns whose node counts are relevant at each child position
+		 */
+		std::vector<int> relevant[2];
+		std::vector<int> projection_of_state[2];
+		std::map<std::vector<int>, int> projection_ids[2];
+		std::vector<std::vector<int> > projections[2];
+		/**
+		 * Indexed by child projections, gives the state for expressions
+		 * and the index in candidates for statements
+		 */
+		std::vector<std::vector<int> > transitions;
+		
+		Signature() : arity(0), exact_destination(false) {}
+	};
+	
+	struct State {
+		int signature;
+		/**
+		 * Node count for every pattern, -1 if it doesn't match
+		 */
+		std::vector<int> counts;
+		InstructionTemplate *best;
+	};
+	
+	/**
+	 * Deque so that pointers to templates stay valid while adding
+	 */
+	std::deque<InstructionTemplate> templates;
+	std::vector<Pattern> patterns;
+	std::map<Pattern, int> pattern_ids;
+	int register_pattern;
+	/**
+	 * Non-zero integers found in patterns, value class is index + 1
+	 */
+	std::vector<int> integer_values;
+	std::vector<int> expression_signature_base, statement_signature_base;
+	std::vector<Signature> signatures;
+	std::vector<State> states;
+	std::map<std::vector<int>, int> state_ids;
+	bool compiled;
+	
+	int addPattern(IR::Expression *templ);
+	int integerClass(int value) const;
+	int expressionSignature(IR::Expression *expression) const;
+	int statementSignature(IR::Statement *statement) const;
+	void addCandidate(InstructionTemplate *templ);
+	void addRelevantPattern(Signature &signature, int position, int pattern,
+		int &slot);
+	int project(Signature &signature, int position, int state);
+	int &transition(Signature &signature, int *child_states);
+	int makeState(int signature_index, int *projections);
+	int chooseStatementTemplate(Signature &signature, int *projections);
+	int label(IR::Expression *expression);
 public:
-	TemplateListKind kind;
+	TemplateMatcher();
+	
+	void addTemplate(int code, IR::Expression *expr);
+	void addTemplate(int code, IR::Statement *statm);
+	/**
+	 * Build pattern and signature tables, to be called after all
+	 * templates are added. States and transitions are added as matching
+	 * meets them, so only the few a program needs get computed.
+	 */
+	void compile();
+	/**
+	 * Compute every state and transition, after which matching only
+	 * reads the tables
+	 */
+	void computeTables();
 	
-	TemplateStorage(TemplateListKind _kind) : kind(_kind) {}
+	/**
+	 * Template matching the most nodes, first added one if there are
+	 * several, NULL if none. Can be called from several threads at once
+	 * only after computeTables.
+	 */
+	InstructionTemplate *findTemplate(IR::Expression *expression);
+	InstructionTemplate *findTemplate(IR::Statement *statement);
+	
+	int getStateCount() const {return states.size();}
 };
 
-class TemplateList: public TemplateStorage {
-public:
-	std::list<InstructionTemplate> list;
-
-	TemplateList() : TemplateStorage(TL_LIST) {}
+enum OperandKind {
+	OPERAND_NONE,
+	/**
+	 * Register from the instruction's inputs or outputs
+	 */
+	OPERAND_REGISTER,
+	/**
+	 * Register hardcoded in the instruction, not seen by the register
+	 * allocator
+	 */
+	OPERAND_MACHINE_REGISTER,
+	OPERAND_IMMEDIATE,
+	/**
+	 * Address of the label used as a value
+	 */
+	OPERAND_LABEL_ADDRESS,
+	/**
+	 * The label itself, as in jumps and calls
+	 */
+	OPERAND_LABEL,
+	/**
+	 * Memory at base register + index register * scale + offset, either
+	 * register may be missing. At label + offset if there is neither.
+	 */
+	OPERAND_MEMORY,
 };
 
-class TemplateOpKindKindMap: public TemplateStorage {
-public:
-	std::vector<std::list<InstructionTemplate> > map;
-	int operation_count;
-
-	TemplateOpKindKindMap(int _operation_count) :
-		TemplateStorage(TL_OP_KIND_KIND_MAP), operation_count(_operation_count)
+struct Operand {
+	enum {NO_REGISTER = -1};
+	
+	unsigned char kind : 4;
+	/**
+	 * 1, 2, 4 or 8 for the index register of OPERAND_MEMORY
+	 */
+	unsigned char scale : 4;
+	bool is_output;
+	/**
+	 * Index in inputs or outputs for OPERAND_REGISTER, of the base
+	 * register for OPERAND_MEMORY
+	 */
+	signed char reg;
+	/**
+	 * Index in inputs of the index register for OPERAND_MEMORY
+	 */
+	signed char index;
+	/**
+	 * Immediate value or memory offset
+	 */
+	int value;
+	union {
+		IR::Label *label;
+		IR::VirtualRegister *machine_reg;
+	};
+	
+	Operand() : kind(OPERAND_NONE), scale(1), is_output(false),
+		reg(NO_REGISTER), index(NO_REGISTER), value(0), label(NULL) {}
+	
+	static Operand Input(int number)
+	{
+		Operand result;
+		result.kind = OPERAND_REGISTER;
+		result.reg = number;
+		return result;
+	}
+	static Operand Output(int number)
 	{
-		map.resize(operation_count/* * IR::IR_EXPR_MAX * IR::IR_EXPR_MAX*/);
+		Operand result = Input(number);
+		result.is_output = true;
+		return result;
+	}
+	static Operand MachineRegister(IR::VirtualRegister *reg)
+	{
+		Operand result;
+		result.kind = OPERAND_MACHINE_REGISTER;
+		result.machine_reg = reg;
+		return result;
+	}
+	static Operand Immediate(int value)
+	{
+		Operand result;
+		result.kind = OPERAND_IMMEDIATE;
+		result.value = value;
+		return result;
+	}
+	static Operand LabelAddress(IR::Label *label)
+	{
+		Operand result;
+		result.kind = OPERAND_LABEL_ADDRESS;
+		result.label = label;
+		return result;
+	}
+	static Operand Label(IR::Label *label)
+	{
+		Operand result = LabelAddress(label);
+		result.kind = OPERAND_LABEL;
+		return result;
+	}
+	static Operand Memory(int input_number, int offset)
+	{
+		Operand result;
+		result.kind = OPERAND_MEMORY;
+		result.reg = input_number;
+		result.value = offset;
+		return result;
+	}
+	static Operand Memory(int base_number, int index_number, int scale,
+		int offset)
+	{
+		Operand result = Memory(base_number, offset);
+		result.index = index_number;
+		result.scale = scale;
+		return result;
+	}
+	static Operand Memory(IR::Label *label, int offset)
+	{
+		Operand result = Memory(NO_REGISTER, offset);
+		result.label = label;
+		return result;
 	}
 	
-	std::list<InstructionTemplate> *getList(int op/*, int kind1, int kind2*/)
+	bool usesInput(int number) const
 	{
-		return &(map[op/* * IR::IR_EXPR_MAX * IR::IR_EXPR_MAX +
-			kind1 * IR::IR_EXPR_MAX + kind2*/]);
+		if (kind == OPERAND_MEMORY)
+			return (reg == number) || (index == number);
+		return (kind == OPERAND_REGISTER) && ! is_output && (reg == number);
 	}
 };
 
-//typedef std::string Instruction;
-
 class Instruction {
 public:
-	static std::string Input(int number)
-	{
-		return std::string("&i") + (char)('0' + number);
-	}
-	static std::string Output(int number)
-	{
-		return std::string("&o") + (char)('0' + number);
-	}
+	enum {MAX_OPERANDS = 2};
 	
-	std::string notation;
+	/**
+	 * Target-specific operation code, text is only produced on output
+	 */
+	int opcode;
+	Operand operands[MAX_OPERANDS];
 	std::vector<IR::VirtualRegister *> inputs, outputs;
 	IR::Label *label;
 	bool is_reg_to_reg_assign;
@@ -84,26 +314,97 @@ public:
 	 */
 	std::vector<IR::Label *> destinations;
 	
-	explicit Instruction(const std::string &_notation,
-		bool _reg_to_reg_assign = false);
+	explicit Instruction(int _opcode, const Operand &operand0 = Operand(),
+		const Operand &operand1 = Operand());
 	
-	Instruction(const std::string &_notation, int ninput, IR::VirtualRegister **inputs,
+	Instruction(int _opcode, const Operand &operand0, const Operand &operand1,
+		int ninput, IR::VirtualRegister **inputs,
 		int noutput, IR::VirtualRegister **outputs, int ndest = 1,
 		IR::Label **_destinations = NULL, bool _reg_to_reg_assign = false);
+	
+	/**
+	 * The operand that refers to the given input register, NULL if the
+	 * register is used implicitly
+	 */
+	Operand *findInputOperand(int number);
+	Operand *findOutputOperand(int number);
 };
 
 typedef std::list<Instruction> Instructions;
 
+/**
+ * Changes made to the code by Assembler::spillRegisters
+ */
+struct SpillResult {
+	/**
+	 * New loads and stores of the spilled values
+	 */
+	std::vector<const Instruction *> inserted;
+	/**
+	 * Instructions that had spilled registers replaced, each listed once
+	 */
+	std::vector<const Instruction *> rewritten;
+	/**
+	 * New registers holding spilled values next to a single instruction
+	 */
+	std::vector<IR::VirtualRegister *> temporaries;
+};
+
+/**
+ * Machine code for a piece of a section. Labels are found by name when
+ * the pieces are put together into an object file
+ */
+struct MachineCode {
+	enum ReferenceKind {
+		/**
+		 * 32 bit sign extended address of the label plus addend
+		 */
+		ADDRESS_32S,
+		/**
+		 * 32 bit address of the label plus addend minus the address
+		 * of the reference itself
+		 */
+		RELATIVE_32
+	};
+
+	struct Reference {
+		ReferenceKind kind;
+		size_t offset;
+		IR::Label *label;
+		int addend;
+
+		Reference(ReferenceKind _kind, size_t _offset, IR::Label *_label,
+			int _addend) :
+			kind(_kind), offset(_offset), label(_label), addend(_addend) {}
+	};
+
+	struct LabelPosition {
+		IR::Label *label;
+		size_t offset;
+
+		LabelPosition(IR::Label *_label, size_t _offset) :
+			label(_label), offset(_offset) {}
+	};
+
+	std::vector<unsigned char> bytes;
+	std::vector<LabelPosition> labels;
+	/**
+	 * Places in bytes to be filled in with label addresses, sorted by offset
+	 */
+	std::vector<Reference> references;
+
+	void append(const MachineCode &code);
+};
+
 class Assembler: public DebugPrinter {
 protected:
 	IR::IREnvironment *IRenvironment;
-	std::vector<TemplateStorage *> expr_templates;
-	std::vector<TemplateStorage *> statm_templates;
-	
-	std::list<InstructionTemplate > *getTemplatesList(IR::Expression *expr);
-	std::list<InstructionTemplate > *getTemplatesList(IR::Statement *statm);
-	void addTemplate(int code, IR::Expression *expr);
-	void addTemplate(int code, IR::Statement *statm);
+	/**
+	 * Compiled templates of the target, set by the subclass. Shared by
+	 * all assemblers of the target and never freed, since template trees
+	 * must outlive the program's IR nodes.
+	 */
+	TemplateMatcher *matcher;
 	
 	class TemplateChildInfo {
 	public:
@@ -120,7 +421,15 @@ protected:
 	virtual void translateStatementTemplate(IR::Statement *templ,
 		const std::list<TemplateChildInfo> &children, Instructions &result) = 0;
 	virtual void translateBlob(const IR::Blob &blob, Instructions &result) = 0;
+	/**
+	 * Append the text of the instruction to output
+	 */
+	virtual void formatInstruction(const Instruction &inst,
+		const IR::RegisterMap *register_map, std::string &output) = 0;
 	
+	/**
+	 * Append the directives starting the section
+	 */
 	virtual void getCodeSectionHeader(std::string &header) = 0;
 	virtual void getBlobSectionHeader(std::string &header) = 0;
 	virtual void functionPrologue(IR::Label *fcn_label,
@@ -137,10 +446,34 @@ protected:
 	virtual void programEpilogue(IR::AbstractFrame *frame, Instructions &result) = 0;
 	virtual void implementFramePointer(IR::AbstractFrame *frame,
 		Instructions &result) = 0;
+
+	/**
+	 * Register to register move that the register map turned into a no-op
+	 */
+	static bool isRedundantMove(const Instruction &inst,
+		const IR::RegisterMap *register_map);
 private:
+	/**
+	 * Expression with its template matched, waiting for the expressions
+	 * glued to the template to be translated
+	 */
+	struct PendingExpression {
+		IR::Expression *expression;
+		IR::VirtualRegister *value_storage;
+		IR::Expression *template_instantiation;
+		std::list<TemplateChildInfo> children;
+		std::list<TemplateChildInfo>::iterator next_child;
+		
+		PendingExpression(IR::Expression *_expression,
+			IR::VirtualRegister *_value_storage) :
+			expression(_expression), value_storage(_value_storage),
+			template_instantiation(NULL), next_child() {}
+	};
 	
-	void FindExpressionTemplate(IR::Expression *expression, InstructionTemplate *&templ);
-	void FindStatementTemplate(IR::Statement *statement, InstructionTemplate *&templ);
+	/**
+	 * Recursion follows the template, so it is only as deep as the
+	 * highest template
+	 */
 	bool MatchExpression(IR::Expression *expression, IR::Expression *templ,
 		int &nodecount, std::list<TemplateChildInfo> *children = NULL,
 		IR::Expression **template_instantiation = NULL);
@@ -162,25 +495,53 @@ public:
 		Instructions &result);
 	void implementProgramFrameSize(IR::AbstractFrame *frame,
 		Instructions &result);
+	/**
+	 * Make the assembler usable from several threads at once
+	 */
+	void prepareForThreads();
 	void translateFunctionBody(IR::Code *code,  IR::Label *fcn_label,
 		IR::AbstractFrame *frame, Instructions &result);
 	void implementFunctionFrameSize(IR::Label *fcn_label, IR::AbstractFrame *frame,
 		Instructions &result);
 	
-	void outputCode(FILE *output,
-		const std::list<Instructions> &code,
-		const IR::RegisterMap *register_map);
-	void outputBlobs(FILE *output, const std::list<IR::Blob> &blobs);
-	
+	/**
+	 * Assembly text in parts, for chunks of code with separate register maps.
+	 * The text is appended to output, to be written with one fwrite.
+	 * With annotate every instruction is followed by a comment with its
+	 * number and the registers it uses.
+	 */
+	void outputCodeHeader(std::string &output);
+	void outputInstructions(std::string &output, const Instructions &code,
+		const IR::RegisterMap *register_map, bool annotate);
+	void outputBlobs(std::string &output, const std::list<IR::Blob> &blobs);
+
+	/**
+	 * Append the machine code of what outputInstructions would write
+	 */
+	virtual void encodeInstructions(const Instructions &code,
+		const IR::RegisterMap *register_map, MachineCode &result) = 0;
+	void encodeBlobs(const std::list<IR::Blob> &blobs, MachineCode &result);
+	/**
+	 * The only label visible outside of the object file
+	 */
+	virtual IR::Label *getProgramLabel() = 0;
+
 	/**
 	 * Frame pointer register must NOT be one of them
 	 */
 	virtual const std::vector<IR::VirtualRegister *> &getAvailableRegisters() = 0;
 	
-	virtual void spillRegister(IR::AbstractFrame *frame, Instructions &code,
-		IR::VirtualRegister *reg) = 0;
+	/**
+	 * Moves the registers to memory in one pass over the code,
+	 * in the order given
+	 */
+	virtual void spillRegisters(IR::AbstractFrame *frame, Instructions &code,
+		const std::vector<IR::VirtualRegister *> &registers,
+		SpillResult &result) = 0;
 };
 
+IR::VirtualRegister *MapRegister(const IR::RegisterMap *register_map,
+	IR::VirtualRegister *reg);
 
 }
 
@@ -0,0 +1,130 @@
+#ifndef _BITSET_H
+#define _BITSET_H
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+/**
+ * Fixed-size dense set of small non-negative integers
+ */
+class BitSet {
+private:
+	typedef uint64_t Word;
+	enum {WORD_BITS = 64};
+
+	std::vector<Word> words;
+	int bitcount;
+public:
+	BitSet(int _bitcount = 0) : bitcount(0) {resize(_bitcount);}
+
+	void resize(int _bitcount)
+	{
+		bitcount = _bitcount;
+		words.resize((bitcount + WORD_BITS - 1) / WORD_BITS, 0);
+	}
+
+	int size() const {return bitcount;}
+
+	void set(int i)
+	{
+		assert((i >= 0) && (i < bitcount));
+		words[i / WORD_BITS] |= (Word)1 << (i % WORD_BITS);
+	}
+
+	void reset(int i)
+	{
+		assert((i >= 0) && (i < bitcount));
+		words[i / WORD_BITS] &= ~((Word)1 << (i % WORD_BITS));
+	}
+
+	bool test(int i) const
+	{
+		assert((i >= 0) && (i < bitcount));
+		return (words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+	}
+
+	void clear()
+	{
+		for (size_t w = 0; w < words.size(); w++)
+			words[w] = 0;
+	}
+
+	bool empty() const
+	{
+		for (size_t w = 0; w < words.size(); w++)
+			if (words[w] != 0)
+				return false;
+		return true;
+	}
+
+	/**
+	 * this = this | other, returns true if anything has been added
+	 */
+	bool unite(const BitSet &other)
+	{
+		assert(other.bitcount == bitcount);
+		Word changed = 0;
+		for (size_t w = 0; w < words.size(); w++) {
+			Word old = words[w];
+			words[w] |= other.words[w];
+			changed |= old ^ words[w];
+		}
+		return changed != 0;
+	}
+
+	/**
+	 * this = this & other, returns true if anything has been removed
+	 */
+	bool intersect(const BitSet &other)
+	{
+		assert(other.bitcount == bitcount);
+		Word changed = 0;
+		for (size_t w = 0; w < words.size(); w++) {
+			Word old = words[w];
+			words[w] &= other.words[w];
+			changed |= old ^ words[w];
+		}
+		return changed != 0;
+	}
+
+	/**
+	 * this = this & ~other
+	 */
+	void subtract(const BitSet &other)
+	{
+		assert(other.bitcount == bitcount);
+		for (size_t w = 0; w < words.size(); w++)
+			words[w] &= ~other.words[w];
+	}
+
+	bool operator==(const BitSet &other) const
+	{
+		return (bitcount == other.bitcount) && (words == other.words);
+	}
+
+	bool operator!=(const BitSet &other) const {return ! (*this == other);}
+
+	/**
+	 * Smallest element >= from, or -1 if there is none
+	 * Iterate with for (i = s.findNext(0); i >= 0; i = s.findNext(i+1))
+	 */
+	int findNext(int from) const
+	{
+		if (from >= bitcount)
+			return -1;
+		int w = from / WORD_BITS;
+		Word bits = words[w] & (~(Word)0 << (from % WORD_BITS));
+		while (true) {
+			if (bits != 0)
+				return w * WORD_BITS + __builtin_ctzll(bits);
+			w++;
+			if ((size_t)w >= words.size())
+				return -1;
+			bits = words[w];
+		}
+	}
+};
+
+#endif
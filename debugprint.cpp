@@ -2,7 +2,15 @@
 #include "syntaxtree.h"
 #include "debugprint.h"
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include <map>
+#include <deque>
+#include <vector>
 
 std::string IntToStr(int x)
 {
@@ -12,36 +20,297 @@ std::string IntToStr(int x)
 }
 
 #ifdef DEBUG
-std::map<std::string, FILE*> open_files;
-#endif
+class DebugLog {
+public:
+	FILE *f;
+};
+
+/**
+ * Messages of one thread waiting to be written, each as the DebugLog
+ * pointer, the length and the text
+ */
+typedef std::string DebugBlock;
+
+enum {DEBUG_BLOCK_SIZE = 64 * 1024};
 
-DebugPrinter::DebugPrinter(const char* filename)
+static pthread_mutex_t debug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t debug_written = PTHREAD_COND_INITIALIZER;
+static std::map<std::string, DebugLog *> *open_logs = NULL;
+/**
+ * Patterns from DEBUG_LOGS, NULL if all logs are written
+ */
+static std::vector<std::string> *selected_logs = NULL;
+/**
+ * Full blocks for the writer thread and written ones to be reused
+ */
+static std::deque<DebugBlock *> full_blocks, free_blocks;
+/**
+ * The block the writer thread is writing, NULL when it is waiting
+ */
+static DebugBlock *writing_block = NULL;
+static bool writer_started = false, writer_stopping = false;
+static pthread_t writer_thread;
+static pthread_key_t thread_block_key;
+static __thread DebugBlock *thread_block = NULL;
+/**
+ * thread_block of every thread that has one, for writing them on a crash
+ */
+static std::vector<DebugBlock **> thread_blocks;
+
+static void WriteBlock(const DebugBlock &block)
 {
-#ifdef DEBUG
-	name = filename;
-	if (open_files.find(std::string(filename)) == open_files.end()) {
-		f = fopen(filename, "w");
-		open_files[std::string(filename)] = f;
-	} else
-		f = open_files[std::string(filename)];
+	size_t pos = 0;
+	while (pos < block.size()) {
+		DebugLog *log;
+		uint32_t length;
+		memcpy(&log, block.data() + pos, sizeof(log));
+		memcpy(&length, block.data() + pos + sizeof(log), sizeof(length));
+		pos += sizeof(log) + sizeof(length);
+		fwrite(block.data() + pos, length, 1, log->f);
+		pos += length;
+	}
+}
+
+static void *DebugWriter(void *)
+{
+	pthread_mutex_lock(&debug_lock);
+	while (true) {
+		while (full_blocks.empty() && ! writer_stopping)
+			pthread_cond_wait(&debug_written, &debug_lock);
+		if (full_blocks.empty())
+			break;
+		DebugBlock *block = full_blocks.front();
+		full_blocks.pop_front();
+		writing_block = block;
+		pthread_mutex_unlock(&debug_lock);
+		WriteBlock(*block);
+		block->clear();
+		pthread_mutex_lock(&debug_lock);
+		writing_block = NULL;
+		free_blocks.push_back(block);
+	}
+	pthread_mutex_unlock(&debug_lock);
+	return NULL;
+}
+
+/**
+ * Hand the block to the writer thread, returns an empty one
+ */
+static DebugBlock *QueueBlock(DebugBlock *block)
+{
+	DebugBlock *result = NULL;
+	pthread_mutex_lock(&debug_lock);
+	if (! writer_started && ! writer_stopping) {
+		if (pthread_create(&writer_thread, NULL, DebugWriter, NULL) == 0)
+			writer_started = true;
+	}
+	if (writer_started && ! writer_stopping) {
+		full_blocks.push_back(block);
+		pthread_cond_signal(&debug_written);
+		if (! free_blocks.empty()) {
+			result = free_blocks.back();
+			free_blocks.pop_back();
+		}
+	} else {
+		// Without a writer thread, or after it is stopped
+		WriteBlock(*block);
+		block->clear();
+		result = block;
+	}
+	pthread_mutex_unlock(&debug_lock);
+	if (result == NULL) {
+		result = new DebugBlock;
+		result->reserve(DEBUG_BLOCK_SIZE + 1024);
+	}
+	return result;
+}
+
+static void FlushThreadBlock(void *block)
+{
+	pthread_mutex_lock(&debug_lock);
+	for (size_t i = 0; i < thread_blocks.size(); i++)
+		if (thread_blocks[i] == &thread_block) {
+			thread_blocks[i] = thread_blocks.back();
+			thread_blocks.pop_back();
+			break;
+		}
+	pthread_mutex_unlock(&debug_lock);
+	if ((block != NULL) && ! ((DebugBlock *)block)->empty())
+		delete QueueBlock((DebugBlock *)block);
+	else
+		delete (DebugBlock *)block;
+}
+
+static void StopDebugWriter()
+{
+	if (thread_block != NULL) {
+		FlushThreadBlock(thread_block);
+		thread_block = NULL;
+		pthread_setspecific(thread_block_key, NULL);
+	}
+	pthread_mutex_lock(&debug_lock);
+	writer_stopping = true;
+	pthread_cond_signal(&debug_written);
+	pthread_mutex_unlock(&debug_lock);
+	if (writer_started)
+		pthread_join(writer_thread, NULL);
+}
+
+static const int CRASH_SIGNALS[] = {SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL};
+
+/**
+ * Write out every pending message before dying of the signal, so that
+ * the logs show what happened up to a failed assert or a crash.
+ * Other threads keep running meanwhile, so this is best effort.
+ */
+static void CrashHandler(int signal_number)
+{
+	// Give the writer thread up to a second to finish the block it has,
+	// so that the messages stay in order
+	bool locked = false;
+	for (int i = 0; i < 1000; i++) {
+		if (pthread_mutex_trylock(&debug_lock) == 0) {
+			if (writing_block == NULL) {
+				locked = true;
+				break;
+			}
+			pthread_mutex_unlock(&debug_lock);
+		}
+		usleep(1000);
+	}
+	for (size_t i = 0; i < full_blocks.size(); i++)
+		WriteBlock(*full_blocks[i]);
+	full_blocks.clear();
+	for (size_t i = 0; i < thread_blocks.size(); i++)
+		if (*thread_blocks[i] != NULL) {
+			WriteBlock(**thread_blocks[i]);
+			(*thread_blocks[i])->clear();
+		}
+	for (std::map<std::string, DebugLog *>::iterator log = open_logs->begin();
+			log != open_logs->end(); log++)
+		fflush(log->second->f);
+	if (locked)
+		pthread_mutex_unlock(&debug_lock);
+	// The handler was reset to the default action on entry
+	raise(signal_number);
+}
+
+static bool LogSelected(const std::string &name)
+{
+	if (selected_logs == NULL)
+		return true;
+	for (size_t i = 0; i < selected_logs->size(); i++) {
+		const std::string &pattern = (*selected_logs)[i];
+		if ((pattern.size() > 0) && (pattern[pattern.size()-1] == '*')) {
+			if (name.compare(0, pattern.size() - 1, pattern, 0,
+					pattern.size() - 1) == 0)
+				return true;
+		} else if (name == pattern)
+			return true;
+	}
+	return false;
+}
+
+static void InitDebugLogs()
+{
+	open_logs = new std::map<std::string, DebugLog *>;
+	const char *selection = getenv("DEBUG_LOGS");
+	if (selection != NULL) {
+		selected_logs = new std::vector<std::string>;
+		std::string list = selection;
+		size_t start = 0;
+		while (start <= list.size()) {
+			size_t end = list.find(',', start);
+			if (end == std::string::npos)
+				end = list.size();
+			if (end > start)
+				selected_logs->push_back(list.substr(start, end - start));
+			start = end + 1;
+		}
+	}
+	pthread_key_create(&thread_block_key, FlushThreadBlock);
+	atexit(StopDebugWriter);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = CrashHandler;
+	action.sa_flags = SA_RESETHAND;
+	sigemptyset(&action.sa_mask);
+	for (size_t i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); i++)
+		sigaction(CRASH_SIGNALS[i], &action, NULL);
+}
 #endif
+
+#ifdef DEBUG
+DebugPrinter::DebugPrinter(const char* filename) : debug_log(NULL)
+{
+	static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+	pthread_once(&init_once, InitDebugLogs);
+	std::string name = filename;
+	if (! LogSelected(name))
+		return;
+	pthread_mutex_lock(&debug_lock);
+	std::map<std::string, DebugLog *>::iterator found = open_logs->find(name);
+	if (found != open_logs->end())
+		debug_log = found->second;
+	else {
+		FILE *f = fopen(filename, "w");
+		if (f != NULL) {
+			debug_log = new DebugLog;
+			debug_log->f = f;
+			(*open_logs)[name] = debug_log;
+		}
+	}
+	pthread_mutex_unlock(&debug_lock);
+}
+#else
+DebugPrinter::DebugPrinter(const char*) : debug_log(NULL)
+{
 }
+#endif
 
 DebugPrinter::~DebugPrinter()
 {
 }
 
+#ifdef DEBUG
 void DebugPrinter::debug(const char *msg, ...)
 {
-#ifdef DEBUG
+	if (debug_log == NULL)
+		return;
+	if (thread_block == NULL) {
+		thread_block = new DebugBlock;
+		thread_block->reserve(DEBUG_BLOCK_SIZE + 1024);
+		pthread_setspecific(thread_block_key, thread_block);
+		pthread_mutex_lock(&debug_lock);
+		thread_blocks.push_back(&thread_block);
+		pthread_mutex_unlock(&debug_lock);
+	}
+	char buf[1024];
 	va_list ap;
 	va_start(ap, msg);
-	vfprintf(f, msg, ap);
-	fputc('\n', f);
-	fflush(f);
+	int length = vsnprintf(buf, sizeof(buf), msg, ap);
 	va_end(ap);
-#endif
+	if (length < 0)
+		return;
+	uint32_t record_length = length + 1;
+	thread_block->append((const char *)&debug_log, sizeof(debug_log));
+	thread_block->append((const char *)&record_length, sizeof(record_length));
+	if ((size_t)length < sizeof(buf))
+		thread_block->append(buf, length);
+	else {
+		std::vector<char> long_buf(length + 1);
+		va_start(ap, msg);
+		vsnprintf(long_buf.data(), long_buf.size(), msg, ap);
+		va_end(ap);
+		thread_block->append(long_buf.data(), length);
+	}
+	*thread_block += '\n';
+	if (thread_block->size() >= DEBUG_BLOCK_SIZE) {
+		thread_block = QueueBlock(thread_block);
+		pthread_setspecific(thread_block_key, thread_block);
+	}
 }
+#endif
 
 namespace IR {
 
@@ -109,7 +378,7 @@ void PrintExpression(FILE *out, Expression *exp, int indent, const char *prefix
 		if (ToCallExpression(exp)->callee_parentfp != NULL)
 			PrintExpression(out, ToCallExpression(exp)->callee_parentfp, indent+4, "Parent FP parameter: ");
 		PrintExpression(out, ToCallExpression(exp)->function, indent+4, "Call address: ");
-		for (std::list<Expression *>::iterator arg = ((CallExpression *)exp)->arguments.begin(); 
+		for (ExpressionList::iterator arg = ((CallExpression *)exp)->arguments.begin(); 
 				arg != ((CallExpression *)exp)->arguments.end(); arg++)
 			 PrintExpression(out, *arg, indent+4, "Argument: ");
 		break;
@@ -159,7 +428,7 @@ void PrintStatement(FILE *out, Statement *statm, int indent, const char *prefix)
 		break;
 	case IR_STAT_SEQ:
 		fprintf(out, "Sequence\n");
-		for (std::list<Statement *>::iterator p = ((StatementSequence*)statm)->statements.begin(); 
+		for (StatementList::iterator p = ((StatementSequence*)statm)->statements.begin(); 
 				p != ((StatementSequence*)statm)->statements.end(); p++)
 			 PrintStatement(out, *p, indent+4);
 		break;
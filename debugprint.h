@@ -6,14 +6,30 @@
 
 std::string IntToStr(int x);
 
+class DebugLog;
+
+/**
+ * Writes to a log file named by the constructor if built with DEBUG.
+ * Messages are collected per thread and written by a background thread,
+ * or by a signal handler when the compiler aborts or crashes.
+ * The DEBUG_LOGS environment variable, a comma separated list of file
+ * names where a trailing '*' matches any rest, selects the logs written,
+ * all of them if it is not set.
+ */
 class DebugPrinter {
 private:
-	FILE *f;
-	std::string name;
+	/**
+	 * NULL if the log is not written
+	 */
+	DebugLog *debug_log;
 public:
 	DebugPrinter(const char *filename);
 	~DebugPrinter();
+#ifdef DEBUG
 	void debug(const char *msg, ...);
+#else
+	void debug(const char *, ...) {}
+#endif
 };
 
 #endif
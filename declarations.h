@@ -73,14 +73,18 @@ public:
 	IR::AbstractFrame *frame;
 	IR::Label *label;
 	bool needs_parent_fp;
+	/**
+	 * Holds the IR of the body, NULL for external functions
+	 */
+	Arena *node_arena;
 
 	Function(const std::string &_name, Type *_return_type,
 		Syntax::Tree _raw, IR::Code *_body,
 		IR::AbstractFrame *_frame, IR::Label *_label,
 		bool _needs_parent_fp) :
-		name(_name), Declaration(DECL_FUNCTION), return_type(_return_type), 
+		Declaration(DECL_FUNCTION), name(_name), return_type(_return_type),
 		raw_body(_raw), body(_body), frame(_frame), label(_label),
-		needs_parent_fp(_needs_parent_fp)
+		needs_parent_fp(_needs_parent_fp), node_arena(NULL)
 	{}
 	FunctionArgument *addArgument(const std::string &name, Type *type,
 		IR::AbstractVarLocation *impl)
@@ -0,0 +1,160 @@
+#ifndef _EDGESET_H
+#define _EDGESET_H
+
+#include "bitset.h"
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <limits.h>
+
+/**
+ * Set of undirected edges between nodes 0..nodecount-1
+ *
+ * Small graphs use a triangular bit matrix. Big ones start with an open
+ * addressing hash table of node pairs and switch to the matrix once the
+ * table would take more memory than it, so memory stays proportional to
+ * min(edges, nodes^2). Graphs whose matrix has more bits than BitSet can
+ * index, about 65000 nodes and up, keep the table.
+ */
+class EdgeSet {
+private:
+	typedef uint64_t Key;
+	enum {
+		/**
+		 * Graphs whose matrix takes up to this many bytes get it at once
+		 */
+		SMALL_MATRIX_BYTES = 256*1024,
+		INITIAL_HASH_SIZE = 1024
+	};
+
+	int nodecount;
+	size_t edgecount;
+	bool use_matrix;
+	BitSet matrix;
+	std::vector<Key> hash;
+
+	static size_t matrixBits(int nodecount)
+	{
+		return (size_t)nodecount * (nodecount - 1) / 2;
+	}
+
+	static size_t matrixIndex(int n1, int n2)
+	{
+		if (n1 < n2) {
+			int x = n1;
+			n1 = n2;
+			n2 = x;
+		}
+		return (size_t)n1 * (n1 - 1) / 2 + n2;
+	}
+
+	/**
+	 * The bigger node goes to the upper half, so no key is 0 and 0
+	 * marks empty hash slots
+	 */
+	static Key makeKey(int n1, int n2)
+	{
+		if (n1 < n2)
+			return ((Key)n2 << 32) | (Key)n1;
+		else
+			return ((Key)n1 << 32) | (Key)n2;
+	}
+
+	size_t findSlot(Key key) const
+	{
+		size_t mask = hash.size() - 1;
+		size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+		while ((hash[slot] != 0) && (hash[slot] != key))
+			slot = (slot + 1) & mask;
+		return slot;
+	}
+
+	void switchToMatrix()
+	{
+		assert(matrixBits(nodecount) <= (size_t)INT_MAX);
+		matrix.resize(matrixBits(nodecount));
+		for (size_t i = 0; i < hash.size(); i++)
+			if (hash[i] != 0)
+				matrix.set(matrixIndex((int)(hash[i] >> 32),
+					(int)(hash[i] & 0xFFFFFFFF)));
+		std::vector<Key>().swap(hash);
+		use_matrix = true;
+	}
+
+	void growHash()
+	{
+		if ((hash.size() * 2 * sizeof(Key) >= matrixBits(nodecount) / 8) &&
+				(matrixBits(nodecount) <= (size_t)INT_MAX)) {
+			switchToMatrix();
+			return;
+		}
+		std::vector<Key> old;
+		old.swap(hash);
+		hash.resize(old.size() * 2, 0);
+		for (size_t i = 0; i < old.size(); i++)
+			if (old[i] != 0)
+				hash[findSlot(old[i])] = old[i];
+	}
+public:
+	EdgeSet() : nodecount(0), edgecount(0), use_matrix(true) {}
+
+	void init(int _nodecount)
+	{
+		nodecount = _nodecount;
+		edgecount = 0;
+		if (matrixBits(nodecount) / 8 <= SMALL_MATRIX_BYTES) {
+			use_matrix = true;
+			matrix.resize(matrixBits(nodecount));
+		} else {
+			use_matrix = false;
+			hash.resize(INITIAL_HASH_SIZE, 0);
+		}
+	}
+
+	bool contains(int n1, int n2) const
+	{
+		assert(n1 != n2);
+		if (use_matrix)
+			return matrix.test(matrixIndex(n1, n2));
+		else
+			return hash[findSlot(makeKey(n1, n2))] != 0;
+	}
+
+	/**
+	 * Returns false if the edge was already there
+	 */
+	bool insert(int n1, int n2)
+	{
+		assert(n1 != n2);
+		if (use_matrix) {
+			size_t index = matrixIndex(n1, n2);
+			if (matrix.test(index))
+				return false;
+			matrix.set(index);
+		} else {
+			Key key = makeKey(n1, n2);
+			size_t slot = findSlot(key);
+			if (hash[slot] != 0)
+				return false;
+			hash[slot] = key;
+			if ((edgecount + 1) * 2 > hash.size())
+				growHash();
+		}
+		edgecount++;
+		return true;
+	}
+
+	size_t getEdgeCount() const {return edgecount;}
+	bool isMatrix() const {return use_matrix;}
+
+	size_t getMemory() const
+	{
+		if (use_matrix)
+			return (matrix.size() + 7) / 8;
+		else
+			return hash.size() * sizeof(Key);
+	}
+};
+
+#endif
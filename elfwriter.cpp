@@ -0,0 +1,236 @@
+#include "elfwriter.h"
+#include "errormsg.h"
+#include <elf.h>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+namespace Asm {
+
+struct LabelDefinition {
+	int section;
+	size_t offset;
+};
+
+/**
+ * Relocation against a section symbol or one of the global symbols
+ */
+struct Relocation {
+	size_t offset;
+	bool against_section;
+	/**
+	 * Section number or global symbol number
+	 */
+	int symbol;
+	int type;
+	long addend;
+};
+
+static void AppendBytes(std::vector<unsigned char> &image, const void *data,
+	size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	image.insert(image.end(), bytes, bytes + size);
+}
+
+static int AddName(std::string &names, const char *name)
+{
+	int offset = names.size();
+	names += name;
+	names += '\0';
+	return offset;
+}
+
+static void AddSection(std::vector<unsigned char> &image, Elf64_Shdr &header,
+	int name, int type, int flags, int alignment, const void *data, size_t size)
+{
+	while (image.size() % alignment != 0)
+		image.push_back(0);
+	header.sh_name = name;
+	header.sh_type = type;
+	header.sh_flags = flags;
+	header.sh_offset = image.size();
+	header.sh_size = size;
+	header.sh_addralign = alignment;
+	AppendBytes(image, data, size);
+}
+
+bool ElfWriter::write(const std::string &filename)
+{
+	static const char *section_names[SECTION_COUNT] = {".text", ".rodata"};
+	static const char *rela_names[SECTION_COUNT] = {".rela.text", ".rela.rodata"};
+	static const int section_flags[SECTION_COUNT] = {
+		SHF_ALLOC | SHF_EXECINSTR,
+		SHF_ALLOC
+	};
+
+	std::map<std::string, LabelDefinition> definitions;
+	for (int s = 0; s < SECTION_COUNT; s++)
+		for (size_t i = 0; i < sections[s].labels.size(); i++) {
+			LabelDefinition definition = {s, sections[s].labels[i].offset};
+			if (! definitions.insert(std::make_pair(
+					sections[s].labels[i].label->getName(), definition)).second)
+				Error::fatalError("Label " + sections[s].labels[i].label->getName() +
+					" defined twice");
+		}
+
+	// The global labels, then undefined ones in order of first use
+	std::vector<std::string> symbols(globals);
+	std::map<std::string, int> symbol_numbers;
+	for (size_t i = 0; i < symbols.size(); i++)
+		symbol_numbers[symbols[i]] = i;
+	bool section_symbol_used[SECTION_COUNT] = {false};
+	std::vector<Relocation> relocations[SECTION_COUNT];
+	for (int s = 0; s < SECTION_COUNT; s++)
+		for (size_t i = 0; i < sections[s].references.size(); i++) {
+			const MachineCode::Reference &ref = sections[s].references[i];
+			const std::string &name = ref.label->getName();
+			std::map<std::string, int>::iterator global =
+				symbol_numbers.find(name);
+			std::map<std::string, LabelDefinition>::iterator definition =
+				definitions.find(name);
+			Relocation relocation;
+			relocation.offset = ref.offset;
+			relocation.addend = ref.addend;
+			if ((global == symbol_numbers.end()) &&
+					(definition != definitions.end())) {
+				const LabelDefinition &target = definition->second;
+				if ((ref.kind == MachineCode::RELATIVE_32) && (target.section == s)) {
+					int value = (long)target.offset + ref.addend - (long)ref.offset;
+					for (int b = 0; b < 4; b++)
+						sections[s].bytes[ref.offset + b] = (value >> (8*b)) & 0xFF;
+					continue;
+				}
+				// Local labels are not in the symbol table
+				relocation.against_section = true;
+				relocation.symbol = target.section;
+				relocation.addend += target.offset;
+				section_symbol_used[target.section] = true;
+				relocation.type = (ref.kind == MachineCode::RELATIVE_32) ?
+					R_X86_64_PC32 : R_X86_64_32S;
+			} else {
+				relocation.against_section = false;
+				if (global == symbol_numbers.end()) {
+					relocation.symbol = symbols.size();
+					symbol_numbers[name] = symbols.size();
+					symbols.push_back(name);
+				} else
+					relocation.symbol = global->second;
+				relocation.type = (ref.kind == MachineCode::RELATIVE_32) ?
+					R_X86_64_PLT32 : R_X86_64_32S;
+			}
+			relocations[s].push_back(relocation);
+		}
+
+	int section_number[SECTION_COUNT], rela_number[SECTION_COUNT];
+	int section_count = 1;
+	for (int s = 0; s < SECTION_COUNT; s++) {
+		section_number[s] = section_count++;
+		rela_number[s] = relocations[s].empty() ? 0 : section_count++;
+	}
+	int symtab_number = section_count++;
+	int strtab_number = section_count++;
+	int shstrtab_number = section_count++;
+
+	std::string strtab(1, '\0');
+	std::vector<Elf64_Sym> symtab(1);
+	memset(&symtab[0], 0, sizeof(Elf64_Sym));
+	int section_symbol[SECTION_COUNT];
+	for (int s = 0; s < SECTION_COUNT; s++)
+		if (section_symbol_used[s]) {
+			Elf64_Sym symbol;
+			memset(&symbol, 0, sizeof(symbol));
+			symbol.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+			symbol.st_shndx = section_number[s];
+			section_symbol[s] = symtab.size();
+			symtab.push_back(symbol);
+		}
+	int first_global = symtab.size();
+	for (size_t i = 0; i < symbols.size(); i++) {
+		Elf64_Sym symbol;
+		memset(&symbol, 0, sizeof(symbol));
+		symbol.st_name = strtab.size();
+		strtab += symbols[i];
+		strtab += '\0';
+		symbol.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+		std::map<std::string, LabelDefinition>::iterator definition =
+			definitions.find(symbols[i]);
+		if (definition != definitions.end()) {
+			symbol.st_shndx = section_number[definition->second.section];
+			symbol.st_value = definition->second.offset;
+		} else
+			symbol.st_shndx = SHN_UNDEF;
+		symtab.push_back(symbol);
+	}
+
+	std::vector<unsigned char> image(sizeof(Elf64_Ehdr), 0);
+	std::vector<Elf64_Shdr> headers(section_count);
+	memset(headers.data(), 0, section_count * sizeof(Elf64_Shdr));
+	std::string shstrtab(1, '\0');
+	for (int s = 0; s < SECTION_COUNT; s++) {
+		AddSection(image, headers[section_number[s]],
+			AddName(shstrtab, section_names[s]), SHT_PROGBITS,
+			section_flags[s], 1, sections[s].bytes.data(),
+			sections[s].bytes.size());
+		if (rela_number[s] == 0)
+			continue;
+		std::vector<Elf64_Rela> rela(relocations[s].size());
+		for (size_t i = 0; i < relocations[s].size(); i++) {
+			const Relocation &relocation = relocations[s][i];
+			int symbol = relocation.against_section ?
+				section_symbol[relocation.symbol] :
+				first_global + relocation.symbol;
+			rela[i].r_offset = relocation.offset;
+			rela[i].r_info = ELF64_R_INFO(symbol, relocation.type);
+			rela[i].r_addend = relocation.addend;
+		}
+		Elf64_Shdr &header = headers[rela_number[s]];
+		AddSection(image, header, AddName(shstrtab, rela_names[s]), SHT_RELA,
+			SHF_INFO_LINK, 8, rela.data(), rela.size() * sizeof(Elf64_Rela));
+		header.sh_entsize = sizeof(Elf64_Rela);
+		header.sh_link = symtab_number;
+		header.sh_info = section_number[s];
+	}
+	AddSection(image, headers[symtab_number], AddName(shstrtab, ".symtab"),
+		SHT_SYMTAB, 0, 8, symtab.data(), symtab.size() * sizeof(Elf64_Sym));
+	headers[symtab_number].sh_entsize = sizeof(Elf64_Sym);
+	headers[symtab_number].sh_link = strtab_number;
+	headers[symtab_number].sh_info = first_global;
+	AddSection(image, headers[strtab_number], AddName(shstrtab, ".strtab"),
+		SHT_STRTAB, 0, 1, strtab.data(), strtab.size());
+	// Its own name goes in before the table is written out
+	int shstrtab_name = AddName(shstrtab, ".shstrtab");
+	AddSection(image, headers[shstrtab_number], shstrtab_name, SHT_STRTAB,
+		0, 1, shstrtab.data(), shstrtab.size());
+
+	while (image.size() % 8 != 0)
+		image.push_back(0);
+	Elf64_Ehdr header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.e_ident, ELFMAG, SELFMAG);
+	header.e_ident[EI_CLASS] = ELFCLASS64;
+	header.e_ident[EI_DATA] = ELFDATA2LSB;
+	header.e_ident[EI_VERSION] = EV_CURRENT;
+	header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	header.e_type = ET_REL;
+	header.e_machine = EM_X86_64;
+	header.e_version = EV_CURRENT;
+	header.e_shoff = image.size();
+	header.e_ehsize = sizeof(Elf64_Ehdr);
+	header.e_shentsize = sizeof(Elf64_Shdr);
+	header.e_shnum = section_count;
+	header.e_shstrndx = shstrtab_number;
+	memcpy(image.data(), &header, sizeof(header));
+	AppendBytes(image, headers.data(), section_count * sizeof(Elf64_Shdr));
+
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (f == NULL)
+		return false;
+	bool ok = fwrite(image.data(), image.size(), 1, f) == 1;
+	if (fclose(f) != 0)
+		ok = false;
+	return ok;
+}
+
+}
@@ -0,0 +1,40 @@
+#ifndef _ELFWRITER_H
+#define _ELFWRITER_H
+
+#include "assembler.h"
+#include <string>
+#include <vector>
+
+namespace Asm {
+
+/**
+ * x86-64 ELF64 relocatable object file with the code in .text and the
+ * blobs in .rodata, what GNU as would make of the assembler text
+ */
+class ElfWriter {
+private:
+	enum {
+		TEXT,
+		RODATA,
+		SECTION_COUNT
+	};
+	MachineCode sections[SECTION_COUNT];
+	std::vector<std::string> globals;
+public:
+	void addCode(const MachineCode &code) {sections[TEXT].append(code);}
+	void addReadOnlyData(const MachineCode &data) {sections[RODATA].append(data);}
+	/**
+	 * Make the label visible to the linker, others are left out of the
+	 * symbol table
+	 */
+	void addGlobal(IR::Label *label) {globals.push_back(label->getName());}
+
+	/**
+	 * Returns false if the file cannot be written
+	 */
+	bool write(const std::string &filename);
+};
+
+}
+
+#endif
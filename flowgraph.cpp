@@ -1,73 +1,136 @@
 #include "flowgraph.h"
-#include <map>
 
 namespace Optimize {
 
-FlowGraphNode::FlowGraphNode(int _index, const Asm::Instruction* _instruction,
-	IR::VirtualRegister *ignored_register)
-	: index(_index), instruction(_instruction)
-{
-	is_reg_to_reg_assign = instruction->is_reg_to_reg_assign;
-	for (int i = 0; i < instruction->outputs.size(); i++)
-		assert(instruction->outputs[i]->getIndex() !=
-			ignored_register->getIndex());
-	for (int i = 0; i < instruction->inputs.size(); i++)
-		if ((ignored_register == NULL) ||
-				(instruction->inputs[i]->getIndex() !=
-				ignored_register->getIndex()))
-			used.push_back(instruction->inputs[i]);
-		else
-			is_reg_to_reg_assign = false;
-}
-
-const std::vector< IR::VirtualRegister* >& FlowGraphNode::usedRegisters() const
-{
-	return used;
-}
-
-const std::vector< IR::VirtualRegister* >& FlowGraphNode::assignedRegisters() const
+/**
+ * Turn edge counts per node into the start of each node's edges and
+ * make room for the edges
+ */
+static void StartRows(std::vector<int> &start, std::vector<int> &edges)
 {
-	return instruction->outputs;
+	int total = 0;
+	for (size_t i = 0; i < start.size(); i++) {
+		int count = start[i];
+		start[i] = total;
+		total += count;
+	}
+	edges.resize(total);
 }
 
 FlowGraph::FlowGraph(const Asm::Instructions &code,
 	IR::VirtualRegister *ignored_register)
 {
-	std::map<std::string, FlowGraphNode *> label_positions;
-	nodecount = 0;
-	FlowGraphNode *newnode = NULL;
+	int min_label = -1, max_label = -1;
+	for (Asm::Instructions::const_iterator inst = code.begin();
+			inst != code.end(); inst++) {
+		if ((*inst).label == NULL)
+			continue;
+		int index = (*inst).label->getIndex();
+		if ((min_label < 0) || (index < min_label))
+			min_label = index;
+		if (index > max_label)
+			max_label = index;
+	}
+	std::vector<int> label_positions;
+	if (min_label >= 0)
+		label_positions.resize(max_label - min_label + 1, -1);
 	
+	nodes.reserve(code.size());
 	for (Asm::Instructions::const_iterator inst = code.begin();
 			inst != code.end(); inst++) {
-		nodes.push_back(FlowGraphNode(nodecount, &(*inst), ignored_register));
+		nodes.push_back(FlowGraphNode(nodes.size(), &(*inst)));
+		FlowGraphNode &node = nodes.back();
+		if (ignored_register != NULL) {
+			for (size_t i = 0; i < (*inst).outputs.size(); i++)
+				assert((*inst).outputs[i]->getIndex() !=
+					ignored_register->getIndex());
+			for (size_t i = 0; i < (*inst).inputs.size(); i++)
+				if ((*inst).inputs[i]->getIndex() == ignored_register->getIndex()) {
+					filtered_inputs.push_back(std::vector<IR::VirtualRegister *>());
+					std::vector<IR::VirtualRegister *> &used = filtered_inputs.back();
+					for (size_t j = 0; j < (*inst).inputs.size(); j++)
+						if ((*inst).inputs[j]->getIndex() !=
+								ignored_register->getIndex())
+							used.push_back((*inst).inputs[j]);
+					node.used = &used;
+					node.is_reg_to_reg_assign = false;
+					break;
+				}
+		}
 		if ((*inst).label != NULL)
-			label_positions[(*inst).label->getName()] = & nodes.back();;
-		nodecount++;
+			label_positions[(*inst).label->getIndex() - min_label] = node.index;
 	}
 	
-	last_instruction = newnode;
-	
-	for (std::list<FlowGraphNode>::iterator node = nodes.begin();
-			node != nodes.end(); node++) {
-		FlowGraphNode *current = &(*node);
-		for (int i = 0; i < current->instruction->destinations.size(); i++)  {
-			const IR::Label *label = current->instruction->destinations[i];
-		
-			FlowGraphNode *nextnode = NULL;
-			if (label == NULL) {
-				std::list<FlowGraphNode>::iterator next_iter = node;
-				next_iter++;
-				if (next_iter != nodes.end())
-					nextnode = &(*next_iter);
-			} else
-				nextnode = label_positions.at(label->getName());
-			
-			if (nextnode != NULL) {
-				current->next.push_back(& *nextnode);
-				(*nextnode).previous.push_back(current);
+	// Successors in code order, then the predecessors counted and filled in
+	int nodecount = nodes.size();
+	next_start.reserve(nodecount + 1);
+	next_nodes.reserve(nodecount + nodecount / 4);
+	previous_start.resize(nodecount + 1, 0);
+	for (int n = 0; n < nodecount; n++) {
+		next_start.push_back(next_nodes.size());
+		const std::vector<IR::Label *> &destinations =
+			nodes[n].instruction->destinations;
+		for (size_t i = 0; i < destinations.size(); i++)  {
+			int next;
+			if (destinations[i] == NULL)
+				next = (n+1 < nodecount) ? n+1 : -1;
+			else {
+				int position = destinations[i]->getIndex() - min_label;
+				if ((min_label < 0) || (position < 0) ||
+						((size_t)position >= label_positions.size()) ||
+						(label_positions[position] < 0))
+					Error::fatalError("Jump to a label outside the function: " +
+						destinations[i]->getName());
+				next = label_positions[position];
+			}
+			if (next >= 0) {
+				next_nodes.push_back(next);
+				previous_start[next]++;
 			}
 		}
 	}
+	next_start.push_back(next_nodes.size());
+	StartRows(previous_start, previous_nodes);
+	std::vector<int> filled(previous_start.begin(), previous_start.end() - 1);
+	for (int n = 0; n < nodecount; n++)
+		for (int i = next_start[n]; i < next_start[n+1]; i++)
+			previous_nodes[filled[next_nodes[i]]++] = n;
+	
+	findBlocks();
 }
 
-}
\ No newline at end of file
+void FlowGraph::findBlocks()
+{
+	int nodecount = nodes.size();
+	block_of_node.resize(nodecount);
+	for (int i = 0; i < nodecount; i++) {
+		bool continues_block = (i > 0) && (previousCount(i) == 1) &&
+			(getPrevious(i, 0) == i-1) && (nextCount(i-1) == 1);
+		if (! continues_block)
+			block_start.push_back(i);
+		block_of_node[i] = block_start.size() - 1;
+	}
+	block_start.push_back(nodecount);
+	
+	int blockcount = blockCount();
+	block_next_start.reserve(blockcount + 1);
+	block_previous_start.resize(blockcount + 1, 0);
+	for (int b = 0; b < blockcount; b++) {
+		block_next_start.push_back(block_next.size());
+		int last = blockLast(b);
+		for (int i = 0; i < nextCount(last); i++) {
+			int next_block = block_of_node[getNext(last, i)];
+			block_next.push_back(next_block);
+			block_previous_start[next_block]++;
+		}
+	}
+	block_next_start.push_back(block_next.size());
+	StartRows(block_previous_start, block_previous);
+	std::vector<int> filled(block_previous_start.begin(),
+		block_previous_start.end() - 1);
+	for (int b = 0; b < blockcount; b++)
+		for (int i = block_next_start[b]; i < block_next_start[b+1]; i++)
+			block_previous[filled[block_next[i]]++] = b;
+}
+
+}
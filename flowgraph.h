@@ -11,9 +11,10 @@ private:
 	const Asm::Instruction *instruction;
 	
 	/**
-	 * Instruction outputs without the ignored node
+	 * Instruction inputs without the ignored register, the instruction's
+	 * own inputs unless the ignored register is among them
 	 */
-	std::vector<IR::VirtualRegister *> used;
+	const std::vector<IR::VirtualRegister *> *used;
 	
 	/**
 	 * Same as instruction->is_reg_to_reg_assign, except if assignment
@@ -22,33 +23,78 @@ private:
 	bool is_reg_to_reg_assign;
 public:
 	int index;
-	std::list<FlowGraphNode *> previous, next;
 	
-	FlowGraphNode(int _index, const Asm::Instruction *_instruction,
-		IR::VirtualRegister *ignored_register);
+	FlowGraphNode(int _index, const Asm::Instruction *_instruction) :
+		instruction(_instruction), used(&_instruction->inputs),
+		is_reg_to_reg_assign(_instruction->is_reg_to_reg_assign),
+		index(_index) {}
 	
-	const std::vector<IR::VirtualRegister *> &usedRegisters() const;
-	const std::vector<IR::VirtualRegister *> &assignedRegisters() const;
+	const std::vector<IR::VirtualRegister *> &usedRegisters() const {return *used;}
+	const std::vector<IR::VirtualRegister *> &assignedRegisters() const
+		{return instruction->outputs;}
 	bool isRegToRegAssignment() const {return is_reg_to_reg_assign;}
+	const Asm::Instruction *getInstruction() const {return instruction;}
 };
 
+/**
+ * Instructions as nodes numbered in code order, with the edges of each
+ * node in one array (compressed sparse rows): the successors of node n
+ * are next_nodes[next_start[n]] .. next_nodes[next_start[n+1] - 1].
+ * 
+ * Basic blocks, maximal sequences of nodes with one entry at the top
+ * and one exit at the bottom, are kept the same way on top of the nodes.
+ */
 class FlowGraph {
-public:
-	typedef std::list<FlowGraphNode> NodeList;
 private:
-	NodeList nodes;
-	int nodecount;
-public:
-	FlowGraphNode *last_instruction;
+	std::vector<FlowGraphNode> nodes;
+	std::vector<int> next_start, next_nodes;
+	std::vector<int> previous_start, previous_nodes;
+	/**
+	 * First node of each block, followed by the node count
+	 */
+	std::vector<int> block_start;
+	std::vector<int> block_of_node;
+	std::vector<int> block_next_start, block_next;
+	std::vector<int> block_previous_start, block_previous;
+	/**
+	 * Inputs of the nodes that use the ignored register
+	 */
+	std::list<std::vector<IR::VirtualRegister *> > filtered_inputs;
 	
+	void findBlocks();
+public:
 	/**
 	 * Frame pointer should be ignored_register because it's not
 	 * handled by the register allocator
 	 */
 	FlowGraph(const Asm::Instructions &code,
 		IR::VirtualRegister *ignored_register);
-	int nodeCount() const {return nodecount;}
-	const NodeList &getNodes() const {return nodes;}
+	
+	int nodeCount() const {return nodes.size();}
+	const FlowGraphNode &getNode(int node) const {return nodes[node];}
+	/**
+	 * A node jumping to the same place in two ways has the edge twice
+	 */
+	int nextCount(int node) const
+		{return next_start[node+1] - next_start[node];}
+	int getNext(int node, int i) const {return next_nodes[next_start[node] + i];}
+	int previousCount(int node) const
+		{return previous_start[node+1] - previous_start[node];}
+	int getPrevious(int node, int i) const
+		{return previous_nodes[previous_start[node] + i];}
+	
+	int blockCount() const {return block_start.size() - 1;}
+	int blockFirst(int block) const {return block_start[block];}
+	int blockLast(int block) const {return block_start[block+1] - 1;}
+	int blockOf(int node) const {return block_of_node[node];}
+	int blockNextCount(int block) const
+		{return block_next_start[block+1] - block_next_start[block];}
+	int getBlockNext(int block, int i) const
+		{return block_next[block_next_start[block] + i];}
+	int blockPreviousCount(int block) const
+		{return block_previous_start[block+1] - block_previous_start[block];}
+	int getBlockPrevious(int block, int i) const
+		{return block_previous[block_previous_start[block] + i];}
 };
 
 };
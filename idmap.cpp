@@ -14,7 +14,7 @@ void IdMap::add(ObjectId id, void* value)
 	if (values.size() <= id) {
 		int newsize = 2*values.size();
 		if (newsize <= id)
-			newsize = id;
+			newsize = id+1;
 		values.resize(newsize, NULL);
 	}
 	values[id] = value;
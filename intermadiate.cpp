@@ -43,148 +43,191 @@ void FlipComparison(CondJumpStatement *jump)
 	}
 }
 
+static __thread Arena *node_arena = NULL;
+
+Arena *GetNodeArena()
+{
+	if (node_arena == NULL)
+		Error::fatalError("No arena for IR nodes");
+	return node_arena;
+}
+
+void SetNodeArena(Arena *arena)
+{
+	node_arena = arena;
+}
+
 void DestroyExpression(Expression *&expression)
 {
-	return;
-	switch (expression->kind) {
-		case IR_INTEGER:
-			delete ToIntegerExpression(expression);
-			break;
-		case IR_LABELADDR:
-			delete ToLabelAddressExpression(expression);
-			break;
-		case IR_REGISTER:
-			delete ToRegisterExpression(expression);
-			break;
-		case IR_BINARYOP:
-			DestroyExpression(ToBinaryOpExpression(expression)->left);
-			DestroyExpression(ToBinaryOpExpression(expression)->right);
-			delete ToBinaryOpExpression(expression);
-			break;
-		case IR_MEMORY:
-			DestroyExpression(ToMemoryExpression(expression)->address);
-			delete ToMemoryExpression(expression);
-			break;
-		case IR_FUN_CALL:
-			DestroyExpression(ToCallExpression(expression)->function);
-			delete ToCallExpression(expression);
-			break;			
-		case IR_STAT_EXP_SEQ: {
-			DestroyStatement(ToStatExpSequence(expression)->stat);
-			DestroyExpression(ToStatExpSequence(expression)->exp);
-			delete ToStatExpSequence(expression);
-			break;
-		}
-	}
 	expression = NULL;
 }
 
 void DestroyStatement(Statement *&statement)
 {
-	return;
-	switch (statement->kind) {
-		case IR_MOVE:
-			DestroyExpression(ToMoveStatement(statement)->to);
-			DestroyExpression(ToMoveStatement(statement)->from);
-			delete ToMoveStatement(statement);
-			break;
-		case IR_EXP_IGNORE_RESULT:
-			DestroyExpression(ToExpressionStatement(statement)->exp);
-			delete ToExpressionStatement(statement);
-			break;
-		case IR_JUMP:
-			delete ToJumpStatement(statement);
-			break;
-		case IR_COND_JUMP:
-			DestroyExpression(ToCondJumpStatement(statement)->left);
-			DestroyExpression(ToCondJumpStatement(statement)->right);
-			delete ToCondJumpStatement(statement);
-			break;
-		case IR_STAT_SEQ: {
-			StatementSequence *seq = ToStatementSequence(statement);
-			for (std::list<Statement *>::iterator s = seq->statements.begin();
-					s != seq->statements.end(); s++)
-				DestroyStatement(*s);
-			delete seq;
-			break;
-		}
-		case IR_LABEL:
-			delete ToLabelPlacementStatement(statement);
-			break;
-	}
 	statement = NULL;
 }
 
 void DestroyCode(Code *&code)
 {
-	return;
 	switch (code->kind) {
 		case CODE_EXPRESSION:
-			DestroyExpression(((ExpressionCode *)code)->exp);
 			delete ((ExpressionCode *)code);
 			break;
 		case CODE_STATEMENT:
-			DestroyStatement(((StatementCode *)code)->statm);
-			delete ((ExpressionCode *)code);
+			delete ((StatementCode *)code);
 			break;
 		case CODE_JUMP_WITH_PATCHES:
-			DestroyStatement(((CondJumpPatchesCode *)code)->statm);
 			delete ((CondJumpPatchesCode *)code);
 			break;
 	}
 	code = NULL;
 }
 
-Label *LabelFactory::addLabel()
+std::string Label::getName() const
 {
-	labels.push_back(Label(labels.size()));
-	return &(labels.back());
+	if (name >= 0)
+		return factory->names[name];
+	return factory->name_prefix + IntToStr(index - factory->first_index);
 }
 
-Label::Label(int _index) : index(_index)
+void Label::appendToName(const std::string &s)
 {
-	char s[32];
-	sprintf(s, ".L%d", _index);
-	name = s;
+	factory->names.push_back(getName() + s);
+	name = factory->names.size() - 1;
 }
 
-VirtualRegister::VirtualRegister(int _index) : index(_index)
+Label *LabelFactory::addLabel()
 {
-	char s[32];
-	sprintf(s, "t%d", _index);
-	name = s;
-	prespilled_location = NULL;
+	labels.push_back(Label(first_index + labels.size(), -1, this));
+	return &(labels.back());
 }
 
-
 Label *LabelFactory::addLabel(const std::string &name)
 {
-	labels.push_back(Label(labels.size(), name));
+	names.push_back(name);
+	labels.push_back(Label(first_index + labels.size(), names.size() - 1, this));
 	return &(labels.back());
 }
 
+std::string VirtualRegister::getName() const
+{
+	if (name != NULL)
+		return *name;
+	char s[32];
+	sprintf(s, "t%d", index);
+	return s;
+}
+
 VirtualRegister *RegisterFactory::addRegister()
 {
-	debug("Adding new unnamed register #%d", registers.size());
-	registers.push_back(VirtualRegister(registers.size()));
+	int index = first_index + registers.size();
+	debug("Adding new unnamed register #%d", index);
+	registers.push_back(VirtualRegister(index));
 	return &(registers.back());
 }
 
 VirtualRegister *RegisterFactory::addRegister(const std::string &name)
 {
-	debug("Adding new register %s as #%d", name.c_str(), registers.size());
-	registers.push_back(VirtualRegister(registers.size(), name));
+	int index = first_index + registers.size();
+	debug("Adding new register %s as #%d", name.c_str(), index);
+	names.push_back(name);
+	registers.push_back(VirtualRegister(index, &(names.back())));
 	return &(registers.back());
 }
 
+static __thread LabelFactory *thread_labels = NULL;
+static __thread RegisterFactory *thread_registers = NULL;
+
+void IREnvironment::useFactories(LabelFactory *labels, RegisterFactory *registers)
+{
+	thread_labels = labels;
+	thread_registers = registers;
+}
+
+Label *IREnvironment::addLabel()
+{
+	if (thread_labels != NULL)
+		return thread_labels->addLabel();
+	return labels.addLabel();
+}
+
+Label *IREnvironment::addLabel(const std::string &name)
+{
+	if (thread_labels != NULL)
+		return thread_labels->addLabel(name);
+	return labels.addLabel(name);
+}
+
+VirtualRegister *IREnvironment::addRegister()
+{
+	if (thread_registers != NULL)
+		return thread_registers->addRegister();
+	return registers.addRegister();
+}
+
+VirtualRegister *IREnvironment::addRegister(const std::string &name)
+{
+	if (thread_registers != NULL)
+		return thread_registers->addRegister(name);
+	return registers.addRegister(name);
+}
+
+IREnvironment::IREnvironment()
+{
+	SetNodeArena(&node_arena);
+}
+
+IREnvironment::~IREnvironment()
+{
+	SetNodeArena(NULL);
+	for (std::list<Arena *>::iterator arena = function_arenas.begin();
+			arena != function_arenas.end(); arena++)
+		delete *arena;
+}
+
+Arena *IREnvironment::newNodeArena()
+{
+	function_arenas.push_back(new Arena(4096));
+	return function_arenas.back();
+}
+
+void IREnvironment::releaseNodes()
+{
+	node_arena.release();
+}
+
+size_t IREnvironment::getNodeMemory() const
+{
+	size_t result = node_arena.getAllocatedSize();
+	for (std::list<Arena *>::const_iterator arena = function_arenas.begin();
+			arena != function_arenas.end(); arena++)
+		result += (*arena)->getAllocatedSize();
+	return result;
+}
+
 Blob *IREnvironment::addBlob()
 {
 	blobs.push_back(Blob());
 	Blob *result = &(blobs.back());
 	result->label = addLabel();
+	blobs_by_label[result->label] = result;
 	return result;
 }
 
+std::string Blob::getString() const
+{
+	int length = *(const int *)data.data();
+	return std::string((const char *)data.data() + data.size() - length, length);
+}
+
+const Blob *IREnvironment::findBlob(Label *label) const
+{
+	std::map<Label *, Blob *>::const_iterator blob = blobs_by_label.find(label);
+	if (blob == blobs_by_label.end())
+		return NULL;
+	return blob->second;
+}
+
 void putLabels(const std::list<Label**> &replace_true, 
 	const std::list<Label**> &replace_false, Label *truelabel, Label *falselabel)
 {
@@ -2,43 +2,68 @@
 #define _INTERMEDIATE_H
 
 #include <list>
+#include <deque>
 #include <assert.h>
 #include <string>
 #include <stdio.h>
 #include <vector>
+#include <map>
 #include <memory>
 #include "debugprint.h"
+#include "arena.h"
 
 namespace IR { // Intermediate Representation
 
+class LabelFactory;
+
 class Label {
+friend class LabelFactory;
 private:
 	int index;
-	std::string name;
-public:
-	Label(int _index);
-	
-	Label(int _index, const std::string &_name) : index(_index), name(_name) {}
+	/**
+	 * Position in the factory's names, -1 for a generated name
+	 */
+	int name;
+	LabelFactory *factory;
 	
+	Label(int _index, int _name, LabelFactory *_factory) :
+		index(_index), name(_name), factory(_factory) {}
+public:
 	/**
 	 * Sequential number, from 0 to total number of labels - 1
 	 */
-	int getIndex() {return index;}
+	int getIndex() const {return index;}
 	
-	const std::string &getName() const {return name;}
+	std::string getName() const;
 	
-	void appendToName(const std::string &s)
-	{
-		name += s;
-	}
+	void appendToName(const std::string &s);
 };
 
+/**
+ * Labels are kept in a deque, so they don't move as more are added.
+ * They refer back to the factory, so a factory is not to be copied
+ * after it has made labels.
+ */
 class LabelFactory {
+friend class Label;
 private:
-	std::list<Label> labels;
+	std::deque<Label> labels;
+	/**
+	 * Names of the labels that were given one
+	 */
+	std::deque<std::string> names;
+	int first_index;
+	std::string name_prefix;
 public:
+	/**
+	 * Unnamed labels are called name_prefix followed by their number
+	 * in this factory
+	 */
+	LabelFactory(int _first_index = 0, const std::string &_name_prefix = ".L")
+		: first_index(_first_index), name_prefix(_name_prefix) {}
 	Label *addLabel();
 	Label *addLabel(const std::string &name);
+	int getNextIndex() const {return first_index + labels.size();}
 };
 
 class AbstractVarLocation;
@@ -46,16 +71,23 @@ class AbstractVarLocation;
 class VirtualRegister {
 private:
 	int index;
-	std::string name;
+	/**
+	 * NULL for registers called t<index>
+	 */
+	const std::string *name;
 	AbstractVarLocation *prespilled_location;
 public:
-	VirtualRegister(int _index, const std::string &_name) :
+	VirtualRegister(int _index, const std::string *_name = NULL) :
 		index(_index), name(_name), prespilled_location(NULL) {}
-	VirtualRegister(int _index);
 	
 	void prespill(AbstractVarLocation *location) {prespilled_location = location;}
 	
 	bool isPrespilled() {return prespilled_location != NULL;}
+	/**
+	 * Unnamed registers hold intermediate values of the translator and
+	 * canonicalizer, which are always assigned before they are used
+	 */
+	bool isTemporary() const {return name == NULL;}
 	AbstractVarLocation *getPrespilledLocation() {return prespilled_location;}
 	
 	/**
@@ -63,18 +95,28 @@ public:
 	 */
 	int getIndex() {return index;}
 	
-	const std::string &getName() {return name;}
+	std::string getName() const;
 };
 
 typedef std::vector<IR::VirtualRegister *> RegisterMap;
 
+/**
+ * Registers are kept in a deque, so they don't move as more are added
+ */
 class RegisterFactory: public DebugPrinter {
 private:
-	std::list<VirtualRegister> registers;
+	std::deque<VirtualRegister> registers;
+	/**
+	 * Names of the registers that were given one
+	 */
+	std::deque<std::string> names;
+	int first_index;
 public:
-	RegisterFactory() : DebugPrinter("registers.log") {}
+	RegisterFactory(int _first_index = 0) : DebugPrinter("registers.log"),
+		first_index(_first_index) {}
 	VirtualRegister *addRegister();
 	VirtualRegister *addRegister(const std::string &name);
+	int getNextIndex() const {return first_index + registers.size();}
 };
 
 enum ExpressionKind {
@@ -128,13 +170,69 @@ enum ComparisonOp {
 	COMPOP_MAX
 };
 
+/**
+ * IR nodes and the lists inside them are allocated from the node arena
+ * of the current thread and are never freed one by one. The arena
+ * belongs to the IREnvironment unless someone has set another one.
+ */
+Arena *GetNodeArena();
+void SetNodeArena(Arena *arena);
+
+template <class T>
+class NodeAllocator {
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	
+	template <class U>
+	struct rebind {typedef NodeAllocator<U> other;};
+	
+	NodeAllocator() {}
+	template <class U>
+	NodeAllocator(const NodeAllocator<U> &) {}
+	
+	pointer address(reference x) const {return &x;}
+	const_pointer address(const_reference x) const {return &x;}
+	pointer allocate(size_type n, const void * = 0)
+	{
+		return (pointer)GetNodeArena()->allocate(n * sizeof(T));
+	}
+	void deallocate(pointer, size_type) {}
+	size_type max_size() const {return (size_type)-1 / sizeof(T);}
+	void construct(pointer p, const T &value) {new((void *)p) T(value);}
+	void destroy(pointer p) {p->~T();}
+	
+	bool operator==(const NodeAllocator &) const {return true;}
+	bool operator!=(const NodeAllocator &) const {return false;}
+};
+
+class Expression;
 class Statement;
 
-class Expression {
+typedef std::list<Expression *, NodeAllocator<Expression *> > ExpressionList;
+typedef std::list<Statement *, NodeAllocator<Statement *> > StatementList;
+typedef std::list<Label *, NodeAllocator<Label *> > LabelList;
+
+class ArenaNode {
+public:
+	static void *operator new(size_t size) {return GetNodeArena()->allocate(size);}
+	static void operator delete(void *) {}
+};
+
+class Expression: public ArenaNode {
 public:
 	ExpressionKind kind;
+	/**
+	 * Instruction selector's automaton state, -1 until labelled
+	 */
+	int match_state;
 	
-	Expression(ExpressionKind _kind) : kind(_kind) {}
+	Expression(ExpressionKind _kind) : kind(_kind), match_state(-1) {}
 };
 
 class IntegerExpression: public Expression {
@@ -170,15 +268,31 @@ public:
 class MemoryExpression: public Expression {
 public:
 	Expression *address;
+	/**
+	 * Variable location, record field or array type the memory belongs to,
+	 * NULL if not known. Memory of two different ones never overlaps,
+	 * as records and arrays of different types are different objects.
+	 */
+	const void *contents;
+	/**
+	 * Not written by the function body, as the static links
+	 */
+	bool is_read_only;
+	/**
+	 * In a stack frame, so reading it cannot fault
+	 */
+	bool is_frame;
 	
-    MemoryExpression(Expression *_address) : Expression(IR_MEMORY),
-		address(_address) {}
+    MemoryExpression(Expression *_address, const void *_contents = NULL,
+		bool _is_read_only = false, bool _is_frame = false) :
+		Expression(IR_MEMORY), address(_address), contents(_contents),
+		is_read_only(_is_read_only), is_frame(_is_frame) {}
 };
 
 class CallExpression: public Expression {
 public:
 	Expression *function;
-	std::list<Expression *> arguments;
+	ExpressionList arguments;
 	Expression *callee_parentfp;
 	
 	CallExpression(Expression *_func, Expression *_callee_parentfp) :
@@ -217,7 +331,7 @@ DECLARE_EXPRESSION_CONVERSION(StatExpSequence, IR_STAT_EXP_SEQ);
 
 #undef DECLARE_EXPRESSION_CONVERSION
 
-class Statement {
+class Statement: public ArenaNode {
 public:
 	StatementKind kind;
 	
@@ -245,7 +359,7 @@ class JumpStatement: public Statement {
 public:
 	Expression *dest;
 	
-	std::list<Label *> possible_results;
+	LabelList possible_results;
 	
     JumpStatement(Expression *_dest) : Statement(IR_JUMP), dest(_dest) {}
     JumpStatement(Expression *_dest, Label *only_option) :
@@ -275,7 +389,7 @@ void FlipComparison(CondJumpStatement *jump);
 
 class StatementSequence: public Statement {
 public:
-	std::list<Statement *>statements;
+	StatementList statements;
 	
     StatementSequence() : Statement(IR_STAT_SEQ) {}
     void addStatement(Statement *stat)
@@ -345,7 +459,7 @@ public:
 };
 
 /**
- * Recursively delete the entire tree
+ * Nothing to do since nodes live in the arena, these only clear the pointer
  */
 void DestroyExpression(Expression *&expression);
 void DestroyStatement(Statement *&statement);
@@ -357,6 +471,11 @@ void putLabels(const std::list<Label**> &replace_true,
 struct Blob {
 	Label *label;
 	std::vector<unsigned char> data;
+	
+	/**
+	 * Characters of a string literal, which has its length before them
+	 */
+	std::string getString() const;
 };
 
 class IREnvironment {
@@ -364,13 +483,54 @@ private:
 	LabelFactory labels;
 	RegisterFactory registers;
 	std::list<Blob >blobs;
+	std::map<Label *, Blob *> blobs_by_label;
+	Arena node_arena;
+	std::list<Arena *> function_arenas;
 public:
-	Label *addLabel() {return labels.addLabel();}
-	Label *addLabel(const std::string &name) {return labels.addLabel(name);}
-	VirtualRegister *addRegister() {return registers.addRegister();}
-	VirtualRegister *addRegister(const std::string &name) {return registers.addRegister(name);}
+	IREnvironment();
+	~IREnvironment();
+	
+	/**
+	 * Separate arena for the body of one function, so that it can be
+	 * freed as soon as the function has gone through instruction selection
+	 */
+	Arena *newNodeArena();
+	/**
+	 * Make the environment's own arena active again
+	 */
+	void useDefaultNodeArena() {SetNodeArena(&node_arena);}
+	
+	/**
+	 * Free the IR nodes of the environment's own arena at once, to be
+	 * called when instruction selection is done. Nodes created after
+	 * that (by the spiller) go to the same arena.
+	 */
+	void releaseNodes();
+	size_t getNodeMemory() const;
+
+	/**
+	 * Make the calling thread take new labels and registers from the given
+	 * factories instead of the environment's own ones, so that functions
+	 * compiled in parallel get the same numbering in any order
+	 */
+	void useFactories(LabelFactory *labels, RegisterFactory *registers);
+	void useDefaultFactories() {useFactories(NULL, NULL);}
+	/**
+	 * Index the given thread-local factories should start from
+	 */
+	int getNextLabelIndex() const {return labels.getNextIndex();}
+	int getNextRegisterIndex() const {return registers.getNextIndex();}
+
+	Label *addLabel();
+	Label *addLabel(const std::string &name);
+	VirtualRegister *addRegister();
+	VirtualRegister *addRegister(const std::string &name);
 	Blob *addBlob();
 	const std::list<Blob> &getBlobs() {return blobs;}
+	/**
+	 * Blob placed at the label, NULL if none
+	 */
+	const Blob *findBlob(Label *label) const;
 	void printBlobs(FILE *out);
 	
 	Expression *killCodeToExpression(Code *&code);
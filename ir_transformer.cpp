@@ -1,6 +1,12 @@
 #include "ir_transformer.h"
 #include "errormsg.h"
+#include "bitset.h"
 #include <map>
+#include <set>
+#include <algorithm>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
 
 namespace IR {
 
@@ -35,7 +41,7 @@ void IRTransformer::canonicalizeMemoryExp(Expression *&exp)
 void growStatementSequence(StatementSequence *sequence, Statement *statement)
 {
 	if (statement->kind == IR_STAT_SEQ) {
-		for (std::list<Statement *>::iterator newstatm =
+		for (StatementList::iterator newstatm =
 				ToStatementSequence(statement)->statements.begin();
 				newstatm != ToStatementSequence(statement)->statements.end();
 				newstatm++)
@@ -110,12 +116,12 @@ void IRTransformer::canonicalizeCallExp(Expression *&exp,
 	arg_saved.resize(call_exp->arguments.size(), false);
 	
 	int arg_index = 0;
-	for (std::list<Expression *>::iterator arg = call_exp->arguments.begin();
+	for (ExpressionList::iterator arg = call_exp->arguments.begin();
 			arg != call_exp->arguments.end(); arg++) {
 		if ((*arg)->kind == IR_STAT_EXP_SEQ) {
 			StatExpSequence *stat_exp = ToStatExpSequence(*arg);
 			int prev_index = 0;
-			for (std::list<Expression *>::iterator prev_arg =
+			for (ExpressionList::iterator prev_arg =
 					call_exp->arguments.begin();
 					prev_arg != arg;  prev_arg++) {
 				if (! arg_saved[prev_index] &&
@@ -133,7 +139,7 @@ void IRTransformer::canonicalizeCallExp(Expression *&exp,
 					// expressions to the left of pre_arg are trivial and we
 					// can move pre_arg past them
 					int pre_prev_index = 0;
-					for (std::list<Expression *>::iterator pre_prev_arg =
+					for (ExpressionList::iterator pre_prev_arg =
 							call_exp->arguments.begin();
 							pre_prev_arg != prev_arg;  pre_prev_arg++) {
 						if (! arg_saved[pre_prev_index])
@@ -152,7 +158,7 @@ void IRTransformer::canonicalizeCallExp(Expression *&exp,
 			}
 			growStatementSequence(pre_statements, stat_exp->stat);
 			// stat_exp->exp and thus the new argument expression is free from
-			// IR_STAT_EXP_SEQ because recursize call to canonicalizeExpression
+			// IR_STAT_EXP_SEQ because canonicalizing the arguments
 			// has got rid of nested IR_STAT_EXP_SEQ before calling us
 			*arg = stat_exp->exp;
 			delete stat_exp;
@@ -218,200 +224,2616 @@ void IRTransformer::combineStatExpSequences(StatExpSequence *exp)
 	}
 }
 
+void IRTransformer::canonicalizeMoveStatement(Statement *&statm)
+{
+	MoveStatement *move_statm = ToMoveStatement(statm);
+	
+	if (move_statm->to->kind == IR_MEMORY) {
+		StatementSequence *pre_statements;
+		pullStatementsOutOfTwoOperands(ToMemoryExpression(move_statm->to)->address,
+			move_statm->from, pre_statements);
+		if (! pre_statements->statements.empty()) {
+			pre_statements->addStatement(move_statm);
+			statm = pre_statements;
+		} else
+			delete pre_statements;
+	} else if (move_statm->to->kind == IR_REGISTER) {
+		if (move_statm->from->kind == IR_STAT_EXP_SEQ) {
+			StatementSequence *sequence = new StatementSequence;
+			StatExpSequence *stat_exp_seq = ToStatExpSequence(move_statm->from);
+			growStatementSequence(sequence, stat_exp_seq->stat);
+			move_statm->from = stat_exp_seq->exp;
+			delete stat_exp_seq;
+			growStatementSequence(sequence, move_statm);
+			statm = sequence;
+		}
+	} else
+		Error::fatalError("canonicalizeMoveStatement: strange destination");
+}
+
+void IRTransformer::canonicalizeExpressionStatement(Statement *&statm)
+{
+	ExpressionStatement *exp_statement = ToExpressionStatement(statm);
+	if (exp_statement->exp->kind == IR_STAT_EXP_SEQ) {
+		StatementSequence *sequence = new StatementSequence;
+		StatExpSequence *stat_exp_seq = ToStatExpSequence(exp_statement->exp);
+		growStatementSequence(sequence, stat_exp_seq->stat);
+		exp_statement->exp = stat_exp_seq->exp;
+		delete stat_exp_seq;
+		growStatementSequence(sequence, exp_statement);
+		statm = sequence;
+	}
+}
+
+void IRTransformer::canonicalizeJumpStatement(Statement *&statm)
+{
+	JumpStatement *jump_statement = ToJumpStatement(statm);
+	if (jump_statement->dest->kind == IR_STAT_EXP_SEQ) {
+		StatementSequence *sequence = new StatementSequence;
+		StatExpSequence *stat_exp_seq = ToStatExpSequence(jump_statement->dest);
+		growStatementSequence(sequence, stat_exp_seq->stat);
+		jump_statement->dest = stat_exp_seq->exp;
+		delete stat_exp_seq;
+		growStatementSequence(sequence, jump_statement);
+		statm = sequence;
+	}
+}
+
+void IRTransformer::canonicalizeCondJumpStatement(Statement *&statm)
+{
+	CondJumpStatement *cjump_statm = ToCondJumpStatement(statm);
+	StatementSequence *pre_statements;
+	
+	pullStatementsOutOfTwoOperands(cjump_statm->left, cjump_statm->right, pre_statements);
+	
+	if (! pre_statements->statements.empty()) {
+		pre_statements->addStatement(cjump_statm);
+		statm = pre_statements;
+	} else
+		delete pre_statements;
+}
+
+void IRTransformer::mergeChildStatSequences(StatementSequence *statm)
+{
+	StatementList::iterator child = statm->statements.begin();
+	while (child != statm->statements.end()) {
+		StatementList::iterator next = child;
+		next++;
+		if ((*child)->kind == IR_STAT_SEQ) {
+			StatementSequence *subsequence = ToStatementSequence(*child);
+			// Moving the list nodes keeps nested sequences linear
+			statm->statements.splice(child, subsequence->statements);
+			delete subsequence;
+			statm->statements.erase(child);
+		}
+		child = next;
+	}
+}
+
+void IRTransformer::pushChildren(std::vector<PendingCanonicalization> &pending,
+	const PendingCanonicalization &parent)
+{
+	size_t first_child = pending.size();
+	if (parent.exp != NULL) {
+		Expression *exp = *parent.exp;
+		switch (exp->kind) {
+			case IR_INTEGER:
+			case IR_LABELADDR:
+			case IR_REGISTER:
+				break;
+			case IR_BINARYOP:
+				pending.push_back(PendingCanonicalization(
+					&ToBinaryOpExpression(exp)->left, exp));
+				pending.push_back(PendingCanonicalization(
+					&ToBinaryOpExpression(exp)->right, exp));
+				break;
+			case IR_MEMORY:
+				pending.push_back(PendingCanonicalization(
+					&ToMemoryExpression(exp)->address, exp));
+				break;
+			case IR_FUN_CALL:
+				pending.push_back(PendingCanonicalization(
+					&ToCallExpression(exp)->function, exp));
+				for (ExpressionList::iterator arg =
+						ToCallExpression(exp)->arguments.begin();
+						arg != ToCallExpression(exp)->arguments.end(); arg++)
+					pending.push_back(PendingCanonicalization(&(*arg), exp));
+				break;
+			case IR_STAT_EXP_SEQ:
+				pending.push_back(PendingCanonicalization(
+					&ToStatExpSequence(exp)->stat));
+				pending.push_back(PendingCanonicalization(
+					&ToStatExpSequence(exp)->exp, exp));
+				break;
+			default:
+				Error::fatalError("Unhandled IR::Expression kind");
+		}
+	} else {
+		Statement *statm = *parent.statm;
+		switch (statm->kind) {
+			case IR_MOVE:
+				pending.push_back(PendingCanonicalization(
+					&ToMoveStatement(statm)->to, NULL, statm));
+				pending.push_back(PendingCanonicalization(
+					&ToMoveStatement(statm)->from, NULL, statm));
+				break;
+			case IR_EXP_IGNORE_RESULT:
+				pending.push_back(PendingCanonicalization(
+					&ToExpressionStatement(statm)->exp, NULL, statm));
+				break;
+			case IR_JUMP:
+				pending.push_back(PendingCanonicalization(
+					&ToJumpStatement(statm)->dest, NULL, statm));
+				break;
+			case IR_COND_JUMP:
+				pending.push_back(PendingCanonicalization(
+					&ToCondJumpStatement(statm)->left, NULL, statm));
+				pending.push_back(PendingCanonicalization(
+					&ToCondJumpStatement(statm)->right, NULL, statm));
+				break;
+			case IR_STAT_SEQ:
+				for (StatementList::iterator child =
+						ToStatementSequence(statm)->statements.begin();
+						child != ToStatementSequence(statm)->statements.end();
+						child++)
+					pending.push_back(PendingCanonicalization(&(*child)));
+				break;
+			case IR_LABEL:
+				break;
+			default:
+				Error::fatalError("Unhandled IR::Statement kind");
+		}
+	}
+	// The first child is to be done first, so it goes on top
+	std::reverse(pending.begin() + first_child, pending.end());
+}
+
+void IRTransformer::canonicalizeNode(const PendingCanonicalization &node)
+{
+	if (node.exp != NULL) {
+		Expression *&exp = *node.exp;
+		switch (exp->kind) {
+			case IR_INTEGER:
+			case IR_LABELADDR:
+			case IR_REGISTER:
+				break;
+			
+			case IR_MEMORY:
+				canonicalizeMemoryExp(exp);
+				break;
+			
+			case IR_BINARYOP:
+				canonicalizeBinaryOpExp(exp);
+				break;
+			
+			case IR_FUN_CALL:
+				canonicalizeCallExp(exp, node.parent_expression,
+					node.parent_statement);
+				break;
+			
+			// If exp has been converted to IR_STAT_EXP_SEQ by the above cases,
+			// it doesn't need to be processed by the below case because its
+			// subexpression tree already doesn't contain any IR_STAT_EXP_SEQ
+			case IR_STAT_EXP_SEQ:
+				combineStatExpSequences(ToStatExpSequence(exp));
+				break;
+				
+			default:
+				Error::fatalError("Unhandled IR::Expression kind");
+		}
+	} else {
+		Statement *&statm = *node.statm;
+		switch (statm->kind) {
+			case IR_MOVE:
+				canonicalizeMoveStatement(statm);
+				break;
+			case IR_EXP_IGNORE_RESULT:
+				canonicalizeExpressionStatement(statm);
+				break;
+			case IR_JUMP:
+				// destroy child StatExpSequence, make statement sequence
+				// plus jump to clean expression
+				canonicalizeJumpStatement(statm);
+				break;
+			case IR_COND_JUMP:
+				// pull statements out of both operands, similar to
+				// processing binary expression
+				canonicalizeCondJumpStatement(statm);
+				break;
+			case IR_STAT_SEQ:
+				mergeChildStatSequences(ToStatementSequence(statm));
+				break;
+			case IR_LABEL:
+				break;
+			default:
+				Error::fatalError("Unhandled IR::Statement kind");
+		}
+	}
+}
+
+void IRTransformer::canonicalize(std::vector<PendingCanonicalization> &pending)
+{
+	// Children are canonicalized before their parents, in the order the
+	// code evaluates them. The stack is explicit since the code may be
+	// nested as deep as the program.
+	while (! pending.empty()) {
+		if (! pending.back().children_pushed) {
+			pending.back().children_pushed = true;
+			PendingCanonicalization parent = pending.back();
+			pushChildren(pending, parent);
+		} else {
+			PendingCanonicalization node = pending.back();
+			pending.pop_back();
+			canonicalizeNode(node);
+		}
+	}
+}
+
 void IRTransformer::canonicalizeExpression(Expression *&exp,
 	Expression *parentExpression, Statement *parentStatement)
 {
-	std::list<Expression **> subexpressions;
+	std::vector<PendingCanonicalization> pending;
+	pending.push_back(PendingCanonicalization(&exp, parentExpression,
+		parentStatement));
+	canonicalize(pending);
+}
+
+void IRTransformer::canonicalizeStatement(Statement *&statm)
+{
+	std::vector<PendingCanonicalization> pending;
+	pending.push_back(PendingCanonicalization(&statm));
+	canonicalize(pending);
+}
+
+static bool FitsInInt(int64_t value)
+{
+	return (value >= INT_MIN) && (value <= INT_MAX);
+}
+
+/**
+ * Nothing in the expression reads memory, calls or may divide by zero,
+ * so leaving it out changes nothing
+ */
+static bool IsPure(Expression *exp)
+{
+	switch (exp->kind) {
+		case IR_INTEGER:
+		case IR_LABELADDR:
+		case IR_REGISTER:
+			return true;
+		case IR_BINARYOP:
+			return (ToBinaryOpExpression(exp)->operation != OP_DIV) &&
+				IsPure(ToBinaryOpExpression(exp)->left) &&
+				IsPure(ToBinaryOpExpression(exp)->right);
+		default:
+			return false;
+	}
+}
+
+void IRTransformer::simplifyBinaryOpExp(Expression *&exp)
+{
+	BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+	if ((op_exp->left->kind == IR_INTEGER) && (op_exp->right->kind == IR_INTEGER)) {
+		int64_t left = ToIntegerExpression(op_exp->left)->value;
+		int64_t right = ToIntegerExpression(op_exp->right)->value;
+		int64_t result;
+		switch (op_exp->operation) {
+			case OP_PLUS:
+				result = left + right;
+				break;
+			case OP_MINUS:
+				result = left - right;
+				break;
+			case OP_MUL:
+				result = left * right;
+				break;
+			case OP_DIV:
+				// Division by zero is left to fail at run time
+				if (right == 0)
+					return;
+				result = left / right;
+				break;
+			default:
+				return;
+		}
+		if (FitsInInt(result))
+			exp = new IntegerExpression(result);
+		return;
+	}
+	
+	// Constant operand on the right, where instructions take it
+	if ((op_exp->left->kind == IR_INTEGER) &&
+			((op_exp->operation == OP_PLUS) || (op_exp->operation == OP_MUL)))
+		std::swap(op_exp->left, op_exp->right);
+	
+	if (op_exp->right->kind == IR_INTEGER) {
+		int value = ToIntegerExpression(op_exp->right)->value;
+		switch (op_exp->operation) {
+			case OP_PLUS:
+			case OP_MINUS: {
+				if (value == 0) {
+					exp = op_exp->left;
+					return;
+				}
+				// (x + c1) + c2 into x + (c1 + c2) and the like
+				if (op_exp->left->kind != IR_BINARYOP)
+					break;
+				BinaryOpExpression *inner = ToBinaryOpExpression(op_exp->left);
+				if (((inner->operation != OP_PLUS) && (inner->operation != OP_MINUS)) ||
+						(inner->right->kind != IR_INTEGER))
+					break;
+				int64_t inner_value = ToIntegerExpression(inner->right)->value;
+				int64_t sum = ((inner->operation == OP_PLUS) ? inner_value : -inner_value) +
+					((op_exp->operation == OP_PLUS) ? value : -(int64_t)value);
+				if (sum == 0)
+					exp = inner->left;
+				else if ((sum > 0) && FitsInInt(sum))
+					exp = new BinaryOpExpression(OP_PLUS, inner->left,
+						new IntegerExpression(sum));
+				else if ((sum < 0) && FitsInInt(-sum))
+					exp = new BinaryOpExpression(OP_MINUS, inner->left,
+						new IntegerExpression(-sum));
+				return;
+			}
+			case OP_MUL:
+				if (value == 1)
+					exp = op_exp->left;
+				else if ((value == 0) && IsPure(op_exp->left))
+					exp = op_exp->right;
+				return;
+			case OP_DIV:
+				if (value == 1)
+					exp = op_exp->left;
+				return;
+			default:
+				return;
+		}
+	}
+	
+	if ((op_exp->operation == OP_MINUS) &&
+			(op_exp->left->kind == IR_REGISTER) &&
+			(op_exp->right->kind == IR_REGISTER) &&
+			(ToRegisterExpression(op_exp->left)->reg->getIndex() ==
+				ToRegisterExpression(op_exp->right)->reg->getIndex()))
+		exp = new IntegerExpression(0);
+}
+
+void IRTransformer::simplifyCallExp(Expression *&exp)
+{
+	CallExpression *call_exp = ToCallExpression(exp);
+	if ((call_exp->function->kind != IR_LABELADDR) ||
+			(call_exp->arguments.size() != 2) ||
+			(ToLabelAddressExpression(call_exp->function)->label->getName() !=
+				"__strcmp"))
+		return;
+	
+	// Comparison of two string literals, as __strcmp does it
+	std::string strings[2];
+	int i = 0;
+	for (ExpressionList::iterator arg = call_exp->arguments.begin();
+			arg != call_exp->arguments.end(); arg++, i++) {
+		if ((*arg)->kind != IR_LABELADDR)
+			return;
+		const Blob *blob = ir_env->findBlob(ToLabelAddressExpression(*arg)->label);
+		if (blob == NULL)
+			return;
+		strings[i] = blob->getString();
+	}
+	int result = strncmp(strings[0].c_str(), strings[1].c_str(),
+		std::min(strings[0].size(), strings[1].size()));
+	if (result == 0)
+		result = (strings[0].size() < strings[1].size()) ? -1 :
+			(strings[0].size() > strings[1].size()) ? 1 : 0;
+	// Only compared to 0
+	exp = new IntegerExpression((result > 0) - (result < 0));
+}
+
+/**
+ * Comparison giving the same result with the operands exchanged
+ */
+static ComparisonOp SwapComparison(ComparisonOp comparison)
+{
+	switch (comparison) {
+		case OP_LESS:
+			return OP_GREATER;
+		case OP_LESSEQUAL:
+			return OP_GREATEQUAL;
+		case OP_GREATER:
+			return OP_LESS;
+		case OP_GREATEQUAL:
+			return OP_LESSEQUAL;
+		case OP_ULESS:
+			return OP_UGREATER;
+		case OP_ULESSEQUAL:
+			return OP_UGREATEQUAL;
+		case OP_UGREATER:
+			return OP_ULESS;
+		case OP_UGREATEQUAL:
+			return OP_ULESSEQUAL;
+		default:
+			return comparison;
+	}
+}
+
+void IRTransformer::simplifyCondJumpStatement(Statement *&statm)
+{
+	CondJumpStatement *cjump_statm = ToCondJumpStatement(statm);
+	if ((cjump_statm->left->kind == IR_INTEGER) &&
+			(cjump_statm->right->kind != IR_INTEGER)) {
+		// Folding may leave the constant on the left, where cmp cannot take it
+		std::swap(cjump_statm->left, cjump_statm->right);
+		cjump_statm->comparison = SwapComparison(cjump_statm->comparison);
+		return;
+	}
+	if ((cjump_statm->left->kind != IR_INTEGER) ||
+			(cjump_statm->right->kind != IR_INTEGER))
+		return;
+	int64_t left = ToIntegerExpression(cjump_statm->left)->value;
+	int64_t right = ToIntegerExpression(cjump_statm->right)->value;
+	bool result;
+	switch (cjump_statm->comparison) {
+		case OP_EQUAL:
+			result = left == right;
+			break;
+		case OP_NONEQUAL:
+			result = left != right;
+			break;
+		case OP_LESS:
+			result = left < right;
+			break;
+		case OP_LESSEQUAL:
+			result = left <= right;
+			break;
+		case OP_GREATER:
+			result = left > right;
+			break;
+		case OP_GREATEQUAL:
+			result = left >= right;
+			break;
+		case OP_ULESS:
+			result = (uint64_t)left < (uint64_t)right;
+			break;
+		case OP_ULESSEQUAL:
+			result = (uint64_t)left <= (uint64_t)right;
+			break;
+		case OP_UGREATER:
+			result = (uint64_t)left > (uint64_t)right;
+			break;
+		case OP_UGREATEQUAL:
+			result = (uint64_t)left >= (uint64_t)right;
+			break;
+		default:
+			return;
+	}
+	Label *dest = result ? cjump_statm->true_dest : cjump_statm->false_dest;
+	statm = new JumpStatement(new LabelAddressExpression(dest), dest);
+}
+
+void IRTransformer::countAssignments(Statement *statm,
+	Simplification &simplification)
+{
+	if (statm->kind == IR_STAT_SEQ) {
+		StatementList &statements = ToStatementSequence(statm)->statements;
+		for (StatementList::iterator child = statements.begin();
+				child != statements.end(); child++)
+			countAssignments(*child, simplification);
+	} else if ((statm->kind == IR_MOVE) &&
+			(ToMoveStatement(statm)->to->kind == IR_REGISTER)) {
+		VirtualRegister *reg = ToRegisterExpression(ToMoveStatement(statm)->to)->reg;
+		if (reg->isTemporary())
+			simplification.assignments[reg->getIndex()]++;
+	}
+}
+
+/**
+ * Assignment of the constant that has been put in place of the register
+ */
+bool IRTransformer::isConstantAssignment(Statement *statm,
+	Simplification &simplification)
+{
+	return (statm->kind == IR_MOVE) &&
+		(ToMoveStatement(statm)->to->kind == IR_REGISTER) &&
+		(simplification.constants.find(ToRegisterExpression(
+			ToMoveStatement(statm)->to)->reg->getIndex()) !=
+			simplification.constants.end());
+}
+
+void IRTransformer::simplifyExpression(Expression *&exp,
+	Simplification &simplification)
+{
+	switch (exp->kind) {
+		case IR_INTEGER:
+		case IR_LABELADDR:
+			break;
+		case IR_REGISTER: {
+			std::map<int, int>::iterator constant = simplification.constants.find(
+				ToRegisterExpression(exp)->reg->getIndex());
+			if (constant != simplification.constants.end())
+				exp = new IntegerExpression(constant->second);
+			break;
+		}
+		case IR_BINARYOP:
+			simplifyExpression(ToBinaryOpExpression(exp)->left, simplification);
+			simplifyExpression(ToBinaryOpExpression(exp)->right, simplification);
+			simplifyBinaryOpExp(exp);
+			break;
+		case IR_MEMORY:
+			simplifyExpression(ToMemoryExpression(exp)->address, simplification);
+			break;
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			simplifyExpression(call_exp->function, simplification);
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				simplifyExpression(*arg, simplification);
+			if (call_exp->callee_parentfp != NULL)
+				simplifyExpression(call_exp->callee_parentfp, simplification);
+			simplifyCallExp(exp);
+			break;
+		}
+		case IR_STAT_EXP_SEQ:
+			simplifyStatement(ToStatExpSequence(exp)->stat, simplification);
+			simplifyExpression(ToStatExpSequence(exp)->exp, simplification);
+			break;
+		default:
+			Error::fatalError("Unhandled IR::Expression kind");
+	}
+}
+
+void IRTransformer::simplifyStatement(Statement *&statm,
+	Simplification &simplification)
+{
+	switch (statm->kind) {
+		case IR_MOVE: {
+			MoveStatement *move_statm = ToMoveStatement(statm);
+			if (move_statm->to->kind == IR_MEMORY)
+				simplifyExpression(move_statm->to, simplification);
+			simplifyExpression(move_statm->from, simplification);
+			// Temporaries are assigned before they are used, so the
+			// only value of one assigned once is known from here on
+			if ((move_statm->to->kind == IR_REGISTER) &&
+					(move_statm->from->kind == IR_INTEGER)) {
+				VirtualRegister *reg = ToRegisterExpression(move_statm->to)->reg;
+				if (reg->isTemporary() &&
+						(simplification.assignments[reg->getIndex()] == 1))
+					simplification.constants[reg->getIndex()] =
+						ToIntegerExpression(move_statm->from)->value;
+			}
+			break;
+		}
+		case IR_EXP_IGNORE_RESULT:
+			simplifyExpression(ToExpressionStatement(statm)->exp, simplification);
+			break;
+		case IR_JUMP:
+			simplifyExpression(ToJumpStatement(statm)->dest, simplification);
+			break;
+		case IR_COND_JUMP:
+			simplifyExpression(ToCondJumpStatement(statm)->left, simplification);
+			simplifyExpression(ToCondJumpStatement(statm)->right, simplification);
+			simplifyCondJumpStatement(statm);
+			break;
+		case IR_STAT_SEQ: {
+			StatementList &statements = ToStatementSequence(statm)->statements;
+			StatementList::iterator child = statements.begin();
+			while (child != statements.end()) {
+				simplifyStatement(*child, simplification);
+				if (isConstantAssignment(*child, simplification))
+					child = statements.erase(child);
+				else
+					child++;
+			}
+			break;
+		}
+		case IR_LABEL:
+			break;
+		default:
+			Error::fatalError("Unhandled IR::Statement kind");
+	}
+}
+
+void IRTransformer::simplifyStatement(Statement *&statm)
+{
+	Simplification simplification;
+	countAssignments(statm, simplification);
+	simplifyStatement(statm, simplification);
+}
+
+void IRTransformer::simplifyExpression(Expression *&exp)
+{
+	Simplification simplification;
+	if (exp->kind == IR_STAT_EXP_SEQ)
+		countAssignments(ToStatExpSequence(exp)->stat, simplification);
+	simplifyExpression(exp, simplification);
+}
+
+/**
+ * Basic blocks of a flat sequence of canonical statements
+ */
+struct IRTransformer::BlockGraph {
+	struct Block {
+		/**
+		 * Statements from first up to but not including end
+		 */
+		int first, end;
+		std::vector<int> next, previous;
+		bool reachable;
+	};
+	
+	/**
+	 * NULL for the result of an expression, after the statements
+	 */
+	std::vector<Statement *> statements;
+	std::vector<StatementList::iterator> positions;
+	std::vector<Block> blocks;
+};
+
+/**
+ * Blocks start at labels and after jumps, the first one is the entry
+ */
+void IRTransformer::findBlocks(StatementList &statements, Expression **result,
+	BlockGraph &graph)
+{
+	for (StatementList::iterator statm = statements.begin();
+			statm != statements.end(); statm++) {
+		graph.statements.push_back(*statm);
+		graph.positions.push_back(statm);
+	}
+	if (result != NULL) {
+		graph.statements.push_back(NULL);
+		graph.positions.push_back(statements.end());
+	}
+	
+	std::map<int, int> blocks_by_labelid;
+	for (size_t s = 0; s < graph.statements.size(); s++) {
+		Statement *statm = graph.statements[s];
+		bool after_jump = (s > 0) && (graph.statements[s-1] != NULL) &&
+			((graph.statements[s-1]->kind == IR_JUMP) ||
+			(graph.statements[s-1]->kind == IR_COND_JUMP));
+		if ((s == 0) || after_jump ||
+				((statm != NULL) && (statm->kind == IR_LABEL))) {
+			if (! graph.blocks.empty())
+				graph.blocks.back().end = s;
+			graph.blocks.push_back(BlockGraph::Block());
+			graph.blocks.back().first = s;
+			graph.blocks.back().reachable = false;
+		}
+		if ((statm != NULL) && (statm->kind == IR_LABEL))
+			blocks_by_labelid[ToLabelPlacementStatement(statm)->label->getIndex()] =
+				graph.blocks.size() - 1;
+	}
+	if (graph.blocks.empty())
+		return;
+	graph.blocks.back().end = graph.statements.size();
+	
+	for (size_t b = 0; b < graph.blocks.size(); b++) {
+		BlockGraph::Block &block = graph.blocks[b];
+		Statement *last = graph.statements[block.end - 1];
+		std::vector<Label *> destinations;
+		if ((last != NULL) && (last->kind == IR_JUMP))
+			destinations.assign(ToJumpStatement(last)->possible_results.begin(),
+				ToJumpStatement(last)->possible_results.end());
+		else if ((last != NULL) && (last->kind == IR_COND_JUMP)) {
+			destinations.push_back(ToCondJumpStatement(last)->true_dest);
+			destinations.push_back(ToCondJumpStatement(last)->false_dest);
+		} else if (b + 1 < graph.blocks.size())
+			block.next.push_back(b + 1);
+		// Jumps out of the sequence lead to no block
+		for (size_t i = 0; i < destinations.size(); i++) {
+			std::map<int, int>::iterator next =
+				blocks_by_labelid.find(destinations[i]->getIndex());
+			if (next != blocks_by_labelid.end())
+				block.next.push_back(next->second);
+		}
+	}
+	
+	std::vector<int> stack(1, 0);
+	graph.blocks[0].reachable = true;
+	while (! stack.empty()) {
+		int b = stack.back();
+		stack.pop_back();
+		for (size_t i = 0; i < graph.blocks[b].next.size(); i++) {
+			int next = graph.blocks[b].next[i];
+			graph.blocks[next].previous.push_back(b);
+			if (! graph.blocks[next].reachable) {
+				graph.blocks[next].reachable = true;
+				stack.push_back(next);
+			}
+		}
+	}
+}
+
+/**
+ * The runtime library writes no memory the program has already got
+ */
+static bool CallWritesMemory(CallExpression *call_exp)
+{
+	static const char *const runtime_functions[] = {
+		"__getmem", "__getmem_fill", "__print", "__flush", "__getchar",
+		"__ord", "__chr", "__size", "__substring", "__concat", "__strcmp",
+		"__not", NULL
+	};
+	if (call_exp->function->kind != IR_LABELADDR)
+		return true;
+	std::string name = ToLabelAddressExpression(call_exp->function)->label->getName();
+	for (int i = 0; runtime_functions[i] != NULL; i++)
+		if (name == runtime_functions[i])
+			return false;
+	return true;
+}
+
+/**
+ * Runtime function whose result depends only on its arguments
+ */
+static bool IsPureCall(CallExpression *call_exp)
+{
+	static const char *const pure_functions[] = {
+		"__ord", "__size", "__strcmp", "__not", NULL
+	};
+	if (call_exp->function->kind != IR_LABELADDR)
+		return false;
+	std::string name = ToLabelAddressExpression(call_exp->function)->label->getName();
+	for (int i = 0; pure_functions[i] != NULL; i++)
+		if (name == pure_functions[i])
+			return true;
+	return false;
+}
+
+/**
+ * Expressions with the same value number compute the same value as long
+ * as the registers and memory they read are not written in between.
+ * Only the values computed more than once are tracked, each by its bit
+ * in the sets of available values.
+ */
+struct IRTransformer::ValueNumbering {
+	/**
+	 * Above this many tracked values times blocks, values are only
+	 * reused within blocks, to keep the sets of available values small
+	 */
+	enum {MAX_AVAILABILITY_BITS = 1 << 22};
+	
+	struct Key {
+		int kind, operation, left, right;
+		const void *contents;
+		
+		Key(int _kind, int _operation, int _left, int _right,
+			const void *_contents = NULL) : kind(_kind), operation(_operation),
+			left(_left), right(_right), contents(_contents) {}
+		
+		bool operator<(const Key &other) const
+		{
+			if (kind != other.kind)
+				return kind < other.kind;
+			if (operation != other.operation)
+				return operation < other.operation;
+			if (left != other.left)
+				return left < other.left;
+			if (right != other.right)
+				return right < other.right;
+			return contents < other.contents;
+		}
+	};
+	
+	struct Value {
+		/**
+		 * Values computed from this one
+		 */
+		std::vector<int> users;
+		int occurrences;
+		/**
+		 * Position in the sets of available values, -1 if not tracked
+		 */
+		int bit;
+		/**
+		 * Temporary keeping the value for its redundant occurrences
+		 */
+		VirtualRegister *reg;
+		
+		Value() : occurrences(0), bit(-1), reg(NULL) {}
+	};
+	
+	struct Occurrence {
+		Expression **place;
+		int value;
+		/**
+		 * Occurrences inside this one are the ones from first_inner
+		 * up to it, as they are recorded children first
+		 */
+		int first_inner;
+		bool redundant;
+	};
+	
+	struct StatementEffects {
+		int first_occurrence;
+		/**
+		 * Value number of the register assigned, -1 if none
+		 */
+		int assigned_register;
+		bool stores, calls;
+		const void *stored_contents;
+	};
+	
+	struct Availability {
+		BitSet generated, killed, available_in, available_out;
+	};
+	
+	std::map<Key, int> numbers;
+	std::vector<Value> values;
+	std::vector<Occurrence> occurrences;
+	BlockGraph graph;
+	/**
+	 * By position in the graph
+	 */
+	std::vector<StatementEffects> statements;
+	std::vector<Availability> blocks;
+	/**
+	 * Values of memory that can be written, by what the memory belongs to
+	 */
+	std::map<const void *, std::vector<int> > loads;
+	std::vector<int> all_loads;
+	/**
+	 * Tracked values changed by writing a register, by its value number,
+	 * and by writing memory, by what the memory belongs to
+	 */
+	std::map<int, std::vector<int> > killed_by_register;
+	std::map<const void *, std::vector<int> > killed_by_store;
+	std::vector<int> killed_by_any_store;
+	bool killed_by_any_store_known;
+	int tracked_count;
+	std::vector<int> visited;
+	int visit;
+	
+	ValueNumbering() : killed_by_any_store_known(false), tracked_count(0),
+		visit(0) {}
+	
+	int number(const Key &key)
+	{
+		std::map<Key, int>::iterator found = numbers.find(key);
+		if (found != numbers.end())
+			return found->second;
+		int value = values.size();
+		values.push_back(Value());
+		numbers.insert(std::make_pair(key, value));
+		return value;
+	}
+	
+	/**
+	 * Tracked values computed from any of the given ones
+	 */
+	void findTrackedUsers(const std::vector<int> &changed,
+		std::vector<int> &result)
+	{
+		visit++;
+		if (visited.size() < values.size())
+			visited.resize(values.size(), 0);
+		std::vector<int> stack(changed);
+		while (! stack.empty()) {
+			int value = stack.back();
+			stack.pop_back();
+			if (visited[value] == visit)
+				continue;
+			visited[value] = visit;
+			if (values[value].bit >= 0)
+				result.push_back(values[value].bit);
+			stack.insert(stack.end(), values[value].users.begin(),
+				values[value].users.end());
+		}
+	}
+	
+	const std::vector<int> &killedByAnyStore()
+	{
+		if (! killed_by_any_store_known) {
+			findTrackedUsers(all_loads, killed_by_any_store);
+			killed_by_any_store_known = true;
+		}
+		return killed_by_any_store;
+	}
+	
+	const std::vector<int> &killedByStore(const void *contents)
+	{
+		if (contents == NULL)
+			return killedByAnyStore();
+		std::map<const void *, std::vector<int> >::iterator found =
+			killed_by_store.find(contents);
+		if (found != killed_by_store.end())
+			return found->second;
+		std::vector<int> &killed = killed_by_store[contents];
+		std::vector<int> changed(loads[contents]);
+		changed.insert(changed.end(), loads[NULL].begin(), loads[NULL].end());
+		findTrackedUsers(changed, killed);
+		return killed;
+	}
+	
+	const std::vector<int> &killedByRegister(int value)
+	{
+		std::map<int, std::vector<int> >::iterator found =
+			killed_by_register.find(value);
+		if (found != killed_by_register.end())
+			return found->second;
+		std::vector<int> &killed = killed_by_register[value];
+		findTrackedUsers(std::vector<int>(1, value), killed);
+		return killed;
+	}
+	
+	/**
+	 * Remove from available the values the statement changes,
+	 * adding them to killed if it is not NULL
+	 */
+	void kill(const StatementEffects &statm, BitSet &available, BitSet *killed)
+	{
+		const std::vector<int> *changed[2] = {NULL, NULL};
+		if (statm.calls)
+			changed[0] = &killedByAnyStore();
+		else if (statm.stores)
+			changed[0] = &killedByStore(statm.stored_contents);
+		if (statm.assigned_register >= 0)
+			changed[1] = &killedByRegister(statm.assigned_register);
+		for (int c = 0; c < 2; c++)
+			if (changed[c] != NULL)
+				for (size_t i = 0; i < changed[c]->size(); i++) {
+					available.reset((*changed[c])[i]);
+					if (killed != NULL)
+						killed->set((*changed[c])[i]);
+				}
+	}
+};
+
+/**
+ * Operation on registers and constants taking a single instruction,
+ * not worth keeping the result of in a register
+ */
+static bool IsCheapOperation(BinaryOpExpression *op_exp)
+{
+	bool left_leaf = (op_exp->left->kind == IR_REGISTER) ||
+		(op_exp->left->kind == IR_INTEGER);
+	bool right_leaf = (op_exp->right->kind == IR_REGISTER) ||
+		(op_exp->right->kind == IR_INTEGER);
+	if (! left_leaf || ! right_leaf)
+		return false;
+	return (op_exp->operation == OP_PLUS) || (op_exp->operation == OP_MINUS) ||
+		((op_exp->operation == OP_MUL) && (op_exp->right->kind == IR_INTEGER));
+}
+
+/**
+ * Value number of the expression, -1 for calls and what contains them.
+ * Loads and, outside of memory addresses where instruction selection
+ * folds them, operations are recorded as occurrences.
+ */
+int IRTransformer::numberExpression(Expression *&exp, bool in_address,
+	ValueNumbering &numbering)
+{
+	int first_inner = numbering.occurrences.size();
+	int value = -1;
+	switch (exp->kind) {
+		case IR_INTEGER:
+			return numbering.number(ValueNumbering::Key(IR_INTEGER, 0,
+				ToIntegerExpression(exp)->value, 0));
+		case IR_LABELADDR:
+			return numbering.number(ValueNumbering::Key(IR_LABELADDR, 0,
+				ToLabelAddressExpression(exp)->label->getIndex(), 0));
+		case IR_REGISTER:
+			return numbering.number(ValueNumbering::Key(IR_REGISTER, 0,
+				ToRegisterExpression(exp)->reg->getIndex(), 0));
+		case IR_BINARYOP: {
+			BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+			// An index is computed before it is scaled in the address
+			bool in_operand_address = in_address && (op_exp->operation != OP_MUL);
+			int left = numberExpression(op_exp->left, in_operand_address,
+				numbering);
+			int right = numberExpression(op_exp->right, in_operand_address,
+				numbering);
+			if ((left < 0) || (right < 0))
+				return -1;
+			if (((op_exp->operation == OP_PLUS) || (op_exp->operation == OP_MUL)) &&
+					(left > right))
+				std::swap(left, right);
+			int count = numbering.values.size();
+			value = numbering.number(ValueNumbering::Key(IR_BINARYOP,
+				op_exp->operation, left, right));
+			if (value == count) {
+				numbering.values[left].users.push_back(value);
+				if (right != left)
+					numbering.values[right].users.push_back(value);
+			}
+			if (in_address || IsCheapOperation(op_exp))
+				return value;
+			break;
+		}
+		case IR_MEMORY: {
+			MemoryExpression *mem_exp = ToMemoryExpression(exp);
+			int address = numberExpression(mem_exp->address, true, numbering);
+			if (address < 0)
+				return -1;
+			int count = numbering.values.size();
+			value = numbering.number(ValueNumbering::Key(IR_MEMORY,
+				mem_exp->is_read_only, address, 0, mem_exp->contents));
+			if (value == count) {
+				numbering.values[address].users.push_back(value);
+				if (! mem_exp->is_read_only) {
+					numbering.loads[mem_exp->contents].push_back(value);
+					numbering.all_loads.push_back(value);
+				}
+			}
+			break;
+		}
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			numberExpression(call_exp->function, false, numbering);
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				numberExpression(*arg, false, numbering);
+			if (call_exp->callee_parentfp != NULL)
+				numberExpression(call_exp->callee_parentfp, false, numbering);
+			if (CallWritesMemory(call_exp))
+				numbering.statements.back().calls = true;
+			return -1;
+		}
+		default:
+			Error::fatalError("Unexpected IR::Expression kind in canonical code");
+			return -1;
+	}
+	numbering.values[value].occurrences++;
+	ValueNumbering::Occurrence occurrence;
+	occurrence.place = &exp;
+	occurrence.value = value;
+	occurrence.first_inner = first_inner;
+	occurrence.redundant = false;
+	numbering.occurrences.push_back(occurrence);
+	return value;
+}
+
+/**
+ * Returns false for code that is not a flat sequence
+ */
+bool IRTransformer::numberStatement(Statement *statm,
+	ValueNumbering &numbering)
+{
+	ValueNumbering::StatementEffects &effects = numbering.statements.back();
+	switch (statm->kind) {
+		case IR_MOVE: {
+			MoveStatement *move_statm = ToMoveStatement(statm);
+			if (move_statm->to->kind == IR_MEMORY) {
+				MemoryExpression *mem_exp = ToMemoryExpression(move_statm->to);
+				numberExpression(mem_exp->address, true, numbering);
+				effects.stores = true;
+				effects.stored_contents = mem_exp->contents;
+			} else {
+				effects.assigned_register = numberExpression(move_statm->to,
+					false, numbering);
+			}
+			numberExpression(move_statm->from, false, numbering);
+			break;
+		}
+		case IR_EXP_IGNORE_RESULT:
+			numberExpression(ToExpressionStatement(statm)->exp, false, numbering);
+			break;
+		case IR_JUMP:
+			numberExpression(ToJumpStatement(statm)->dest, false, numbering);
+			break;
+		case IR_COND_JUMP:
+			numberExpression(ToCondJumpStatement(statm)->left, false, numbering);
+			numberExpression(ToCondJumpStatement(statm)->right, false, numbering);
+			break;
+		case IR_LABEL:
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+void IRTransformer::findAvailableValues(ValueNumbering &numbering)
+{
+	BlockGraph &graph = numbering.graph;
+	std::vector<bool> in_worklist(graph.blocks.size(), false);
+	std::vector<bool> solved(graph.blocks.size(), false);
+	for (size_t b = 0; b < graph.blocks.size(); b++) {
+		ValueNumbering::Availability &block = numbering.blocks[b];
+		if (! graph.blocks[b].reachable)
+			continue;
+		block.generated.resize(numbering.tracked_count);
+		block.killed.resize(numbering.tracked_count);
+		block.available_in.resize(numbering.tracked_count);
+		for (int s = graph.blocks[b].first; s < graph.blocks[b].end; s++) {
+			ValueNumbering::StatementEffects &statm = numbering.statements[s];
+			int end_occurrence = ((size_t)(s + 1) < numbering.statements.size()) ?
+				numbering.statements[s+1].first_occurrence :
+				numbering.occurrences.size();
+			for (int o = statm.first_occurrence; o < end_occurrence; o++) {
+				int bit = numbering.values[numbering.occurrences[o].value].bit;
+				if (bit >= 0)
+					block.generated.set(bit);
+			}
+			numbering.kill(statm, block.generated, &block.killed);
+		}
+	}
+	
+	// A block is solved after some of its predecessors, the ones not
+	// solved yet count as having everything available
+	std::vector<int> worklist(1, 0);
+	in_worklist[0] = true;
+	BitSet available_in(numbering.tracked_count);
+	while (! worklist.empty()) {
+		int b = worklist.back();
+		worklist.pop_back();
+		in_worklist[b] = false;
+		ValueNumbering::Availability &block = numbering.blocks[b];
+		
+		bool first = true;
+		if (b == 0)
+			available_in.clear();
+		else
+			for (size_t i = 0; i < graph.blocks[b].previous.size(); i++) {
+				int previous = graph.blocks[b].previous[i];
+				if (! solved[previous])
+					continue;
+				if (first)
+					available_in = numbering.blocks[previous].available_out;
+				else
+					available_in.intersect(numbering.blocks[previous].available_out);
+				first = false;
+			}
+		block.available_in = available_in;
+		available_in.subtract(block.killed);
+		available_in.unite(block.generated);
+		if (solved[b] && (available_in == block.available_out))
+			continue;
+		block.available_out = available_in;
+		solved[b] = true;
+		for (size_t i = 0; i < graph.blocks[b].next.size(); i++) {
+			int next = graph.blocks[b].next[i];
+			if (! in_worklist[next]) {
+				in_worklist[next] = true;
+				worklist.push_back(next);
+			}
+		}
+	}
+}
+
+void IRTransformer::findRedundantOccurrences(ValueNumbering &numbering)
+{
+	BitSet available(numbering.tracked_count);
+	for (size_t b = 0; b < numbering.graph.blocks.size(); b++) {
+		BlockGraph::Block &block = numbering.graph.blocks[b];
+		if (! block.reachable)
+			continue;
+		if (numbering.blocks[b].available_in.size() == numbering.tracked_count)
+			available = numbering.blocks[b].available_in;
+		else
+			available.clear();
+		for (int s = block.first; s < block.end; s++) {
+			ValueNumbering::StatementEffects &statm = numbering.statements[s];
+			int end_occurrence = ((size_t)(s + 1) < numbering.statements.size()) ?
+				numbering.statements[s+1].first_occurrence :
+				numbering.occurrences.size();
+			for (int o = statm.first_occurrence; o < end_occurrence; o++) {
+				int bit = numbering.values[numbering.occurrences[o].value].bit;
+				if (bit < 0)
+					continue;
+				if (available.test(bit))
+					numbering.occurrences[o].redundant = true;
+				else
+					available.set(bit);
+			}
+			numbering.kill(statm, available, NULL);
+			
+			// Redundant occurrences inside redundant ones go away with them
+			for (int o = end_occurrence - 1; o >= statm.first_occurrence; o--) {
+				ValueNumbering::Occurrence &occurrence = numbering.occurrences[o];
+				if (! occurrence.redundant)
+					continue;
+				ValueNumbering::Value &value = numbering.values[occurrence.value];
+				if (value.reg == NULL)
+					value.reg = ir_env->addRegister();
+				o = occurrence.first_inner;
+			}
+		}
+	}
+}
+
+/**
+ * Put the temporary in place of the redundant occurrences and assign it
+ * before the statements with the other occurrences of its value
+ */
+void IRTransformer::reuseValues(StatementList &statements,
+	ValueNumbering &numbering)
+{
+	for (size_t s = 0; s < numbering.statements.size(); s++) {
+		ValueNumbering::StatementEffects &statm = numbering.statements[s];
+		int end_occurrence = (s + 1 < numbering.statements.size()) ?
+			numbering.statements[s+1].first_occurrence :
+			numbering.occurrences.size();
+		// Assignments for inner occurrences go before the outer ones
+		StatementList::iterator insert_before = numbering.graph.positions[s];
+		for (int o = end_occurrence - 1; o >= statm.first_occurrence; o--) {
+			ValueNumbering::Occurrence &occurrence = numbering.occurrences[o];
+			VirtualRegister *reg = numbering.values[occurrence.value].reg;
+			if (reg == NULL)
+				continue;
+			if (occurrence.redundant)
+				o = occurrence.first_inner;
+			else
+				insert_before = statements.insert(insert_before,
+					new MoveStatement(new RegisterExpression(reg),
+						*occurrence.place));
+			*occurrence.place = new RegisterExpression(reg);
+		}
+	}
+}
+
+void IRTransformer::eliminateCommonSubexpressions(StatementList &statements,
+	Expression **result)
+{
+	ValueNumbering numbering;
+	findBlocks(statements, result, numbering.graph);
+	for (size_t s = 0; s < numbering.graph.statements.size(); s++) {
+		numbering.statements.push_back(ValueNumbering::StatementEffects());
+		ValueNumbering::StatementEffects &effects = numbering.statements.back();
+		effects.first_occurrence = numbering.occurrences.size();
+		effects.assigned_register = -1;
+		effects.stores = false;
+		effects.calls = false;
+		effects.stored_contents = NULL;
+		if (numbering.graph.statements[s] == NULL)
+			numberExpression(*result, false, numbering);
+		else if (! numberStatement(numbering.graph.statements[s], numbering))
+			return;
+	}
+	
+	for (size_t v = 0; v < numbering.values.size(); v++)
+		if (numbering.values[v].occurrences > 1)
+			numbering.values[v].bit = numbering.tracked_count++;
+	if (numbering.tracked_count == 0)
+		return;
+	numbering.blocks.resize(numbering.graph.blocks.size());
+	if ((int64_t)numbering.tracked_count * numbering.blocks.size() <=
+			ValueNumbering::MAX_AVAILABILITY_BITS)
+		findAvailableValues(numbering);
+	findRedundantOccurrences(numbering);
+	reuseValues(statements, numbering);
+}
+
+void IRTransformer::eliminateCommonSubexpressions(StatementSequence *sequence)
+{
+	eliminateCommonSubexpressions(sequence->statements, NULL);
+}
+
+void IRTransformer::eliminateCommonSubexpressionsInExpression(
+	Expression *expression)
+{
+	if ((expression->kind == IR_STAT_EXP_SEQ) &&
+			(ToStatExpSequence(expression)->stat->kind == IR_STAT_SEQ))
+		eliminateCommonSubexpressions(ToStatementSequence(
+			ToStatExpSequence(expression)->stat)->statements,
+			&ToStatExpSequence(expression)->exp);
+}
+
+/**
+ * Natural loop of the back edges to a header, with what it changes
+ */
+struct IRTransformer::Loop {
+	int header;
+	std::vector<int> blocks;
+	/**
+	 * Registers assigned and memory written in the loop
+	 */
+	std::set<int> assigned;
+	std::set<const void *> stored;
+	bool stores_unknown, calls;
+	/**
+	 * Blocks the loop is left or repeated from
+	 */
+	std::vector<int> last_blocks;
+	/**
+	 * Statements put into the loop by reduceInLoop
+	 */
+	std::vector<Statement *> added;
+	/**
+	 * Assignments of the hoisted values, to go before the header
+	 */
+	std::vector<Statement *> preheader;
+	
+	Loop(int _header) : header(_header), stores_unknown(false),
+		calls(false) {}
+	
+	void addEffects(Statement *statm);
+	bool keepsMemory(MemoryExpression *mem_exp) const
+	{
+		if (mem_exp->is_read_only)
+			return true;
+		if (calls || stores_unknown)
+			return false;
+		if (mem_exp->contents == NULL)
+			return stored.empty();
+		return stored.find(mem_exp->contents) == stored.end();
+	}
+};
+
+/**
+ * Loops are found from the back edges of the flow graph, each with the
+ * blocks that reach the edge without passing through its header
+ */
+struct IRTransformer::LoopHoisting {
+	BlockGraph graph;
+	/**
+	 * Immediate dominator of each reachable block and the interval
+	 * of its dominator tree descendants in tree order
+	 */
+	std::vector<int> idom, tree_first, tree_last;
+	std::vector<Loop> loops;
+	/**
+	 * Loop with the block as its header, -1 if none
+	 */
+	std::vector<int> loop_by_header;
+	
+	bool dominates(int dominator, int block) const
+	{
+		return (tree_first[dominator] <= tree_first[block]) &&
+			(tree_last[block] <= tree_last[dominator]);
+	}
+	
+	bool isInLoop(int block, const Loop &loop) const
+	{
+		return std::binary_search(loop.blocks.begin(), loop.blocks.end(), block);
+	}
+	
+	static bool hasFewerBlocks(const Loop &a, const Loop &b)
+	{
+		return a.blocks.size() < b.blocks.size();
+	}
+	
+	/**
+	 * A block is passed in every iteration if it dominates the blocks
+	 * the loop is left or repeated from
+	 */
+	void findLastBlocks(Loop &loop) const;
+	bool runsEveryIteration(int block, const Loop &loop) const
+	{
+		for (size_t i = 0; i < loop.last_blocks.size(); i++)
+			if (! dominates(block, loop.last_blocks[i]))
+				return false;
+		return true;
+	}
+	
+	bool canAddPreheader(const Loop &loop) const;
+};
+
+void IRTransformer::findDominators(LoopHoisting &hoisting)
+{
+	BlockGraph &graph = hoisting.graph;
+	int count = graph.blocks.size();
+	std::vector<int> postorder, postorder_number(count, -1);
+	std::vector<std::pair<int, int> > stack;
+	std::vector<bool> visited(count, false);
+	stack.push_back(std::make_pair(0, 0));
+	visited[0] = true;
+	while (! stack.empty()) {
+		int b = stack.back().first;
+		int &next = stack.back().second;
+		if ((size_t)next < graph.blocks[b].next.size()) {
+			int successor = graph.blocks[b].next[next++];
+			if (! visited[successor]) {
+				visited[successor] = true;
+				stack.push_back(std::make_pair(successor, 0));
+			}
+		} else {
+			postorder_number[b] = postorder.size();
+			postorder.push_back(b);
+			stack.pop_back();
+		}
+	}
+	
+	// Cooper, Harvey and Kennedy's iteration in reverse postorder
+	hoisting.idom.assign(count, -1);
+	hoisting.idom[0] = 0;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i = postorder.size() - 2; i >= 0; i--) {
+			int b = postorder[i];
+			int new_idom = -1;
+			for (size_t p = 0; p < graph.blocks[b].previous.size(); p++) {
+				int previous = graph.blocks[b].previous[p];
+				if (hoisting.idom[previous] < 0)
+					continue;
+				if (new_idom < 0) {
+					new_idom = previous;
+					continue;
+				}
+				int other = previous;
+				while (other != new_idom) {
+					while (postorder_number[other] < postorder_number[new_idom])
+						other = hoisting.idom[other];
+					while (postorder_number[new_idom] < postorder_number[other])
+						new_idom = hoisting.idom[new_idom];
+				}
+			}
+			if (hoisting.idom[b] != new_idom) {
+				hoisting.idom[b] = new_idom;
+				changed = true;
+			}
+		}
+	}
+	
+	std::vector<std::vector<int> > children(count);
+	for (int i = postorder.size() - 2; i >= 0; i--)
+		children[hoisting.idom[postorder[i]]].push_back(postorder[i]);
+	hoisting.tree_first.assign(count, -1);
+	hoisting.tree_last.assign(count, -1);
+	int number = 0;
+	stack.clear();
+	stack.push_back(std::make_pair(0, 0));
+	hoisting.tree_first[0] = number++;
+	while (! stack.empty()) {
+		int b = stack.back().first;
+		int &next = stack.back().second;
+		if ((size_t)next < children[b].size()) {
+			int child = children[b][next++];
+			hoisting.tree_first[child] = number++;
+			stack.push_back(std::make_pair(child, 0));
+		} else {
+			hoisting.tree_last[b] = number - 1;
+			stack.pop_back();
+		}
+	}
+}
+
+void IRTransformer::findLoops(LoopHoisting &hoisting)
+{
+	BlockGraph &graph = hoisting.graph;
+	hoisting.loop_by_header.assign(graph.blocks.size(), -1);
+	std::vector<int> in_loop(graph.blocks.size(), -1);
+	for (size_t b = 0; b < graph.blocks.size(); b++) {
+		if (! graph.blocks[b].reachable)
+			continue;
+		for (size_t i = 0; i < graph.blocks[b].next.size(); i++) {
+			int header = graph.blocks[b].next[i];
+			if (! hoisting.dominates(header, b))
+				continue;
+			int l = hoisting.loop_by_header[header];
+			if (l < 0) {
+				l = hoisting.loops.size();
+				hoisting.loop_by_header[header] = l;
+				hoisting.loops.push_back(Loop(header));
+				hoisting.loops.back().blocks.push_back(header);
+				in_loop[header] = l;
+			}
+			Loop &loop = hoisting.loops[l];
+			std::vector<int> stack;
+			if (in_loop[b] != l) {
+				in_loop[b] = l;
+				loop.blocks.push_back(b);
+				stack.push_back(b);
+			}
+			while (! stack.empty()) {
+				int block = stack.back();
+				stack.pop_back();
+				for (size_t p = 0; p < graph.blocks[block].previous.size(); p++) {
+					int previous = graph.blocks[block].previous[p];
+					if (in_loop[previous] != l) {
+						in_loop[previous] = l;
+						loop.blocks.push_back(previous);
+						stack.push_back(previous);
+					}
+				}
+			}
+		}
+	}
+	// A block is found again through a second back edge to the header
+	for (size_t l = 0; l < hoisting.loops.size(); l++) {
+		std::vector<int> &blocks = hoisting.loops[l].blocks;
+		std::sort(blocks.begin(), blocks.end());
+		blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+	}
+	// Inner loops first, so that what they hoist can go on outwards
+	std::stable_sort(hoisting.loops.begin(), hoisting.loops.end(), LoopHoisting::hasFewerBlocks);
+	for (size_t l = 0; l < hoisting.loops.size(); l++)
+		hoisting.loop_by_header[hoisting.loops[l].header] = l;
+}
+
+static bool ContainsWritingCall(Expression *exp)
+{
+	switch (exp->kind) {
+		case IR_BINARYOP:
+			return ContainsWritingCall(ToBinaryOpExpression(exp)->left) ||
+				ContainsWritingCall(ToBinaryOpExpression(exp)->right);
+		case IR_MEMORY:
+			return ContainsWritingCall(ToMemoryExpression(exp)->address);
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			if (CallWritesMemory(call_exp))
+				return true;
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				if (ContainsWritingCall(*arg))
+					return true;
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+void IRTransformer::Loop::addEffects(Statement *statm)
+{
+	switch (statm->kind) {
+		case IR_MOVE: {
+			MoveStatement *move_statm = ToMoveStatement(statm);
+			if (move_statm->to->kind == IR_REGISTER)
+				assigned.insert(ToRegisterExpression(move_statm->to)->reg->getIndex());
+			else if (ToMemoryExpression(move_statm->to)->contents == NULL)
+				stores_unknown = true;
+			else
+				stored.insert(ToMemoryExpression(move_statm->to)->contents);
+			if (ContainsWritingCall(move_statm->from))
+				calls = true;
+			break;
+		}
+		case IR_EXP_IGNORE_RESULT:
+			if (ContainsWritingCall(ToExpressionStatement(statm)->exp))
+				calls = true;
+			break;
+		default:
+			break;
+	}
+}
+
+void IRTransformer::LoopHoisting::findLastBlocks(Loop &loop) const
+{
+	for (size_t i = 0; i < loop.blocks.size(); i++) {
+		const BlockGraph::Block &block = graph.blocks[loop.blocks[i]];
+		bool is_last = block.next.empty();
+		for (size_t n = 0; n < block.next.size(); n++)
+			if ((block.next[n] == loop.header) || ! isInLoop(block.next[n], loop))
+				is_last = true;
+		if (is_last)
+			loop.last_blocks.push_back(loop.blocks[i]);
+	}
+}
+
+/**
+ * A preheader can only be put before a header whose jumps from outside
+ * the loop can be redirected to it
+ */
+bool IRTransformer::LoopHoisting::canAddPreheader(const Loop &loop) const
+{
+	int first = graph.blocks[loop.header].first;
+	if ((graph.statements[first] == NULL) ||
+			(graph.statements[first]->kind != IR_LABEL))
+		return false;
+	for (size_t p = 0; p < graph.blocks[loop.header].previous.size(); p++) {
+		int previous = graph.blocks[loop.header].previous[p];
+		Statement *last = graph.statements[graph.blocks[previous].end - 1];
+		if (! isInLoop(previous, loop) && (last != NULL) &&
+				(last->kind == IR_JUMP) &&
+				(ToJumpStatement(last)->dest->kind != IR_LABELADDR))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Computation that may fault where the loop would not have done it,
+ * as a load through nil or a division by zero
+ */
+static bool CanFault(Expression *exp)
+{
+	switch (exp->kind) {
+		case IR_BINARYOP: {
+			BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+			if ((op_exp->operation == OP_DIV) &&
+					((op_exp->right->kind != IR_INTEGER) ||
+					(ToIntegerExpression(op_exp->right)->value == 0) ||
+					(ToIntegerExpression(op_exp->right)->value == -1)))
+				return true;
+			return CanFault(op_exp->left) || CanFault(op_exp->right);
+		}
+		case IR_MEMORY:
+			return ! ToMemoryExpression(exp)->is_frame ||
+				CanFault(ToMemoryExpression(exp)->address);
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				if (CanFault(*arg))
+					return true;
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+/**
+ * Move the invariant expression, or its parts worth keeping in
+ * a register, to the preheader. Unless the expression is computed
+ * in every iteration, only what cannot fault is moved.
+ */
+void IRTransformer::hoistInvariant(Expression *&exp, bool in_address,
+	bool every_iteration, Loop &loop)
+{
+	bool worth = false;
+	switch (exp->kind) {
+		case IR_BINARYOP:
+			worth = ! in_address && ! IsCheapOperation(ToBinaryOpExpression(exp));
+			break;
+		case IR_MEMORY:
+		case IR_FUN_CALL:
+			worth = true;
+			break;
+		default:
+			return;
+	}
+	if (worth && (every_iteration || ! CanFault(exp))) {
+		VirtualRegister *reg = ir_env->addRegister();
+		loop.preheader.push_back(new MoveStatement(new RegisterExpression(reg), exp));
+		exp = new RegisterExpression(reg);
+		return;
+	}
+	switch (exp->kind) {
+		case IR_BINARYOP: {
+			BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+			bool in_operand_address = in_address && (op_exp->operation != OP_MUL);
+			hoistInvariant(op_exp->left, in_operand_address, every_iteration, loop);
+			hoistInvariant(op_exp->right, in_operand_address, every_iteration, loop);
+			break;
+		}
+		case IR_MEMORY:
+			hoistInvariant(ToMemoryExpression(exp)->address, true,
+				every_iteration, loop);
+			break;
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				hoistInvariant(*arg, false, every_iteration, loop);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/**
+ * Whether the expression has the same value all through the loop.
+ * Invariant parts of an expression that is not are hoisted.
+ */
+bool IRTransformer::findInvariants(Expression *&exp, bool in_address,
+	bool every_iteration, Loop &loop)
+{
+	switch (exp->kind) {
+		case IR_INTEGER:
+		case IR_LABELADDR:
+			return true;
+		case IR_REGISTER:
+			return loop.assigned.find(ToRegisterExpression(exp)->reg->getIndex()) ==
+				loop.assigned.end();
+		case IR_BINARYOP: {
+			BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+			bool in_operand_address = in_address && (op_exp->operation != OP_MUL);
+			bool left = findInvariants(op_exp->left, in_operand_address,
+				every_iteration, loop);
+			bool right = findInvariants(op_exp->right, in_operand_address,
+				every_iteration, loop);
+			if (left && right)
+				return true;
+			if (left)
+				hoistInvariant(op_exp->left, in_operand_address, every_iteration, loop);
+			if (right)
+				hoistInvariant(op_exp->right, in_operand_address, every_iteration, loop);
+			return false;
+		}
+		case IR_MEMORY: {
+			MemoryExpression *mem_exp = ToMemoryExpression(exp);
+			if (! findInvariants(mem_exp->address, true, every_iteration, loop))
+				return false;
+			if (loop.keepsMemory(mem_exp))
+				return true;
+			hoistInvariant(mem_exp->address, true, every_iteration, loop);
+			return false;
+		}
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			std::vector<bool> invariant_arguments;
+			bool invariant = IsPureCall(call_exp) && (call_exp->callee_parentfp == NULL);
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++) {
+				invariant_arguments.push_back(findInvariants(*arg, false,
+					every_iteration, loop));
+				invariant = invariant && invariant_arguments.back();
+			}
+			if (call_exp->callee_parentfp != NULL) {
+				if (findInvariants(call_exp->callee_parentfp, false,
+						every_iteration, loop))
+					hoistInvariant(call_exp->callee_parentfp, false,
+						every_iteration, loop);
+			}
+			if (invariant)
+				return true;
+			int i = 0;
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++, i++)
+				if (invariant_arguments[i])
+					hoistInvariant(*arg, false, every_iteration, loop);
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+void IRTransformer::hoistFromStatement(Statement *statm, bool every_iteration,
+	Loop &loop)
+{
+	switch (statm->kind) {
+		case IR_MOVE: {
+			MoveStatement *move_statm = ToMoveStatement(statm);
+			if (move_statm->to->kind == IR_MEMORY) {
+				Expression *&address = ToMemoryExpression(move_statm->to)->address;
+				if (findInvariants(address, true, every_iteration, loop))
+					hoistInvariant(address, true, every_iteration, loop);
+			}
+			if (findInvariants(move_statm->from, false, every_iteration, loop))
+				hoistInvariant(move_statm->from, false, every_iteration, loop);
+			break;
+		}
+		case IR_EXP_IGNORE_RESULT:
+			findInvariants(ToExpressionStatement(statm)->exp, false,
+				every_iteration, loop);
+			break;
+		case IR_COND_JUMP: {
+			CondJumpStatement *cjump_statm = ToCondJumpStatement(statm);
+			if (findInvariants(cjump_statm->left, false, every_iteration, loop))
+				hoistInvariant(cjump_statm->left, false, every_iteration, loop);
+			if (findInvariants(cjump_statm->right, false, every_iteration, loop))
+				hoistInvariant(cjump_statm->right, false, every_iteration, loop);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void IRTransformer::hoistFromLoop(LoopHoisting &hoisting, Loop &loop)
+{
+	BlockGraph &graph = hoisting.graph;
+	// Preheaders of the inner loops have been filled already
+	for (size_t i = 0; i < loop.blocks.size(); i++) {
+		int b = loop.blocks[i];
+		int inner = hoisting.loop_by_header[b];
+		if ((b != loop.header) && (inner >= 0))
+			for (size_t s = 0; s < hoisting.loops[inner].preheader.size(); s++)
+				loop.addEffects(hoisting.loops[inner].preheader[s]);
+		for (int s = graph.blocks[b].first; s < graph.blocks[b].end; s++)
+			if (graph.statements[s] != NULL)
+				loop.addEffects(graph.statements[s]);
+	}
+	
+	hoisting.findLastBlocks(loop);
+	for (size_t i = 0; i < loop.blocks.size(); i++) {
+		int b = loop.blocks[i];
+		bool every_iteration = hoisting.runsEveryIteration(b, loop);
+		int inner = hoisting.loop_by_header[b];
+		if ((b != loop.header) && (inner >= 0))
+			for (size_t s = 0; s < hoisting.loops[inner].preheader.size(); s++)
+				hoistFromStatement(hoisting.loops[inner].preheader[s],
+					every_iteration, loop);
+		for (int s = graph.blocks[b].first; s < graph.blocks[b].end; s++)
+			if (graph.statements[s] != NULL)
+				hoistFromStatement(graph.statements[s], every_iteration, loop);
+	}
+}
+
+/**
+ * Put the preheader before the header and make the jumps into the loop
+ * from outside go to it
+ */
+void IRTransformer::insertPreheader(StatementList &statements,
+	LoopHoisting &hoisting, Loop &loop)
+{
+	BlockGraph &graph = hoisting.graph;
+	int first = graph.blocks[loop.header].first;
+	Label *header_label = ToLabelPlacementStatement(graph.statements[first])->label;
+	Label *preheader_label = ir_env->addLabel();
+	for (size_t p = 0; p < graph.blocks[loop.header].previous.size(); p++) {
+		int previous = graph.blocks[loop.header].previous[p];
+		if (hoisting.isInLoop(previous, loop))
+			continue;
+		Statement *last = graph.statements[graph.blocks[previous].end - 1];
+		if (last->kind == IR_JUMP) {
+			JumpStatement *jump_statm = ToJumpStatement(last);
+			ToLabelAddressExpression(jump_statm->dest)->label = preheader_label;
+			for (LabelList::iterator label = jump_statm->possible_results.begin();
+					label != jump_statm->possible_results.end(); label++)
+				if (*label == header_label)
+					*label = preheader_label;
+		} else if (last->kind == IR_COND_JUMP) {
+			CondJumpStatement *cjump_statm = ToCondJumpStatement(last);
+			if (cjump_statm->true_dest == header_label)
+				cjump_statm->true_dest = preheader_label;
+			if (cjump_statm->false_dest == header_label)
+				cjump_statm->false_dest = preheader_label;
+		}
+	}
+	StatementList::iterator position = graph.positions[first];
+	if ((first > 0) && (graph.statements[first - 1]->kind != IR_JUMP) &&
+			(graph.statements[first - 1]->kind != IR_COND_JUMP) &&
+			hoisting.isInLoop(loop.header - 1, loop))
+		statements.insert(position, new JumpStatement(
+			new LabelAddressExpression(header_label), header_label));
+	statements.insert(position, new LabelPlacementStatement(preheader_label));
+	for (size_t s = 0; s < loop.preheader.size(); s++)
+		statements.insert(position, loop.preheader[s]);
+}
+
+void IRTransformer::hoistLoopInvariants(StatementList &statements,
+	Expression **result)
+{
+	LoopHoisting hoisting;
+	findBlocks(statements, result, hoisting.graph);
+	if (hoisting.graph.blocks.empty())
+		return;
+	findDominators(hoisting);
+	findLoops(hoisting);
+	for (size_t l = 0; l < hoisting.loops.size(); l++)
+		if (hoisting.canAddPreheader(hoisting.loops[l]))
+			hoistFromLoop(hoisting, hoisting.loops[l]);
+	for (size_t l = 0; l < hoisting.loops.size(); l++)
+		if (! hoisting.loops[l].preheader.empty())
+			insertPreheader(statements, hoisting, hoisting.loops[l]);
+}
+
+void IRTransformer::hoistLoopInvariants(StatementSequence *sequence)
+{
+	hoistLoopInvariants(sequence->statements, NULL);
+}
+
+void IRTransformer::hoistLoopInvariantsInExpression(Expression *expression)
+{
+	if ((expression->kind == IR_STAT_EXP_SEQ) &&
+			(ToStatExpSequence(expression)->stat->kind == IR_STAT_SEQ))
+		hoistLoopInvariants(ToStatementSequence(
+			ToStatExpSequence(expression)->stat)->statements,
+			&ToStatExpSequence(expression)->exp);
+}
+
+/**
+ * Registers changed in a loop only by adding a constant to them once,
+ * with the values derived from them that get registers of their own
+ */
+struct IRTransformer::InductionVariables {
+	struct Family {
+		/**
+		 * base + counter * factor + constant, the base being a register
+		 * or a label address not changed in the loop, NULL for none
+		 */
+		Expression *base;
+		int factor, constant;
+		VirtualRegister *reg;
+		/**
+		 * Used as a memory address in every iteration
+		 */
+		bool addressed_every_iteration;
+	};
+	
+	struct Counter {
+		VirtualRegister *reg;
+		int step;
+		/**
+		 * The only assignment of the counter in the loop
+		 */
+		MoveStatement *increment;
+		int increment_index;
+		std::vector<Family> families;
+		/**
+		 * Conditional jumps comparing the counter with a value not changed
+		 * in the loop, which are all it is used for besides its increment
+		 * unless is_used_otherwise
+		 */
+		std::vector<CondJumpStatement *> comparisons;
+		bool is_used_otherwise;
+	};
+	
+	/**
+	 * Statements of the loop and the preheaders of the loops inside,
+	 * index in the block graph or -1
+	 */
+	struct LoopStatement {
+		Statement *statm;
+		int index;
+		bool every_iteration;
+	};
+	
+	/**
+	 * Factors of the derived values that can replace a counter are kept
+	 * small, see findReplacingFamily
+	 */
+	enum {MAX_REPLACING_FACTOR = 64};
 	
+	std::vector<LoopStatement> statements;
+	/**
+	 * Number of assignments in the loop by register index
+	 */
+	std::map<int, int> assignments;
+	std::vector<Counter> counters;
+	/**
+	 * Counter by register index
+	 */
+	std::map<int, int> counter_by_reg;
+	
+	bool isInvariant(Expression *exp) const
+	{
+		if ((exp->kind == IR_INTEGER) || (exp->kind == IR_LABELADDR))
+			return true;
+		return (exp->kind == IR_REGISTER) && (assignments.find(
+			ToRegisterExpression(exp)->reg->getIndex()) == assignments.end());
+	}
+	
+	/**
+	 * Whether the expression is factor * counter + constant for one of
+	 * the counters. counter is left -1 for a constant.
+	 */
+	bool getLinearForm(Expression *exp, int &counter, int64_t &factor,
+		int64_t &constant) const;
+};
+
+bool IRTransformer::InductionVariables::getLinearForm(Expression *exp,
+	int &counter, int64_t &factor, int64_t &constant) const
+{
 	switch (exp->kind) {
 		case IR_INTEGER:
-		case IR_LABELADDR:
-		case IR_REGISTER:
-			break;
+			counter = -1;
+			factor = 0;
+			constant = ToIntegerExpression(exp)->value;
+			return true;
+		case IR_REGISTER: {
+			std::map<int, int>::const_iterator found = counter_by_reg.find(
+				ToRegisterExpression(exp)->reg->getIndex());
+			if (found == counter_by_reg.end())
+				return false;
+			counter = found->second;
+			factor = 1;
+			constant = 0;
+			return true;
+		}
+		case IR_BINARYOP: {
+			BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+			int left_counter, right_counter;
+			int64_t left_factor, left_constant, right_factor, right_constant;
+			if (! getLinearForm(op_exp->left, left_counter, left_factor,
+					left_constant) ||
+					! getLinearForm(op_exp->right, right_counter, right_factor,
+					right_constant))
+				return false;
+			switch (op_exp->operation) {
+				case OP_PLUS:
+				case OP_MINUS: {
+					if ((left_counter >= 0) && (right_counter >= 0) &&
+							(left_counter != right_counter))
+						return false;
+					int sign = (op_exp->operation == OP_PLUS) ? 1 : -1;
+					counter = std::max(left_counter, right_counter);
+					factor = left_factor + sign * right_factor;
+					constant = left_constant + sign * right_constant;
+					break;
+				}
+				case OP_MUL:
+					if (left_counter >= 0) {
+						if (right_counter >= 0)
+							return false;
+						counter = left_counter;
+						factor = left_factor * right_constant;
+						constant = left_constant * right_constant;
+					} else {
+						counter = right_counter;
+						factor = right_factor * left_constant;
+						constant = right_constant * left_constant;
+					}
+					break;
+				default:
+					return false;
+			}
+			return FitsInInt(factor) && FitsInInt(constant);
+		}
+		default:
+			return false;
+	}
+}
+
+/**
+ * Whether computing the derived value takes more than the single
+ * instruction, or nothing in a memory address, that adding to its
+ * register in every iteration would
+ */
+static bool IsCostlyDerivedValue(bool has_base, int64_t factor, int64_t constant)
+{
+	bool is_scale = (factor == 1) || (factor == 2) || (factor == 4) ||
+		(factor == 8);
+	if (has_base)
+		return (constant != 0) || ! is_scale;
+	else
+		return (factor != 1) && ((constant != 0) || ! is_scale);
+}
+
+static bool IsSameBase(Expression *a, Expression *b)
+{
+	if ((a == NULL) || (b == NULL))
+		return a == b;
+	if (a->kind != b->kind)
+		return false;
+	if (a->kind == IR_REGISTER)
+		return ToRegisterExpression(a)->reg->getIndex() ==
+			ToRegisterExpression(b)->reg->getIndex();
+	if (a->kind == IR_LABELADDR)
+		return ToLabelAddressExpression(a)->label ==
+			ToLabelAddressExpression(b)->label;
+	return ToIntegerExpression(a)->value == ToIntegerExpression(b)->value;
+}
+
+static Expression *CopyBase(Expression *base)
+{
+	if (base->kind == IR_REGISTER)
+		return new RegisterExpression(ToRegisterExpression(base)->reg);
+	else if (base->kind == IR_LABELADDR)
+		return new LabelAddressExpression(ToLabelAddressExpression(base)->label);
+	else
+		return new IntegerExpression(ToIntegerExpression(base)->value);
+}
+
+/**
+ * base + value * factor + constant, value being a register or a constant
+ */
+static Expression *MakeDerivedValue(Expression *base, Expression *value,
+	int factor, int constant)
+{
+	Expression *result;
+	if ((value->kind == IR_INTEGER) &&
+			FitsInInt((int64_t)ToIntegerExpression(value)->value * factor + constant)) {
+		result = new IntegerExpression(ToIntegerExpression(value)->value *
+			factor + constant);
+		if (base != NULL)
+			result = new BinaryOpExpression(OP_PLUS, CopyBase(base), result);
+		return result;
+	}
+	if (factor == 1)
+		result = value;
+	else
+		result = new BinaryOpExpression(OP_MUL, value, new IntegerExpression(factor));
+	if (constant != 0)
+		result = new BinaryOpExpression(OP_PLUS, result,
+			new IntegerExpression(constant));
+	if (base != NULL)
+		result = new BinaryOpExpression(OP_PLUS, CopyBase(base), result);
+	return result;
+}
+
+/**
+ * Put registers in place of the values derived from counters that are
+ * costly to compute
+ */
+void IRTransformer::reduceDerivedValues(Expression *&exp, bool is_address,
+	bool every_iteration, InductionVariables &variables)
+{
+	int counter = -1;
+	int64_t factor, constant;
+	Expression *base = NULL;
+	bool is_derived = false;
+	if ((exp->kind == IR_BINARYOP) &&
+			(ToBinaryOpExpression(exp)->operation == OP_PLUS)) {
+		BinaryOpExpression *op_exp = ToBinaryOpExpression(exp);
+		if ((op_exp->left->kind != IR_INTEGER) &&
+				variables.isInvariant(op_exp->left) &&
+				variables.getLinearForm(op_exp->right, counter, factor, constant)) {
+			base = op_exp->left;
+			is_derived = true;
+		} else if ((op_exp->right->kind != IR_INTEGER) &&
+				variables.isInvariant(op_exp->right) &&
+				variables.getLinearForm(op_exp->left, counter, factor, constant)) {
+			base = op_exp->right;
+			is_derived = true;
+		}
+	}
+	if (! is_derived && (exp->kind != IR_REGISTER))
+		is_derived = variables.getLinearForm(exp, counter, factor, constant);
+	if (is_derived && (counter >= 0) && (factor != 0)) {
+		if (! IsCostlyDerivedValue(base != NULL, factor, constant))
+			return;
+		InductionVariables::Counter &c = variables.counters[counter];
+		if (! FitsInInt(factor * c.step))
+			return;
+		size_t f;
+		for (f = 0; f < c.families.size(); f++)
+			if (IsSameBase(c.families[f].base, base) &&
+					(c.families[f].factor == factor) &&
+					(c.families[f].constant == constant))
+				break;
+		if (f == c.families.size()) {
+			c.families.push_back(InductionVariables::Family());
+			c.families.back().base = base;
+			c.families.back().factor = factor;
+			c.families.back().constant = constant;
+			c.families.back().reg = ir_env->addRegister();
+			c.families.back().addressed_every_iteration = false;
+			variables.assignments[c.families.back().reg->getIndex()]++;
+		}
+		if (is_address && every_iteration)
+			c.families[f].addressed_every_iteration = true;
+		exp = new RegisterExpression(c.families[f].reg);
+		return;
+	}
+	
+	switch (exp->kind) {
 		case IR_BINARYOP:
-			subexpressions.push_back(& ToBinaryOpExpression(exp)->left);
-			subexpressions.push_back(& ToBinaryOpExpression(exp)->right);
+			reduceDerivedValues(ToBinaryOpExpression(exp)->left, false,
+				every_iteration, variables);
+			reduceDerivedValues(ToBinaryOpExpression(exp)->right, false,
+				every_iteration, variables);
 			break;
 		case IR_MEMORY:
-			subexpressions.push_back(& ToMemoryExpression(exp)->address);
+			reduceDerivedValues(ToMemoryExpression(exp)->address, true,
+				every_iteration, variables);
 			break;
 		case IR_FUN_CALL: {
-			subexpressions.push_back(& ToCallExpression(exp)->function);
-			for (std::list<Expression *>::iterator arg =
-					ToCallExpression(exp)->arguments.begin();
-					arg != ToCallExpression(exp)->arguments.end(); arg++)
-				subexpressions.push_back(&(*arg));
+			CallExpression *call_exp = ToCallExpression(exp);
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				reduceDerivedValues(*arg, false, every_iteration, variables);
+			if (call_exp->callee_parentfp != NULL)
+				reduceDerivedValues(call_exp->callee_parentfp, false,
+					every_iteration, variables);
 			break;
 		}
-		case IR_STAT_EXP_SEQ:
-			subexpressions.push_back(& ToStatExpSequence(exp)->exp);
-			canonicalizeStatement(ToStatExpSequence(exp)->stat);
-			break;
 		default:
-			Error::fatalError("Unhandled IR::Expression kind");
+			break;
 	}
-	
-	for (std::list<Expression **>::iterator subexp = subexpressions.begin();
-			 subexp != subexpressions.end(); subexp++)
-		canonicalizeExpression(*(*subexp), exp, NULL);
-	
+}
+
+static bool UsesRegister(Expression *exp, int reg)
+{
 	switch (exp->kind) {
-		case IR_INTEGER:
-		case IR_LABELADDR:
 		case IR_REGISTER:
-			break;
-		
-		case IR_MEMORY:
-			canonicalizeMemoryExp(exp);
-			break;
-		
+			return ToRegisterExpression(exp)->reg->getIndex() == reg;
 		case IR_BINARYOP:
-			canonicalizeBinaryOpExp(exp);
-			break;
-		
-		case IR_FUN_CALL:
-			canonicalizeCallExp(exp, parentExpression, parentStatement);
-			break;
-		
-		// If exp has been converted to IR_STAT_EXP_SEQ by the above cases,
-		// it doesn't need to be processed by the below case because its
-		// subexpression tree already doesn't contain any IR_STAT_EXP_SEQ
-		case IR_STAT_EXP_SEQ:
-			combineStatExpSequences(ToStatExpSequence(exp));
-			break;
-			
+			return UsesRegister(ToBinaryOpExpression(exp)->left, reg) ||
+				UsesRegister(ToBinaryOpExpression(exp)->right, reg);
+		case IR_MEMORY:
+			return UsesRegister(ToMemoryExpression(exp)->address, reg);
+		case IR_FUN_CALL: {
+			CallExpression *call_exp = ToCallExpression(exp);
+			if (UsesRegister(call_exp->function, reg) ||
+					((call_exp->callee_parentfp != NULL) &&
+					UsesRegister(call_exp->callee_parentfp, reg)))
+				return true;
+			for (ExpressionList::iterator arg = call_exp->arguments.begin();
+					arg != call_exp->arguments.end(); arg++)
+				if (UsesRegister(*arg, reg))
+					return true;
+			return false;
+		}
 		default:
-			Error::fatalError("Unhandled IR::Expression kind");
+			return false;
 	}
 }
 
-void IRTransformer::canonicalizeMoveStatement(Statement *&statm)
+static bool StatementUsesRegister(Statement *statm, int reg)
 {
-	MoveStatement *move_statm = ToMoveStatement(statm);
-	
-	if (move_statm->to->kind == IR_MEMORY) {
-		StatementSequence *pre_statements;
-		pullStatementsOutOfTwoOperands(ToMemoryExpression(move_statm->to)->address,
-			move_statm->from, pre_statements);
-		if (! pre_statements->statements.empty()) {
-			pre_statements->addStatement(move_statm);
-			statm = pre_statements;
-		} else
-			delete pre_statements;
-	} else if (move_statm->to->kind == IR_REGISTER) {
-		if (move_statm->from->kind == IR_STAT_EXP_SEQ) {
-			StatementSequence *sequence = new StatementSequence;
-			StatExpSequence *stat_exp_seq = ToStatExpSequence(move_statm->from);
-			growStatementSequence(sequence, stat_exp_seq->stat);
-			move_statm->from = stat_exp_seq->exp;
-			delete stat_exp_seq;
-			growStatementSequence(sequence, move_statm);
-			statm = sequence;
+	switch (statm->kind) {
+		case IR_MOVE: {
+			MoveStatement *move_statm = ToMoveStatement(statm);
+			if ((move_statm->to->kind == IR_MEMORY) &&
+					UsesRegister(ToMemoryExpression(move_statm->to)->address, reg))
+				return true;
+			return UsesRegister(move_statm->from, reg);
 		}
-	} else
-		Error::fatalError("canonicalizeMoveStatement: strange destination");
+		case IR_EXP_IGNORE_RESULT:
+			return UsesRegister(ToExpressionStatement(statm)->exp, reg);
+		case IR_JUMP:
+			return UsesRegister(ToJumpStatement(statm)->dest, reg);
+		case IR_COND_JUMP:
+			return UsesRegister(ToCondJumpStatement(statm)->left, reg) ||
+				UsesRegister(ToCondJumpStatement(statm)->right, reg);
+		default:
+			return false;
+	}
 }
 
-void IRTransformer::canonicalizeExpressionStatement(Statement *&statm)
+static bool IsRegister(Expression *exp, int reg)
 {
-	ExpressionStatement *exp_statement = ToExpressionStatement(statm);
-	if (exp_statement->exp->kind == IR_STAT_EXP_SEQ) {
-		StatementSequence *sequence = new StatementSequence;
-		StatExpSequence *stat_exp_seq = ToStatExpSequence(exp_statement->exp);
-		growStatementSequence(sequence, stat_exp_seq->stat);
-		exp_statement->exp = stat_exp_seq->exp;
-		delete stat_exp_seq;
-		growStatementSequence(sequence, exp_statement);
-		statm = sequence;
-	}
+	return (exp->kind == IR_REGISTER) &&
+		(ToRegisterExpression(exp)->reg->getIndex() == reg);
 }
 
-void IRTransformer::canonicalizeJumpStatement(Statement *&statm)
+static bool AssignsRegister(Statement *statm, int reg)
 {
-	JumpStatement *jump_statement = ToJumpStatement(statm);
-	if (jump_statement->dest->kind == IR_STAT_EXP_SEQ) {
-		StatementSequence *sequence = new StatementSequence;
-		StatExpSequence *stat_exp_seq = ToStatExpSequence(jump_statement->dest);
-		growStatementSequence(sequence, stat_exp_seq->stat);
-		jump_statement->dest = stat_exp_seq->exp;
-		delete stat_exp_seq;
-		growStatementSequence(sequence, jump_statement);
-		statm = sequence;
-	}
+	return (statm->kind == IR_MOVE) && IsRegister(ToMoveStatement(statm)->to, reg);
 }
 
-void IRTransformer::canonicalizeCondJumpStatement(Statement *&statm)
+/**
+ * Whether the register may be read after leaving the loop before it is
+ * assigned again. Gives up, answering yes, after looking through
+ * MAX_LIVENESS_SEARCH statements.
+ */
+bool IRTransformer::isUsedAfterLoop(int reg, LoopHoisting &hoisting,
+	Loop &loop, Expression **result)
 {
-	CondJumpStatement *cjump_statm = ToCondJumpStatement(statm);
-	StatementSequence *pre_statements;
-	
-	pullStatementsOutOfTwoOperands(cjump_statm->left, cjump_statm->right, pre_statements);
-	
-	if (! pre_statements->statements.empty()) {
-		pre_statements->addStatement(cjump_statm);
-		statm = pre_statements;
-	} else
-		delete pre_statements;
+	const int MAX_LIVENESS_SEARCH = 10000;
+	BlockGraph &graph = hoisting.graph;
+	std::vector<bool> visited(graph.blocks.size(), false);
+	std::vector<int> stack;
+	for (size_t i = 0; i < loop.last_blocks.size(); i++) {
+		BlockGraph::Block &block = graph.blocks[loop.last_blocks[i]];
+		for (size_t n = 0; n < block.next.size(); n++)
+			if (! hoisting.isInLoop(block.next[n], loop) &&
+					! visited[block.next[n]]) {
+				visited[block.next[n]] = true;
+				stack.push_back(block.next[n]);
+			}
+	}
+	int searched = 0;
+	while (! stack.empty()) {
+		int b = stack.back();
+		stack.pop_back();
+		std::vector<Statement *> block_statements;
+		int inner = hoisting.loop_by_header[b];
+		if (inner >= 0)
+			block_statements = hoisting.loops[inner].preheader;
+		for (int s = graph.blocks[b].first; s < graph.blocks[b].end; s++)
+			block_statements.push_back(graph.statements[s]);
+		bool assigned = false;
+		for (size_t s = 0; s < block_statements.size(); s++) {
+			if (++searched > MAX_LIVENESS_SEARCH)
+				return true;
+			if (block_statements[s] == NULL) {
+				if (UsesRegister(*result, reg))
+					return true;
+			} else if (StatementUsesRegister(block_statements[s], reg))
+				return true;
+			else if (AssignsRegister(block_statements[s], reg)) {
+				assigned = true;
+				break;
+			}
+		}
+		if (assigned)
+			continue;
+		for (size_t n = 0; n < graph.blocks[b].next.size(); n++)
+			if (! visited[graph.blocks[b].next[n]]) {
+				visited[graph.blocks[b].next[n]] = true;
+				stack.push_back(graph.blocks[b].next[n]);
+			}
+	}
+	return false;
 }
 
-void IRTransformer::doChildrenAndMergeChildStatSequences(StatementSequence *statm)
+/**
+ * Whether the loop is only entered after checking that the counter is
+ * at most the bound, as a for loop is
+ */
+bool IRTransformer::isEnteredBelowBound(LoopHoisting &hoisting, Loop &loop,
+	int counter_reg, Expression *bound)
 {
-	std::list<Statement *>::iterator child = statm->statements.begin();
-	while (child != statm->statements.end()) {
-		std::list<Statement *>::iterator next = child;
-		canonicalizeStatement(*child);
-		next++;
-		if ((*child)->kind == IR_STAT_SEQ) {
-			StatementSequence *subsequence = ToStatementSequence(*child);
-			for (std::list<Statement *>::iterator subitem =
-					subsequence->statements.begin();
-					subitem != subsequence->statements.end(); subitem++) {
-				assert((*subitem)->kind != IR_STAT_SEQ);
-				statm->statements.insert(child, *subitem);
-			}
-			delete subsequence;
-			statm->statements.erase(child);
+	BlockGraph &graph = hoisting.graph;
+	int entry = -1;
+	for (size_t p = 0; p < graph.blocks[loop.header].previous.size(); p++) {
+		int previous = graph.blocks[loop.header].previous[p];
+		if (hoisting.isInLoop(previous, loop))
+			continue;
+		if (entry >= 0)
+			return false;
+		entry = previous;
+	}
+	int block = loop.header;
+	for (size_t steps = 0; (entry >= 0) && (steps < graph.blocks.size()); steps++) {
+		Statement *last = graph.statements[graph.blocks[entry].end - 1];
+		if ((last != NULL) && (last->kind == IR_COND_JUMP)) {
+			CondJumpStatement *cjump_statm = ToCondJumpStatement(last);
+			Statement *first = graph.statements[graph.blocks[block].first];
+			if ((first == NULL) || (first->kind != IR_LABEL))
+				return false;
+			Label *label = ToLabelPlacementStatement(first)->label;
+			if ((cjump_statm->true_dest == label) == (cjump_statm->false_dest == label))
+				return false;
+			ComparisonOp comparison = cjump_statm->comparison;
+			if (IsRegister(cjump_statm->right, counter_reg) &&
+					IsSameBase(cjump_statm->left, bound))
+				comparison = SwapComparison(comparison);
+			else if (! IsRegister(cjump_statm->left, counter_reg) ||
+					! IsSameBase(cjump_statm->right, bound))
+				return false;
+			if (cjump_statm->true_dest == label)
+				return (comparison == OP_LESS) || (comparison == OP_LESSEQUAL);
+			else
+				return (comparison == OP_GREATER) || (comparison == OP_GREATEQUAL);
 		}
-		child = next;
+		// Nothing on the way from the check may change what it compared
+		for (int s = graph.blocks[entry].first; s < graph.blocks[entry].end; s++)
+			if ((graph.statements[s] == NULL) ||
+					AssignsRegister(graph.statements[s], counter_reg) ||
+					((bound->kind == IR_REGISTER) &&
+					AssignsRegister(graph.statements[s],
+						ToRegisterExpression(bound)->reg->getIndex())))
+				return false;
+		if (graph.blocks[entry].previous.size() != 1)
+			return false;
+		block = entry;
+		entry = graph.blocks[entry].previous[0];
 	}
+	return false;
 }
 
-void IRTransformer::canonicalizeStatement(Statement *&statm)
+void IRTransformer::reduceInStatement(Statement *statm, bool every_iteration,
+	InductionVariables &variables)
 {
 	switch (statm->kind) {
-		case IR_MOVE:
-			canonicalizeExpression(ToMoveStatement(statm)->to, NULL, statm);
-			canonicalizeExpression(ToMoveStatement(statm)->from, NULL, statm);
-			canonicalizeMoveStatement(statm);
-			break;
-		case IR_EXP_IGNORE_RESULT: {
-			canonicalizeExpression(ToExpressionStatement(statm)->exp, NULL, statm);
-			canonicalizeExpressionStatement(statm);
+		case IR_MOVE: {
+			MoveStatement *move_statm = ToMoveStatement(statm);
+			if (move_statm->to->kind == IR_MEMORY)
+				reduceDerivedValues(ToMemoryExpression(move_statm->to)->address,
+					true, every_iteration, variables);
+			reduceDerivedValues(move_statm->from, false, every_iteration, variables);
 			break;
 		}
-		case IR_JUMP:
-			canonicalizeExpression(ToJumpStatement(statm)->dest, NULL, statm);
-			canonicalizeJumpStatement(statm); // destroy child StatExpSequence, make statement sequence plus jump to clean expression
+		case IR_EXP_IGNORE_RESULT:
+			reduceDerivedValues(ToExpressionStatement(statm)->exp, false,
+				every_iteration, variables);
 			break;
 		case IR_COND_JUMP:
-			canonicalizeExpression(ToCondJumpStatement(statm)->left, NULL, statm);
-			canonicalizeExpression(ToCondJumpStatement(statm)->right, NULL, statm);
-			canonicalizeCondJumpStatement(statm); // pull statements out of both operands, similar to processing binary expression
+			reduceDerivedValues(ToCondJumpStatement(statm)->left, false,
+				every_iteration, variables);
+			reduceDerivedValues(ToCondJumpStatement(statm)->right, false,
+				every_iteration, variables);
 			break;
-		case IR_STAT_SEQ:
-			doChildrenAndMergeChildStatSequences(ToStatementSequence(statm));
+		default:
 			break;
-		case IR_LABEL:
+	}
+}
+
+/**
+ * A counter only compared with its bound can be replaced by one of its
+ * derived values used as an address, compared with the bound derived
+ * the same way. The loop must be left only by these comparisons and be
+ * entered below the bound, so that the derived values could only wrap
+ * around where the loop would have gone on to read outside the address
+ * space.
+ */
+int IRTransformer::findReplacingFamily(InductionVariables &variables,
+	int counter_index, LoopHoisting &hoisting, Loop &loop, Expression **result)
+{
+	InductionVariables::Counter &counter = variables.counters[counter_index];
+	if (counter.is_used_otherwise || (counter.step <= 0) ||
+			counter.comparisons.empty())
+		return -1;
+	int family = -1;
+	for (size_t f = 0; f < counter.families.size(); f++)
+		if ((counter.families[f].base != NULL) &&
+				(counter.families[f].factor > 0) &&
+				(counter.families[f].factor <= InductionVariables::MAX_REPLACING_FACTOR) &&
+				counter.families[f].addressed_every_iteration) {
+			family = f;
 			break;
-		default:
-			Error::fatalError("Unhandled IR::Statement kind");
+		}
+	if (family < 0)
+		return -1;
+	
+	int reg = counter.reg->getIndex();
+	Expression *bound = NULL;
+	for (size_t i = 0; i < counter.comparisons.size(); i++) {
+		CondJumpStatement *cjump_statm = counter.comparisons[i];
+		Expression *other = IsRegister(cjump_statm->left, reg) ?
+			cjump_statm->right : cjump_statm->left;
+		if (bound == NULL)
+			bound = other;
+		else if (! IsSameBase(bound, other))
+			return -1;
+	}
+	
+	BlockGraph &graph = hoisting.graph;
+	for (size_t i = 0; i < loop.last_blocks.size(); i++) {
+		BlockGraph::Block &block = graph.blocks[loop.last_blocks[i]];
+		bool leaves = block.next.empty();
+		for (size_t n = 0; n < block.next.size(); n++)
+			if (! hoisting.isInLoop(block.next[n], loop))
+				leaves = true;
+		if (! leaves)
+			continue;
+		Statement *last = graph.statements[block.end - 1];
+		if (std::find(counter.comparisons.begin(), counter.comparisons.end(),
+				last) == counter.comparisons.end())
+			return -1;
+	}
+	if (! isEnteredBelowBound(hoisting, loop, reg, bound) ||
+			isUsedAfterLoop(reg, hoisting, loop, result))
+		return -1;
+	return family;
+}
+
+void IRTransformer::reduceInLoop(LoopHoisting &hoisting, Loop &loop,
+	StatementList &statements, Expression **result)
+{
+	BlockGraph &graph = hoisting.graph;
+	InductionVariables variables;
+	hoisting.findLastBlocks(loop);
+	for (size_t i = 0; i < loop.blocks.size(); i++) {
+		int b = loop.blocks[i];
+		InductionVariables::LoopStatement loop_statm;
+		loop_statm.every_iteration = hoisting.runsEveryIteration(b, loop);
+		loop_statm.index = -1;
+		int inner = hoisting.loop_by_header[b];
+		if ((b != loop.header) && (inner >= 0)) {
+			Loop &inner_loop = hoisting.loops[inner];
+			for (size_t s = 0; s < inner_loop.preheader.size(); s++) {
+				loop_statm.statm = inner_loop.preheader[s];
+				variables.statements.push_back(loop_statm);
+			}
+			loop_statm.every_iteration = false;
+			for (size_t s = 0; s < inner_loop.added.size(); s++) {
+				loop_statm.statm = inner_loop.added[s];
+				variables.statements.push_back(loop_statm);
+			}
+			loop_statm.every_iteration = hoisting.runsEveryIteration(b, loop);
+		}
+		for (int s = graph.blocks[b].first; s < graph.blocks[b].end; s++)
+			if (graph.statements[s] != NULL) {
+				loop_statm.statm = graph.statements[s];
+				loop_statm.index = s;
+				variables.statements.push_back(loop_statm);
+			}
+	}
+	for (size_t s = 0; s < variables.statements.size(); s++) {
+		Statement *statm = variables.statements[s].statm;
+		if ((statm->kind == IR_MOVE) &&
+				(ToMoveStatement(statm)->to->kind == IR_REGISTER))
+			variables.assignments[ToRegisterExpression(
+				ToMoveStatement(statm)->to)->reg->getIndex()]++;
+	}
+	
+	for (size_t s = 0; s < variables.statements.size(); s++) {
+		Statement *statm = variables.statements[s].statm;
+		if ((variables.statements[s].index < 0) || (statm->kind != IR_MOVE) ||
+				(ToMoveStatement(statm)->to->kind != IR_REGISTER) ||
+				(ToMoveStatement(statm)->from->kind != IR_BINARYOP))
+			continue;
+		VirtualRegister *reg = ToRegisterExpression(ToMoveStatement(statm)->to)->reg;
+		BinaryOpExpression *op_exp = ToBinaryOpExpression(ToMoveStatement(statm)->from);
+		if (variables.assignments[reg->getIndex()] != 1)
+			continue;
+		Expression *step = NULL;
+		if (IsRegister(op_exp->left, reg->getIndex()))
+			step = op_exp->right;
+		else if ((op_exp->operation == OP_PLUS) &&
+				IsRegister(op_exp->right, reg->getIndex()))
+			step = op_exp->left;
+		if ((step == NULL) || (step->kind != IR_INTEGER) ||
+				((op_exp->operation != OP_PLUS) && (op_exp->operation != OP_MINUS)))
+			continue;
+		int64_t step_value = ToIntegerExpression(step)->value;
+		if (op_exp->operation == OP_MINUS)
+			step_value = -step_value;
+		if ((step_value == 0) || ! FitsInInt(step_value))
+			continue;
+		variables.counter_by_reg[reg->getIndex()] = variables.counters.size();
+		variables.counters.push_back(InductionVariables::Counter());
+		InductionVariables::Counter &counter = variables.counters.back();
+		counter.reg = reg;
+		counter.step = step_value;
+		counter.increment = ToMoveStatement(statm);
+		counter.increment_index = variables.statements[s].index;
+		counter.is_used_otherwise = false;
 	}
+	if (variables.counters.empty())
+		return;
+	
+	for (size_t s = 0; s < variables.statements.size(); s++)
+		reduceInStatement(variables.statements[s].statm,
+			variables.statements[s].every_iteration, variables);
+	
+	for (size_t c = 0; c < variables.counters.size(); c++) {
+		InductionVariables::Counter &counter = variables.counters[c];
+		int reg = counter.reg->getIndex();
+		for (size_t s = 0; s < variables.statements.size(); s++) {
+			Statement *statm = variables.statements[s].statm;
+			if (statm == counter.increment)
+				continue;
+			if (statm->kind == IR_COND_JUMP) {
+				CondJumpStatement *cjump_statm = ToCondJumpStatement(statm);
+				if ((IsRegister(cjump_statm->left, reg) &&
+						variables.isInvariant(cjump_statm->right)) ||
+						(IsRegister(cjump_statm->right, reg) &&
+						variables.isInvariant(cjump_statm->left))) {
+					counter.comparisons.push_back(cjump_statm);
+					continue;
+				}
+			}
+			if (StatementUsesRegister(statm, reg))
+				counter.is_used_otherwise = true;
+		}
+		if (counter.families.empty())
+			continue;
+		
+		int replacing = findReplacingFamily(variables, c, hoisting,
+			loop, result);
+		for (size_t f = 0; f < counter.families.size(); f++) {
+			InductionVariables::Family &family = counter.families[f];
+			loop.preheader.push_back(new MoveStatement(
+				new RegisterExpression(family.reg),
+				MakeDerivedValue(family.base, new RegisterExpression(counter.reg),
+					family.factor, family.constant)));
+		}
+		StatementList::iterator after = graph.positions[counter.increment_index];
+		after++;
+		for (int f = 0; f < (int)counter.families.size(); f++) {
+			InductionVariables::Family &family = counter.families[f];
+			Expression *increment = new BinaryOpExpression(OP_PLUS,
+				new RegisterExpression(family.reg),
+				new IntegerExpression(family.factor * counter.step));
+			if (f == replacing) {
+				counter.increment->to = new RegisterExpression(family.reg);
+				counter.increment->from = increment;
+			} else {
+				Statement *statm = new MoveStatement(
+					new RegisterExpression(family.reg), increment);
+				statements.insert(after, statm);
+				loop.added.push_back(statm);
+			}
+		}
+		if (replacing < 0)
+			continue;
+		
+		// The counter is compared with one bound, so one limit does
+		InductionVariables::Family &family = counter.families[replacing];
+		VirtualRegister *limit = ir_env->addRegister();
+		CondJumpStatement *first = counter.comparisons[0];
+		Expression *bound = IsRegister(first->left, reg) ?
+			first->right : first->left;
+		loop.preheader.push_back(new MoveStatement(new RegisterExpression(limit),
+			MakeDerivedValue(family.base, CopyBase(bound), family.factor,
+				family.constant)));
+		for (size_t i = 0; i < counter.comparisons.size(); i++) {
+			CondJumpStatement *cjump_statm = counter.comparisons[i];
+			if (IsRegister(cjump_statm->left, reg)) {
+				cjump_statm->left = new RegisterExpression(family.reg);
+				cjump_statm->right = new RegisterExpression(limit);
+			} else {
+				cjump_statm->left = new RegisterExpression(limit);
+				cjump_statm->right = new RegisterExpression(family.reg);
+			}
+		}
+	}
+}
+
+void IRTransformer::reduceInductionVariables(StatementList &statements,
+	Expression **result)
+{
+	LoopHoisting hoisting;
+	findBlocks(statements, result, hoisting.graph);
+	if (hoisting.graph.blocks.empty())
+		return;
+	findDominators(hoisting);
+	findLoops(hoisting);
+	for (size_t l = 0; l < hoisting.loops.size(); l++)
+		if (hoisting.canAddPreheader(hoisting.loops[l]))
+			reduceInLoop(hoisting, hoisting.loops[l], statements, result);
+	for (size_t l = 0; l < hoisting.loops.size(); l++)
+		if (! hoisting.loops[l].preheader.empty())
+			insertPreheader(statements, hoisting, hoisting.loops[l]);
+}
+
+void IRTransformer::reduceInductionVariables(StatementSequence *sequence)
+{
+	reduceInductionVariables(sequence->statements, NULL);
+}
+
+void IRTransformer::reduceInductionVariablesInExpression(Expression *expression)
+{
+	if ((expression->kind == IR_STAT_EXP_SEQ) &&
+			(ToStatExpSequence(expression)->stat->kind == IR_STAT_SEQ))
+		reduceInductionVariables(ToStatementSequence(
+			ToStatExpSequence(expression)->stat)->statements,
+			&ToStatExpSequence(expression)->exp);
 }
 
 void IRTransformer::splitToBlocks(StatementSequence* sequence,
 	BlockSequence& blocks)
 {
-	std::list<Statement *>::iterator statm = sequence->statements.begin();
+	StatementList::iterator statm = sequence->statements.begin();
 	blocks.finish_label = NULL;
 	while (statm != sequence->statements.end()) {
 		blocks.blocks.push_back(StatementBlock());
@@ -563,7 +2985,7 @@ void IRTransformer::arrangeJumps(StatementSequence* sequence)
 				sequence->statements.pop_back();
 			}
 		}
-		for (std::list<Statement *>::iterator block_statm =
+		for (StatementList::iterator block_statm =
 				(*block)->statements.begin();
 				block_statm != (*block)->statements.end(); block_statm++)
 			sequence->addStatement(*block_statm);
@@ -592,5 +3014,107 @@ void IRTransformer::arrangeJumpsInExpression(Expression* expression)
 		arrangeJumps(ToStatementSequence(ToStatExpSequence(expression)->stat));
 }
 
+/**
+ * Code tree node at its depth
+ */
+struct NestedCode {
+	Expression *exp;
+	Statement *statm;
+	int depth;
+	
+	NestedCode(Expression *_exp, Statement *_statm, int _depth) :
+		exp(_exp), statm(_statm), depth(_depth) {}
+};
+
+/**
+ * Whether no node of the code is deeper than max_depth, found without
+ * recursion
+ */
+static bool IsShallow(Expression *exp, Statement *statm, int max_depth)
+{
+	std::vector<NestedCode> pending(1, NestedCode(exp, statm, 1));
+	while (! pending.empty()) {
+		NestedCode node = pending.back();
+		pending.pop_back();
+		if (node.depth > max_depth)
+			return false;
+		int depth = node.depth + 1;
+		if (node.exp != NULL) {
+			switch (node.exp->kind) {
+				case IR_BINARYOP:
+					pending.push_back(NestedCode(
+						ToBinaryOpExpression(node.exp)->left, NULL, depth));
+					pending.push_back(NestedCode(
+						ToBinaryOpExpression(node.exp)->right, NULL, depth));
+					break;
+				case IR_MEMORY:
+					pending.push_back(NestedCode(
+						ToMemoryExpression(node.exp)->address, NULL, depth));
+					break;
+				case IR_FUN_CALL: {
+					CallExpression *call_exp = ToCallExpression(node.exp);
+					pending.push_back(NestedCode(call_exp->function, NULL, depth));
+					for (ExpressionList::iterator arg = call_exp->arguments.begin();
+							arg != call_exp->arguments.end(); arg++)
+						pending.push_back(NestedCode(*arg, NULL, depth));
+					break;
+				}
+				case IR_STAT_EXP_SEQ:
+					pending.push_back(NestedCode(NULL,
+						ToStatExpSequence(node.exp)->stat, depth));
+					pending.push_back(NestedCode(
+						ToStatExpSequence(node.exp)->exp, NULL, depth));
+					break;
+				default:
+					break;
+			}
+		} else {
+			switch (node.statm->kind) {
+				case IR_MOVE:
+					pending.push_back(NestedCode(
+						ToMoveStatement(node.statm)->to, NULL, depth));
+					pending.push_back(NestedCode(
+						ToMoveStatement(node.statm)->from, NULL, depth));
+					break;
+				case IR_EXP_IGNORE_RESULT:
+					pending.push_back(NestedCode(
+						ToExpressionStatement(node.statm)->exp, NULL, depth));
+					break;
+				case IR_JUMP:
+					pending.push_back(NestedCode(
+						ToJumpStatement(node.statm)->dest, NULL, depth));
+					break;
+				case IR_COND_JUMP:
+					pending.push_back(NestedCode(
+						ToCondJumpStatement(node.statm)->left, NULL, depth));
+					pending.push_back(NestedCode(
+						ToCondJumpStatement(node.statm)->right, NULL, depth));
+					break;
+				case IR_STAT_SEQ: {
+					StatementList &statements =
+						ToStatementSequence(node.statm)->statements;
+					for (StatementList::iterator child = statements.begin();
+							child != statements.end(); child++)
+						pending.push_back(NestedCode(NULL, *child, depth));
+					break;
+				}
+				default:
+					break;
+			}
+		}
+	}
+	return true;
+}
+
+bool IRTransformer::isShallow(Statement *statm, int max_depth)
+{
+	return IsShallow(NULL, statm, max_depth);
+}
+
+bool IRTransformer::isShallow(Expression *exp, int max_depth)
+{
+	return IsShallow(exp, NULL, max_depth);
+}
+
 
 }
@@ -3,6 +3,7 @@
 
 #include "intermediate.h"
 #include "debugprint.h"
+#include <map>
 
 namespace IR {
 
@@ -22,10 +23,34 @@ private:
 	void canonicalizeExpressionStatement(Statement *&statm);
 	void canonicalizeJumpStatement(Statement *&statm);
 	void canonicalizeCondJumpStatement(Statement *&statm);
-	void doChildrenAndMergeChildStatSequences(StatementSequence *statm);
+	void mergeChildStatSequences(StatementSequence *statm);
+	
+	/**
+	 * Expression or statement waiting for its children to be canonicalized
+	 */
+	struct PendingCanonicalization {
+		Expression **exp;
+		Statement **statm;
+		Expression *parent_expression;
+		Statement *parent_statement;
+		bool children_pushed;
+		
+		PendingCanonicalization(Expression **_exp,
+			Expression *_parent_expression, Statement *_parent_statement = NULL) :
+			exp(_exp), statm(NULL), parent_expression(_parent_expression),
+			parent_statement(_parent_statement), children_pushed(false) {}
+		PendingCanonicalization(Statement **_statm) :
+			exp(NULL), statm(_statm), parent_expression(NULL),
+			parent_statement(NULL), children_pushed(false) {}
+	};
+	
+	void pushChildren(std::vector<PendingCanonicalization> &pending,
+		const PendingCanonicalization &parent);
+	void canonicalizeNode(const PendingCanonicalization &node);
+	void canonicalize(std::vector<PendingCanonicalization> &pending);
 
 	struct StatementBlock {
-		std::list<Statement *> statements;
+		StatementList statements;
 		Label *start_label;
 		bool used_in_trace;
 	};
@@ -45,6 +70,82 @@ private:
 				block(_block), position_in_remaining_list(_position) {}
 	};
 	
+	/**
+	 * State of one simplifyStatement or simplifyExpression call
+	 */
+	struct Simplification {
+		/**
+		 * Number of assignments to each temporary register, by index
+		 */
+		std::map<int, int> assignments;
+		/**
+		 * Temporaries assigned a constant once, by index
+		 */
+		std::map<int, int> constants;
+	};
+	
+	void countAssignments(Statement *statm, Simplification &simplification);
+	void simplifyBinaryOpExp(Expression *&exp);
+	void simplifyCallExp(Expression *&exp);
+	void simplifyCondJumpStatement(Statement *&statm);
+	bool isConstantAssignment(Statement *statm, Simplification &simplification);
+	void simplifyExpression(Expression *&exp, Simplification &simplification);
+	void simplifyStatement(Statement *&statm, Simplification &simplification);
+
+	struct BlockGraph;
+	void findBlocks(StatementList &statements, Expression **result,
+		BlockGraph &graph);
+	
+	/**
+	 * State of one eliminateCommonSubexpressions call
+	 */
+	struct ValueNumbering;
+	
+	int numberExpression(Expression *&exp, bool in_address,
+		ValueNumbering &numbering);
+	bool numberStatement(Statement *statm, ValueNumbering &numbering);
+	void findAvailableValues(ValueNumbering &numbering);
+	void findRedundantOccurrences(ValueNumbering &numbering);
+	void reuseValues(StatementList &statements, ValueNumbering &numbering);
+	void eliminateCommonSubexpressions(StatementList &statements,
+		Expression **result);
+
+	/**
+	 * State of one hoistLoopInvariants or reduceInductionVariables call
+	 */
+	struct Loop;
+	struct LoopHoisting;
+	
+	void findDominators(LoopHoisting &hoisting);
+	void findLoops(LoopHoisting &hoisting);
+	void hoistInvariant(Expression *&exp, bool in_address,
+		bool every_iteration, Loop &loop);
+	bool findInvariants(Expression *&exp, bool in_address,
+		bool every_iteration, Loop &loop);
+	void hoistFromStatement(Statement *statm, bool every_iteration,
+		Loop &loop);
+	void hoistFromLoop(LoopHoisting &hoisting, Loop &loop);
+	void insertPreheader(StatementList &statements, LoopHoisting &hoisting,
+		Loop &loop);
+	void hoistLoopInvariants(StatementList &statements, Expression **result);
+	
+	struct InductionVariables;
+	
+	void reduceDerivedValues(Expression *&exp, bool is_address,
+		bool every_iteration, InductionVariables &variables);
+	void reduceInStatement(Statement *statm, bool every_iteration,
+		InductionVariables &variables);
+	bool isUsedAfterLoop(int reg, LoopHoisting &hoisting, Loop &loop,
+		Expression **result);
+	bool isEnteredBelowBound(LoopHoisting &hoisting, Loop &loop,
+		int counter_reg, Expression *bound);
+	int findReplacingFamily(InductionVariables &variables, int counter,
+		LoopHoisting &hoisting, Loop &loop, Expression **result);
+	void reduceInLoop(LoopHoisting &hoisting, Loop &loop,
+		StatementList &statements, Expression **result);
+	void reduceInductionVariables(StatementList &statements,
+		Expression **result);
+
 	void splitToBlocks(StatementSequence *sequence, BlockSequence &blocks);
 	void arrangeBlocksForPrettyJumps(BlockSequence &blocks,
 		BlockOrdering &new_order);
@@ -58,6 +159,46 @@ public:
 	void canonicalizeExpression(Expression *&exp,
 		Expression *parentExpression, Statement *parentStatement);
 	void canonicalizeStatement(Statement *&statm);
+	/**
+	 * Deepest nesting of code the optimizations below are run on. They
+	 * recurse once per level, simplification with the smaller frames.
+	 */
+	enum {
+		MAX_SIMPLIFIED_DEPTH = 50000,
+		MAX_OPTIMIZED_DEPTH = 20000
+	};
+	/**
+	 * Whether no expression or statement in the code is nested deeper
+	 * than max_depth
+	 */
+	bool isShallow(Statement *statm, int max_depth);
+	bool isShallow(Expression *exp, int max_depth);
+	/**
+	 * Fold constants in canonical code, leave out operations that change
+	 * nothing, put constants assigned to temporaries in place of the
+	 * temporaries and turn conditional jumps on constants into jumps
+	 */
+	void simplifyStatement(Statement *&statm);
+	void simplifyExpression(Expression *&exp);
+	/**
+	 * Compute values that stay the same all through a loop once
+	 * before entering it
+	 */
+	void hoistLoopInvariants(StatementSequence *sequence);
+	void hoistLoopInvariantsInExpression(Expression *expression);
+	/**
+	 * Keep values computed from loop counters in registers of their own,
+	 * added to along with the counters, and compare one of them instead
+	 * of a counter used for nothing else
+	 */
+	void reduceInductionVariables(StatementSequence *sequence);
+	void reduceInductionVariablesInExpression(Expression *expression);
+	/**
+	 * Compute values of canonical code once and keep them in temporaries
+	 * while they stay the same, including memory not written since
+	 */
+	void eliminateCommonSubexpressions(StatementSequence *sequence);
+	void eliminateCommonSubexpressionsInExpression(Expression *expression);
 	void arrangeJumps(StatementSequence *sequence);
 	void arrangeJumpsInExpression(Expression *expression);
 };
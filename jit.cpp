@@ -0,0 +1,147 @@
+#include "jit.h"
+#include "errormsg.h"
+#include <map>
+#include <string>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+extern "C" {
+void *__getmem(int64_t size);
+void *__getmem_fill(int64_t count, int64_t value);
+void __print(char *s);
+void __flush();
+void *__getchar();
+int64_t __ord(unsigned char *s);
+void *__chr(int64_t i);
+int64_t __size(char *s);
+void *__substring(char *s, int64_t first, int64_t n);
+void *__concat(char *s1, char *s2);
+int64_t __strcmp(char *s1, char *s2);
+int64_t __not(int64_t i);
+}
+
+namespace Asm {
+
+static const struct {
+	const char *name;
+	void *address;
+} runtime_functions[] = {
+	{"__getmem", (void *)__getmem},
+	{"__getmem_fill", (void *)__getmem_fill},
+	{"__print", (void *)__print},
+	{"__flush", (void *)__flush},
+	{"__getchar", (void *)__getchar},
+	{"__ord", (void *)__ord},
+	{"__chr", (void *)__chr},
+	{"__size", (void *)__size},
+	{"__substring", (void *)__substring},
+	{"__concat", (void *)__concat},
+	{"__strcmp", (void *)__strcmp},
+	{"__not", (void *)__not},
+};
+
+/**
+ * jmp *0(%rip) followed by the 8 byte destination, padded to 16 bytes
+ */
+enum {STUB_SIZE = 16};
+
+static bool FitsInInt32(int64_t value)
+{
+	return (value >= INT_MIN) && (value <= INT_MAX);
+}
+
+bool JitProgram::load(const MachineCode &code, const MachineCode &data,
+	IR::Label *entry_label)
+{
+	std::map<std::string, size_t> definitions;
+	for (size_t i = 0; i < code.labels.size(); i++)
+		definitions[code.labels[i].label->getName()] = code.labels[i].offset;
+	size_t data_start = code.bytes.size();
+	for (size_t i = 0; i < data.labels.size(); i++)
+		definitions[data.labels[i].label->getName()] =
+			data_start + data.labels[i].offset;
+
+	std::map<std::string, void *> runtime;
+	int runtime_count = sizeof(runtime_functions) / sizeof(runtime_functions[0]);
+	for (int i = 0; i < runtime_count; i++)
+		runtime[runtime_functions[i].name] = runtime_functions[i].address;
+	// Runtime functions are likely more than 2GB away from the program,
+	// so calls go through jumps placed after the data
+	std::map<std::string, size_t> stubs;
+	std::vector<void *> stub_destinations;
+	size_t stubs_start = (data_start + data.bytes.size() + STUB_SIZE - 1) /
+		STUB_SIZE * STUB_SIZE;
+	const MachineCode *sections[] = {&code, &data};
+	bool ok = true;
+	for (int s = 0; s < 2; s++)
+		for (size_t i = 0; i < sections[s]->references.size(); i++) {
+			const std::string &name = sections[s]->references[i].label->getName();
+			if ((definitions.find(name) != definitions.end()) ||
+					(stubs.find(name) != stubs.end()))
+				continue;
+			std::map<std::string, void *>::iterator function = runtime.find(name);
+			if (function == runtime.end()) {
+				Error::global_error("Cannot run the program, " + name +
+					" is not in the runtime library");
+				ok = false;
+				// Not to be reported again
+				stubs[name] = 0;
+				continue;
+			}
+			stubs[name] = stubs_start + stub_destinations.size() * STUB_SIZE;
+			stub_destinations.push_back(function->second);
+		}
+	std::map<std::string, size_t>::iterator entry_position =
+		definitions.find(entry_label->getName());
+	if (entry_position == definitions.end()) {
+		Error::global_error("Cannot run the program without " +
+			entry_label->getName());
+		ok = false;
+	}
+	if (! ok)
+		return false;
+
+	// Absolute addresses of data must fit in 32 bits
+	size_t size = stubs_start + stub_destinations.size() * STUB_SIZE;
+	unsigned char *memory = (unsigned char *)mmap(NULL, size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (memory == MAP_FAILED) {
+		Error::global_error("Cannot allocate memory for the program");
+		return false;
+	}
+	memcpy(memory, code.bytes.data(), code.bytes.size());
+	memcpy(memory + data_start, data.bytes.data(), data.bytes.size());
+	for (size_t i = 0; i < stub_destinations.size(); i++) {
+		unsigned char *stub = memory + stubs_start + i * STUB_SIZE;
+		static const unsigned char jump[] = {0xFF, 0x25, 0, 0, 0, 0};
+		memcpy(stub, jump, sizeof(jump));
+		memcpy(stub + sizeof(jump), &stub_destinations[i], sizeof(void *));
+	}
+
+	for (int s = 0; s < 2; s++) {
+		size_t start = (s == 0) ? 0 : data_start;
+		for (size_t i = 0; i < sections[s]->references.size(); i++) {
+			const MachineCode::Reference &ref = sections[s]->references[i];
+			const std::string &name = ref.label->getName();
+			std::map<std::string, size_t>::iterator target = definitions.find(name);
+			if (target == definitions.end())
+				target = stubs.find(name);
+			int64_t value = (int64_t)(memory + target->second) + ref.addend;
+			if (ref.kind == MachineCode::RELATIVE_32)
+				value -= (int64_t)(memory + start + ref.offset);
+			if (! FitsInInt32(value))
+				Error::fatalError("Reference to " + name + " out of range");
+			int32_t value32 = value;
+			memcpy(memory + start + ref.offset, &value32, sizeof(value32));
+		}
+	}
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		Error::global_error("Cannot make the program executable");
+		return false;
+	}
+	entry = (int64_t (*)())(memory + entry_position->second);
+	return true;
+}
+
+}
@@ -0,0 +1,34 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "assembler.h"
+#include <stdint.h>
+
+namespace Asm {
+
+/**
+ * Program loaded into executable memory of the compiler process and
+ * linked against the compiler's own copy of the runtime library
+ */
+class JitProgram {
+private:
+	int64_t (*entry)();
+public:
+	JitProgram() : entry(NULL) {}
+
+	/**
+	 * Place the code and data in memory and resolve their references,
+	 * reporting the labels that can't be resolved.
+	 * Returns false if the program cannot be run.
+	 */
+	bool load(const MachineCode &code, const MachineCode &data,
+		IR::Label *entry_label);
+	/**
+	 * Call the entry label like the C library calls main
+	 */
+	int64_t run() {return entry();}
+};
+
+}
+
+#endif
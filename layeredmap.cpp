@@ -1,16 +1,95 @@
 #include "layeredmap.h"
-#include <map>
-#include <list>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 
+/**
+ * One open addressing hash table for all layers. Each name has a slot
+ * pointing to its innermost definition, which points to the one it
+ * shadows. Definitions are kept in a stack in the order they were added,
+ * so removing a layer pops the definitions made since it was created
+ * and puts back what they shadowed.
+ */
 class LayeredMapPrivate {
 public:
-	typedef std::list<std::map<std::string, void*> > MapList;
-	MapList maps;
-	
-	LayeredMapPrivate()
+	enum {INITIAL_HASH_SIZE = 64};
+
+	struct Slot {
+		/**
+		 * NO_SYMBOL if the slot is empty
+		 */
+		Symbol name;
+		/**
+		 * Index in definitions of the innermost definition, -1 if none.
+		 * Names stay in the table after their definitions are removed.
+		 */
+		int top;
+
+		Slot() : name(NO_SYMBOL), top(-1) {}
+	};
+
+	struct Definition {
+		void *value;
+		int slot;
+		/**
+		 * Definition of the same name in an outer layer, -1 if none
+		 */
+		int shadowed;
+	};
+
+	std::vector<Slot> slots;
+	size_t used_slots;
+	std::vector<Definition> definitions;
+	/**
+	 * Size of definitions when each layer was created
+	 */
+	std::vector<int> layer_starts;
+
+	LayeredMapPrivate() : slots(INITIAL_HASH_SIZE), used_slots(0)
+	{
+		layer_starts.push_back(0);
+	}
+
+	/**
+	 * Slot of the name, or the empty slot where it would go
+	 */
+	int findSlot(Symbol name) const
+	{
+		size_t mask = slots.size() - 1;
+		size_t slot = (name * 0x9E3779B9U) & mask;
+		while ((slots[slot].name != NO_SYMBOL) && (slots[slot].name != name))
+			slot = (slot + 1) & mask;
+		return slot;
+	}
+
+	void grow()
+	{
+		std::vector<Slot> old_slots(slots.size() * 2);
+		old_slots.swap(slots);
+		for (size_t i = 0; i < old_slots.size(); i++)
+			if (old_slots[i].name != NO_SYMBOL) {
+				int slot = findSlot(old_slots[i].name);
+				slots[slot] = old_slots[i];
+				if (slots[slot].top != -1)
+					renumberSlot(slots[slot].top, slot);
+			}
+	}
+
+	void renumberSlot(int definition, int slot)
+	{
+		while (definition != -1) {
+			definitions[definition].slot = slot;
+			definition = definitions[definition].shadowed;
+		}
+	}
+
+	/**
+	 * Innermost definition of the name, -1 if none
+	 */
+	int find(Symbol name) const
 	{
-		maps.resize(1);
+		return slots[findSlot(name)].top;
 	}
 };
 
@@ -24,37 +103,60 @@ LayeredMap::~LayeredMap()
 	delete d;
 }
 
-void LayeredMap::add(const std::string &name, void *value)
+void LayeredMap::add(Symbol name, void *value)
 {
-	d->maps.back().insert(std::make_pair(name, value));
+	assert(name != NO_SYMBOL);
+	int slot = d->findSlot(name);
+	if (d->slots[slot].name == NO_SYMBOL) {
+		// Keep at most half of the table used
+		if (2 * (d->used_slots + 1) > d->slots.size()) {
+			d->grow();
+			slot = d->findSlot(name);
+		}
+		d->slots[slot].name = name;
+		d->used_slots++;
+	}
+	int top = d->slots[slot].top;
+	// A second definition in the same layer does not replace the first
+	if (top >= d->layer_starts.back())
+		return;
+	LayeredMapPrivate::Definition definition;
+	definition.value = value;
+	definition.slot = slot;
+	definition.shadowed = top;
+	d->slots[slot].top = d->definitions.size();
+	d->definitions.push_back(definition);
 }
 
-void *LayeredMap::lookup(const std::string &name)
+void *LayeredMap::lookup(Symbol name)
 {
-	for (LayeredMapPrivate::MapList::reverse_iterator i = d->maps.rbegin();
-		 i != d->maps.rend(); i++) {
-		std::map<std::string, void*>::iterator entry = (*i).find(name);
-		if (entry != (*i).end())
-			return (*entry).second;
-	}
-	return NULL;
+	int definition = d->find(name);
+	if (definition == -1)
+		return NULL;
+	return d->definitions[definition].value;
 }
 
-void *LayeredMap::lookup_last_layer(const std::string &name)
+void *LayeredMap::lookup_last_layer(Symbol name)
 {
-	std::map<std::string, void*>::iterator entry = d->maps.back().find(name);
-	if (entry != d->maps.back().end())
-		return (*entry).second;
-	return NULL;
+	int definition = d->find(name);
+	if (definition < d->layer_starts.back())
+		return NULL;
+	return d->definitions[definition].value;
 }
 
 void LayeredMap::newLayer()
 {
-	d->maps.push_back(std::map<std::string, void*>());
+	d->layer_starts.push_back(d->definitions.size());
 }
 
 void LayeredMap::removeLastLayer()
 {
-	assert(d->maps.size() >= 1);
-	d->maps.pop_back();
+	assert(d->layer_starts.size() >= 1);
+	size_t start = d->layer_starts.back();
+	while (d->definitions.size() > start) {
+		LayeredMapPrivate::Definition &definition = d->definitions.back();
+		d->slots[definition.slot].top = definition.shadowed;
+		d->definitions.pop_back();
+	}
+	d->layer_starts.pop_back();
 }
@@ -1,7 +1,7 @@
 #ifndef _LAYEREDMAP_H
 #define _LAYEREDMAP_H
 
-#include <string>
+#include "symbols.h"
 
 class LayeredMapPrivate;
 
@@ -12,9 +12,9 @@ public:
 	LayeredMap();
 	~LayeredMap();
 	
-	void add(const std::string &name, void *value);
-	void *lookup(const std::string &name);
-	void *lookup_last_layer(const std::string &name);
+	void add(Symbol name, void *value);
+	void *lookup(Symbol name);
+	void *lookup_last_layer(Symbol name);
 	void newLayer();
 	void removeLastLayer();
 };
@@ -4,6 +4,9 @@
 #include "x86_64_frame.h"
 #include "x86_64assembler.h"
 #include "regallocator.h"
+#include "elfwriter.h"
+#include "jit.h"
+#include "subprocess.h"
 #include "syntaxtree.h"
 
 #include <iostream>
@@ -14,24 +17,14 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <algorithm>
 
 extern "C" {
 extern FILE *yyin;
 }
 
-void MergeVirtualRegisterMaps(IR::RegisterMap &merge_to,
-	const IR::RegisterMap &merge_from)
-{
-	if (merge_to.size() < merge_from.size())
-		merge_to.resize(merge_from.size(), NULL);
-	for (int i = 0; i < merge_from.size(); i++)
-		if (merge_from[i] != NULL) {
-			if (merge_to[i] != NULL)
-				assert(merge_from[i]->getIndex() == merge_to[i]->getIndex());
-			merge_to[i] = merge_from[i];
-		}
-}
-
 std::string inputname;
 
 std::string GetExtension(const std::string &filename)
@@ -66,12 +59,204 @@ std::string GetDirPath(const std::string &path)
 	return result;
 }
 
-struct CodeInfo {
-	Asm::Instructions *code;
-	IR::Label *funclabel;
-	IR::AbstractFrame *frame;
+/**
+ * Number of threads for the per-function back end
+ */
+int backend_threads = 1;
+
+/**
+ * Pipe assembler text to as instead of writing the object file directly
+ */
+bool assembler_text = false;
+
+/**
+ * Run the Tiger program in the compiler process instead of writing
+ * an object file
+ */
+bool run_program = false;
+Asm::JitProgram jit_program;
+
+/**
+ * Stack size of the threads that parse and compile the program. The
+ * passes over whole trees keep their work on explicit stacks, what
+ * still recurses per level of an expression fits in this, whatever
+ * the stack limit of the main thread is.
+ */
+enum {COMPILE_STACK_SIZE = 16 << 20};
+
+static bool StartCompileThread(pthread_t *thread, void *(*function)(void *),
+	void *arg)
+{
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, COMPILE_STACK_SIZE);
+	bool ok = pthread_create(thread, &attr, function, arg) == 0;
+	pthread_attr_destroy(&attr);
+	return ok;
+}
+
+static void *ParseThread(void *)
+{
+	yyparse();
+	return NULL;
+}
+
+/**
+ * Back end work for one function or the main program, from
+ * canonicalization to register allocation
+ */
+struct BackendJob {
+	/**
+	 * NULL for the main program
+	 */
+	Semantic::Function *function;
+	/**
+	 * Labels and registers created for this function, numbered the same
+	 * whichever thread and in which order processes it
+	 */
+	IR::LabelFactory labels;
+	IR::RegisterFactory registers;
+	size_t size;
+	Asm::Instructions code;
+	IR::RegisterMap register_map;
+	/**
+	 * Assembler text or machine code, the only thing kept until
+	 * the output is written
+	 */
+	std::string text;
+	Asm::MachineCode machine_code;
+	bool finished;
+	
+	BackendJob(Semantic::Function *_function, int number,
+		IR::IREnvironment &env) :
+		function(_function),
+		labels(env.getNextLabelIndex(), ".L" + IntToStr(number) + "_"),
+		registers(env.getNextRegisterIndex()),
+		size(0), finished(false) {}
+};
+
+struct BackendPool {
+	IR::IREnvironment *env;
+	Semantic::Translator *translator;
+	Asm::Assembler *assembler;
+	IR::Statement *program_body;
+	IR::AbstractFrame *body_frame;
+	/**
+	 * Largest first, so that a big function doesn't start last
+	 */
+	std::vector<BackendJob *> order;
+	size_t next_job;
+	pthread_mutex_t lock;
+	/**
+	 * Assembler text goes here in output order as soon as the jobs
+	 * before it are finished, if not NULL
+	 */
+	FILE *output;
+	std::vector<BackendJob *> output_order;
+	size_t next_output;
+	pthread_mutex_t output_lock;
+#ifdef DEBUG
+	FILE *canonical, *liveness, *raw;
+#endif
 };
 
+static bool LargerJob(const BackendJob *a, const BackendJob *b)
+{
+	return a->size > b->size;
+}
+
+static void RunBackendJob(BackendPool &pool, BackendJob &job)
+{
+	pool.env->useFactories(&job.labels, &job.registers);
+	IR::AbstractFrame *frame;
+	if (job.function != NULL) {
+		Semantic::Function &func = *job.function;
+		frame = func.frame;
+		IR::SetNodeArena(func.node_arena);
+		pool.translator->canonicalizeFunction(func);
+#ifdef DEBUG
+		fprintf(pool.canonical, "Function %s\n", func.label->getName().c_str());
+		IR::PrintCode(pool.canonical, func.body);
+#endif
+		pool.assembler->translateFunctionBody(func.body, func.label,
+			frame, job.code);
+	} else {
+		frame = pool.body_frame;
+		pool.env->useDefaultNodeArena();
+		pool.translator->canonicalizeProgram(pool.program_body);
+#ifdef DEBUG
+		IR::PrintStatement(pool.canonical, pool.program_body);
+#endif
+		pool.assembler->translateProgram(pool.program_body, frame, job.code);
+	}
+#ifdef DEBUG
+	Optimize::PrintLivenessInfo(pool.liveness, job.code, frame);
+	std::string raw;
+	pool.assembler->outputInstructions(raw, job.code, NULL, true);
+	fwrite(raw.data(), raw.size(), 1, pool.raw);
+#endif
+	
+	Optimize::AssignRegisters(job.code, *pool.assembler, frame,
+		pool.assembler->getAvailableRegisters(), job.register_map);
+	if (job.function != NULL) {
+		pool.assembler->implementFunctionFrameSize(job.function->label,
+			frame, job.code);
+		// The IR trees are not needed after instruction selection and spilling
+		job.function->node_arena->release();
+	} else
+		pool.assembler->implementProgramFrameSize(frame, job.code);
+	pool.env->useDefaultFactories();
+	
+	if (assembler_text)
+		pool.assembler->outputInstructions(job.text, job.code,
+			&job.register_map, false);
+	else
+		pool.assembler->encodeInstructions(job.code, &job.register_map,
+			job.machine_code);
+	job.code.clear();
+	IR::RegisterMap().swap(job.register_map);
+}
+
+static void WriteFinishedJobs(BackendPool &pool)
+{
+	pthread_mutex_lock(&pool.output_lock);
+	while (true) {
+		BackendJob *job = NULL;
+		pthread_mutex_lock(&pool.lock);
+		if ((pool.next_output < pool.output_order.size()) &&
+				pool.output_order[pool.next_output]->finished)
+			job = pool.output_order[pool.next_output];
+		pthread_mutex_unlock(&pool.lock);
+		if (job == NULL)
+			break;
+		fwrite(job->text.data(), job->text.size(), 1, pool.output);
+		std::string().swap(job->text);
+		pool.next_output++;
+	}
+	pthread_mutex_unlock(&pool.output_lock);
+}
+
+static void *BackendWorker(void *arg)
+{
+	BackendPool *pool = (BackendPool *)arg;
+	while (true) {
+		BackendJob *job = NULL;
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next_job < pool->order.size())
+			job = pool->order[pool->next_job++];
+		pthread_mutex_unlock(&pool->lock);
+		if (job == NULL)
+			break;
+		RunBackendJob(*pool, *job);
+		pthread_mutex_lock(&pool->lock);
+		job->finished = true;
+		pthread_mutex_unlock(&pool->lock);
+		if (pool->output != NULL)
+			WriteFinishedJobs(*pool);
+	}
+	return NULL;
+}
+
 void ProcessTree(Syntax::Tree tree)
 {
 	//Syntax::PrintTree(tree);
@@ -96,116 +281,145 @@ void ProcessTree(Syntax::Tree tree)
 	fclose(f);
 #endif
 	
-	translator.canonicalizeFunctions();
-	translator.canonicalizeProgram(program_body);
-	
-#ifdef DEBUG
-	f = fopen("canonical", "w");
-	translator.printFunctions(f);
-	IR::PrintStatement(f, program_body);
-	IR_env.printBlobs(f);
-	fclose(f);
-#endif
-	
 	Asm::X86_64Assembler assembler(&IR_env);
-	std::list<Asm::Instructions> code;
-	std::list<CodeInfo> chunks;
-#ifdef DEBUG
-	f = fopen("liveness", "w");
-#endif
 	
-	for (std::list<Semantic::Function>::const_iterator func =
+	// Functions followed by the main program, in output order
+	std::list<BackendJob> jobs;
+	size_t function_nodes = 0;
+	for (std::list<Semantic::Function>::iterator func =
 			translator.getFunctions().begin(); 
 			func != translator.getFunctions().end(); func++)
 		if ((*func).body != NULL) {
-			code.push_back(Asm::Instructions());
-			chunks.push_back(CodeInfo());
-			assembler.translateFunctionBody((*func).body, (*func).label,
-				(*func).frame, code.back());
-#ifdef DEBUG
-			Optimize::PrintLivenessInfo(f, code.back(), (*func).frame);
-#endif
-			chunks.back().code = &code.back();
-			chunks.back().frame = (*func).frame;
-			chunks.back().funclabel = (*func).label;
+			jobs.push_back(BackendJob(&(*func), jobs.size(), IR_env));
+			jobs.back().size = (*func).node_arena->getAllocatedSize();
+			function_nodes += jobs.back().size;
 		}
-	code.push_back(Asm::Instructions());
-	assembler.translateProgram(program_body, body_frame, code.back());
-#ifdef DEBUG
-	Optimize::PrintLivenessInfo(f, code.back(), body_frame);
-	fclose(f);
-#endif
-
+	jobs.push_back(BackendJob(NULL, jobs.size(), IR_env));
+	jobs.back().size = IR_env.getNodeMemory() - function_nodes;
+	
+	BackendPool pool;
+	pool.env = &IR_env;
+	pool.translator = &translator;
+	pool.assembler = &assembler;
+	pool.program_body = program_body;
+	pool.body_frame = body_frame;
+	for (std::list<BackendJob>::iterator job = jobs.begin();
+			job != jobs.end(); job++)
+		pool.order.push_back(&(*job));
+	pool.output_order = pool.order;
+	pool.next_job = 0;
+	pool.next_output = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_mutex_init(&pool.output_lock, NULL);
+	
 #ifdef DEBUG
-	f = fopen("assembler_raw", "w");
-	assembler.outputCode(f, code, NULL);
-	assembler.outputBlobs(f, IR_env.getBlobs());
-	fclose(f);
+	pool.canonical = fopen("canonical", "w");
+	pool.liveness = fopen("liveness", "w");
+	pool.raw = fopen("assembler_raw", "w");
+	// Debug output and logs are not made for several threads
+	int thread_count = 1;
+#else
+	int thread_count = backend_threads;
+	if (thread_count > (int)pool.order.size())
+		thread_count = pool.order.size();
 #endif
-		
-	const std::vector<IR::VirtualRegister *> &machine_registers =
-		assembler.getAvailableRegisters();
-	//IR::VirtualRegister *fp_register = assembler.getFramePointerRegister();
-	IR::RegisterMap virtual_register_map;
-	for (std::list<CodeInfo>::iterator chunk = chunks.begin();
-			chunk != chunks.end(); chunk++) {
-		IR::RegisterMap vreg_map;
-		Optimize::AssignRegisters(*(*chunk).code,
-			assembler,
-			(*chunk).frame,
-			machine_registers,
-			vreg_map);
-
-		MergeVirtualRegisterMaps(virtual_register_map, vreg_map);
-		
-		assembler.implementFunctionFrameSize((*chunk).funclabel,
-			(*chunk).frame, *(*chunk).code);
+	// A single thread goes in output order so that the text is written
+	// out while the next function is being processed
+	if (thread_count > 1) {
+		std::stable_sort(pool.order.begin(), pool.order.end(), LargerJob);
+		assembler.prepareForThreads();
 	}
 	
-	IR::RegisterMap vreg_map;
-	Optimize::AssignRegisters(code.back(),
-		assembler,
-		body_frame,
-		machine_registers,
-		vreg_map);
-	MergeVirtualRegisterMaps(virtual_register_map, vreg_map);
-	assembler.implementProgramFrameSize(body_frame, code.back());
-	
 	std::string basename = StripExtension(inputname);
-	std::string asm_name = basename + ".s";
-
-	FILE *asm_out = fopen(asm_name.c_str(), "w");
-	assembler.outputCode(asm_out, code, &virtual_register_map);
-	assembler.outputBlobs(asm_out, IR_env.getBlobs());
-	fclose(asm_out);
-	
 	std::string obj_name = basename + ".o";
-	std::string asm_cmd = "as -o " + obj_name + " " + asm_name;
-	if (system(asm_cmd.c_str()) != 0)
-		Error::fatalError("Failed to run assembler on " + asm_name);
+	Subprocess as;
+	pool.output = NULL;
+	if (assembler_text) {
+		std::vector<std::string> as_argv;
+		as_argv.push_back("as");
+		as_argv.push_back("-o");
+		as_argv.push_back(obj_name);
+		if (! as.start(as_argv, true))
+			Error::fatalError("Failed to run assembler");
+		pool.output = as.getInput();
+		std::string header;
+		assembler.outputCodeHeader(header);
+		fwrite(header.data(), header.size(), 1, pool.output);
+	}
 	
-#ifndef DEBUG
-	unlink(asm_name.c_str());
+	// The calling thread is one of the workers. Without room for the
+	// stacks of the others, fewer threads do the same work.
+	std::vector<pthread_t> threads;
+	for (int i = 1; i < thread_count; i++) {
+		pthread_t thread;
+		if (! StartCompileThread(&thread, BackendWorker, &pool))
+			break;
+		threads.push_back(thread);
+	}
+	BackendWorker(&pool);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_mutex_destroy(&pool.output_lock);
+	IR_env.useDefaultNodeArena();
+	IR_env.releaseNodes();
+	
+#ifdef DEBUG
+	fclose(pool.canonical);
+	fclose(pool.liveness);
+	fclose(pool.raw);
 #endif
+	
+	if (run_program) {
+		Asm::MachineCode code, blobs;
+		for (std::list<BackendJob>::iterator job = jobs.begin();
+				job != jobs.end(); job++) {
+			code.append((*job).machine_code);
+			(*job).machine_code = Asm::MachineCode();
+		}
+		assembler.encodeBlobs(IR_env.getBlobs(), blobs);
+		jit_program.load(code, blobs, assembler.getProgramLabel());
+		return;
+	}
+	
+	if (! assembler_text) {
+		Asm::ElfWriter writer;
+		for (std::list<BackendJob>::iterator job = jobs.begin();
+				job != jobs.end(); job++) {
+			writer.addCode((*job).machine_code);
+			(*job).machine_code = Asm::MachineCode();
+		}
+		Asm::MachineCode blobs;
+		assembler.encodeBlobs(IR_env.getBlobs(), blobs);
+		writer.addReadOnlyData(blobs);
+		writer.addGlobal(assembler.getProgramLabel());
+		if (! writer.write(obj_name))
+			Error::fatalError("Failed to write " + obj_name + ": " +
+				strerror(errno));
+		return;
+	}
+	
+	std::string blobs;
+	assembler.outputBlobs(blobs, IR_env.getBlobs());
+	fwrite(blobs.data(), blobs.size(), 1, pool.output);
+	if (as.wait() != 0)
+		Error::fatalError("Failed to assemble " + inputname);
 }
 
 std::string ourname;
 
 void link(const std::list<std::string> &filenames, const std::string &out_name)
 {
-	std::string input_list;
-	for (std::list<std::string>::const_iterator obj_name = filenames.begin();
-			obj_name != filenames.end(); obj_name++) {
-		input_list += " ";
-		input_list += *obj_name;
-	}
-	std::string link_cmd = "ld -o " + out_name +
-		input_list +
-		" " + GetDirPath(ourname) + "/libtigerlibrary.a "
+	std::vector<std::string> link_argv;
+	link_argv.push_back("ld");
+	link_argv.push_back("-o");
+	link_argv.push_back(out_name);
+	link_argv.insert(link_argv.end(), filenames.begin(), filenames.end());
+	SplitCommand(GetDirPath(ourname) + "/libtigerlibrary.a "
 		"-dynamic-linker /lib64/ld-linux-x86-64.so.2 "
 		"/usr/lib64/crt1.o /usr/lib64/crti.o "
-		"-lc /usr/lib64/crtn.o";
-	int ret = system(link_cmd.c_str());
+		"-lc /usr/lib64/crtn.o", link_argv);
+	int ret = RunCommand(link_argv);
 
 	if (ret != 0) {
 		Error::global_error("Linker error");
@@ -218,14 +432,22 @@ int main(int argc, char **argv)
 	const char *USAGE =
 		"Usage: compiler [options] <input-files>\n\n"
 		       "Options:\n"
-		       "  -c           Compile but do not link\n";
+		       "  -c           Compile but do not link\n"
 			   "  -C COMMAND   Specify C compiler (default: cc)\n"
-			   "  -o FILENAME  Specify executable file name (default: first input without extension)\n";
+			   "  -j N         Compile functions in N threads and N C files at once (default: 1)\n"
+			   "  -o FILENAME  Specify executable file name (default: first input without extension)\n"
+			   "  -S           Pipe assembler text to as instead of writing the object file\n"
+			   "  --run        Run the Tiger program instead of writing any files\n";
 	int opt;
 	std::string c_compiler = "cc";
 	std::string out_name = "";
 	
-	while ((opt = getopt(argc, argv, "cC:o:")) >= 0) {
+	static const struct option long_options[] = {
+		{"run", no_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0},
+	};
+	
+	while ((opt = getopt_long(argc, argv, "cC:j:o:S", long_options, NULL)) >= 0) {
 		switch (opt) {
 			case 'c':
 				compile_only = true;
@@ -233,9 +455,22 @@ int main(int argc, char **argv)
 			case 'C':
 				c_compiler = optarg;
 				break;
+			case 'j':
+				backend_threads = atoi(optarg);
+				if (backend_threads < 1) {
+					fputs(USAGE, stdout);
+					return 1;
+				}
+				break;
 			case 'o':
 				out_name = optarg;
 				break;
+			case 'S':
+				assembler_text = true;
+				break;
+			case 'r':
+				run_program = true;
+				break;
 			default:
 				fputs(USAGE, stdout);
 				return 1;
@@ -245,54 +480,87 @@ int main(int argc, char **argv)
 		fputs(USAGE, stdout);
 		return 1;
 	}
+	if (run_program)
+		assembler_text = false;
 	ourname = argv[0];
 	
 	std::list<std::string> objfiles_translated, objfiles_input;
 	
-	bool had_tiger_input = false;
+	// C files are compiled by other programs while the Tiger program is
+	// compiled here, -j limits how many run at once
+	JobScheduler c_jobs(backend_threads);
+	std::vector<std::string> c_inputs, c_objects;
+	std::string tiger_input;
 	if (out_name == "")
 		out_name = StripExtension(argv[optind]);
 	
 	for (int i = optind; i < argc; i++) {
-		inputname = argv[i];
-		
-		std::string extension = GetExtension(inputname);
-		std::string obj_name = StripExtension(inputname) + ".o";
+		std::string filename = argv[i];
+		std::string extension = GetExtension(filename);
+		std::string obj_name = StripExtension(filename) + ".o";
 		
 		if (extension == "tig") {
-			if (had_tiger_input)
-				Error::error("Cannot have second tiger input " + inputname);
+			if (tiger_input != "")
+				Error::global_error("Cannot have second tiger input " + filename);
 			else {
-				had_tiger_input = true;
-				Error::setFileName(inputname);
-				yyin = fopen(inputname.c_str(), "r");
-				if (yyin == NULL)
-					Error::global_error("Cannot open " + inputname + ": " +
-						strerror(errno));
-				else {
-					yyparse();
-					fclose(yyin);
-					objfiles_translated.push_back(obj_name);
+				tiger_input = filename;
+				if (! run_program)
 					objfiles_input.push_back(obj_name);
-				}
-			}
-		} else if (extension == "c") {
-			std::string cmd = c_compiler + " -c " + inputname +
-				" -o " + obj_name;
-			int ret = system(cmd.c_str());
-			if (ret != 0)
-				Error::error("C compiler failed on " + inputname);
-			else {
-				objfiles_translated.push_back(obj_name);
-				objfiles_input.push_back(obj_name);
 			}
+		} else if (run_program)
+			Error::global_error("Only a Tiger program can be run, not " +
+				filename);
+		else if (extension == "c") {
+			std::vector<std::string> cc_argv;
+			SplitCommand(c_compiler, cc_argv);
+			cc_argv.push_back("-c");
+			cc_argv.push_back(filename);
+			cc_argv.push_back("-o");
+			cc_argv.push_back(obj_name);
+			c_jobs.add(cc_argv);
+			c_inputs.push_back(filename);
+			c_objects.push_back(obj_name);
+			objfiles_input.push_back(obj_name);
 		} else if (extension == "o")
-			objfiles_input.push_back(inputname);
+			objfiles_input.push_back(filename);
 		else
-			Error::global_error("Unrecognized input extension for " + inputname);
-		
+			Error::global_error("Unrecognized input extension for " + filename);
+	}
+	if (Error::getErrorCount() != 0)
+		return 1;
+	
+	c_jobs.start();
+	if (tiger_input != "") {
+		inputname = tiger_input;
+		Error::setFileName(inputname);
+		yyin = fopen(inputname.c_str(), "r");
+		if (yyin == NULL)
+			Error::global_error("Cannot open " + inputname + ": " +
+				strerror(errno));
+		else {
+			pthread_t parser;
+			if (! StartCompileThread(&parser, ParseThread, NULL))
+				Error::fatalError("Failed to start the compiler thread");
+			pthread_join(parser, NULL);
+			fclose(yyin);
+			if (! run_program)
+				objfiles_translated.push_back(StripExtension(inputname) + ".o");
+		}
+	}
+	c_jobs.wait();
+	fflush(stdout);
+	for (size_t i = 0; i < c_inputs.size(); i++) {
+		fputs(c_jobs.getErrors(i).c_str(), stderr);
+		if (c_jobs.getStatus(i) != 0)
+			Error::global_error("C compiler failed on " + c_inputs[i]);
+		else
+			objfiles_translated.push_back(c_objects[i]);
+	}
+	
+	if (run_program) {
 		if (Error::getErrorCount() != 0)
-			break;
+			return 1;
+		return jit_program.run();
 	}
 	
 	if (! compile_only) {
@@ -1,47 +1,77 @@
 #include "regallocator.h"
 #include "flowgraph.h"
+#include "bitset.h"
+#include "edgeset.h"
 #include <vector>
+#include <algorithm>
 #include <stdio.h>
 #include <stdarg.h>
 
 namespace Optimize {
 
 class LivenessInfo: public DebugPrinter {
+public:
+	typedef std::vector<int> VarArray;
 private:
-	typedef std::list<const FlowGraphNode *> NodeList;
-	std::vector<NodeList> nodes_using;
 	std::vector<int> number_invocations; // uses plus assigns for each virtual register
-
-	void findLiveness(int virt_reg, const FlowGraphNode *node);
 	
-	struct VirtualRegInfo {
-		int index; // int this->virtuals
-		IR::VirtualRegister *reg;
-		
-		VirtualRegInfo(int i, IR::VirtualRegister *r) : index(i), reg(r) {}
+	/**
+	 * Liveness of the flow graph's basic blocks
+	 */
+	struct BasicBlock {
+		/**
+		 * Registers used before being assigned inside the block and
+		 * registers assigned anywhere inside it
+		 */
+		BitSet used, assigned;
+		BitSet live_in, live_out;
 	};
-	std::map<int, VirtualRegInfo> virt_indices_by_id;
+	std::vector<BasicBlock> blocks;
+	
+	void addNodeRegisters(const std::vector<IR::VirtualRegister *> &regs,
+		VarArray &indices);
+	void readNodes(const FlowGraph &flowgraph);
+	bool patchAfterSpill(const LivenessInfo &previous,
+		const std::vector<IR::VirtualRegister *> &spilled,
+		const Asm::SpillResult &spill);
+	void makeBlocks();
+	void solveBlocks();
+	void findNodeLiveness();
+	
+	/**
+	 * Index in this->virtuals for every virtual register ID,
+	 * -1 for registers not used in the code
+	 */
+	std::vector<int> virt_index_by_id;
 	int max_virt_reg_id;
 	const FlowGraph *flowgraph;
 public:
 	std::vector<IR::VirtualRegister *> virtuals;
 	
 	int nodecount;
-	typedef std::list<int> VarList;
-	typedef std::vector<int> VarArray;
-	std::vector<VarList> live_after_node;
+	/**
+	 * Sorted by register index
+	 */
+	std::vector<VarArray> live_after_node;
 	std::vector<VarArray > used_at_node;
 	std::vector<VarArray > assigned_at_node;
 	std::vector<bool> node_is_reg_reg_move;
 	
 	bool isLiveAfterNode(const FlowGraphNode *node, int var) const;
 	bool isLiveAfterNode(int node, int var) const;
-	bool isAssignedAtNode(const FlowGraphNode *node, int var);
 	int getInvocationCount(int node) const	{return number_invocations[node];}
-	int getVirtualRegisterIndex(IR::VirtualRegister *vreg);
+	int getVirtualRegisterIndex(IR::VirtualRegister *vreg) const;
 	int getMaxVirtualRegisterId() {return max_virt_reg_id;}
 	
 	LivenessInfo(const FlowGraph &flowgraph);
+	/**
+	 * Liveness of the code after spilling the registers, patched from
+	 * the liveness before spilling. Solved from scratch if spilling
+	 * changed more than the spilled registers and the temporaries.
+	 */
+	LivenessInfo(const FlowGraph &flowgraph, const LivenessInfo &previous,
+		const std::vector<IR::VirtualRegister *> &spilled,
+		const Asm::SpillResult &spill);
 };
 
 typedef std::list<int> Intlist;
@@ -81,6 +111,11 @@ private:
 // 	Intlist selected;
 	Intlist node_lists[MAX_NODESTATUS];
 	std::vector<uint8_t> node_status;
+	/**
+	 * Position of each node in its status list, so that status changes
+	 * don't have to search the list
+	 */
+	std::vector<Intlist::iterator> node_positions;
 	
 // 	Intlist coalesced_moves;
 // 	Intlist constrained_moves;
@@ -89,6 +124,7 @@ private:
 // 	Intlist active_moves;
 	Intlist move_lists[MAX_NODESTATUS];
 	std::vector<uint8_t> move_status;
+	std::vector<Intlist::iterator> move_positions;
 	
 	
 public:
@@ -113,13 +149,15 @@ public:
 	void addNode(int n, NodeStatus status)
 	{
 		node_status[n] = status;
-		node_lists[(int)status].push_back(n);
+		node_positions[n] = node_lists[(int)status].insert(
+			node_lists[(int)status].end(), n);
 	}
 	
 	void addMove(int m, MoveStatus status)
 	{
 		move_status[m] = status;
-		move_lists[(int)status].push_back(m);
+		move_positions[m] = move_lists[(int)status].insert(
+			move_lists[(int)status].end(), m);
 	}
 };
 
@@ -127,8 +165,8 @@ class PartialRegAllocator: public DebugPrinter {
 private:
 	const LivenessInfo *liveness;
 	
-	std::vector<bool> table;
-	std::vector<Intlist > list;
+	EdgeSet edges;
+	std::vector<std::vector<int> > list;
 	std::vector<bool> no_list;
 	std::vector<bool> used_in_moves;
 	int nodecount;
@@ -137,7 +175,7 @@ private:
 	void setNoAdjacencyList(int n);
 	void connect(int n1, int n2);
 	bool isAdjacent(int n1, int n2);
-	const std::list<int> &getAdjacent(int n);
+	const std::vector<int> &getAdjacent(int n);
 	
 	NodeMoveManager status;
 	
@@ -146,14 +184,26 @@ private:
 	std::vector<int> coalesced_with;
 	std::vector<int> colors;
 	
-	const char *NodeName(int n)
+	/**
+	 * Register names are made on request, so without DEBUG, where the
+	 * debug output is dropped, they are not made at all
+	 */
+#ifdef DEBUG
+	std::string NodeName(int n)
+	{
+		return liveness->virtuals[n]->getName();
+	}
+#else
+	std::string NodeName(int)
 	{
-		return liveness->virtuals[n]->getName().c_str();
+		return std::string();
 	}
+#endif
 	
 	void buildGraph();
 	void classifyNodes();
 	void getRemainingAdjacent(int n, Intlist &nodes);
+	void pruneFinishedMoves(int n);
 	bool hasRemainingMoves(int n);
 	void getRemainingMoves(int n, Intlist &moves);
 	
@@ -184,6 +234,10 @@ public:
 	void tryColoring();
 	const Intlist &getSpilled();
 	const std::vector<int> &getColors();
+	/**
+	 * Bytes taken by the interference graph
+	 */
+	size_t getGraphMemory() const;
 };
 
 bool LivenessInfo::isLiveAfterNode(const FlowGraphNode *node, int var) const
@@ -193,128 +247,336 @@ bool LivenessInfo::isLiveAfterNode(const FlowGraphNode *node, int var) const
 
 bool LivenessInfo::isLiveAfterNode(int node, int var) const
 {
-	const VarList &vars = live_after_node[node];
-	for (VarList::const_iterator v = vars.begin(); v != vars.end(); v++)
-		if (*v == var)
-			return true;
-	return false;
+	const VarArray &vars = live_after_node[node];
+	return std::binary_search(vars.begin(), vars.end(), var);
 }
 
-bool LivenessInfo::isAssignedAtNode(const FlowGraphNode *node, int var)
+int LivenessInfo::getVirtualRegisterIndex(IR::VirtualRegister* vreg) const
 {
-	std::vector<int> &vars = assigned_at_node[node->index];
-	for (int i = 0; i < vars.size(); i++)
-		if (vars[i] == var)
-			return true;
-	return false;
+	if ((size_t)vreg->getIndex() >= virt_index_by_id.size())
+		return -1;
+	else
+		return virt_index_by_id[vreg->getIndex()];
+}
+
+void LivenessInfo::addNodeRegisters(
+	const std::vector<IR::VirtualRegister *> &regs, VarArray &indices)
+{
+	indices.resize(regs.size());
+	for (size_t i = 0; i < regs.size(); i++) {
+		int id = regs[i]->getIndex();
+		if ((size_t)id >= virt_index_by_id.size())
+			virt_index_by_id.resize(id+1, -1);
+		if (virt_index_by_id[id] < 0) {
+			virt_index_by_id[id] = virtuals.size();
+			virtuals.push_back(regs[i]);
+			if (id > max_virt_reg_id)
+				max_virt_reg_id = id;
+		}
+		indices[i] = virt_index_by_id[id];
+	}
 }
 
-void LivenessInfo::findLiveness(int virt_reg, const FlowGraphNode* node)
+void LivenessInfo::makeBlocks()
 {
-// 	if (! isLiveAtNode(node, virt_reg) && ! isAssignedAtNode(node, virt_reg)) {
-// 		live_at_node[node->index].push_back(virt_reg);
-// 		for (std::list<FlowGraphNode *>::const_iterator prev = node->previous.begin();
-// 				prev != node->previous.end(); prev++)
-// 			findLiveness(virt_reg, *prev);
-// 	}
-		for (std::list<FlowGraphNode *>::const_iterator prev = node->previous.begin();
-				prev != node->previous.end(); prev++) {
-			if (! isLiveAfterNode(*prev, virt_reg)) {
-				live_after_node[(*prev)->index].push_back(virt_reg);
-				if (! isAssignedAtNode(*prev, virt_reg))
-					findLiveness(virt_reg, *prev);
+	blocks.resize(flowgraph->blockCount());
+	for (size_t b = 0; b < blocks.size(); b++) {
+		BasicBlock &block = blocks[b];
+		block.used.resize(virtuals.size());
+		block.assigned.resize(virtuals.size());
+		block.live_in.resize(virtuals.size());
+		block.live_out.resize(virtuals.size());
+		for (int i = flowgraph->blockLast(b); i >= flowgraph->blockFirst(b); i--) {
+			for (size_t j = 0; j < assigned_at_node[i].size(); j++) {
+				block.used.reset(assigned_at_node[i][j]);
+				block.assigned.set(assigned_at_node[i][j]);
 			}
+			for (size_t j = 0; j < used_at_node[i].size(); j++)
+				block.used.set(used_at_node[i][j]);
 		}
+	}
 }
 
-int LivenessInfo::getVirtualRegisterIndex(IR::VirtualRegister* vreg)
+void LivenessInfo::solveBlocks()
 {
-	std::map<int, VirtualRegInfo>::iterator pos = virt_indices_by_id.find(vreg->getIndex());
-	if (pos == virt_indices_by_id.end())
-		return -1;
-	else
-		return (*pos).second.index;
+	std::vector<int> worklist;
+	std::vector<bool> in_worklist(blocks.size(), true);
+	// Liveness flows backwards, so pop the last blocks first
+	for (size_t b = 0; b < blocks.size(); b++) {
+		blocks[b].live_in = blocks[b].used;
+		worklist.push_back(b);
+	}
+	
+	BitSet live_in(virtuals.size());
+	while (! worklist.empty()) {
+		int b = worklist.back();
+		worklist.pop_back();
+		in_worklist[b] = false;
+		BasicBlock &block = blocks[b];
+		
+		for (int i = 0; i < flowgraph->blockNextCount(b); i++)
+			block.live_out.unite(blocks[flowgraph->getBlockNext(b, i)].live_in);
+		live_in = block.live_out;
+		live_in.subtract(block.assigned);
+		if (block.live_in.unite(live_in))
+			for (int i = 0; i < flowgraph->blockPreviousCount(b); i++) {
+				int previous = flowgraph->getBlockPrevious(b, i);
+				if (! in_worklist[previous]) {
+					in_worklist[previous] = true;
+					worklist.push_back(previous);
+				}
+			}
+	}
 }
 
-LivenessInfo::LivenessInfo(const FlowGraph& flowgraph) : DebugPrinter("liveness.log")
+void LivenessInfo::findNodeLiveness()
+{
+	live_after_node.resize(nodecount);
+	BitSet live(virtuals.size());
+	for (size_t b = 0; b < blocks.size(); b++) {
+		live = blocks[b].live_out;
+		for (int i = flowgraph->blockLast(b); i >= flowgraph->blockFirst(b); i--) {
+			for (int v = live.findNext(0); v >= 0; v = live.findNext(v+1))
+				live_after_node[i].push_back(v);
+			for (size_t j = 0; j < assigned_at_node[i].size(); j++)
+				live.reset(assigned_at_node[i][j]);
+			for (size_t j = 0; j < used_at_node[i].size(); j++)
+				live.set(used_at_node[i][j]);
+		}
+	}
+}
+
+void LivenessInfo::readNodes(const FlowGraph &flowgraph)
 {
 	this->flowgraph = &flowgraph;
 	nodecount = flowgraph.nodeCount();
-	int n_virtreg = 0;
 	used_at_node.resize(flowgraph.nodeCount());
 	assigned_at_node.resize(flowgraph.nodeCount());
 	node_is_reg_reg_move.resize(flowgraph.nodeCount(), false);
 	max_virt_reg_id = -1;
 	
-	const FlowGraph::NodeList &nodes = flowgraph.getNodes();	
-	for (FlowGraph::NodeList::const_iterator node = nodes.begin();
-			node != nodes.end(); node++) {
-		debug("node %d, %d next, %d prev", (*node).index,
-			  (*node).next.size(), (*node).previous.size());
-		{
-		const std::vector<IR::VirtualRegister *> &regs = (*node).usedRegisters();
-		if ((*node).isRegToRegAssignment())
-			assert(regs.size() == 1);
-		node_is_reg_reg_move[(*node).index] = (*node).isRegToRegAssignment();
-		used_at_node[(*node).index].resize(regs.size());
-		for (int i = 0; i < regs.size(); i++) {
-			if (virt_indices_by_id.find(regs[i]->getIndex()) == virt_indices_by_id.end()) {
-				virt_indices_by_id.insert(std::make_pair(regs[i]->getIndex(),  VirtualRegInfo(n_virtreg, regs[i])));
-				if (regs[i]->getIndex() > max_virt_reg_id)
-					max_virt_reg_id = regs[i]->getIndex();
-				n_virtreg++;
+	for (int i = 0; i < nodecount; i++) {
+		const FlowGraphNode &node = flowgraph.getNode(i);
+		debug("node %d, %d next, %d prev", i,
+			  flowgraph.nextCount(i), flowgraph.previousCount(i));
+		if (node.isRegToRegAssignment())
+			assert(node.usedRegisters().size() == 1);
+		node_is_reg_reg_move[i] = node.isRegToRegAssignment();
+		addNodeRegisters(node.usedRegisters(), used_at_node[i]);
+		addNodeRegisters(node.assignedRegisters(), assigned_at_node[i]);
+	}
+	
+	number_invocations.resize(virtuals.size(), 0);
+	for (int i = 0; i < nodecount; i++) {
+		for (size_t j = 0; j < used_at_node[i].size(); j++)
+			number_invocations[used_at_node[i][j]]++;
+		for (size_t j = 0; j < assigned_at_node[i].size(); j++)
+			number_invocations[assigned_at_node[i][j]]++;
+	}
+}
+
+LivenessInfo::LivenessInfo(const FlowGraph& flowgraph) : DebugPrinter("liveness.log")
+{
+	readNodes(flowgraph);
+	makeBlocks();
+	solveBlocks();
+	findNodeLiveness();
+	debug("%d nodes, %d basic blocks, %d registers", nodecount,
+		blocks.size(), virtuals.size());
+	std::vector<BasicBlock>().swap(blocks);
+}
+
+/**
+ * Whether the node registers are the same, not counting the spilled
+ * registers before and the spill-made ones after
+ */
+static bool SameExceptSpill(const LivenessInfo::VarArray &before,
+	const LivenessInfo::VarArray &after, const std::vector<int> &new_index,
+	const std::vector<bool> &from_spill)
+{
+	LivenessInfo::VarArray kept, found;
+	for (size_t i = 0; i < before.size(); i++)
+		if (new_index[before[i]] >= 0)
+			kept.push_back(new_index[before[i]]);
+	for (size_t i = 0; i < after.size(); i++)
+		if (! from_spill[after[i]])
+			found.push_back(after[i]);
+	std::sort(kept.begin(), kept.end());
+	std::sort(found.begin(), found.end());
+	return kept == found;
+}
+
+/**
+ * Spilling only inserts straight-line loads and stores of temporaries
+ * around the instructions it rewrites, so the other registers keep
+ * their liveness minus the spilled ones, and the temporaries are live
+ * between the neighbouring instructions only. A spilled register may
+ * stay as an output of an instruction storing it, but is never live.
+ */
+bool LivenessInfo::patchAfterSpill(const LivenessInfo &previous,
+	const std::vector<IR::VirtualRegister *> &spilled,
+	const Asm::SpillResult &spill)
+{
+	std::vector<bool> known(virtuals.size(), false);
+	std::vector<int> new_index(previous.virtuals.size());
+	for (size_t i = 0; i < previous.virtuals.size(); i++) {
+		new_index[i] = getVirtualRegisterIndex(previous.virtuals[i]);
+		if (new_index[i] >= 0)
+			known[new_index[i]] = true;
+	}
+	// Temporaries and spilled registers left as outputs
+	std::vector<bool> from_spill(virtuals.size(), false);
+	for (size_t i = 0; i < spilled.size(); i++) {
+		int index = getVirtualRegisterIndex(spilled[i]);
+		if (index >= 0)
+			from_spill[index] = true;
+		int old_index = previous.getVirtualRegisterIndex(spilled[i]);
+		assert(old_index >= 0);
+		new_index[old_index] = -2;
+	}
+	for (size_t i = 0; i < previous.virtuals.size(); i++)
+		if (new_index[i] == -1) {
+			debug("%s disappeared", previous.virtuals[i]->getName().c_str());
+			return false;
+		} else if (new_index[i] == -2)
+			new_index[i] = -1;
+	
+	std::vector<bool> is_temporary(virtuals.size(), false);
+	for (size_t i = 0; i < spill.temporaries.size(); i++) {
+		int index = getVirtualRegisterIndex(spill.temporaries[i]);
+		if (index >= 0) {
+			if (known[index]) {
+				debug("Temporary %s was there before",
+					spill.temporaries[i]->getName().c_str());
+				return false;
 			}
-			used_at_node[(*node).index][i] =
-				virt_indices_by_id.at(regs[i]->getIndex()).index;
+			is_temporary[index] = true;
+			from_spill[index] = true;
 		}
+	}
+	for (size_t i = 0; i < virtuals.size(); i++)
+		if (! known[i] && ! from_spill[i]) {
+			debug("%s appeared", virtuals[i]->getName().c_str());
+			return false;
 		}
-		{
-		const std::vector<IR::VirtualRegister *> &regs = (*node).assignedRegisters();
-		assigned_at_node[(*node).index].resize(regs.size());
-		for (int i = 0; i < regs.size(); i++) {
-			if (virt_indices_by_id.find(regs[i]->getIndex()) == virt_indices_by_id.end()) {
-				virt_indices_by_id.insert(std::make_pair(regs[i]->getIndex(),  VirtualRegInfo(n_virtreg, regs[i])));
-				if (regs[i]->getIndex() > max_virt_reg_id)
-					max_virt_reg_id = regs[i]->getIndex();
-				n_virtreg++;
+	
+	std::vector<const Asm::Instruction *> inserted = spill.inserted;
+	std::vector<const Asm::Instruction *> rewritten = spill.rewritten;
+	std::sort(inserted.begin(), inserted.end());
+	std::sort(rewritten.begin(), rewritten.end());
+	std::vector<int> old_node(nodecount);
+	int old_count = 0;
+	for (int i = 0; i < nodecount; i++) {
+		const Asm::Instruction *inst = flowgraph->getNode(i).getInstruction();
+		if (std::binary_search(inserted.begin(), inserted.end(), inst)) {
+			if ((i+1 == nodecount) || (flowgraph->nextCount(i) != 1) ||
+					(flowgraph->getNext(i, 0) != i+1)) {
+				debug("Inserted node %d doesn't fall through", i);
+				return false;
+			}
+			old_node[i] = -1;
+		} else {
+			old_node[i] = old_count;
+			old_count++;
+			if (std::binary_search(rewritten.begin(), rewritten.end(), inst) &&
+					(! SameExceptSpill(previous.used_at_node[old_node[i]],
+						used_at_node[i], new_index, from_spill) ||
+					! SameExceptSpill(previous.assigned_at_node[old_node[i]],
+						assigned_at_node[i], new_index, from_spill))) {
+				debug("Node %d changed more than spilled registers", i);
+				return false;
 			}
-			assigned_at_node[(*node).index][i] =
-				virt_indices_by_id.at(regs[i]->getIndex()).index;
-		}
 		}
+		for (size_t j = 0; j < used_at_node[i].size(); j++)
+			if (from_spill[used_at_node[i][j]] &&
+					! is_temporary[used_at_node[i][j]]) {
+				debug("Spilled %s still used at node %d",
+					virtuals[used_at_node[i][j]]->getName().c_str(), i);
+				return false;
+			}
+	}
+	if (old_count != previous.nodecount) {
+		debug("%d nodes left of %d", old_count, previous.nodecount);
+		return false;
 	}
 	
-	live_after_node.resize(flowgraph.nodeCount());
-	nodes_using.resize(n_virtreg);
-	number_invocations.resize(n_virtreg, 0);
-	virtuals.resize(n_virtreg);
-	for (std::map<int, VirtualRegInfo>::iterator reg = virt_indices_by_id.begin();
-			reg != virt_indices_by_id.end(); reg++)
-		virtuals[(*reg).second.index] = (*reg).second.reg;
-	
-	for (FlowGraph::NodeList::const_iterator node = nodes.begin();
-			node != nodes.end(); node++) {
-		{
-		const std::vector<IR::VirtualRegister *> &regs = (*node).usedRegisters();
-		for (int i = 0; i < regs.size(); i++) {
-			int index = virt_indices_by_id.at(regs[i]->getIndex()).index;
-			nodes_using[index].push_back(& *node);
-			number_invocations[index]++;
-		}
-		}
-		{
-		const std::vector<IR::VirtualRegister *> &regs = (*node).assignedRegisters();
-		for (int i = 0; i < regs.size(); i++) {
-			int index = virt_indices_by_id.at(regs[i]->getIndex()).index;
-			number_invocations[index]++;
-		}
+	live_after_node.resize(nodecount);
+	VarArray live_temporaries;
+	for (int i = nodecount-1; i >= 0; i--) {
+		VarArray &live = live_after_node[i];
+		if (old_node[i] >= 0) {
+			const VarArray &before = previous.live_after_node[old_node[i]];
+			bool sorted = live_temporaries.empty();
+			live.reserve(before.size() + live_temporaries.size());
+			for (size_t j = 0; j < before.size(); j++) {
+				int v = new_index[before[j]];
+				if (v < 0)
+					continue;
+				if (! live.empty() && (v < live.back()))
+					sorted = false;
+				live.push_back(v);
+			}
+			live.insert(live.end(), live_temporaries.begin(),
+				live_temporaries.end());
+			if (! sorted)
+				std::sort(live.begin(), live.end());
+		} else {
+			// Inserted instructions fall through to the next one
+			live = live_after_node[i+1];
+			for (size_t j = 0; j < assigned_at_node[i+1].size(); j++) {
+				VarArray::iterator pos = std::lower_bound(live.begin(),
+					live.end(), assigned_at_node[i+1][j]);
+				if ((pos != live.end()) && (*pos == assigned_at_node[i+1][j]))
+					live.erase(pos);
+			}
+			for (size_t j = 0; j < used_at_node[i+1].size(); j++) {
+				VarArray::iterator pos = std::lower_bound(live.begin(),
+					live.end(), used_at_node[i+1][j]);
+				if ((pos == live.end()) || (*pos != used_at_node[i+1][j]))
+					live.insert(pos, used_at_node[i+1][j]);
+			}
 		}
+		
+		for (size_t j = 0; j < assigned_at_node[i].size(); j++)
+			if (is_temporary[assigned_at_node[i][j]]) {
+				VarArray::iterator pos = std::find(live_temporaries.begin(),
+					live_temporaries.end(), assigned_at_node[i][j]);
+				if (pos != live_temporaries.end())
+					live_temporaries.erase(pos);
+			}
+		for (size_t j = 0; j < used_at_node[i].size(); j++)
+			if (is_temporary[used_at_node[i][j]] &&
+					(std::find(live_temporaries.begin(), live_temporaries.end(),
+						used_at_node[i][j]) == live_temporaries.end()))
+				live_temporaries.push_back(used_at_node[i][j]);
+	}
+	return live_temporaries.empty();
+}
+
+LivenessInfo::LivenessInfo(const FlowGraph &flowgraph,
+	const LivenessInfo &previous,
+	const std::vector<IR::VirtualRegister *> &spilled,
+	const Asm::SpillResult &spill) : DebugPrinter("liveness.log")
+{
+	readNodes(flowgraph);
+	if (patchAfterSpill(previous, spilled, spill)) {
+		debug("%d nodes, %d registers, patched after spilling %d",
+			nodecount, virtuals.size(), spilled.size());
+#ifdef DEBUG
+		LivenessInfo solved(flowgraph);
+		if ((solved.virtuals != virtuals) ||
+				(solved.live_after_node != live_after_node))
+			Error::fatalError("Patched liveness differs from the solved one");
+#endif
+	} else {
+		live_after_node.clear();
+		makeBlocks();
+		solveBlocks();
+		findNodeLiveness();
+		debug("%d nodes, %d basic blocks, %d registers, solved after spilling",
+			nodecount, blocks.size(), virtuals.size());
+		std::vector<BasicBlock>().swap(blocks);
 	}
-	
-	for (int i = 0; i < n_virtreg; i++)
-		for (NodeList::iterator node = nodes_using[i].begin();
-				node != nodes_using[i].end(); node++)
-			findLiveness(i, *node);
 }
 
 void PrintLivenessInfo(FILE *f, Asm::Instructions& code, IR::AbstractFrame *frame)
@@ -324,7 +586,7 @@ void PrintLivenessInfo(FILE *f, Asm::Instructions& code, IR::AbstractFrame *fram
 	
 	for (int i = 0; i < graph.nodeCount(); i++) {
 		fprintf(f, "Line %d:", i);
-		for (LivenessInfo::VarList::iterator v = liveness.live_after_node[i].begin();
+		for (LivenessInfo::VarArray::iterator v = liveness.live_after_node[i].begin();
 				v != liveness.live_after_node[i].end(); v++)
 			fprintf(f, " %s", liveness.virtuals[*v]->getName().c_str());
 		fputc('\n', f);
@@ -336,46 +598,23 @@ void NodeMoveManager::init(int nodecount, int movecount)
 	
 	
 	node_status.resize(nodecount, S_UNPROCESSED);
-	move_status.resize(movecount);
-}
-
-void ListRemove(Intlist& list, int value)
-{
-	for (Intlist::iterator x = list.begin(); x != list.end(); ++x)
-		if (*x == value) {
-			list.erase(x);
-			return;
-		}
-	assert(false);
-}
-
-void ListRemoveReverse(Intlist& list, int value)
-{
-	for (Intlist::iterator x = list.end(); x != list.begin();) {
-		--x;
-		if (*x == value) {
-			list.erase(x);
-			return;
-		}
-	}
-	assert(false);
+	node_positions.resize(nodecount);
+	move_status.resize(movecount, M_UNPROCESSED);
+	move_positions.resize(movecount);
 }
 
 void NodeMoveManager::setMoveStatus(int m, MoveStatus status)
 {
-	ListRemove(move_lists[(int)move_status[m]], m);
-	move_status[m] = status;
-	move_lists[(int)status].push_back(m);
+	assert(move_status[m] != M_UNPROCESSED);
+	move_lists[(int)move_status[m]].erase(move_positions[m]);
+	addMove(m, status);
 }
 
 void NodeMoveManager::setNodeStatus(int n, NodeStatus status)
 {
-	if (node_status[n] == S_SELECTED)
-		ListRemoveReverse(node_lists[(int)node_status[n]], n);
-	else
-		ListRemove(node_lists[(int)node_status[n]], n);
-	node_status[n] = status;
-	node_lists[(int)status].push_back(n);
+	assert(node_status[n] != S_UNPROCESSED);
+	node_lists[(int)node_status[n]].erase(node_positions[n]);
+	addNode(n, status);
 }
 
 void PartialRegAllocator::printRegisters()
@@ -411,15 +650,9 @@ const char *move_status_names[] = {
 	"active",
 };
 
-static std::string IntToStr(int x)
-{
-	char buf[30];
-	sprintf(buf, "%d", x);
-	return std::string(buf);
-}
-
 void PartialRegAllocator::printStatus()
 {
+#ifdef DEBUG
 	for (NodeStatus ns = (NodeStatus)0; ns < MAX_NODESTATUS; ns = (NodeStatus)((int)ns+1)) {
 		debug("%s nodes:", node_status_names[(int)ns]);
 		const Intlist &nodes = status.getNodes(ns);
@@ -442,10 +675,11 @@ void PartialRegAllocator::printStatus()
 		const Intlist &moves = status.getMoves(ms);
 		for (Intlist::const_iterator m = moves.begin(); m != moves.end(); m++) {
 			debug("%d: %s -> %s", *m,
-				NodeName(liveness->used_at_node[*m][0]),
-				NodeName(liveness->assigned_at_node[*m][0]));
+				NodeName(liveness->used_at_node[*m][0]).c_str(),
+				NodeName(liveness->assigned_at_node[*m][0]).c_str());
 		}
 	}
+#endif
 }
 
 PartialRegAllocator::PartialRegAllocator(const LivenessInfo *_liveness,
@@ -455,7 +689,7 @@ PartialRegAllocator::PartialRegAllocator(const LivenessInfo *_liveness,
 {
 	colorcount = _colorcount;
 	nodecount = liveness->virtuals.size();
-	table.resize(nodecount*nodecount, false);
+	edges.init(nodecount);
 	list.resize(nodecount);
 	no_list.resize(nodecount, false);
 	used_in_moves.resize(nodecount, false);
@@ -481,10 +715,7 @@ void PartialRegAllocator::setNoAdjacencyList(int n)
 
 void PartialRegAllocator::connect(int n1, int n2)
 {
-	assert(n1 != n2);
-	if (! table[n1*nodecount+n2] && ! table[n2*nodecount+n1]) {
-		table[n1*nodecount+n2] = true;
-		table[n2*nodecount+n1] = true;
+	if (edges.insert(n1, n2)) {
 		if (! no_list[n1]) {
 			list[n1].push_back(n2);
 			node_degrees[n1]++;
@@ -498,15 +729,23 @@ void PartialRegAllocator::connect(int n1, int n2)
 
 bool PartialRegAllocator::isAdjacent(int n1, int n2)
 {
-	return table[n1*nodecount+n2];
+	return (n1 != n2) && edges.contains(n1, n2);
 }
 
-const std::list< int > &PartialRegAllocator::getAdjacent(int n)
+const std::vector<int> &PartialRegAllocator::getAdjacent(int n)
 {
 	assert(! no_list[n]);
 	return list[n];
 }
 
+size_t PartialRegAllocator::getGraphMemory() const
+{
+	size_t result = edges.getMemory() + list.capacity() * sizeof(list[0]);
+	for (size_t n = 0; n < list.size(); n++)
+		result += list[n].capacity() * sizeof(int);
+	return result;
+}
+
 void PartialRegAllocator::precolor(int node, int color)
 {
 	colors[node] = color;
@@ -525,7 +764,7 @@ void PartialRegAllocator::buildGraph()
 			int r1 = liveness->used_at_node[i][0];
 			int r2 = liveness->assigned_at_node[i][0];
 			if (r1 != r2) {
-				debug("move %s -> %s", NodeName(r1), NodeName(r2));
+				debug("move %s -> %s", NodeName(r1).c_str(), NodeName(r2).c_str());
 				assignment_source = r1;
 				used_in_moves[r1] = true;
 				used_in_moves[r2] = true;
@@ -535,19 +774,19 @@ void PartialRegAllocator::buildGraph()
 			}
 		}
 		
-		for (int assign_ind = 0; assign_ind < liveness->assigned_at_node[i].size();
+		for (size_t assign_ind = 0; assign_ind < liveness->assigned_at_node[i].size();
 				assign_ind++) {
 			int assigned_here = liveness->assigned_at_node[i][assign_ind];
 			//if (liveness->isLiveAfterNode(i, assigned_here))
-				for (LivenessInfo::VarList::const_iterator livehere =
+				for (LivenessInfo::VarArray::const_iterator livehere =
 						liveness->live_after_node[i].begin();
 						livehere != liveness->live_after_node[i].end();
 						livehere++) {
 					if ((*livehere != assigned_here) &&
 							(*livehere != assignment_source)) {
 						debug("Line %d, Assigned node %s, collides with live node %s",
-							  i, NodeName(assigned_here),
-							  NodeName(*livehere));
+							  i, NodeName(assigned_here).c_str(),
+							  NodeName(*livehere).c_str());
 						connect(assigned_here, *livehere);
 					}
 				}
@@ -564,10 +803,10 @@ void PartialRegAllocator::classifyNodes()
 	for (int n = 0; n < nodecount; n++)
 		if (colors[n] < 0) {
 			if (node_degrees[n] >= colorcount) {
-				debug("Node %s is SPILLABLE", NodeName(n));
+				debug("Node %s is SPILLABLE", NodeName(n).c_str());
 				status.addNode(n, S_SPILLABLE);
 			} else if (used_in_moves[n]) {
-				debug("Node %s is FREEZEABLE", NodeName(n));
+				debug("Node %s is FREEZEABLE", NodeName(n).c_str());
 				status.addNode(n, S_FREEZEABLE);
 			} else
 				status.addNode(n, S_REMOVABLE);
@@ -577,31 +816,39 @@ void PartialRegAllocator::classifyNodes()
 
 void PartialRegAllocator::getRemainingAdjacent(int n, Intlist& nodes)
 {
-	const Intlist &core_list = getAdjacent(n);
+	const std::vector<int> &core_list = getAdjacent(n);
 	nodes.clear();
-	for (Intlist::const_iterator node = core_list.begin(); node != core_list.end(); node++)
+	for (std::vector<int>::const_iterator node = core_list.begin();
+			node != core_list.end(); node++)
 		if ((status.nodeStatus(*node) != S_SELECTED) && (status.nodeStatus(*node) != S_COALESCED))
 			nodes.push_back(*node);
 }
 
-bool PartialRegAllocator::hasRemainingMoves(int n)
+/**
+ * Coalesced, constrained and frozen moves never become active again, so
+ * they are dropped from the node's move list for good
+ */
+void PartialRegAllocator::pruneFinishedMoves(int n)
 {
-	for (Intlist::iterator move = moves_per_node[n].begin();
-			move != moves_per_node[n].end(); move++)
+	Intlist &node_moves = moves_per_node[n];
+	for (Intlist::iterator move = node_moves.begin(); move != node_moves.end();)
 		if ((status.moveStatus(*move) == M_COALESCABLE) ||
-			(status.moveStatus(*move) == M_ACTIVE))
-			return true;
-	return false;
+				(status.moveStatus(*move) == M_ACTIVE))
+			++move;
+		else
+			move = node_moves.erase(move);
+}
+
+bool PartialRegAllocator::hasRemainingMoves(int n)
+{
+	pruneFinishedMoves(n);
+	return ! moves_per_node[n].empty();
 }
 
 void PartialRegAllocator::getRemainingMoves(int n, Intlist& moves)
 {
-	moves.clear();
-	for (Intlist::iterator move = moves_per_node[n].begin();
-			move != moves_per_node[n].end(); move++)
-		if ((status.moveStatus(*move) == M_COALESCABLE) ||
-			(status.moveStatus(*move) == M_ACTIVE))
-			moves.push_back(*move);
+	pruneFinishedMoves(n);
+	moves = moves_per_node[n];
 }
 
 void PartialRegAllocator::remove_one_removable()
@@ -609,7 +856,7 @@ void PartialRegAllocator::remove_one_removable()
 	if (status.getNodes(S_REMOVABLE).empty())
 		return;
 	int n = status.getNodes(S_REMOVABLE).front();
-	debug("Removing node %s", NodeName(n));
+	debug("Removing node %s", NodeName(n).c_str());
 	status.setNodeStatus(n, S_SELECTED);
 	Intlist adjacent;
 	getRemainingAdjacent(n, adjacent);
@@ -622,7 +869,7 @@ void PartialRegAllocator::decrementDegree(int n)
 	if (status.nodeStatus(n) == S_PRECOLORED)
 		return;
 	debug("decrementDegree: node %s is initially %d", 
-		  NodeName(n), node_degrees[n]);
+		  NodeName(n).c_str(), node_degrees[n]);
 	node_degrees[n]--;
 	if (node_degrees[n] == colorcount-1) {
 		Intlist neighbours;
@@ -632,10 +879,10 @@ void PartialRegAllocator::decrementDegree(int n)
 		assert(status.nodeStatus(n) == S_SPILLABLE);
 		if (hasRemainingMoves(n)) {
 			debug("DecrementDegree: setting node %s to freezeable",
-				NodeName(n));
+				NodeName(n).c_str());
 			status.setNodeStatus(n, S_FREEZEABLE);
 		} else {
-			debug("DecrementDegree: Can now remove node %s", NodeName(n));
+			debug("DecrementDegree: Can now remove node %s", NodeName(n).c_str());
 			status.setNodeStatus(n, S_REMOVABLE);
 		}
 	}
@@ -671,8 +918,8 @@ void PartialRegAllocator::coalesce_one()
 	int n1 = liveness->used_at_node[move][0];
 	int n2 = liveness->assigned_at_node[move][0];
 	debug("coalesce_one: merging %s and %s",
-		NodeName(n1),
-		NodeName(n2));
+		NodeName(n1).c_str(),
+		NodeName(n2).c_str());
 	
 	n1 = getRemaingFromCoalescedGroup(n1);
 	n2 = getRemaingFromCoalescedGroup(n2);
@@ -733,10 +980,10 @@ bool PartialRegAllocator::canCoalesce_noAdjacentListfor1(int n1, int n2)
 			isAdjacent(*neighbour2, n1)
 		)) {
 			debug("Afraid to coalesce %s and %s",
-				NodeName(n1), NodeName(n2));
+				NodeName(n1).c_str(), NodeName(n2).c_str());
 			debug("... because %s has neighbour %s of degree %d not precolored and not adjacent to %s",
-					NodeName(n2), NodeName(*neighbour2), node_degrees[*neighbour2],
-					NodeName(n1));
+					NodeName(n2).c_str(), NodeName(*neighbour2).c_str(), node_degrees[*neighbour2],
+					NodeName(n1).c_str());
 			return false;
 		}
 	}
@@ -778,8 +1025,8 @@ void PartialRegAllocator::combineNodes(int remain, int remove)
 			neighbour++) {
 		if (! isAdjacent(*neighbour, remain)) {
 			debug("combineNodes: Connecting %s with %s, degrees initially %d and %d",
-				NodeName(*neighbour),
-				NodeName(remain),
+				NodeName(*neighbour).c_str(),
+				NodeName(remain).c_str(),
 				node_degrees[*neighbour], node_degrees[remain]
 				);
 			connect(*neighbour, remain);
@@ -787,9 +1034,9 @@ void PartialRegAllocator::combineNodes(int remain, int remove)
 			if (status.nodeStatus(*neighbour) != S_PRECOLORED)
 				node_degrees[*neighbour]--;
 			debug("combineNodes: Connected, degrees are now %s = %d  %s = %d",
-				NodeName(*neighbour),
+				NodeName(*neighbour).c_str(),
 				node_degrees[*neighbour], 
-				NodeName(remain),
+				NodeName(remain).c_str(),
 				node_degrees[remain]
 				);
 		}
@@ -797,7 +1044,7 @@ void PartialRegAllocator::combineNodes(int remain, int remove)
 	if ((node_degrees[remain] >= colorcount) &&
 			status.nodeStatus(remain) == S_FREEZEABLE) {
 		debug("CombineNodes: node %s has now degree %d thus SPILLABLE",
-			  NodeName(remain), node_degrees[remain]);
+			  NodeName(remain).c_str(), node_degrees[remain]);
 		status.setNodeStatus(remain, S_SPILLABLE);
 	}
 }
@@ -813,7 +1060,7 @@ void PartialRegAllocator::freezeOne()
 
 void PartialRegAllocator::freezeMoves(int node)
 {
-	debug("freezeMoves for node %s", NodeName(node));
+	debug("freezeMoves for node %s", NodeName(node).c_str());
 	Intlist moves;
 	getRemainingMoves(node, moves);
 	for (Intlist::iterator move = moves.begin(); move != moves.end(); move++) {
@@ -825,8 +1072,8 @@ void PartialRegAllocator::freezeMoves(int node)
 		else
 			node2 = n2;
 		debug("Freezing move %s -> %s",
-			NodeName(liveness->used_at_node[*move][0]),
-			NodeName(liveness->assigned_at_node[*move][0]));
+			NodeName(liveness->used_at_node[*move][0]).c_str(),
+			NodeName(liveness->assigned_at_node[*move][0]).c_str());
 		assert(status.moveStatus(*move) == M_ACTIVE);
 		status.setMoveStatus(*move, M_FROZEN);
 		if (! hasRemainingMoves(node2) && (node_degrees[node2] < colorcount) &&
@@ -851,14 +1098,14 @@ void PartialRegAllocator::prespillOne()
 			node != status.getNodes(S_SPILLABLE).end(); node++) {
 		float badness = getSpillBadness(*node);
 		debug("Spillable node %s, badness %g",
-			  NodeName(*node), badness);
+			  NodeName(*node).c_str(), badness);
 		if ((node_to_spill < 0) || (badness < best_badness)) {
 			node_to_spill = *node;
 			best_badness = badness;
 		}
 	}
 	debug("Spilling node %s, (badness %g)",
-			NodeName(node_to_spill),
+			NodeName(node_to_spill).c_str(),
 			best_badness);
 	status.setNodeStatus(node_to_spill, S_REMOVABLE);
 	freezeMoves(node_to_spill);
@@ -872,8 +1119,8 @@ void PartialRegAllocator::assignColors()
 		std::vector<int> colors_available;
 		colors_available.resize(colorcount, true);
 		
-		Intlist &neighbours = list[n];
-		for (Intlist::iterator neighbour = neighbours.begin();
+		std::vector<int> &neighbours = list[n];
+		for (std::vector<int>::iterator neighbour = neighbours.begin();
 				neighbour != neighbours.end(); neighbour++) {
 			int uncoalesced = getRemaingFromCoalescedGroup(*neighbour);
 			if ((status.nodeStatus(uncoalesced) == S_PRECOLORED) ||
@@ -954,11 +1201,11 @@ void PartialRegAllocator::checkColors()
 		}
 		if (assignment_source < 0)
 			continue;
-		for (int assign_ind = 0; assign_ind < liveness->assigned_at_node[i].size();
+		for (size_t assign_ind = 0; assign_ind < liveness->assigned_at_node[i].size();
 				assign_ind++) {
 			int assigned_here = liveness->assigned_at_node[i][assign_ind];
 			if (liveness->isLiveAfterNode(i, assigned_here))
-				for (LivenessInfo::VarList::const_iterator livehere =
+				for (LivenessInfo::VarArray::const_iterator livehere =
 						liveness->live_after_node[i].begin();
 						livehere != liveness->live_after_node[i].end();
 						livehere++) {
@@ -974,64 +1221,139 @@ void PartialRegAllocator::checkColors()
 	}
 }
 
+/**
+ * Gives colors to the registers left without one after spilling, which
+ * are the temporaries and the ones coalesced with spilled registers,
+ * keeping the colors of all others. Fails if some of them has no free
+ * color or the kept colors collide in the new code.
+ */
+static bool ColorAfterSpill(const LivenessInfo &liveness, int colorcount,
+	std::vector<int> &colors)
+{
+	std::vector<int> uncolored_index(colors.size(), -1);
+	std::vector<int> uncolored;
+	for (size_t i = 0; i < colors.size(); i++)
+		if (colors[i] < 0) {
+			uncolored_index[i] = uncolored.size();
+			uncolored.push_back(i);
+		}
+	std::vector<std::vector<int> > neighbours(uncolored.size());
+	
+	for (int i = 0; i < liveness.nodecount; i++) {
+		int assignment_source = -1;
+		if (liveness.node_is_reg_reg_move[i] &&
+				(liveness.used_at_node[i][0] != liveness.assigned_at_node[i][0]))
+			assignment_source = liveness.used_at_node[i][0];
+		for (size_t assign_ind = 0; assign_ind < liveness.assigned_at_node[i].size();
+				assign_ind++) {
+			int assigned_here = liveness.assigned_at_node[i][assign_ind];
+			const LivenessInfo::VarArray &live = liveness.live_after_node[i];
+			for (size_t j = 0; j < live.size(); j++) {
+				if ((live[j] == assigned_here) || (live[j] == assignment_source))
+					continue;
+				if ((colors[assigned_here] >= 0) && (colors[live[j]] >= 0)) {
+					if (colors[assigned_here] == colors[live[j]])
+						return false;
+				} else {
+					if (colors[assigned_here] < 0)
+						neighbours[uncolored_index[assigned_here]].push_back(live[j]);
+					if (colors[live[j]] < 0)
+						neighbours[uncolored_index[live[j]]].push_back(assigned_here);
+				}
+			}
+		}
+	}
+	
+	std::vector<bool> available(colorcount);
+	for (size_t i = 0; i < uncolored.size(); i++) {
+		available.assign(colorcount, true);
+		for (size_t j = 0; j < neighbours[i].size(); j++)
+			if (colors[neighbours[i][j]] >= 0)
+				available[colors[neighbours[i][j]]] = false;
+		int color = std::find(available.begin(), available.end(), true) -
+			available.begin();
+		if (color == colorcount)
+			return false;
+		colors[uncolored[i]] = color;
+	}
+	return true;
+}
+
 void AssignRegisters(Asm::Instructions& code,
 	Asm::Assembler &assembler,
 	IR::AbstractFrame *frame,
 	const std::vector<IR::VirtualRegister *> &machine_registers,
 	IR::RegisterMap &id_to_machine_map)
 {
-	bool finished = false;
-	FlowGraph *graph = NULL;
-	LivenessInfo *liveness = NULL;
-	PartialRegAllocator *allocator = NULL;
-	const std::vector<int> *colors = NULL;
-	const Intlist *spilled = NULL;
+	FlowGraph *graph = new FlowGraph(code, frame->getFramePointer());
+	LivenessInfo *liveness = new LivenessInfo(*graph);
+	std::vector<int> colors;
 	
-	do {
-		delete graph;
-		delete liveness;
-		delete allocator;
-		graph = new FlowGraph(code, frame->getFramePointer());
-		liveness = new LivenessInfo(*graph);
-		allocator = new PartialRegAllocator(liveness, machine_registers.size(),
+	while (true) {
+		PartialRegAllocator allocator(liveness, machine_registers.size(),
 			frame->getName());
-		allocator->debug("%d colors", machine_registers.size());
-		bool found_fp = false;
-		for (int i = 0; i < machine_registers.size(); i++)
-			allocator->debug("%d: %s", i, machine_registers[i]->getName().c_str());
-		for (int i = 0; i < machine_registers.size(); i++) {
+		allocator.debug("%d colors", machine_registers.size());
+		for (size_t i = 0; i < machine_registers.size(); i++)
+			allocator.debug("%d: %s", i, machine_registers[i]->getName().c_str());
+		for (size_t i = 0; i < machine_registers.size(); i++) {
 			int index = liveness->getVirtualRegisterIndex(machine_registers[i]);
 			if (index >= 0) {
-				allocator->precolor(index, i);
+				allocator.precolor(index, i);
 			}
 		}
-		allocator->tryColoring();
-		spilled = & allocator->getSpilled();
-		colors = & allocator->getColors();
-		
-		if (! spilled->empty()) {
-			allocator->debug("================================ SPILLING AND RESTARTING");
-		}
+		allocator.tryColoring();
+		allocator.debug("Interference graph takes %lu bytes",
+			(unsigned long)allocator.getGraphMemory());
+		colors = allocator.getColors();
+		const Intlist &spilled = allocator.getSpilled();
+		if (spilled.empty())
+			break;
+		allocator.debug("================================ SPILLING AND RESTARTING");
 		
-		for (Intlist::const_iterator n = spilled->begin(); n != spilled->end();
+		std::vector<IR::VirtualRegister *> spilled_registers;
+		for (Intlist::const_iterator n = spilled.begin(); n != spilled.end();
 				n++)
-			assembler.spillRegister(frame, code, liveness->virtuals[*n]);
-	} while (! spilled->empty());
-	
-		id_to_machine_map.resize(liveness->getMaxVirtualRegisterId()+1, NULL);
-		assert(colors->size() == liveness->virtuals.size());
-		for (int i = 0; i < colors->size(); i++) {
-			assert(colors->at(i) < (int)machine_registers.size());
-			if (spilled->empty())
-				assert(colors->at(i) >= 0);
-			if (colors->at(i) >= 0)
-				id_to_machine_map[liveness->virtuals[i]->getIndex()] =
-					machine_registers[colors->at(i)];
+			spilled_registers.push_back(liveness->virtuals[*n]);
+		Asm::SpillResult spill_result;
+		assembler.spillRegisters(frame, code, spilled_registers, spill_result);
+		
+		delete graph;
+		graph = new FlowGraph(code, frame->getFramePointer());
+		LivenessInfo *spilled_liveness = new LivenessInfo(*graph,
+			*liveness, spilled_registers, spill_result);
+		
+		// Only the registers spilling affected need new colors
+		std::vector<int> kept_colors(spilled_liveness->virtuals.size(), -1);
+		for (size_t i = 0; i < liveness->virtuals.size(); i++) {
+			int index = spilled_liveness->getVirtualRegisterIndex(
+				liveness->virtuals[i]);
+			if (index >= 0)
+				kept_colors[index] = colors[i];
 		}
+		for (size_t i = 0; i < machine_registers.size(); i++) {
+			int index = spilled_liveness->getVirtualRegisterIndex(
+				machine_registers[i]);
+			if (index >= 0)
+				kept_colors[index] = i;
+		}
+		delete liveness;
+		liveness = spilled_liveness;
+		if (ColorAfterSpill(*liveness, machine_registers.size(), kept_colors)) {
+			colors.swap(kept_colors);
+			break;
+		}
+	}
+	
+	id_to_machine_map.resize(liveness->getMaxVirtualRegisterId()+1, NULL);
+	assert(colors.size() == liveness->virtuals.size());
+	for (size_t i = 0; i < colors.size(); i++) {
+		assert((colors[i] >= 0) && (colors[i] < (int)machine_registers.size()));
+		id_to_machine_map[liveness->virtuals[i]->getIndex()] =
+			machine_registers[colors[i]];
+	}
 
-	delete graph;
 	delete liveness;
-	delete allocator;
+	delete graph;
 }
 
 }
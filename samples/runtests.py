@@ -4,10 +4,14 @@ import os
 import subprocess
 import sys
 
-if len(sys.argv) < 2:
+# With --bench, time the compilation of generated inputs instead
+bench_mode = "--bench" in sys.argv
+arguments = [a for a in sys.argv[1:] if a != "--bench"]
+
+if len(arguments) < 1:
     executable = subprocess.Popen(["find", "..", "-type", "f", "-name", "compiler"], stdout=subprocess.PIPE).communicate()[0].strip()
 else:
-    executable = sys.argv[1]
+    executable = arguments[0]
 
 open(executable).close()
 
@@ -80,10 +84,126 @@ def add(name, output):
 	tests += [[name+".tig", True]]
 	expected_outputs += [[name+".bin", output]]
 
+def write_stress(name, statements, terms, depth):
+	"""Long sequence, long operator chain and deep nesting, to be
+	compiled in time and memory linear in their size"""
+	f = open(name + ".tig", "w")
+	f.write("let var a := 0\n    var b := 1\n")
+	f.write("  function sequence() = (" + "; ".join(["a := a + 1"] * statements) + ")\n")
+	f.write("  function sum(): int = " + " + ".join(["b"] * terms) + "\n")
+	f.write("  function nested_if() = " + "if b then (" * depth + "print(\"if ok\\n\")" + ")" * depth + "\n")
+	f.write("  function nested_let() = " + "".join(["let var v%d := %d in " % (i, i) for i in range(depth)]))
+	f.write("if v%d = %d then print(\"let ok\\n\")" % (depth - 1, depth - 1) + " end" * depth + "\n")
+	f.write("in\n  sequence();\n")
+	f.write("  if a = %d then print(\"sequence ok\\n\");\n" % statements)
+	f.write("  if sum() = %d then print(\"sum ok\\n\");\n" % terms)
+	f.write("  nested_if();\n  nested_let()\nend\n")
+	f.close()
+	return "sequence ok\nsum ok\nif ok\nlet ok\n"
+
+def write_nested(name, depth):
+	"""Nested let scopes, each name looked up from the innermost one
+	through all of them"""
+	f = open(name + ".tig", "w")
+	f.write("let\n  var total := 0\n  function nested() = ")
+	f.write("".join(["let var v%d := %d in " % (i, i) for i in range(depth)]))
+	f.write("total := " + " + ".join(["v0"] * depth) + " + v%d" % (depth - 1))
+	f.write(" end" * depth + "\n")
+	f.write("in\n  nested();\n")
+	f.write("  if total = %d then print(\"nested ok\\n\")\nend\n" % (depth - 1))
+	f.close()
+	return "nested ok\n"
+
+def write_functions(name, count):
+	"""Many small functions with loops, array and record accesses, for
+	instruction selection over a large number of IR nodes"""
+	def divide(x, y):
+		q = abs(x) // abs(y)
+		return q if (x < 0) == (y < 0) else -q
+	f = open(name + ".tig", "w")
+	f.write("let\n  type intarray = array of int\n  type pair = {x: int, y: int}\n")
+	f.write("  var arr := intarray[10] of 0\n  var total := 0\nin\n")
+	f.write("  for j := 0 to 9 do arr[j] := j;\n")
+	total = 0
+	for group in range(0, count, 50):
+		f.write("  let\n")
+		calls = []
+		for k in range(group, min(group + 50, count)):
+			f.write("    function f%d(a: int, b: int): int =\n" % k)
+			f.write("      let var s := a var t := %d var r := pair{x = a, y = b} in\n" % (k % 7 + 1))
+			f.write("        for j := 0 to 9 do (s := s + arr[j] * b + j * %d; r.x := r.x + s / (t + j));\n" % k)
+			f.write("        while t < 50 do (t := t + 3; if t > 20 then s := s + 1 else s := s - 1);\n")
+			f.write("        s - r.x + t * 2 - s / 3 * (a + r.y)\n      end\n")
+			calls.append("f%d(%d, %d)" % (k, k % 5, k % 3))
+			a, b = k % 5, k % 3
+			s, t, x = a, k % 7 + 1, a
+			for j in range(10):
+				s = s + j * b + j * k
+				x = x + divide(s, t + j)
+			while t < 50:
+				t = t + 3
+				s = s + 1 if t > 20 else s - 1
+			total += s - x + t * 2 - divide(s, 3) * (a + b)
+		f.write("  in\n    total := total + " + " + ".join(calls) + "\n  end;\n")
+	f.write("  if total = %d then print(\"functions ok\\n\")\nend\n" % total)
+	f.close()
+	return "functions ok\n"
+
+def write_calls(name, count):
+	"""One function adding up many calls, each call's arguments and
+	result moved between registers, for the register allocator"""
+	f = open(name + ".tig", "w")
+	f.write("let\n  function g(x: int): int = x * 2\n")
+	f.write("  function f(a: int): int =\n    ")
+	f.write(" + ".join(["g(a + %d)" % (k % 13) for k in range(count)]) + "\n")
+	f.write("in\n  if f(1) = %d then print(\"calls ok\\n\")\nend\n" %
+		sum([2 * (1 + k % 13) for k in range(count)]))
+	f.close()
+	return "calls ok\n"
+
+benchmarks = [ \
+	["nested", write_nested, [2000, 4000, 8000]], \
+	["functions", write_functions, [200, 400, 800]], \
+	["calls", write_calls, [1000, 2000, 4000]], \
+]
+
+if bench_mode:
+	ok = True
+	for b in benchmarks:
+		for size in b[2]:
+			output = b[1](b[0], size)
+			before = os.times()
+			ret = os.system(executable + " -o " + b[0] + ".bin " + b[0] + ".tig >test.log 2>&1")
+			after = os.times()
+			if ret != 0:
+				print "Failed to compile %s %d" % (b[0], size)
+				ok = False
+				continue
+			print "%s %d: %.3f s" % (b[0], size, after[2] + after[3] - before[2] - before[3])
+			os.system("./" + b[0] + ".bin >test.out 2>&1")
+			if open("test.out").read() != output:
+				print "Benchmark %s %d got wrong answer" % (b[0], size)
+				ok = False
+		os.system("rm -f " + b[0] + ".tig " + b[0] + ".bin " + b[0] + ".o")
+	os.system("rm -f test.out test.log")
+	if not ok:
+		exit(1)
+	exit(0)
+
 add("recursion", open("recursion.out", "r").read())
 add("nest2", open("nest2.out", "r").read())
 add("emptyrecursion", "")
 add("queens", open("queens.out", "r").read())
+add("licmspill", "-2 -6 -3 4 41 \n")
+add("licmguard", "10 320 0 24 3 \n")
+add("licmalias", "18 602 33 36 \n")
+add("licmexit", "0 60 0 1500 8 16 \n")
+add("ivedges", "474 186 0 0 64 -28 -9223372036854775793 51539607472 1 \n")
+add("ivafter", "100 10 0 0 63 7 273 14 190 25 322 \n")
+add("csealias", "27 12 20 50 110 17 \n")
+add("foldedcompare", "baaaaa\n")
+add("deepnest", "sum ok\nnegation ok\nif ok\nlet ok\nloop ok\n")
+add("stress", write_stress("stress", 150000, 20000, 20000))
 
 os.system("rm -f *.bin test.log")
 
@@ -118,15 +238,38 @@ for test in expected_outputs:
 		ok = False
 		print "Test %s got wrong answer" % (test[0])
 
-multitests = ["neerc2015/king", "neerc2015/landscape"]
+def check_same_output(name, description, command):
+	"""Run the shell command, which prints what the sample prints when
+	compiled another way, and compare with the normally compiled binary"""
+	global ok
+	os.system("./" + name + ".bin >test.out 2>>test.log")
+	reference = open("test.out").read()
+	open("test.log", "a").write("running " + name + " " + description + "\n")
+	ret = os.system(command + " >test.out 2>>test.log")
+	if (ret != 0) or (open("test.out").read() != reference):
+		print "Test %s %s got wrong answer" % (name, description)
+		ok = False
+
+several_functions = ["primes", "queens", "licmalias", "ivafter", "csealias"]
+
+for name in several_functions:
+	check_same_output(name, "compiled with -j 4", executable + " -j 4 -o variant.bin " +
+		name + ".tig >>test.log 2>>test.log && ./variant.bin")
+	check_same_output(name, "run with --run", executable + " --run " + name + ".tig")
+	check_same_output(name, "compiled with -S", executable + " -S -o variant.bin " +
+		name + ".tig >>test.log 2>>test.log && ./variant.bin")
+
+# king also links C files, which -j compiles alongside the Tiger program
+multitests = [["neerc2015/king", ""], ["neerc2015/landscape", ""], \
+	["neerc2015/king", "-j 4 "]]
 
-for d in multitests:
+for d, options in multitests:
 	source = [s for s in os.listdir(d) if s.endswith(".tig")][0]
 	C = reduce(lambda x, y: x + " " + d+"/"+y, [s for s in os.listdir(d) if s.endswith(".c")], "")
-	open("test.log", "a").write("compiling " + source + " " + C + "\n")
-	ret = os.system(executable + " -o program.bin " + d + "/" + source + " " + C + " >>test.log 2>>test.log")
+	open("test.log", "a").write("compiling " + options + source + " " + C + "\n")
+	ret = os.system(executable + " " + options + "-o program.bin " + d + "/" + source + " " + C + " >>test.log 2>>test.log")
 	if ret != 0:
-		print "Failed to compile " + d + "/" + source
+		print "Failed to compile " + options + d + "/" + source
 		ok = False
 	for f in os.listdir(d + "/tests"):
 		if not f.endswith(".a"):
@@ -140,7 +283,7 @@ for d in multitests:
 				print "Wrong answer for " + d + "/tests/" + f
 				ok = False
 
-os.system("rm -f *.bin")
+os.system("rm -f *.bin stress.tig")
 os.unlink("test.out")
 
 if not ok:
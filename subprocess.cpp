@@ -0,0 +1,192 @@
+#include "subprocess.h"
+
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+
+extern char **environ;
+
+bool Subprocess::start(const std::vector<std::string> &argv, bool pipe_input,
+	bool pipe_errors)
+{
+	std::vector<char *> args(argv.size() + 1, NULL);
+	for (size_t i = 0; i < argv.size(); i++)
+		args[i] = (char *)argv[i].c_str();
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	int fds[2];
+	if (pipe_input) {
+		// Close on exec, so that no other child keeps the pipe open
+		// and the reader always sees the end of input
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			posix_spawn_file_actions_destroy(&actions);
+			return false;
+		}
+		posix_spawn_file_actions_adddup2(&actions, fds[0], 0);
+		// A program that exits early should show in its exit code
+		// rather than kill us with SIGPIPE
+		signal(SIGPIPE, SIG_IGN);
+	}
+	int error_fds[2];
+	if (pipe_errors) {
+		if (pipe2(error_fds, O_CLOEXEC) != 0) {
+			if (pipe_input) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			posix_spawn_file_actions_destroy(&actions);
+			return false;
+		}
+		posix_spawn_file_actions_adddup2(&actions, error_fds[1], 2);
+	}
+	int error = posix_spawnp(&pid, args[0], &actions, NULL, args.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (pipe_input) {
+		close(fds[0]);
+		if (error == 0)
+			input = fdopen(fds[1], "w");
+		else
+			close(fds[1]);
+	}
+	if (pipe_errors) {
+		close(error_fds[1]);
+		if (error == 0)
+			errors = error_fds[0];
+		else
+			close(error_fds[0]);
+	}
+	if (error != 0) {
+		pid = -1;
+		return false;
+	}
+	return true;
+}
+
+int Subprocess::wait()
+{
+	if (input != NULL) {
+		fclose(input);
+		input = NULL;
+	}
+	if (errors >= 0) {
+		close(errors);
+		errors = -1;
+	}
+	if (pid < 0)
+		return -1;
+	int status;
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	pid = -1;
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	else
+		return -1;
+}
+
+void SplitCommand(const std::string &command, std::vector<std::string> &argv)
+{
+	size_t start = 0;
+	while (true) {
+		start = command.find_first_not_of(" \t", start);
+		if (start == std::string::npos)
+			break;
+		size_t end = command.find_first_of(" \t", start);
+		if (end == std::string::npos)
+			end = command.size();
+		argv.push_back(command.substr(start, end - start));
+		start = end;
+	}
+}
+
+int RunCommand(const std::vector<std::string> &argv)
+{
+	Subprocess process;
+	if (! process.start(argv))
+		return -1;
+	return process.wait();
+}
+
+int JobScheduler::add(const std::vector<std::string> &argv)
+{
+	jobs.push_back(Job());
+	jobs.back().argv = argv;
+	jobs.back().status = -1;
+	return jobs.size() - 1;
+}
+
+void *JobScheduler::RunThread(void *arg)
+{
+	((JobScheduler *)arg)->run();
+	return NULL;
+}
+
+void JobScheduler::start()
+{
+	if (jobs.empty())
+		return;
+	if (pthread_create(&thread, NULL, RunThread, this) == 0)
+		thread_started = true;
+	else
+		run();
+}
+
+void JobScheduler::wait()
+{
+	if (thread_started) {
+		pthread_join(thread, NULL);
+		thread_started = false;
+	}
+}
+
+void JobScheduler::run()
+{
+	size_t next_job = 0;
+	std::vector<int> running;
+	std::vector<struct pollfd> polled;
+	while (true) {
+		while (((int)running.size() < max_running) && (next_job < jobs.size())) {
+			Job &job = jobs[next_job];
+			if (job.process.start(job.argv, false, true))
+				running.push_back(next_job);
+			next_job++;
+		}
+		if (running.empty())
+			break;
+		
+		// A program is finished when its error output is closed
+		polled.resize(running.size());
+		for (size_t i = 0; i < running.size(); i++) {
+			polled[i].fd = jobs[running[i]].process.getErrors();
+			polled[i].events = POLLIN;
+			polled[i].revents = 0;
+		}
+		if (poll(polled.data(), polled.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int i = running.size() - 1; i >= 0; i--) {
+			if (polled[i].revents == 0)
+				continue;
+			Job &job = jobs[running[i]];
+			char buffer[4096];
+			ssize_t count = read(polled[i].fd, buffer, sizeof(buffer));
+			if (count > 0)
+				job.errors.append(buffer, count);
+			else if ((count == 0) || (errno != EINTR)) {
+				job.status = job.process.wait();
+				running.erase(running.begin() + i);
+			}
+		}
+	}
+	// Only reached with running programs if poll fails
+	for (size_t i = 0; i < running.size(); i++)
+		jobs[running[i]].status = jobs[running[i]].process.wait();
+}
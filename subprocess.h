@@ -0,0 +1,91 @@
+#ifndef _SUBPROCESS_H
+#define _SUBPROCESS_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+/**
+ * Program started with posix_spawnp, without a shell in between
+ */
+class Subprocess {
+private:
+	pid_t pid;
+	FILE *input;
+	int errors;
+public:
+	Subprocess() : pid(-1), input(NULL), errors(-1) {}
+
+	/**
+	 * argv[0] is looked up in PATH. With pipe_input the child's standard
+	 * input is a pipe written through getInput(), with pipe_errors its
+	 * standard error is a pipe read from getErrors(). Returns false if
+	 * the program could not be started.
+	 */
+	bool start(const std::vector<std::string> &argv, bool pipe_input = false,
+		bool pipe_errors = false);
+	FILE *getInput() {return input;}
+	int getErrors() {return errors;}
+	/**
+	 * Close the pipes and wait for the program to finish.
+	 * Returns its exit code, -1 if it was killed or never started.
+	 */
+	int wait();
+};
+
+/**
+ * Programs run in a background thread, at most a given number at once.
+ * The error output of each is kept apart to be shown after it finishes.
+ */
+class JobScheduler {
+private:
+	struct Job {
+		std::vector<std::string> argv;
+		Subprocess process;
+		std::string errors;
+		int status;
+	};
+	std::vector<Job> jobs;
+	int max_running;
+	pthread_t thread;
+	bool thread_started;
+	
+	static void *RunThread(void *arg);
+	void run();
+public:
+	JobScheduler(int _max_running) : max_running(_max_running),
+		thread_started(false) {}
+	
+	/**
+	 * Queue a program before start(), returns its job number
+	 */
+	int add(const std::vector<std::string> &argv);
+	/**
+	 * Start running the queued programs, returns immediately
+	 */
+	void start();
+	/**
+	 * Wait for all the programs to finish
+	 */
+	void wait();
+	
+	/**
+	 * Exit code of a finished job, as Subprocess::wait()
+	 */
+	int getStatus(int job) {return jobs[job].status;}
+	const std::string &getErrors(int job) {return jobs[job].errors;}
+};
+
+/**
+ * Split a command given as one string, such as a -C argument, at white space
+ */
+void SplitCommand(const std::string &command, std::vector<std::string> &argv);
+
+/**
+ * Start the program and wait for it, returns the exit code as wait()
+ */
+int RunCommand(const std::vector<std::string> &argv);
+
+#endif
@@ -0,0 +1,104 @@
+#include "symbols.h"
+#include <deque>
+#include <vector>
+#include <string.h>
+
+/**
+ * Open addressing hash table of symbols, each slot holds the symbol
+ * or NO_SYMBOL if empty
+ */
+class SymbolTable {
+private:
+	enum {INITIAL_HASH_SIZE = 1024};
+	
+	std::deque<std::string> names;
+	std::vector<uint32_t> hashes;
+	std::vector<Symbol> slots;
+	
+	static uint32_t hashString(const char *s, size_t length)
+	{
+		// FNV-1a
+		uint32_t hash = 2166136261U;
+		for (size_t i = 0; i < length; i++) {
+			hash ^= (unsigned char)s[i];
+			hash *= 16777619U;
+		}
+		return hash;
+	}
+	
+	size_t findSlot(const char *s, size_t length, uint32_t hash) const
+	{
+		size_t mask = slots.size() - 1;
+		size_t slot = hash & mask;
+		while (slots[slot] != NO_SYMBOL) {
+			const std::string &name = names[slots[slot]];
+			if ((hashes[slots[slot]] == hash) && (name.size() == length) &&
+					(memcmp(name.data(), s, length) == 0))
+				break;
+			slot = (slot + 1) & mask;
+		}
+		return slot;
+	}
+	
+	void grow()
+	{
+		std::vector<Symbol> old_slots(slots.size() * 2, NO_SYMBOL);
+		old_slots.swap(slots);
+		size_t mask = slots.size() - 1;
+		for (size_t i = 0; i < old_slots.size(); i++)
+			if (old_slots[i] != NO_SYMBOL) {
+				size_t slot = hashes[old_slots[i]] & mask;
+				while (slots[slot] != NO_SYMBOL)
+					slot = (slot + 1) & mask;
+				slots[slot] = old_slots[i];
+			}
+	}
+public:
+	SymbolTable() : slots(INITIAL_HASH_SIZE, NO_SYMBOL)
+	{
+		names.push_back("");
+		hashes.push_back(0);
+	}
+	
+	Symbol intern(const char *s, size_t length)
+	{
+		if (length == 0)
+			return NO_SYMBOL;
+		uint32_t hash = hashString(s, length);
+		size_t slot = findSlot(s, length, hash);
+		if (slots[slot] != NO_SYMBOL)
+			return slots[slot];
+		// Keep at most half of the table used
+		if (2 * names.size() > slots.size()) {
+			grow();
+			slot = findSlot(s, length, hash);
+		}
+		Symbol symbol = names.size();
+		names.push_back(std::string(s, length));
+		hashes.push_back(hash);
+		slots[slot] = symbol;
+		return symbol;
+	}
+	
+	const std::string &getName(Symbol symbol) const
+	{
+		return names[symbol];
+	}
+};
+
+static SymbolTable table;
+
+Symbol Intern(const char *s, size_t length)
+{
+	return table.intern(s, length);
+}
+
+Symbol Intern(const std::string &s)
+{
+	return table.intern(s.data(), s.size());
+}
+
+const std::string &SymbolName(Symbol symbol)
+{
+	return table.getName(symbol);
+}
@@ -0,0 +1,28 @@
+#ifndef _SYMBOLS_H
+#define _SYMBOLS_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Identifier or string literal stored once for the whole compilation,
+ * equal symbols mean equal strings. The empty string is NO_SYMBOL.
+ */
+typedef uint32_t Symbol;
+
+enum {NO_SYMBOL = 0};
+
+/**
+ * Symbol of the string, adding it to the table if it's new.
+ * Used by the front end only, not safe for several threads.
+ */
+Symbol Intern(const char *s, size_t length);
+Symbol Intern(const std::string &s);
+
+/**
+ * The string stays where it is for the rest of the compilation
+ */
+const std::string &SymbolName(Symbol symbol);
+
+#endif
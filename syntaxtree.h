@@ -2,6 +2,8 @@
 #define _SYNTAXTREE_H
 
 #define YYSTYPE_IS_DECLARED
+// A pointer, so that the parser may reallocate its stack
+#define YYSTYPE_IS_TRIVIAL 1
 namespace Syntax {
 	class Node;
 	typedef Node *Tree;
@@ -11,6 +13,7 @@ typedef Syntax::Tree YYSTYPE;
 
 #include <errormsg.h>
 #include <idmap.h>
+#include <symbols.h>
 
 #include <string>
 #include <list>
@@ -64,16 +67,20 @@ public:
 
 class Identifier: public Node {
 public:
-	std::string name;
+	Symbol symbol;
+	const std::string &name;
 	
-	Identifier(const char *_name) : Node(IDENTIFIER), name(_name) {}
+	Identifier(Symbol _symbol) : Node(IDENTIFIER), symbol(_symbol),
+		name(SymbolName(_symbol)) {}
 };
 
 class StringValue: public Node {
 public:
-	std::string value;
+	Symbol symbol;
+	const std::string &value;
 	
-	StringValue(const std::string &_value = "") : Node(STRINGVALUE), value(_value) {}
+	StringValue(Symbol _symbol) : Node(STRINGVALUE), symbol(_symbol),
+		value(SymbolName(_symbol)) {}
 };
 
 class BinaryOp: public Node {
@@ -110,9 +117,9 @@ public:
 	std::list<Tree> expressions;
 	
 	ExpressionList() : Node(EXPRESSIONLIST) {}
-	void prepend(Tree expression)
+	void append(Tree expression)
 	{
-		expressions.push_front(expression);
+		expressions.push_back(expression);
 	}
 };
 
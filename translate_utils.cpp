@@ -1,5 +1,6 @@
 #include "translate_utils.h"
 #include "layeredmap.h"
+#include <algorithm>
 
 namespace IR {
 	
@@ -96,7 +97,7 @@ void VariablesAccessInfo::handleCall(Syntax::Tree function_exp,
 	if (function_exp->type != Syntax::IDENTIFIER)
 		return;
 	VarAccessDefInfo *callee_info = (VarAccessDefInfo *)impl->variable_names.
-		lookup(((Syntax::Identifier *)function_exp)->name);
+		lookup(((Syntax::Identifier *)function_exp)->symbol);
 		
 	if (callee_info == NULL)
 		return;
@@ -113,7 +114,7 @@ void VariablesAccessInfo::handleCall(Syntax::Tree function_exp,
 
 
 void VariablesAccessInfo::processDeclaration(Syntax::Tree declaration,
-	ObjectId current_function_id)
+	ObjectId current_function_id, std::vector<PendingNode> &pending)
 {
 	switch (declaration->type) {
 		case Syntax::TYPEDECLARATION:
@@ -122,7 +123,7 @@ void VariablesAccessInfo::processDeclaration(Syntax::Tree declaration,
 			impl->variables.push_back(VarAccessDefInfo(
 				((Syntax::VariableDeclaration *)declaration)->id,
 				current_function_id, false));
-			impl->variable_names.add(((Syntax::VariableDeclaration *)declaration)->name->name,
+			impl->variable_names.add(((Syntax::VariableDeclaration *)declaration)->name->symbol,
 				&(impl->variables.back()));
 			break;
 		case Syntax::FUNCTION: {
@@ -139,7 +140,7 @@ void VariablesAccessInfo::processDeclaration(Syntax::Tree declaration,
 				our_info->func_exports_parent_fp_to_children = true;
 			}
 			
-			impl->variable_names.add(func_declaration->name->name,
+			impl->variable_names.add(func_declaration->name->symbol,
 				&(impl->functions.back()));
 			impl->var_info.add(func_declaration->id, &(impl->functions.back()));
 			
@@ -152,13 +153,14 @@ void VariablesAccessInfo::processDeclaration(Syntax::Tree declaration,
 					impl->variables.push_back(VarAccessDefInfo(
 						((Syntax::ParameterDeclaration *) *param)->id,
 						func_declaration->id, false));
-					impl->variable_names.add(((Syntax::VariableDeclaration *) *param)->name->name,
+					impl->variable_names.add(((Syntax::VariableDeclaration *) *param)->name->symbol,
 						&(impl->variables.back()));
 				}
 				func_stack.push_back(func_declaration->id);
-				processExpression(func_declaration->body, func_declaration->id);
-				func_stack.pop_back();
-				impl->variable_names.removeLastLayer();
+				pending.push_back(PendingNode(PendingNode::EXPRESSION,
+					func_declaration->body, func_declaration->id));
+				pending.push_back(PendingNode(PendingNode::LEAVE_FUNCTION,
+					declaration, current_function_id));
 			}
 			break;
 		}
@@ -168,12 +170,12 @@ void VariablesAccessInfo::processDeclaration(Syntax::Tree declaration,
 }
 
 void VariablesAccessInfo::processExpression(Syntax::Tree expression,
-	ObjectId current_function_id)
+	ObjectId current_function_id, std::vector<PendingNode> &pending)
 {
 	switch (expression->type) {
 		case Syntax::IDENTIFIER: {
 			VarAccessDefInfo *variable = (VarAccessDefInfo *)impl->variable_names.
-				lookup(((Syntax::Identifier *)expression)->name);
+				lookup(((Syntax::Identifier *)expression)->symbol);
 			if ((variable != NULL) && (! variable->is_function) &&
 					(variable->owner_func_id != current_function_id)) {
 				impl->var_info.add(variable->object_id, variable);
@@ -198,46 +200,63 @@ void VariablesAccessInfo::processExpression(Syntax::Tree expression,
 		case Syntax::BREAK:
 			break;
 		case Syntax::BINARYOP:
-			processExpression(((Syntax::BinaryOp *)expression)->left, current_function_id);
-			processExpression(((Syntax::BinaryOp *)expression)->right, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::BinaryOp *)expression)->left, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::BinaryOp *)expression)->right, current_function_id));
 			break;
 		case Syntax::SEQUENCE: {
 			for (std::list<Syntax::Tree>::iterator child =
 					((Syntax::Sequence *)expression)->content->expressions.begin();
 					child != ((Syntax::Sequence *)expression)->content->expressions.end();
 					child++)
-				processExpression(*child, current_function_id);
+				pending.push_back(PendingNode(PendingNode::EXPRESSION,
+					*child, current_function_id));
 			break;
 		}
 		case Syntax::ARRAYINDEXING:
-			processExpression(((Syntax::ArrayIndexing *)expression)->array, current_function_id);
-			processExpression(((Syntax::ArrayIndexing *)expression)->index, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::ArrayIndexing *)expression)->array, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::ArrayIndexing *)expression)->index, current_function_id));
 			break;
 		case Syntax::ARRAYINSTANTIATION:
-			processExpression(((Syntax::ArrayInstantiation *)expression)->arraydef->index, current_function_id);
-			processExpression(((Syntax::ArrayInstantiation *)expression)->value, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::ArrayInstantiation *)expression)->arraydef->index, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::ArrayInstantiation *)expression)->value, current_function_id));
 			break;
 		case Syntax::IF:
-			processExpression(((Syntax::If *)expression)->condition, current_function_id);
-			processExpression(((Syntax::If *)expression)->action, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::If *)expression)->condition, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::If *)expression)->action, current_function_id));
 			break;
 		case Syntax::IFELSE:
-			processExpression(((Syntax::IfElse *)expression)->condition, current_function_id);
-			processExpression(((Syntax::IfElse *)expression)->action, current_function_id);
-			processExpression(((Syntax::IfElse *)expression)->elseaction, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::IfElse *)expression)->condition, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::IfElse *)expression)->action, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::IfElse *)expression)->elseaction, current_function_id));
 			break;
 		case Syntax::WHILE:
-			processExpression(((Syntax::While *)expression)->condition, current_function_id);
-			processExpression(((Syntax::While *)expression)->action, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::While *)expression)->condition, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::While *)expression)->action, current_function_id));
 			break;
 		case Syntax::FOR:
 			impl->variables.push_back(VarAccessDefInfo(
 				((Syntax::For *)expression)->variable_id, current_function_id, false));
-			impl->variable_names.add(((Syntax::For *)expression)->variable->name,
+			impl->variable_names.add(((Syntax::For *)expression)->variable->symbol,
 				&(impl->variables.back()));
-			processExpression(((Syntax::For *)expression)->start, current_function_id);
-			processExpression(((Syntax::For *)expression)->stop, current_function_id);
-			processExpression(((Syntax::For *)expression)->action, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::For *)expression)->start, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::For *)expression)->stop, current_function_id));
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::For *)expression)->action, current_function_id));
 			break;
 		case Syntax::SCOPE: {
 			impl->variable_names.newLayer();
@@ -245,26 +264,33 @@ void VariablesAccessInfo::processExpression(Syntax::Tree expression,
 					((Syntax::Scope *)expression)->declarations->expressions.begin();
 					declaration != ((Syntax::Scope *)expression)->declarations->expressions.end();
 					declaration++)
-				processDeclaration(*declaration, current_function_id);
+				pending.push_back(PendingNode(PendingNode::DECLARATION,
+					*declaration, current_function_id));
 			for (std::list<Syntax::Tree>::iterator body_expression =
 					((Syntax::Scope *)expression)->action->expressions.begin();
 					body_expression != ((Syntax::Scope *)expression)->action->expressions.end();
 					body_expression++)
-				processExpression(*body_expression, current_function_id);
-			impl->variable_names.removeLastLayer();
+				pending.push_back(PendingNode(PendingNode::EXPRESSION,
+					*body_expression, current_function_id));
+			pending.push_back(PendingNode(PendingNode::LEAVE_SCOPE,
+				expression, current_function_id));
 			break;
 		}
 		case Syntax::RECORDFIELD:
-			processExpression(((Syntax::RecordField *)expression)->record, current_function_id);
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::RecordField *)expression)->record, current_function_id));
 			break;
 		case Syntax::FUNCTIONCALL:
-			processExpression(((Syntax::FunctionCall *)expression)->function, current_function_id);
-			handleCall(((Syntax::FunctionCall *)expression)->function, current_function_id); 
+			pending.push_back(PendingNode(PendingNode::EXPRESSION,
+				((Syntax::FunctionCall *)expression)->function, current_function_id));
+			pending.push_back(PendingNode(PendingNode::CALL,
+				((Syntax::FunctionCall *)expression)->function, current_function_id));
 			for (std::list<Syntax::Tree>::iterator child =
 					((Syntax::FunctionCall *)expression)->arguments->expressions.begin();
 					child != ((Syntax::FunctionCall *)expression)->arguments->expressions.end();
 					child++)
-				processExpression(*child, current_function_id);
+				pending.push_back(PendingNode(PendingNode::EXPRESSION,
+					*child, current_function_id));
 			break;
 		case Syntax::RECORDINSTANTIATION: {
 			for (std::list<Syntax::Tree>::iterator field_def =
@@ -274,7 +300,8 @@ void VariablesAccessInfo::processExpression(Syntax::Tree expression,
 				assert((*field_def)->type == Syntax::BINARYOP);
 				Syntax::BinaryOp *fieldvalue = (Syntax::BinaryOp *) *field_def;
 				assert(fieldvalue->operation == SYM_ASSIGN);
-				processExpression(fieldvalue->right, current_function_id);
+				pending.push_back(PendingNode(PendingNode::EXPRESSION,
+					fieldvalue->right, current_function_id));
 			}
 			break;
 		}
@@ -283,6 +310,53 @@ void VariablesAccessInfo::processExpression(Syntax::Tree expression,
 	}
 }
 
+void VariablesAccessInfo::process(std::vector<PendingNode> &pending)
+{
+	// The stack is explicit since the program may be nested deeper than
+	// the C++ stack allows recursion
+	while (! pending.empty()) {
+		PendingNode node = pending.back();
+		pending.pop_back();
+		size_t first_child = pending.size();
+		switch (node.kind) {
+			case PendingNode::EXPRESSION:
+				processExpression(node.tree, node.current_function_id, pending);
+				break;
+			case PendingNode::DECLARATION:
+				processDeclaration(node.tree, node.current_function_id, pending);
+				break;
+			case PendingNode::CALL:
+				handleCall(node.tree, node.current_function_id);
+				break;
+			case PendingNode::LEAVE_FUNCTION:
+				func_stack.pop_back();
+				impl->variable_names.removeLastLayer();
+				break;
+			case PendingNode::LEAVE_SCOPE:
+				impl->variable_names.removeLastLayer();
+				break;
+		}
+		// The first child is to be looked into first, so it goes on top
+		std::reverse(pending.begin() + first_child, pending.end());
+	}
+}
+
+void VariablesAccessInfo::processDeclaration(Syntax::Tree declaration,
+	ObjectId current_function_id)
+{
+	std::vector<PendingNode> pending(1, PendingNode(PendingNode::DECLARATION,
+		declaration, current_function_id));
+	process(pending);
+}
+
+void VariablesAccessInfo::processExpression(Syntax::Tree expression,
+	ObjectId current_function_id)
+{
+	std::vector<PendingNode> pending(1, PendingNode(PendingNode::EXPRESSION,
+		expression, current_function_id));
+	process(pending);
+}
+
 bool VariablesAccessInfo::isAccessedByAddress(Syntax::Tree definition)
 {
 	int id;
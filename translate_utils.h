@@ -158,7 +158,29 @@ private:
 	VariablesAccessInfoPrivate *impl;
 	std::list<int> func_stack;
 	
+	/**
+	 * Syntax tree node to look into, or what to do after a function body
+	 * or scope has been looked into
+	 */
+	struct PendingNode {
+		enum Kind {EXPRESSION, DECLARATION, CALL, LEAVE_FUNCTION, LEAVE_SCOPE};
+		Kind kind;
+		Syntax::Tree tree;
+		ObjectId current_function_id;
+		
+		PendingNode(Kind _kind, Syntax::Tree _tree, ObjectId _current_function_id) :
+			kind(_kind), tree(_tree), current_function_id(_current_function_id) {}
+	};
+	
 	void handleCall(Syntax::Tree function_exp, ObjectId current_function_id);
+	/**
+	 * Look into the node, leaving its children in pending
+	 */
+	void processExpression(Syntax::Tree expression, ObjectId current_function_id,
+		std::vector<PendingNode> &pending);
+	void processDeclaration(Syntax::Tree declaration, ObjectId current_function_id,
+		std::vector<PendingNode> &pending);
+	void process(std::vector<PendingNode> &pending);
 public:
 	VariablesAccessInfo();
 	~VariablesAccessInfo();
@@ -8,6 +8,7 @@
 #include <set>
 #include <string.h>
 #include <map>
+#include <deque>
 
 namespace Semantic {
 
@@ -46,68 +47,126 @@ private:
 	LayeredMap func_and_var_names;
 	TypesEnvironment *type_environment;
 	Variable *undefined_variable;
-	typedef std::map<std::string, IR::Blob *> BlobsMap;
+	typedef std::map<Symbol, IR::Blob *> BlobsMap;
 	BlobsMap blobs_by_string;
 	
-	Function *getmem_func, *getmem_fill_func, *strcmp_func;
+	Function *getmem_func, *getmem_fill_func, *strcmp_func, *concat_func;
+	
+	/**
+	 * Expression waiting for its children to be translated. The translation
+	 * of each kind of expression goes through stages, one per child.
+	 */
+	struct PendingTranslation {
+		Syntax::Tree expression;
+		IR::Code **translated;
+		Type **type;
+		IR::Label *last_loop_exit;
+		IR::AbstractFrame *currentFrame;
+		bool expect_comparison;
+		int stage;
+		
+		/**
+		 * Translated children
+		 */
+		IR::Code *code[3];
+		Type *child_type[3];
+		/**
+		 * Next child out of a list: sequence item, declaration, argument
+		 * or field value
+		 */
+		std::list<Syntax::Tree>::iterator item;
+		bool item_translated;
+		IR::StatementSequence *sequence;
+		IR::Expression *last_expression;
+		IR::Label *exit_label;
+		Variable *loopvar;
+		/**
+		 * Type expected from the child being translated
+		 */
+		Type *expected_type;
+		Function *function;
+		std::list<FunctionArgument>::iterator function_arg;
+		bool already_too_many;
+		std::list<IR::Code *> arguments_code;
+		RecordType::FieldsList::iterator record_field;
+		IR::VirtualRegister *record_address;
+		std::list<Variable *> new_vars;
+		std::list<Function *> recent_functions;
+		std::list<Function *>::iterator function_body;
+		Arena *outer_arena;
+		/**
+		 * If-else standing for & or |, owned by the translation
+		 */
+		Syntax::IfElse *replacement;
+		Syntax::IntValue *constant;
+		
+		PendingTranslation(Syntax::Tree _expression, IR::Code **_translated,
+			Type **_type, IR::Label *_last_loop_exit,
+			IR::AbstractFrame *_currentFrame, bool _expect_comparison) :
+			expression(_expression), translated(_translated), type(_type),
+			last_loop_exit(_last_loop_exit), currentFrame(_currentFrame),
+			expect_comparison(_expect_comparison), stage(0),
+			item_translated(false), sequence(NULL), last_expression(NULL),
+			exit_label(NULL), loopvar(NULL), expected_type(NULL),
+			function(NULL), already_too_many(false), record_address(NULL),
+			outer_arena(NULL), replacement(NULL), constant(NULL)
+		{
+			code[0] = code[1] = code[2] = NULL;
+			child_type[0] = child_type[1] = child_type[2] = NULL;
+		}
+	};
+	std::deque<PendingTranslation> pending_translations;
 	
 	void newLayer();
 	void removeLastLayer();
-	void processDeclarations(Syntax::ExpressionList *declarations,
-		IR::AbstractFrame *currentFrame, std::list<Variable *> &new_vars);
 	Declaration *findVariableOrFunction(Syntax::Identifier *id);
 
 	void processVariableDeclaration(Syntax::VariableDeclaration *declaration,
+		Type *vartype, IR::Code *translatedValue, Type *exprtype,
 		IR::AbstractFrame *currentFrame, std::list<Variable *> &new_vars);
 	void processFunctionDeclarationBatch(std::list<Syntax::Tree>::iterator begin,
-		std::list<Syntax::Tree>::iterator end, IR::AbstractFrame *currentFrame);
+		std::list<Syntax::Tree>::iterator end, IR::AbstractFrame *currentFrame,
+		std::list<Function *> &recent_functions);
 	void prependPrologue(IR::Code *&translated,
 		IR::AbstractFrame *func_frame);
 	
+	void translateChild(Syntax::Tree expression, IR::Code **translated,
+		Type **type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame,
+		bool expect_comparison);
 	void translateIntValue(int value, IR::Code *&translated);
+	IR::Blob *getStringBlob(Symbol symbol);
+	const IR::Blob *findStringBlob(IR::Code *code);
 	void translateStringValue(Syntax::StringValue *expression, IR::Code *&translated);
 	void translateIdentifier(Syntax::Identifier *expression, IR::Code *&translated,
 		Type *&type, IR::AbstractFrame *currentFrame);
 	Type *getOpResultType(Type *leftType, Type *rightType,
 		Syntax::BinaryOp *expression);
-	void translateBinaryOperation(Syntax::BinaryOp *expression,
-		IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-		IR::AbstractFrame *currentFrame);
-	void translateSequence(const std::list<Syntax::Tree> &expressions,
-		IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-		IR::AbstractFrame *currentFrame, IR::StatementSequence *existing_sequence = NULL);
-	void translateArrayIndexing(Syntax::ArrayIndexing *expression,
-		IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-		IR::AbstractFrame *currentFrame);
-	void translateArrayInstantiation(Syntax::ArrayInstantiation *expression,
-		IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-		IR::AbstractFrame *currentFrame);
+	void translateBinaryOperation(PendingTranslation &node);
+	bool translateSequenceItems(PendingTranslation &node,
+		std::list<Syntax::Tree> &expressions, IR::Label *last_loop_exit);
+	void finishSequence(PendingTranslation &node);
+	void translateSequence(PendingTranslation &node);
+	void translateArrayIndexing(PendingTranslation &node);
+	void translateArrayInstantiation(PendingTranslation &node);
 	bool translateIf_IfElse_Then(Syntax::IfElse *condition,
 		Syntax::Tree action, IR::Code *&translated,
 		IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
 	bool translateIf_IfElse_ThenElse(Syntax::IfElse *condition,
 		Syntax::Tree action, Syntax::Tree elseaction, IR::Code *&translated,
 		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
-	void translateIf(Syntax::If *expression, IR::Code *&translated,
-		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
-	void translateIfElse(Syntax::IfElse *expression, IR::Code *&translated,
-		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame,
+	void translateIf(PendingTranslation &node);
+	void translateIfElse(PendingTranslation &node, Syntax::IfElse *expression,
 		bool expect_comparison_in_actions);
-	void translateWhile(Syntax::While *expression, IR::Code *&translated,
-		Type *&type, IR::AbstractFrame *currentFrame);
-	void translateFor(Syntax::For *expression, IR::Code *&translated,
-		Type *&type, IR::AbstractFrame *currentFrame);
+	void translateWhile(PendingTranslation &node);
+	void translateFor(PendingTranslation &node);
 	void translateBreak(IR::Code *&translated, IR::Label *loop_exit);
-	void translateScope(Syntax::Scope *expression, IR::Code *&translated,
-		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
-	void translateRecordField(Syntax::RecordField *expression, IR::Code *&translated,
-		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
+	void translateScope(PendingTranslation &node);
+	void translateRecordField(PendingTranslation &node);
 	void makeCallCode(Function *function, std::list<IR::Code *>arguments,
 		IR::Code *&result, IR::AbstractFrame *currentFrame);
-	void translateFunctionCall(Syntax::FunctionCall *expression, IR::Code *&translated,
-		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
-	void translateRecordInstantiation(Syntax::RecordInstantiation *expression, IR::Code *&translated,
-		Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame);
+	void translateFunctionCall(PendingTranslation &node);
+	void translateRecordInstantiation(PendingTranslation &node);
+	void translatePending(PendingTranslation &node);
 public:
 	IR::IREnvironment *IRenvironment;
 	IR::IRTransformer *IRtransformer;
@@ -143,19 +202,15 @@ TypesEnvironment::TypesEnvironment(IR::AbstractFrameManager *_framemanager)
 	types.push_back(void_type);
 	types.push_back(error_type);
 	
-	typenames.add("int", int_type);
-	typenames.add("string", string_type);
+	typenames.add(Intern("int"), int_type);
+	typenames.add(Intern("string"), string_type);
 }
 
 TypesEnvironment::~TypesEnvironment()
 {
-	delete int_type;
+	// The rest of the basic types are in the types list
 	delete looped_int;
-	delete string_type;
-	delete nil_type;
-	delete void_type;
-	delete error_type;
-	
+
 	for (std::list<Type*>::iterator i = types.begin(); i != types.end(); i++)
 		delete *i;
 }
@@ -180,7 +235,7 @@ Type *TypesEnvironment::createRecordType(Syntax::RecordTypeDefinition *definitio
 	     i != definition->fields->expressions.end(); i++) {
 		assert((*i)->type == Syntax::PARAMETERDECLARATION);
 		Syntax::ParameterDeclaration *param = (Syntax::ParameterDeclaration *)*i;
-		type->addField(param->name->name, getType(param->type,
+		type->addField(param->name->symbol, getType(param->type,
 			allow_forward_references));
 	}
 	
@@ -198,16 +253,16 @@ Type *TypesEnvironment::getType(Syntax::Tree definition,
 			return createRecordType((Syntax::RecordTypeDefinition *)definition,
 				allow_forward_references);
 		case Syntax::IDENTIFIER: {
-			std::string &identifier = ((Syntax::Identifier *)definition)->name;
-			Semantic::Type *type = (Semantic::Type *)typenames.lookup(identifier);
+			Syntax::Identifier *identifier = (Syntax::Identifier *)definition;
+			Semantic::Type *type = (Semantic::Type *)typenames.lookup(identifier->symbol);
 			if (type == NULL) {
 				if (! allow_forward_references) {
-					Error::error(std::string("Undefined type ") + ((Syntax::Identifier *)definition)->name);
+					Error::error(std::string("Undefined type ") + identifier->name);
 					return error_type;
 				}
-				type = new ForwardReferenceType(identifier, definition);
+				type = new ForwardReferenceType(identifier->name, definition);
 				unknown_types.push_back((ForwardReferenceType *)type);
-				typenames.add(identifier, type);
+				typenames.add(identifier->symbol, type);
 			}
 			return type;
 		}
@@ -222,26 +277,26 @@ void TypesEnvironment::processTypeDeclarationBatch(std::list<Syntax::Tree>::iter
 {
 	unknown_types.clear();
 	std::list<Type *> new_records;
-	std::set<std::string> types_in_the_batch;
+	std::set<Symbol> types_in_the_batch;
 	for (std::list<Syntax::Tree>::iterator i = begin; i != end; i++) {
 		assert((*i)->type == Syntax::TYPEDECLARATION);
 		Syntax::TypeDeclaration *declaration = (Syntax::TypeDeclaration *)*i;
-		if (types_in_the_batch.find(declaration->name->name) != types_in_the_batch.end())
+		if (types_in_the_batch.find(declaration->name->symbol) != types_in_the_batch.end())
 			Error::error("Type " + declaration->name->name +
 				"redefined in a same batch of consequtive types", declaration->name->linenumber);
-		types_in_the_batch.insert(declaration->name->name);
+		types_in_the_batch.insert(declaration->name->symbol);
 		Type *type = getType(declaration->definition, true);
 		assert(type != NULL);
 		if (type->basetype == TYPE_RECORD)
 			new_records.push_back(type);
-		Type *existing = (Type *)typenames.lookup_last_layer(declaration->name->name);
+		Type *existing = (Type *)typenames.lookup_last_layer(declaration->name->symbol);
 		if (existing != NULL) {
 			if ((existing->basetype == TYPE_NAMEREFERENCE) &&
 				(((ForwardReferenceType *)existing)->meaning == NULL)) {
 				((ForwardReferenceType *)existing)->meaning = type;
 			}
 		} else
-			typenames.add(declaration->name->name, type);
+			typenames.add(declaration->name->symbol, type);
 	}
 	
 	for (std::list<ForwardReferenceType *>::iterator t = unknown_types.begin();
@@ -300,65 +355,66 @@ TranslatorPrivate::TranslatorPrivate(IR::IREnvironment *ir_inv,
 	functions.push_back(Function("print", type_environment->getVoidType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__print"), false));
 	functions.back().addArgument("s", type_environment->getStringType(), NULL);
-	func_and_var_names.add("print", &(functions.back()));
+	func_and_var_names.add(Intern("print"), &(functions.back()));
 
 	functions.push_back(Function("flush", type_environment->getVoidType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__flush"), false));
-	func_and_var_names.add("flush", &(functions.back()));
+	func_and_var_names.add(Intern("flush"), &(functions.back()));
 
 	functions.push_back(Function("getchar", type_environment->getStringType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__getchar"), false));
-	func_and_var_names.add("getchar", &(functions.back()));
+	func_and_var_names.add(Intern("getchar"), &(functions.back()));
 
 	functions.push_back(Function("ord", type_environment->getIntType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__ord"), false));
 	functions.back().addArgument("s", type_environment->getStringType(), NULL);
-	func_and_var_names.add("ord", &(functions.back()));
+	func_and_var_names.add(Intern("ord"), &(functions.back()));
 
 	functions.push_back(Function("chr", type_environment->getStringType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__chr"), false));
 	functions.back().addArgument("i", type_environment->getIntType(), NULL);
-	func_and_var_names.add("chr", &(functions.back()));
+	func_and_var_names.add(Intern("chr"), &(functions.back()));
 
 	functions.push_back(Function("size", type_environment->getIntType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__size"), false));
 	functions.back().addArgument("s", type_environment->getStringType(), NULL);
-	func_and_var_names.add("size", &(functions.back()));
+	func_and_var_names.add(Intern("size"), &(functions.back()));
 
 	functions.push_back(Function("substring", type_environment->getStringType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__substring"), false));
 	functions.back().addArgument("s", type_environment->getStringType(), NULL);
 	functions.back().addArgument("first", type_environment->getIntType(), NULL);
 	functions.back().addArgument("n", type_environment->getIntType(), NULL);
-	func_and_var_names.add("substring", &(functions.back()));
+	func_and_var_names.add(Intern("substring"), &(functions.back()));
 
 	functions.push_back(Function("concat", type_environment->getStringType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__concat"), false));
 	functions.back().addArgument("s1", type_environment->getStringType(), NULL);
 	functions.back().addArgument("s2", type_environment->getStringType(), NULL);
-	func_and_var_names.add("concat", &(functions.back()));
+	func_and_var_names.add(Intern("concat"), &(functions.back()));
+	concat_func = &(functions.back());
 
 	functions.push_back(Function("not", type_environment->getIntType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__not"), false));
 	functions.back().addArgument("i", type_environment->getIntType(), NULL);
-	func_and_var_names.add("not", &(functions.back()));
+	func_and_var_names.add(Intern("not"), &(functions.back()));
 
 	functions.push_back(Function("exit", type_environment->getVoidType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("exit"), false));
 	functions.back().addArgument("i", type_environment->getIntType(), NULL);
-	func_and_var_names.add("exit", &(functions.back()));
+	func_and_var_names.add(Intern("exit"), &(functions.back()));
 
 	functions.push_back(Function("getmem", type_environment->getIntType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__getmem"), false));
 	functions.back().addArgument("size", type_environment->getIntType(), NULL);
-	//func_and_var_names.add("getmem", &(functions.back()));
+	//func_and_var_names.add(Intern("getmem"), &(functions.back()));
 	getmem_func = &(functions.back());
 
 	functions.push_back(Function("getmem_fill", type_environment->getIntType(),
 		NULL, NULL, framemanager->rootFrame(), IRenvironment->addLabel("__getmem_fill"), false));
 	functions.back().addArgument("elemcount", type_environment->getIntType(), NULL);
 	functions.back().addArgument("value", type_environment->getIntType(), NULL);
-	//func_and_var_names.add("getmem_fill", &(functions.back()));
+	//func_and_var_names.add(Intern("getmem_fill"), &(functions.back()));
 	getmem_fill_func = &(functions.back());
 
 	functions.push_back(Function("strcmp", type_environment->getIntType(),
@@ -375,7 +431,8 @@ TranslatorPrivate::~TranslatorPrivate()
 		 delete (*var).value;
 	for (std::list<Function>::iterator func = functions.begin();
 		 func != functions.end(); func++)
-		 delete (*func).body;
+		if ((*func).body != NULL)
+			IR::DestroyCode((*func).body);
 	delete undefined_variable->value;
 	delete undefined_variable;
 	delete type_environment;
@@ -440,19 +497,14 @@ bool CheckAssignmentTypes(Type *left, Type *right)
 	}
 }
 
+/**
+ * Declare the variable once its value is translated
+ */
 void TranslatorPrivate::processVariableDeclaration(
-	Syntax::VariableDeclaration *declaration, IR::AbstractFrame *currentFrame,
+	Syntax::VariableDeclaration *declaration, Type *vartype,
+	IR::Code *translatedValue, Type *exprtype, IR::AbstractFrame *currentFrame,
 	std::list<Variable *> &new_vars)
 {
-	Type *vartype;
-	if (declaration->type != NULL)
-		vartype = type_environment->getType(declaration->type, false)->resolve();
-	else
-		vartype = NULL;
-	Type *exprtype;
-	IR::Code *translatedValue;
-	translateExpression(declaration->value, translatedValue, exprtype, NULL,
-		currentFrame, true);
 	if (exprtype->basetype == TYPE_VOID) {
 		Error::error("Statement without value assigned to a variable",
 					 declaration->linenumber);
@@ -478,7 +530,7 @@ void TranslatorPrivate::processVariableDeclaration(
 		currentFrame->addVariable(declaration->name->name,
 			framemanager->getVarSize(vartype),
 			variables_extra_info.isAccessedByAddress(declaration))));
-	func_and_var_names.add(declaration->name->name, &(variables.back()));
+	func_and_var_names.add(declaration->name->symbol, &(variables.back()));
 	new_vars.push_back(&(variables.back()));
 }
 
@@ -513,19 +565,22 @@ void TranslatorPrivate::prependPrologue(IR::Code*& translated,
 }
 
 
+/**
+ * Declare the functions of the batch, their bodies are translated after
+ */
 void TranslatorPrivate::processFunctionDeclarationBatch(
 	std::list<Syntax::Tree>::iterator begin,
-	std::list<Syntax::Tree>::iterator end, IR::AbstractFrame *currentFrame)
+	std::list<Syntax::Tree>::iterator end, IR::AbstractFrame *currentFrame,
+	std::list<Function *> &recent_functions)
 {
-	std::list<Function *> recent_functions;
-	std::set<std::string> names_in_batch;
+	std::set<Symbol> names_in_batch;
 	for (std::list<Syntax::Tree>::iterator f = begin; f != end; f++) {
 		assert((*f)->type == Syntax::FUNCTION);
 		Syntax::Function *declaration = (Syntax::Function *) *f;
-		if (names_in_batch.find(declaration->name->name) != names_in_batch.end())
+		if (names_in_batch.find(declaration->name->symbol) != names_in_batch.end())
 			Error::error("Function " + declaration->name->name +
 				"redefined in a successive batch of functions", declaration->name->linenumber);
-		names_in_batch.insert(declaration->name->name);
+		names_in_batch.insert(declaration->name->symbol);
 		Type *return_type;
 		if (declaration->type == NULL)
 			return_type = type_environment->getVoidType();
@@ -542,6 +597,8 @@ void TranslatorPrivate::processFunctionDeclarationBatch(
 			framemanager->newFrame(currentFrame, function_label->getName()),
 			function_label, variables_extra_info.functionNeedsParentFp(declaration)));
 		Function *function = &(functions.back());
+		if (declaration->body != NULL)
+			function->node_arena = IRenvironment->newNodeArena();
 		debug("New frame %s, id %d", function->frame->getName().c_str(),
 				function->frame->getId());
 		if (variables_extra_info.functionNeedsParentFp(declaration))
@@ -554,7 +611,7 @@ void TranslatorPrivate::processFunctionDeclarationBatch(
 			function->name.c_str(), declaration->name->linenumber,
 			variables_extra_info.isFunctionParentFpAccessedByChildren(declaration)
 				? "yes" : "no");
-		func_and_var_names.add(declaration->name->name, function);
+		func_and_var_names.add(declaration->name->symbol, function);
 		recent_functions.push_back(function);
 		
 		for (std::list<Syntax::Tree>::iterator param =
@@ -573,63 +630,11 @@ void TranslatorPrivate::processFunctionDeclarationBatch(
 			);
 		}
 	}
-	for (std::list<Function *>::iterator fcn = recent_functions.begin();
-		 fcn != recent_functions.end(); fcn++) {
-		if ((*fcn)->raw_body == NULL)
-			continue;
-		
-		Type *actual_return_type;
-		func_and_var_names.newLayer();
-		for (std::list<FunctionArgument>::iterator param = (*fcn)->arguments.begin();
-				param != (*fcn)->arguments.end(); param++)
-			func_and_var_names.add((*param).name, &(*param));
-		translateExpression((*fcn)->raw_body, ((*fcn)->body), actual_return_type,
-			NULL, (*fcn)->frame, true);
-		func_and_var_names.removeLastLayer();
-		prependPrologue((*fcn)->body, (*fcn)->frame);
-		if (((*fcn)->return_type->basetype != TYPE_VOID) &&
-			! CheckAssignmentTypes((*fcn)->return_type, actual_return_type))
-			Error::error("Type of function body doesn't match specified return type",
-				(*fcn)->raw_body->linenumber);
-		else if (((*fcn)->return_type->basetype == TYPE_VOID) &&
-				(actual_return_type->basetype != TYPE_VOID) &&
-				(actual_return_type->basetype != TYPE_ERROR))
-			Error::error("Body of a function without return value produces a value",
-				(*fcn)->raw_body->linenumber);
-	}
-}
-
-void TranslatorPrivate::processDeclarations(
-	Syntax::ExpressionList *declarations, IR::AbstractFrame *currentFrame,
-	std::list<Variable *> &new_vars)
-{
-	std::list<Syntax::Tree>::iterator d = declarations->expressions.begin();
-	std::list<Syntax::Tree>::iterator end = declarations->expressions.end();
-	while (d != end) {
-		Syntax::Tree declaration = *d;
-		Syntax::NodeType dectype = declaration->type;
-		if (dectype == Syntax::VARDECLARATION) {
-			processVariableDeclaration((Syntax::VariableDeclaration *)declaration,
-				currentFrame, new_vars);
-			d++;
-		} else if ((dectype == Syntax::FUNCTION) || 
-			       (dectype == Syntax::TYPEDECLARATION)) {
-			std::list<Syntax::Tree>::iterator batch_begin = d;
-			while ((d != end) && ((*d)->type == dectype))
-				d++;
-			if (dectype == Syntax::FUNCTION) {
-				processFunctionDeclarationBatch(batch_begin, d, currentFrame);
-			} else {
-				type_environment->processTypeDeclarationBatch(batch_begin, d);
-			}
-		} else
-			Error::fatalError("Not a declaration inside declaration block", declaration->linenumber);
-	}
 }
 
 Declaration *TranslatorPrivate::findVariableOrFunction(Syntax::Identifier *id)
 {
-	Declaration *result = (Declaration *)func_and_var_names.lookup(id->name);
+	Declaration *result = (Declaration *)func_and_var_names.lookup(id->symbol);
 	if (result == NULL) {
 		Error::error("Undefined variable or function " + id->name, id->linenumber);
 		result = undefined_variable;
@@ -642,24 +647,39 @@ void TranslatorPrivate::translateIntValue(int value, IR::Code *&translated)
 	translated = new IR::ExpressionCode(new IR::IntegerExpression(value));
 }
 
+IR::Blob *TranslatorPrivate::getStringBlob(Symbol symbol)
+{
+	BlobsMap::iterator existing_blob = blobs_by_string.find(symbol);
+	if (existing_blob != blobs_by_string.end())
+		return (*existing_blob).second;
+	const std::string &value = SymbolName(symbol);
+	IR::Blob *blob = IRenvironment->addBlob();
+	int intsize = framemanager->getVarSize(type_environment->getIntType());
+	blob->data.resize(value.size() + intsize);
+	*((int *)blob->data.data()) = value.size();
+	memmove(blob->data.data() + intsize, value.c_str(), value.size());
+	blobs_by_string.insert(std::make_pair(symbol, blob));
+	return blob;
+}
+
 void TranslatorPrivate::translateStringValue(Syntax::StringValue *expression,
 	IR::Code *&translated)
 {
-	IR::Blob *blob;
-	BlobsMap::iterator existing_blob = blobs_by_string.find(expression->value);
-	if (existing_blob != blobs_by_string.end())
-		blob = (*existing_blob).second;
-	else {
-		blob = IRenvironment->addBlob();
-		int intsize = framemanager->getVarSize(type_environment->getIntType());
-		blob->data.resize(expression->value.size() + intsize);
-		*((int *)blob->data.data()) = expression->value.size();
-		memmove(blob->data.data() + intsize, expression->value.c_str(), 
-			expression->value.size());
-		blobs_by_string.insert(std::make_pair(expression->value, blob));
-	}
 	translated = new IR::ExpressionCode(new IR::LabelAddressExpression(
-		blob->label));
+		getStringBlob(expression->symbol)->label));
+}
+
+/**
+ * Blob of the string literal the code stands for, NULL if it is not one
+ */
+const IR::Blob *TranslatorPrivate::findStringBlob(IR::Code *code)
+{
+	if ((code->kind != IR::CODE_EXPRESSION) ||
+			(((IR::ExpressionCode *)code)->exp == NULL) ||
+			(((IR::ExpressionCode *)code)->exp->kind != IR::IR_LABELADDR))
+		return NULL;
+	return IRenvironment->findBlob(IR::ToLabelAddressExpression(
+		((IR::ExpressionCode *)code)->exp)->label);
 }
 
 IR::Code *ErrorPlaceholderCode()
@@ -671,7 +691,7 @@ void TranslatorPrivate::translateIdentifier(Syntax::Identifier *expression,
 	IR::Code *&translated, Type *&type, IR::AbstractFrame *currentFrame)
 {
 	Declaration *var_or_function = (Declaration *)func_and_var_names.lookup(
-		expression->name);
+		expression->symbol);
 	if (var_or_function == NULL) {
 		Error::error("Undeclared variable/function identifier", expression->linenumber);
 		type = type_environment->getErrorType();
@@ -794,30 +814,43 @@ IR::ComparisonOp getIRComparisonOp(yytokentype op_token)
 	}
 }
 
-void TranslatorPrivate::translateBinaryOperation(Syntax::BinaryOp *expression,
-	IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-	IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateBinaryOperation(PendingTranslation &node)
 {
+	Syntax::BinaryOp *expression = (Syntax::BinaryOp *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
 	if (expression->operation == SYM_AND) {
-		Syntax::IntValue zero(0);
-		Syntax::IfElse replacement(expression->left,
-			expression->right, &zero);
-		translateIfElse(&replacement, translated, type, last_loop_exit,
-			currentFrame, true);
+		if (node.replacement == NULL) {
+			node.constant = new Syntax::IntValue(0);
+			node.replacement = new Syntax::IfElse(expression->left,
+				expression->right, node.constant);
+		}
+		translateIfElse(node, node.replacement, true);
 		return;
 	} else if (expression->operation == SYM_OR) {
-		Syntax::IntValue one(1);
-		Syntax::IfElse replacement(expression->left,
-			&one, expression->right);
-		translateIfElse(&replacement, translated, type, last_loop_exit,
-			currentFrame, true);
+		if (node.replacement == NULL) {
+			node.constant = new Syntax::IntValue(1);
+			node.replacement = new Syntax::IfElse(expression->left,
+				node.constant, expression->right);
+		}
+		translateIfElse(node, node.replacement, true);
 		return;
 	}
 	
-	IR::Code *left, *right;
-	Type *leftType, *rightType;
-	translateExpression(expression->left, left, leftType, last_loop_exit, currentFrame, true);
-	translateExpression(expression->right, right, rightType, last_loop_exit, currentFrame, true);
+	switch (node.stage) {
+		case 0:
+			node.stage = 1;
+			translateChild(expression->left, &node.code[0], &node.child_type[0],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+		case 1:
+			node.stage = 2;
+			translateChild(expression->right, &node.code[1], &node.child_type[1],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+	}
+	IR::Code *left = node.code[0], *right = node.code[1];
+	Type *leftType = node.child_type[0], *rightType = node.child_type[1];
 	bool bullshit = false;
 	if (leftType->basetype == TYPE_VOID) {
 		Error::error("Statement without value used in expression",
@@ -859,7 +892,7 @@ void TranslatorPrivate::translateBinaryOperation(Syntax::BinaryOp *expression,
 				args.push_back(left);
 				args.push_back(right);
 				IR::Code *strcmp_call;
-				makeCallCode(strcmp_func, args, strcmp_call, currentFrame);
+				makeCallCode(strcmp_func, args, strcmp_call, node.currentFrame);
 				left_expr = IRenvironment->killCodeToExpression(strcmp_call);
 				right_expr = new IR::IntegerExpression(0);
 			} else {
@@ -888,48 +921,82 @@ void TranslatorPrivate::translateBinaryOperation(Syntax::BinaryOp *expression,
 	}
 }
 
-void TranslatorPrivate::translateSequence(const std::list<Syntax::Tree> &expressions,
-	IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-	IR::AbstractFrame *currentFrame, IR::StatementSequence *existing_sequence)
+/**
+ * Translate the next item of the sequence into node.sequence, returns true
+ * when there are no items left. Expects node.item at the first item, the
+ * type of the sequence is the type of its last item.
+ */
+bool TranslatorPrivate::translateSequenceItems(PendingTranslation &node,
+	std::list<Syntax::Tree> &expressions, IR::Label *last_loop_exit)
 {
-	type = type_environment->getVoidType();
-	IR::StatementSequence *sequence = existing_sequence;
-	if (sequence == NULL)
-		sequence = new IR::StatementSequence;
-	IR::Expression *last_expression = NULL;
-	for (std::list<Syntax::Tree>::const_iterator e = expressions.begin();
-			e != expressions.end();
-			e++) {
-		std::list<Syntax::Tree>::const_iterator next = e;
+	Type *&type = *node.type;
+	if (node.item_translated) {
+		std::list<Syntax::Tree>::iterator next = node.item;
 		next++;
-		IR::Code *item_code;
-		translateExpression(*e, item_code, type, last_loop_exit, currentFrame, false);
+		IR::Code *item_code = node.code[0];
 		if ((next != expressions.end()) || type->basetype == TYPE_VOID)
-			sequence->addStatement(IRenvironment->killCodeToStatement(item_code));
+			node.sequence->addStatement(IRenvironment->killCodeToStatement(item_code));
 		else
-			last_expression = IRenvironment->killCodeToExpression(item_code);
+			node.last_expression = IRenvironment->killCodeToExpression(item_code);
+		node.item = next;
+		node.item_translated = false;
 	}
-	if (last_expression == NULL)
-		translated = new IR::StatementCode(sequence);
+	if (node.item == expressions.end())
+		return true;
+	node.item_translated = true;
+	translateChild(*node.item, &node.code[0], node.type, last_loop_exit,
+		node.currentFrame, false);
+	return false;
+}
+
+void TranslatorPrivate::finishSequence(PendingTranslation &node)
+{
+	IR::Code *&translated = *node.translated;
+	if (node.last_expression == NULL)
+		translated = new IR::StatementCode(node.sequence);
 	else
-		if (! sequence->statements.empty())
+		if (! node.sequence->statements.empty())
 			translated = new IR::ExpressionCode(new IR::StatExpSequence(
-				sequence, last_expression));
+				node.sequence, node.last_expression));
 		else
-			translated = new IR::ExpressionCode(last_expression);
+			translated = new IR::ExpressionCode(node.last_expression);
 }
 
-void TranslatorPrivate::translateArrayIndexing(
-	Syntax::ArrayIndexing *expression,
-	IR::Code *&translated, Type *&type, IR::Label *last_loop_exit,
-	IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateSequence(PendingTranslation &node)
+{
+	std::list<Syntax::Tree> &expressions =
+		((Syntax::Sequence *)node.expression)->content->expressions;
+	if (node.stage == 0) {
+		node.stage = 1;
+		*node.type = type_environment->getVoidType();
+		node.sequence = new IR::StatementSequence;
+		node.item = expressions.begin();
+	}
+	if (translateSequenceItems(node, expressions, node.last_loop_exit))
+		finishSequence(node);
+}
+
+void TranslatorPrivate::translateArrayIndexing(PendingTranslation &node)
 {
-	IR::Code *array, *index;
-	Type *arrayType, *indexType;
-	translateExpression(expression->array, array, arrayType, last_loop_exit, currentFrame, true);
-	if (! IsArray(arrayType))
-		Error::error("Not an array got indexed", expression->array->linenumber);
-	translateExpression(expression->index, index, indexType, last_loop_exit, currentFrame, true);
+	Syntax::ArrayIndexing *expression = (Syntax::ArrayIndexing *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	switch (node.stage) {
+		case 0:
+			node.stage = 1;
+			translateChild(expression->array, &node.code[0], &node.child_type[0],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+		case 1:
+			if (! IsArray(node.child_type[0]))
+				Error::error("Not an array got indexed", expression->array->linenumber);
+			node.stage = 2;
+			translateChild(expression->index, &node.code[1], &node.child_type[1],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+	}
+	IR::Code *array = node.code[0], *index = node.code[1];
+	Type *arrayType = node.child_type[0], *indexType = node.child_type[1];
 	if (! IsInt(indexType))
 		Error::error("Index is not an integer", expression->index->linenumber);
 	if (arrayType->basetype == TYPE_ARRAY) {
@@ -939,44 +1006,56 @@ void TranslatorPrivate::translateArrayIndexing(
 			new IR::IntegerExpression(framemanager->getVarSize(type)));
 		IR::BinaryOpExpression *target_address = new IR::BinaryOpExpression(
 			IR::OP_PLUS, IRenvironment->killCodeToExpression(array), offset);
-		translated = new IR::ExpressionCode(new IR::MemoryExpression(target_address));
+		translated = new IR::ExpressionCode(new IR::MemoryExpression(
+			target_address, arrayType));
 	} else {
 		type = type_environment->getErrorType();
 		translated = ErrorPlaceholderCode();
 	}
 }
 
-void TranslatorPrivate::translateArrayInstantiation(
-	Syntax::ArrayInstantiation *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateArrayInstantiation(PendingTranslation &node)
 {
-	assert(expression->arrayIsSingleId());
-	type = type_environment->getType(expression->arraydef->array, false)->resolve();
-	Type *elem_type = NULL;
-	if (type == NULL) {
-		Error::error("Undefined type identifier in array instantiation",
-			expression->arraydef->array->linenumber);
-		type = type_environment->getErrorType();
-	} else {
-		if (type->basetype != TYPE_ARRAY) {
-			if (type->basetype != TYPE_ERROR)
-				Error::error("Not an array type in array instantiation",
+	Syntax::ArrayInstantiation *expression =
+		(Syntax::ArrayInstantiation *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	switch (node.stage) {
+		case 0: {
+			assert(expression->arrayIsSingleId());
+			type = type_environment->getType(expression->arraydef->array, false)->resolve();
+			Type *elem_type = NULL;
+			if (type == NULL) {
+				Error::error("Undefined type identifier in array instantiation",
 					expression->arraydef->array->linenumber);
-			type = type_environment->getErrorType();
-		} else {
-			elem_type = ((ArrayType *)type)->elemtype->resolve();
+				type = type_environment->getErrorType();
+			} else {
+				if (type->basetype != TYPE_ARRAY) {
+					if (type->basetype != TYPE_ERROR)
+						Error::error("Not an array type in array instantiation",
+							expression->arraydef->array->linenumber);
+					type = type_environment->getErrorType();
+				} else {
+					elem_type = ((ArrayType *)type)->elemtype->resolve();
+				}
+			}
+			node.expected_type = elem_type;
+			node.stage = 1;
+			translateChild(expression->arraydef->index, &node.code[0],
+				&node.child_type[0], node.last_loop_exit, node.currentFrame, true);
+			return;
 		}
+		case 1:
+			if (! IsInt(node.child_type[0]))
+				Error::error("Not an integer as array length", expression->arraydef->index->linenumber);
+			node.stage = 2;
+			translateChild(expression->value, &node.code[1], &node.child_type[1],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
 	}
-	IR::Code *length;
-	Type *lengthType;
-	translateExpression(expression->arraydef->index, length, lengthType, last_loop_exit,
-		currentFrame, true);
-	if (! IsInt(lengthType))
-		Error::error("Not an integer as array length", expression->arraydef->index->linenumber);
-
-	IR::Code *value;
-	Type *valueType;
-	translateExpression(expression->value, value, valueType, last_loop_exit, currentFrame, true);
+	Type *elem_type = node.expected_type;
+	IR::Code *length = node.code[0], *value = node.code[1];
+	Type *valueType = node.child_type[1];
 	if ((elem_type != NULL) && ! CheckAssignmentTypes(elem_type, valueType))
 		Error::error("Value type doesn't match array element type",
 			expression->value->linenumber);
@@ -985,7 +1064,7 @@ void TranslatorPrivate::translateArrayInstantiation(
 		std::list<IR::Code *> args;
 		args.push_back(length);
 		args.push_back(value);
-		makeCallCode(getmem_fill_func, args, translated, currentFrame);
+		makeCallCode(getmem_fill_func, args, translated, node.currentFrame);
 	} else
 		translated = ErrorPlaceholderCode();
 }
@@ -998,25 +1077,34 @@ bool TranslatorPrivate::translateIf_IfElse_Then(Syntax::IfElse *condition,
 	return false;
 }
 
-void TranslatorPrivate::translateIf(
-	Syntax::If *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateIf(PendingTranslation &node)
 {
-	type = type_environment->getVoidType();
-	if (expression->condition->type == Syntax::IFELSE) {
-		if (translateIf_IfElse_Then((Syntax::IfElse *)expression->condition,
-				expression->action, translated,
-				last_loop_exit, currentFrame))
+	Syntax::If *expression = (Syntax::If *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	switch (node.stage) {
+		case 0:
+			type = type_environment->getVoidType();
+			if (expression->condition->type == Syntax::IFELSE) {
+				if (translateIf_IfElse_Then((Syntax::IfElse *)expression->condition,
+						expression->action, translated,
+						node.last_loop_exit, node.currentFrame))
+					return;
+			}
+			node.stage = 1;
+			translateChild(expression->condition, &node.code[0], &node.child_type[0],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+		case 1:
+			if (! IsInt(node.child_type[0]))
+				Error::error("If condition not integer", expression->condition->linenumber);
+			node.stage = 2;
+			translateChild(expression->action, &node.code[1], &node.child_type[1],
+				node.last_loop_exit, node.currentFrame, false);
 			return;
 	}
-	Type *conditionType, *actionType;
-	IR::Code *condition, *action;
-	translateExpression(expression->condition, condition, conditionType, last_loop_exit,
-		currentFrame, true);
-	if (! IsInt(conditionType))
-		Error::error("If condition not integer", expression->condition->linenumber);
-	translateExpression(expression->action, action, actionType, last_loop_exit,
-		currentFrame, false);
+	IR::Code *condition = node.code[0], *action = node.code[1];
+	Type *conditionType = node.child_type[0], *actionType = node.child_type[1];
 	if ((actionType->basetype != TYPE_VOID) && (actionType->basetype != TYPE_ERROR))
 		Error::error("Body of if-then statement is not valueless", expression->action->linenumber);
 	
@@ -1045,31 +1133,44 @@ bool TranslatorPrivate::translateIf_IfElse_ThenElse(Syntax::IfElse *condition,
 	return false;
 }
 
-void TranslatorPrivate::translateIfElse(
-	Syntax::IfElse *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame,
-	bool expect_comparison_in_actions)
+void TranslatorPrivate::translateIfElse(PendingTranslation &node,
+	Syntax::IfElse *expression, bool expect_comparison_in_actions)
 {
-	if (expression->condition->type == Syntax::IFELSE) {
-		if (translateIf_IfElse_ThenElse((Syntax::IfElse *)expression->condition,
-				expression->action, expression->elseaction, translated, type,
-				last_loop_exit, currentFrame))
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	switch (node.stage) {
+		case 0:
+			if (expression->condition->type == Syntax::IFELSE) {
+				if (translateIf_IfElse_ThenElse((Syntax::IfElse *)expression->condition,
+						expression->action, expression->elseaction, translated, type,
+						node.last_loop_exit, node.currentFrame))
+					return;
+			}
+			node.stage = 1;
+			translateChild(expression->condition, &node.code[0], &node.child_type[0],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+		case 1:
+			if (! IsInt(node.child_type[0]))
+				Error::error("If condition not integer", expression->condition->linenumber);
+			node.stage = 2;
+			translateChild(expression->action, &node.code[1], &node.child_type[1],
+				node.last_loop_exit, node.currentFrame, expect_comparison_in_actions);
+			return;
+		case 2:
+			node.stage = 3;
+			translateChild(expression->elseaction, &node.code[2], &node.child_type[2],
+				node.last_loop_exit, node.currentFrame, expect_comparison_in_actions);
 			return;
 	}
-	Type *conditionType, *actionType, *elseType;
-	IR::Code *condition_code, *action_code, *elseaction_code;
-	translateExpression(expression->condition, condition_code, conditionType, last_loop_exit,
-		currentFrame, true);
-	if (! IsInt(conditionType))
-		Error::error("If condition not integer", expression->condition->linenumber);
-	translateExpression(expression->action, action_code, actionType, last_loop_exit,
-		currentFrame, expect_comparison_in_actions);
-	translateExpression(expression->elseaction, elseaction_code, elseType, last_loop_exit,
-		currentFrame, expect_comparison_in_actions);
+	Type *conditionType = node.child_type[0], *actionType = node.child_type[1],
+		*elseType = node.child_type[2];
+	IR::Code *condition_code = node.code[0], *action_code = node.code[1],
+		*elseaction_code = node.code[2];
 	if ((actionType->basetype == TYPE_VOID) && (elseType->basetype == TYPE_VOID) ||
 			CheckComparisonTypes(actionType, elseType)) {
 		if (conditionType->basetype == TYPE_ERROR)
-			actionType = type_environment->getErrorType();
+			type = type_environment->getErrorType();
 		else if (actionType->basetype == TYPE_NIL)
 			type = elseType;
 		else
@@ -1121,20 +1222,30 @@ void TranslatorPrivate::translateIfElse(
 	}
 }
 
-void TranslatorPrivate::translateWhile(
-	Syntax::While *expression, IR::Code *&translated,
-	Type *&type, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateWhile(PendingTranslation &node)
 {
-	type = type_environment->getVoidType();
-	Type *conditionType, *actionType;
-	IR::Code *condition, *action;
-	IR::Label *exit_label = IRenvironment->addLabel();
-	translateExpression(expression->condition, condition, conditionType, exit_label,
-		currentFrame, true);
-	if (! IsInt(conditionType))
-		Error::error("While condition not integer", expression->condition->linenumber);
-	translateExpression(expression->action, action, actionType, exit_label,
-		currentFrame, false);
+	Syntax::While *expression = (Syntax::While *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	switch (node.stage) {
+		case 0:
+			type = type_environment->getVoidType();
+			node.exit_label = IRenvironment->addLabel();
+			node.stage = 1;
+			translateChild(expression->condition, &node.code[0], &node.child_type[0],
+				node.exit_label, node.currentFrame, true);
+			return;
+		case 1:
+			if (! IsInt(node.child_type[0]))
+				Error::error("While condition not integer", expression->condition->linenumber);
+			node.stage = 2;
+			translateChild(expression->action, &node.code[1], &node.child_type[1],
+				node.exit_label, node.currentFrame, false);
+			return;
+	}
+	IR::Code *condition = node.code[0], *action = node.code[1];
+	Type *conditionType = node.child_type[0], *actionType = node.child_type[1];
+	IR::Label *exit_label = node.exit_label;
 	if ((actionType->basetype != TYPE_VOID) && (actionType->basetype != TYPE_ERROR))
 		Error::error("Body of while loop is not valueless", expression->action->linenumber);
 	if (conditionType->basetype == TYPE_INT) {
@@ -1159,38 +1270,54 @@ void TranslatorPrivate::translateWhile(
 		translated = ErrorPlaceholderCode();
 }
 
-void TranslatorPrivate::translateFor(
-	Syntax::For *expression, IR::Code *&translated,
-	Type *&type, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateFor(PendingTranslation &node)
 {
-	type = type_environment->getVoidType();
-	Type *from_type, *to_type, *actionType;
-	IR::Code *from_code, *to_code, *action_code;
-	IR::Label *exit_label = IRenvironment->addLabel();
-	translateExpression(expression->start, from_code, from_type, exit_label,
-		currentFrame, false);
-	if (! IsInt(from_type))
-		Error::error("For loop start not integer", expression->start->linenumber);
-	translateExpression(expression->stop, to_code, to_type, exit_label,
-		currentFrame, false);
-	if (! IsInt(to_type))
-		Error::error("For loop 'to' not integer", expression->stop->linenumber);
-	func_and_var_names.newLayer();
-// 	printf("Loop variable %s at line %d is %s by address\n",
-// 		expression->variable->name.c_str(),
-// 		expression->linenumber,
-// 		variables_extra_info.isAccessedByAddress(expression) ? "accessed" : "not accessed");
-	variables.push_back(Variable(
-		expression->variable->name,
-		type_environment->getLoopIntType(), NULL, currentFrame->addVariable(
-			expression->variable->name,
-			framemanager->getVarSize(from_type),
-			variables_extra_info.isAccessedByAddress(expression)
-		)));
-	Variable *loopvar = &(variables.back());
-	func_and_var_names.add(expression->variable->name, loopvar);
-	translateExpression(expression->action, action_code, actionType, exit_label,
-		currentFrame, false);
+	Syntax::For *expression = (Syntax::For *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	IR::AbstractFrame *currentFrame = node.currentFrame;
+	switch (node.stage) {
+		case 0:
+			type = type_environment->getVoidType();
+			node.exit_label = IRenvironment->addLabel();
+			node.stage = 1;
+			translateChild(expression->start, &node.code[0], &node.child_type[0],
+				node.exit_label, currentFrame, false);
+			return;
+		case 1:
+			if (! IsInt(node.child_type[0]))
+				Error::error("For loop start not integer", expression->start->linenumber);
+			node.stage = 2;
+			translateChild(expression->stop, &node.code[1], &node.child_type[1],
+				node.exit_label, currentFrame, false);
+			return;
+		case 2:
+			if (! IsInt(node.child_type[1]))
+				Error::error("For loop 'to' not integer", expression->stop->linenumber);
+			func_and_var_names.newLayer();
+// 			printf("Loop variable %s at line %d is %s by address\n",
+// 				expression->variable->name.c_str(),
+// 				expression->linenumber,
+// 				variables_extra_info.isAccessedByAddress(expression) ? "accessed" : "not accessed");
+			variables.push_back(Variable(
+				expression->variable->name,
+				type_environment->getLoopIntType(), NULL, currentFrame->addVariable(
+					expression->variable->name,
+					framemanager->getVarSize(node.child_type[0]),
+					variables_extra_info.isAccessedByAddress(expression)
+				)));
+			node.loopvar = &(variables.back());
+			func_and_var_names.add(expression->variable->symbol, node.loopvar);
+			node.stage = 3;
+			translateChild(expression->action, &node.code[2], &node.child_type[2],
+				node.exit_label, currentFrame, false);
+			return;
+	}
+	Type *from_type = node.child_type[0], *to_type = node.child_type[1];
+	IR::Code *from_code = node.code[0], *to_code = node.code[1],
+		*action_code = node.code[2];
+	IR::Label *exit_label = node.exit_label;
+	Variable *loopvar = node.loopvar;
 	if ((from_type->basetype == TYPE_INT) && (to_type->basetype == TYPE_INT)) {
 		IR::StatementSequence *sequence = new IR::StatementSequence;
 		IR::VirtualRegister *upper_bound = IRenvironment->addRegister();
@@ -1240,37 +1367,143 @@ void TranslatorPrivate::translateBreak(IR::Code *&translated, IR::Label *loop_ex
 		new IR::LabelAddressExpression(loop_exit), loop_exit));
 }
 
-void TranslatorPrivate::translateScope(
-	Syntax::Scope *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateScope(PendingTranslation &node)
 {
-	newLayer();
-	std::list<Variable *> new_vars;
-	processDeclarations(expression->declarations, currentFrame, new_vars);
-	IR::StatementSequence *sequence = new IR::StatementSequence;
-	for (std::list<Variable *>::iterator newvar = new_vars.begin();
-			newvar != new_vars.end(); newvar++)
-		if ((*newvar)->type->basetype != TYPE_ERROR) {
-			IR::Code *var_code = new IR::ExpressionCode(
-				(*newvar)->implementation->createCode(currentFrame));
-			sequence->addStatement(new IR::MoveStatement(
-				IRenvironment->killCodeToExpression(var_code),
-				IRenvironment->killCodeToExpression((*newvar)->value)
-			));
+	Syntax::Scope *expression = (Syntax::Scope *)node.expression;
+	IR::AbstractFrame *currentFrame = node.currentFrame;
+	std::list<Syntax::Tree> &declarations = expression->declarations->expressions;
+	for (;;) switch (node.stage) {
+		case 0:
+			newLayer();
+			node.item = declarations.begin();
+			node.stage = 1;
+			continue;
+		case 1: {
+			// Next declaration or batch of declarations
+			if (node.item == declarations.end()) {
+				node.stage = 5;
+				continue;
+			}
+			Syntax::Tree declaration = *node.item;
+			Syntax::NodeType dectype = declaration->type;
+			if (dectype == Syntax::VARDECLARATION) {
+				Syntax::VariableDeclaration *var_declaration =
+					(Syntax::VariableDeclaration *)declaration;
+				if (var_declaration->type != NULL)
+					node.expected_type = type_environment->getType(
+						var_declaration->type, false)->resolve();
+				else
+					node.expected_type = NULL;
+				node.stage = 2;
+				translateChild(var_declaration->value, &node.code[0],
+					&node.child_type[0], NULL, currentFrame, true);
+				return;
+			} else if ((dectype == Syntax::FUNCTION) || 
+			           (dectype == Syntax::TYPEDECLARATION)) {
+				std::list<Syntax::Tree>::iterator batch_begin = node.item;
+				while ((node.item != declarations.end()) &&
+						((*node.item)->type == dectype))
+					node.item++;
+				if (dectype == Syntax::FUNCTION) {
+					node.recent_functions.clear();
+					processFunctionDeclarationBatch(batch_begin, node.item,
+						currentFrame, node.recent_functions);
+					node.function_body = node.recent_functions.begin();
+					node.stage = 3;
+				} else {
+					type_environment->processTypeDeclarationBatch(batch_begin,
+						node.item);
+				}
+				continue;
+			}
+			Error::fatalError("Not a declaration inside declaration block", declaration->linenumber);
+			return;
+		}
+		case 2:
+			processVariableDeclaration((Syntax::VariableDeclaration *)*node.item,
+				node.expected_type, node.code[0], node.child_type[0],
+				currentFrame, node.new_vars);
+			node.item++;
+			node.stage = 1;
+			continue;
+		case 3: {
+			// Next body in the batch of functions
+			while ((node.function_body != node.recent_functions.end()) &&
+					((*node.function_body)->raw_body == NULL))
+				node.function_body++;
+			if (node.function_body == node.recent_functions.end()) {
+				node.stage = 1;
+				continue;
+			}
+			Function *fcn = *node.function_body;
+			node.outer_arena = IR::GetNodeArena();
+			IR::SetNodeArena(fcn->node_arena);
+			func_and_var_names.newLayer();
+			for (std::list<FunctionArgument>::iterator param = fcn->arguments.begin();
+					param != fcn->arguments.end(); param++)
+				func_and_var_names.add(Intern((*param).name), &(*param));
+			node.stage = 4;
+			translateChild(fcn->raw_body, &fcn->body, &node.child_type[0],
+				NULL, fcn->frame, true);
+			return;
+		}
+		case 4: {
+			Function *fcn = *node.function_body;
+			Type *actual_return_type = node.child_type[0];
+			func_and_var_names.removeLastLayer();
+			prependPrologue(fcn->body, fcn->frame);
+			IR::SetNodeArena(node.outer_arena);
+			if ((fcn->return_type->basetype != TYPE_VOID) &&
+				! CheckAssignmentTypes(fcn->return_type, actual_return_type))
+				Error::error("Type of function body doesn't match specified return type",
+					fcn->raw_body->linenumber);
+			else if ((fcn->return_type->basetype == TYPE_VOID) &&
+					(actual_return_type->basetype != TYPE_VOID) &&
+					(actual_return_type->basetype != TYPE_ERROR))
+				Error::error("Body of a function without return value produces a value",
+					fcn->raw_body->linenumber);
+			node.function_body++;
+			node.stage = 3;
+			continue;
 		}
-	translateSequence(expression->action->expressions, translated, type,
-		NULL, currentFrame, sequence);
-	removeLastLayer();
+		case 5:
+			node.sequence = new IR::StatementSequence;
+			for (std::list<Variable *>::iterator newvar = node.new_vars.begin();
+					newvar != node.new_vars.end(); newvar++)
+				if ((*newvar)->type->basetype != TYPE_ERROR) {
+					IR::Code *var_code = new IR::ExpressionCode(
+						(*newvar)->implementation->createCode(currentFrame));
+					node.sequence->addStatement(new IR::MoveStatement(
+						IRenvironment->killCodeToExpression(var_code),
+						IRenvironment->killCodeToExpression((*newvar)->value)
+					));
+				}
+			*node.type = type_environment->getVoidType();
+			node.item = expression->action->expressions.begin();
+			node.stage = 6;
+			continue;
+		case 6:
+			if (! translateSequenceItems(node, expression->action->expressions, NULL))
+				return;
+			finishSequence(node);
+			removeLastLayer();
+			return;
+	}
 }
 
-void TranslatorPrivate::translateRecordField(
-	Syntax::RecordField *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateRecordField(PendingTranslation &node)
 {
-	Type *recType;
-	IR::Code *record_code;
-	translateExpression(expression->record, record_code, recType, last_loop_exit,
-		currentFrame, true);
+	Syntax::RecordField *expression = (Syntax::RecordField *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	if (node.stage == 0) {
+		node.stage = 1;
+		translateChild(expression->record, &node.code[0], &node.child_type[0],
+			node.last_loop_exit, node.currentFrame, true);
+		return;
+	}
+	Type *recType = node.child_type[0];
+	IR::Code *record_code = node.code[0];
 	if (recType->basetype != TYPE_RECORD) {
 		if (recType->basetype != TYPE_ERROR)
 			Error::error("What is being got field of is not a record",
@@ -1279,7 +1512,7 @@ void TranslatorPrivate::translateRecordField(
 		translated = ErrorPlaceholderCode();
 	} else {
 		RecordType *record = (RecordType *)recType;
-		RecordType::FieldsMap::iterator field = record->fields.find(expression->field->name);
+		RecordType::FieldsMap::iterator field = record->fields.find(expression->field->symbol);
 		if (field == record->fields.end()) {
 			Error::error("This field is not in that record",
 				expression->field->linenumber);
@@ -1290,7 +1523,8 @@ void TranslatorPrivate::translateRecordField(
 			IR::BinaryOpExpression *target_address = new IR::BinaryOpExpression(
 				IR::OP_PLUS, IRenvironment->killCodeToExpression(record_code),
 				new IR::IntegerExpression((*field).second->offset));
-			translated = new IR::ExpressionCode(new IR::MemoryExpression(target_address));
+			translated = new IR::ExpressionCode(new IR::MemoryExpression(
+				target_address, (*field).second));
 		}
 	}
 }
@@ -1327,130 +1561,189 @@ void TranslatorPrivate::makeCallCode(Function *function,
 	result = new IR::ExpressionCode(call);
 }
 
-void TranslatorPrivate::translateFunctionCall(
-	Syntax::FunctionCall *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateFunctionCall(PendingTranslation &node)
 {
-	Declaration *var_or_function = (Declaration *)
-		func_and_var_names.lookup(expression->function->name);
-	if (var_or_function == NULL) {
-		Error::error(std::string("Undefined variable or function identifier ") +
-			expression->function->name,
-			expression->function->linenumber);
-		type = type_environment->getErrorType();
-		translated = ErrorPlaceholderCode();
-		return;
-	}
-	if (var_or_function->kind != DECL_FUNCTION) {
-		Error::error("Variable used as a function",
-			expression->function->linenumber);
-		type = type_environment->getErrorType();
-		translated = ErrorPlaceholderCode();
-		return;
-	}
-	Function *function = (Function *)var_or_function;
-	type = function->return_type->resolve();
-	std::list<FunctionArgument>::iterator function_arg = function->arguments.begin();
-	bool already_too_many = false;
-	std::list<IR::Code *> arguments_code;
-	for (std::list<Syntax::Tree>::iterator passed_arg = expression->arguments->expressions.begin();
-		 passed_arg != expression->arguments->expressions.end(); passed_arg++) {
-		Type *argument_type = type_environment->getErrorType();
-		Type *passed_type;
-		IR::Code *argument_code;
-		translateExpression(*passed_arg, argument_code, passed_type, NULL,
-			currentFrame, true);
-		arguments_code.push_back(argument_code);
-		if (! already_too_many && (function_arg == function->arguments.end())) {
-			already_too_many = true;
-			Error::error("Too many arguments to the function",
-				(*passed_arg)->linenumber);
+	Syntax::FunctionCall *expression = (Syntax::FunctionCall *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	std::list<Syntax::Tree> &passed_args = expression->arguments->expressions;
+	while (node.stage < 3) switch (node.stage) {
+		case 0: {
+			Declaration *var_or_function = (Declaration *)
+				func_and_var_names.lookup(expression->function->symbol);
+			if (var_or_function == NULL) {
+				Error::error(std::string("Undefined variable or function identifier ") +
+					expression->function->name,
+					expression->function->linenumber);
+				type = type_environment->getErrorType();
+				translated = ErrorPlaceholderCode();
+				return;
+			}
+			if (var_or_function->kind != DECL_FUNCTION) {
+				Error::error("Variable used as a function",
+					expression->function->linenumber);
+				type = type_environment->getErrorType();
+				translated = ErrorPlaceholderCode();
+				return;
+			}
+			node.function = (Function *)var_or_function;
+			type = node.function->return_type->resolve();
+			node.function_arg = node.function->arguments.begin();
+			node.item = passed_args.begin();
+			node.stage = 1;
+			continue;
 		}
-		
-		if (! already_too_many) {
-			argument_type = (*function_arg).type->resolve();
-			if (! CheckAssignmentTypes(argument_type, passed_type)) {
-				Error::error("Incompatible type passed as an argument",
+		case 1:
+			if (node.item == passed_args.end()) {
+				node.stage = 3;
+				continue;
+			}
+			node.stage = 2;
+			translateChild(*node.item, &node.code[0], &node.child_type[0], NULL,
+				node.currentFrame, true);
+			return;
+		case 2: {
+			Type *argument_type = type_environment->getErrorType();
+			Type *passed_type = node.child_type[0];
+			std::list<Syntax::Tree>::iterator passed_arg = node.item;
+			node.arguments_code.push_back(node.code[0]);
+			if (! node.already_too_many &&
+					(node.function_arg == node.function->arguments.end())) {
+				node.already_too_many = true;
+				Error::error("Too many arguments to the function",
 					(*passed_arg)->linenumber);
 			}
-			function_arg++;
+			
+			if (! node.already_too_many) {
+				argument_type = (*node.function_arg).type->resolve();
+				if (! CheckAssignmentTypes(argument_type, passed_type)) {
+					Error::error("Incompatible type passed as an argument",
+						(*passed_arg)->linenumber);
+				}
+				node.function_arg++;
+			}
+			node.item++;
+			node.stage = 1;
+			continue;
 		}
 	}
-	if (function_arg != function->arguments.end())
+	Function *function = node.function;
+	std::list<IR::Code *> &arguments_code = node.arguments_code;
+	if (node.function_arg != function->arguments.end())
 		Error::error("Not enough arguments to the function",
 			expression->linenumber);
-	makeCallCode(function, arguments_code, translated, currentFrame);
+	if ((function == concat_func) && (arguments_code.size() == 2)) {
+		// Concatenation of two literals is a literal
+		const IR::Blob *s1 = findStringBlob(arguments_code.front());
+		const IR::Blob *s2 = findStringBlob(arguments_code.back());
+		if ((s1 != NULL) && (s2 != NULL)) {
+			IR::Blob *blob = getStringBlob(Intern(s1->getString() + s2->getString()));
+			for (std::list<IR::Code *>::iterator arg = arguments_code.begin();
+					arg != arguments_code.end(); arg++)
+				IR::DestroyCode(*arg);
+			translated = new IR::ExpressionCode(new IR::LabelAddressExpression(
+				blob->label));
+			return;
+		}
+	}
+	makeCallCode(function, arguments_code, translated, node.currentFrame);
 }
 
-void TranslatorPrivate::translateRecordInstantiation(
-	Syntax::RecordInstantiation *expression, IR::Code *&translated,
-	Type *&type, IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame)
+void TranslatorPrivate::translateRecordInstantiation(PendingTranslation &node)
 {
-	type = type_environment->getType(expression->type, false)->resolve();
-	if (type == NULL) {
-		Error::error("Unknown type identifier", expression->type->linenumber);
-		type = type_environment->getErrorType();
-		return;
-	}
-	if (type->basetype != TYPE_RECORD) {
-		if (type->basetype != TYPE_ERROR)
-			Error::error("Not a record type being record-instantiated",
-				expression->type->linenumber);
-		type = type_environment->getErrorType();
-		return;
-	}
-	RecordType *record = (RecordType *)type;
-	
-	IR::VirtualRegister *record_address = IRenvironment->addRegister();
-	IR::StatementSequence *sequence = new IR::StatementSequence;
-	std::list<IR::Code *>alloc_argument;
-	alloc_argument.push_back(new IR::ExpressionCode(new IR::IntegerExpression(
-		record->data_size)));
-	IR::Code *alloc_code;
-	makeCallCode(getmem_func, alloc_argument, alloc_code, currentFrame);
-	sequence->addStatement(new IR::MoveStatement(
-		new IR::RegisterExpression(record_address),
-		IRenvironment->killCodeToExpression(alloc_code)));
-		
-	RecordType::FieldsList::iterator record_field = record->field_list.begin();
-	for (std::list<Syntax::Tree>::iterator set_field = expression->fieldvalues->expressions.begin();
-			set_field != expression->fieldvalues->expressions.end(); set_field++) {
-		if (record_field == record->field_list.end()) {
-			Error::error("More field initialized than there are in the record",
-				(*set_field)->linenumber);
-			break;
+	Syntax::RecordInstantiation *expression =
+		(Syntax::RecordInstantiation *)node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
+	std::list<Syntax::Tree> &fieldvalues = expression->fieldvalues->expressions;
+	while (node.stage < 3) switch (node.stage) {
+		case 0: {
+			type = type_environment->getType(expression->type, false)->resolve();
+			if (type == NULL) {
+				Error::error("Unknown type identifier", expression->type->linenumber);
+				type = type_environment->getErrorType();
+				return;
+			}
+			if (type->basetype != TYPE_RECORD) {
+				if (type->basetype != TYPE_ERROR)
+					Error::error("Not a record type being record-instantiated",
+						expression->type->linenumber);
+				type = type_environment->getErrorType();
+				return;
+			}
+			RecordType *record = (RecordType *)type;
+			
+			node.record_address = IRenvironment->addRegister();
+			node.sequence = new IR::StatementSequence;
+			std::list<IR::Code *>alloc_argument;
+			alloc_argument.push_back(new IR::ExpressionCode(new IR::IntegerExpression(
+				record->data_size)));
+			IR::Code *alloc_code;
+			makeCallCode(getmem_func, alloc_argument, alloc_code, node.currentFrame);
+			node.sequence->addStatement(new IR::MoveStatement(
+				new IR::RegisterExpression(node.record_address),
+				IRenvironment->killCodeToExpression(alloc_code)));
+			
+			node.record_field = record->field_list.begin();
+			node.item = fieldvalues.begin();
+			node.stage = 1;
+			continue;
 		}
-		Type *field_type = (*record_field).type->resolve();
-		assert((*set_field)->type == Syntax::BINARYOP);
-		Syntax::BinaryOp *fieldvalue = (Syntax::BinaryOp *) *set_field;
-		assert(fieldvalue->operation == SYM_ASSIGN);
-		assert(fieldvalue->left->type == Syntax::IDENTIFIER);
-		Syntax::Identifier * field = (Syntax::Identifier *)fieldvalue->left;
-		if (field->name != (*record_field).name) {
-			Error::error(std::string("Wrong field name ") + field->name +
-				" expected " + (*record_field).name,
-				fieldvalue->left->linenumber);
-		} else {
-			Type *valueType;
-			IR::Code *value_code;
-			translateExpression(fieldvalue->right, value_code, valueType, last_loop_exit,
-				currentFrame, true);
+		case 1: {
+			if (node.item == fieldvalues.end()) {
+				node.stage = 3;
+				continue;
+			}
+			RecordType *record = (RecordType *)type;
+			if (node.record_field == record->field_list.end()) {
+				Error::error("More field initialized than there are in the record",
+					(*node.item)->linenumber);
+				node.stage = 3;
+				continue;
+			}
+			node.expected_type = (*node.record_field).type->resolve();
+			assert((*node.item)->type == Syntax::BINARYOP);
+			Syntax::BinaryOp *fieldvalue = (Syntax::BinaryOp *) *node.item;
+			assert(fieldvalue->operation == SYM_ASSIGN);
+			assert(fieldvalue->left->type == Syntax::IDENTIFIER);
+			Syntax::Identifier * field = (Syntax::Identifier *)fieldvalue->left;
+			if (field->symbol != (*node.record_field).symbol) {
+				Error::error(std::string("Wrong field name ") + field->name +
+					" expected " + (*node.record_field).name,
+					fieldvalue->left->linenumber);
+				node.record_field++;
+				node.item++;
+				continue;
+			}
+			node.stage = 2;
+			translateChild(fieldvalue->right, &node.code[0], &node.child_type[0],
+				node.last_loop_exit, node.currentFrame, true);
+			return;
+		}
+		case 2: {
+			Syntax::BinaryOp *fieldvalue = (Syntax::BinaryOp *) *node.item;
+			Type *field_type = node.expected_type;
+			Type *valueType = node.child_type[0];
+			IR::Code *value_code = node.code[0];
 			if (! CheckAssignmentTypes(field_type, valueType)) {
 				Error::error("Incompatible type for this field value",
 					fieldvalue->right->linenumber);
 			} else {
-				sequence->addStatement(new IR::MoveStatement(
+				node.sequence->addStatement(new IR::MoveStatement(
 					new IR::MemoryExpression(new IR::BinaryOpExpression(IR::OP_PLUS,
-						new IR::RegisterExpression(record_address),
-						new IR::IntegerExpression((*record_field).offset)
-					)), IRenvironment->killCodeToExpression(value_code)
+						new IR::RegisterExpression(node.record_address),
+						new IR::IntegerExpression((*node.record_field).offset)
+					), &(*node.record_field)), IRenvironment->killCodeToExpression(value_code)
 				));
 			}
+			node.record_field++;
+			node.item++;
+			node.stage = 1;
+			continue;
 		}
-		record_field++;
 	}
-	translated = new IR::ExpressionCode(new IR::StatExpSequence(sequence,
-		new IR::RegisterExpression(record_address)));
+	translated = new IR::ExpressionCode(new IR::StatExpSequence(node.sequence,
+		new IR::RegisterExpression(node.record_address)));
 }
 
 const char *NODETYPENAMES[] = {
@@ -1480,12 +1773,23 @@ const char *NODETYPENAMES[] = {
 	"FUNCTION",
 };
 
-void TranslatorPrivate::translateExpression(Syntax::Tree expression,
-	IR::Code *&translated, Type*& type,
-	IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame,
-	bool expect_comparison)
+void TranslatorPrivate::translateChild(Syntax::Tree expression,
+	IR::Code **translated, Type **type, IR::Label *last_loop_exit,
+	IR::AbstractFrame *currentFrame, bool expect_comparison)
+{
+	*translated = NULL;
+	pending_translations.push_back(PendingTranslation(expression, translated,
+		type, last_loop_exit, currentFrame, expect_comparison));
+}
+
+/**
+ * Go on with the translation, either finishing it or asking for a child
+ */
+void TranslatorPrivate::translatePending(PendingTranslation &node)
 {
-	translated = NULL;
+	Syntax::Tree expression = node.expression;
+	IR::Code *&translated = *node.translated;
+	Type *&type = *node.type;
 	switch (expression->type) {
 		case Syntax::INTVALUE:
 			translateIntValue(((Syntax::IntValue *)expression)->value, translated);
@@ -1497,75 +1801,89 @@ void TranslatorPrivate::translateExpression(Syntax::Tree expression,
 			break;
 		case Syntax::IDENTIFIER:
 			translateIdentifier((Syntax::Identifier *)expression, translated, type,
-				currentFrame);
+				node.currentFrame);
 			break;
 		case Syntax::NIL:
 			type = type_environment->getNilType();
 			translateIntValue(0, translated);
 			break;
 		case Syntax::BINARYOP: {
-			if (! expect_comparison &&
+			if ((node.stage == 0) && ! node.expect_comparison &&
 					((Syntax::BinaryOp *)expression)->operation == SYM_EQUAL)
 				Error::warning("Might have written comparison instead of assignment",
 					expression->linenumber);
-			translateBinaryOperation((Syntax::BinaryOp *)expression, translated,
-				type, last_loop_exit, currentFrame);
+			translateBinaryOperation(node);
 			break;
 		}
 		case Syntax::SEQUENCE:
-			translateSequence(((Syntax::Sequence *)expression)->content->expressions, translated, type,
-				last_loop_exit, currentFrame);
+			translateSequence(node);
 			break;
 		case Syntax::ARRAYINDEXING:
-			translateArrayIndexing((Syntax::ArrayIndexing *)expression, translated,
-				type, last_loop_exit, currentFrame);
+			translateArrayIndexing(node);
 			break;
 		case Syntax::ARRAYINSTANTIATION:
-			translateArrayInstantiation((Syntax::ArrayInstantiation *)expression,
-				translated, type, last_loop_exit, currentFrame);
+			translateArrayInstantiation(node);
 			break;
 		case Syntax::IF:
-			translateIf((Syntax::If *)expression, translated, type, last_loop_exit,
-				currentFrame);
+			translateIf(node);
 			break;
 		case Syntax::IFELSE:
-			translateIfElse((Syntax::IfElse *)expression, translated, type, last_loop_exit,
-				currentFrame, false);
+			translateIfElse(node, (Syntax::IfElse *)expression, false);
 			break;
 		case Syntax::WHILE:
-			translateWhile((Syntax::While *)expression, translated, type, currentFrame);
+			translateWhile(node);
 			break;
 		case Syntax::FOR:
-			translateFor((Syntax::For *)expression, translated, type, currentFrame);
+			translateFor(node);
 			break;
 		case Syntax::BREAK:
 			type = type_environment->getVoidType();
-			if (last_loop_exit == NULL)
+			if (node.last_loop_exit == NULL)
 				Error::error("Break outside of a loop", expression->linenumber);
 			else
-				translateBreak(translated, last_loop_exit);
+				translateBreak(translated, node.last_loop_exit);
 			break;
 		case Syntax::SCOPE:
-			translateScope((Syntax::Scope *)expression, translated, type, last_loop_exit,
-				currentFrame);
+			translateScope(node);
 			break;
 		case Syntax::RECORDFIELD:
-			translateRecordField((Syntax::RecordField *)expression, translated, type,
-				last_loop_exit, currentFrame);
+			translateRecordField(node);
 			break;
 		case Syntax::FUNCTIONCALL:
-			translateFunctionCall((Syntax::FunctionCall *)expression, translated, type,
-				last_loop_exit, currentFrame);
+			translateFunctionCall(node);
 			break;
 		case Syntax::RECORDINSTANTIATION:
-			translateRecordInstantiation((Syntax::RecordInstantiation *)expression,
-				translated, type, last_loop_exit, currentFrame);
+			translateRecordInstantiation(node);
 			break;
 		default:
 			Error::fatalError(std::string("Unexpected ") + NODETYPENAMES[expression->type]);
 	}
 }
 
+void TranslatorPrivate::translateExpression(Syntax::Tree expression,
+	IR::Code *&translated, Type*& type,
+	IR::Label *last_loop_exit, IR::AbstractFrame *currentFrame,
+	bool expect_comparison)
+{
+	// Children are translated on an explicit stack rather than by
+	// recursion since expressions may be nested as deep as the program.
+	// A deque keeps the results of the children, written through
+	// pointers into their parents, in place.
+	size_t outer_size = pending_translations.size();
+	translateChild(expression, &translated, &type, last_loop_exit,
+		currentFrame, expect_comparison);
+	while (pending_translations.size() > outer_size) {
+		PendingTranslation &node = pending_translations.back();
+		size_t size = pending_translations.size();
+		translatePending(node);
+		if (pending_translations.size() == size) {
+			delete node.replacement;
+			delete node.constant;
+			pending_translations.pop_back();
+		}
+	}
+}
+
 Translator::Translator(IR::IREnvironment *ir_inv,
 	IR::AbstractFrameManager * _framemanager)
 {
@@ -1601,41 +1919,68 @@ void Translator::printFunctions(FILE *out)
 void Translator::canonicalizeProgram(IR::Statement*& statement)
 {
 	impl->IRtransformer->canonicalizeStatement(statement);
-	if (statement->kind == IR::IR_STAT_SEQ)
+	// Code nested deeper than the optimizations can recurse is left as is
+	if (impl->IRtransformer->isShallow(statement,
+			IR::IRTransformer::MAX_SIMPLIFIED_DEPTH))
+		impl->IRtransformer->simplifyStatement(statement);
+	if (statement->kind == IR::IR_STAT_SEQ) {
+		if (impl->IRtransformer->isShallow(statement,
+				IR::IRTransformer::MAX_OPTIMIZED_DEPTH)) {
+			impl->IRtransformer->hoistLoopInvariants(IR::ToStatementSequence(statement));
+			impl->IRtransformer->reduceInductionVariables(
+				IR::ToStatementSequence(statement));
+			impl->IRtransformer->eliminateCommonSubexpressions(
+				IR::ToStatementSequence(statement));
+		}
 		impl->IRtransformer->arrangeJumps(IR::ToStatementSequence(statement));
+	}
 }
 
-void Translator::canonicalizeFunctions()
+/**
+ * Optimize a canonicalized function body expression, leaving alone code
+ * nested deeper than the optimizations can recurse
+ */
+static void OptimizeExpression(IR::IRTransformer *transformer,
+	IR::Expression *&exp)
 {
-	for (std::list<Function>::iterator func = impl->functions.begin();
-			func != impl->functions.end(); func++) {
-		if ((*func).body == NULL)
-			continue;
-		switch ((*func).body->kind) {
-			case IR::CODE_EXPRESSION: {
-				IR::ExpressionCode *exp_code = (IR::ExpressionCode *) (*func).body;
-				impl->IRtransformer->canonicalizeExpression(
-					exp_code->exp, NULL, NULL);
-				impl->IRtransformer->arrangeJumpsInExpression(exp_code->exp);
-				break;
-			}
-			case IR::CODE_STATEMENT: {
-				IR::StatementCode *statm_code = (IR::StatementCode *) (*func).body;
-				canonicalizeProgram(statm_code->statm);
-				break;
-			}
-			case IR::CODE_JUMP_WITH_PATCHES: {
-				IR::Expression *expr = impl->IRenvironment->
-					killCodeToExpression((*func).body);
-				impl->IRtransformer->canonicalizeExpression(expr, NULL, NULL);
-				impl->IRtransformer->arrangeJumpsInExpression(expr);
-				(*func).body = new IR::ExpressionCode(expr);
-			}
+	if (transformer->isShallow(exp, IR::IRTransformer::MAX_SIMPLIFIED_DEPTH))
+		transformer->simplifyExpression(exp);
+	if (transformer->isShallow(exp, IR::IRTransformer::MAX_OPTIMIZED_DEPTH)) {
+		transformer->hoistLoopInvariantsInExpression(exp);
+		transformer->reduceInductionVariablesInExpression(exp);
+		transformer->eliminateCommonSubexpressionsInExpression(exp);
+	}
+	transformer->arrangeJumpsInExpression(exp);
+}
+
+void Translator::canonicalizeFunction(Function &function)
+{
+	if (function.body == NULL)
+		return;
+	switch (function.body->kind) {
+		case IR::CODE_EXPRESSION: {
+			IR::ExpressionCode *exp_code = (IR::ExpressionCode *) function.body;
+			impl->IRtransformer->canonicalizeExpression(
+				exp_code->exp, NULL, NULL);
+			OptimizeExpression(impl->IRtransformer, exp_code->exp);
+			break;
+		}
+		case IR::CODE_STATEMENT: {
+			IR::StatementCode *statm_code = (IR::StatementCode *) function.body;
+			canonicalizeProgram(statm_code->statm);
+			break;
+		}
+		case IR::CODE_JUMP_WITH_PATCHES: {
+			IR::Expression *expr = impl->IRenvironment->
+				killCodeToExpression(function.body);
+			impl->IRtransformer->canonicalizeExpression(expr, NULL, NULL);
+			OptimizeExpression(impl->IRtransformer, expr);
+			function.body = new IR::ExpressionCode(expr);
 		}
 	}
 }
 
-const std::list< Function >& Translator::getFunctions()
+std::list<Function> &Translator::getFunctions()
 {
 	return impl->functions;
 }
@@ -25,8 +25,12 @@ public:
 		IR::Statement *&result, IR::AbstractFrame *&frame);
 	void printFunctions(FILE *out);
 	void canonicalizeProgram(IR::Statement *&statement);
-	void canonicalizeFunctions();
-	const std::list<Function> &getFunctions();
+	/**
+	 * Uses the current node arena and label/register factories, so
+	 * different functions can be canonicalized by different threads
+	 */
+	void canonicalizeFunction(Function &function);
+	std::list<Function> &getFunctions();
 };
 
 }
@@ -56,11 +56,13 @@ public:
 
 class RecordField {
 public:
-	std::string name;
+	Symbol symbol;
+	const std::string &name;
 	Type *type;
 	int offset;
 	
-	RecordField(const std::string &_name, Type *_type) : name(_name), type(_type) {}
+	RecordField(Symbol _symbol, Type *_type) : symbol(_symbol),
+		name(SymbolName(_symbol)), type(_type) {}
 };
 
 class RecordType: public Type {
@@ -72,13 +74,13 @@ public:
 	ObjectId id;
 	
 	typedef std::list<RecordField> FieldsList;
-	typedef std::map<std::string, RecordField*> FieldsMap;
+	typedef std::map<Symbol, RecordField*> FieldsMap;
 	FieldsMap fields;
 	FieldsList field_list;
 	int data_size;
 	
 	RecordType(ObjectId _id) : Type(TYPE_RECORD), id(_id), data_size(0) {}
-	RecordField *addField(const std::string &name, Type *type)
+	RecordField *addField(Symbol name, Type *type)
 	{
 		field_list.push_back(RecordField(name, type));
 		fields.insert(std::make_pair(name, &(field_list.back())));
@@ -80,7 +80,12 @@ Expression* X86_64VarLocation::createCode(AbstractFrame *calling_frame)
 		} else {
 			BinaryOpExpression *address_expr = new BinaryOpExpression(
 				IR::OP_PLUS, NULL, new IntegerExpression(var_location->offset));
-			access_to_owner_frame = new MemoryExpression(address_expr);
+			// Static links are only written by the function prologue
+			bool is_static_link =
+				(var_location == (*frame)->getParentFpForUs()) ||
+				(var_location == (*frame)->getParentFpForChildren());
+			access_to_owner_frame = new MemoryExpression(address_expr,
+				var_location, is_static_link, true);
 			put_access_to_next_owner_frame = &address_expr->left;
 		}
 		
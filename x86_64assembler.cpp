@@ -2,8 +2,10 @@
 #include "x86_64_frame.h"
 #include "errormsg.h"
 #include <list>
+#include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 namespace Asm {
 
@@ -59,109 +61,369 @@ enum {
 	I_CALL
 };
 
-X86_64Assembler::X86_64Assembler(IR::IREnvironment *ir_env)
-	: Assembler(ir_env)
-{
-	exp_int = new IR::IntegerExpression(0);
-	exp_label = new IR::LabelAddressExpression(NULL);
-	exp_register = new IR::RegisterExpression(NULL);
-	
-	memory_exp.push_back(exp_int);
-	memory_exp.push_back(exp_label);
-	memory_exp.push_back(exp_register);
+/**
+ * Opcodes of generated instructions
+ */
+enum {
+	X86_MOVQ,
+	X86_LEAQ,
+	X86_ADDQ,
+	X86_SUBQ,
+	X86_IMULQ,
+	X86_IDIVQ,
+	X86_SHLQ,
+	X86_CQO,
+	X86_CMP,
+	// Same order as IR::ComparisonOp
+	X86_JE,
+	X86_JNE,
+	X86_JL,
+	X86_JLE,
+	X86_JG,
+	X86_JGE,
+	X86_JB,
+	X86_JBE,
+	X86_JA,
+	X86_JAE,
+	X86_JMP,
+	X86_CALL,
+	X86_PUSH,
+	X86_RET,
+	/**
+	 * Placement of operand 0 label
+	 */
+	X86_LABEL,
+	/**
+	 * Pseudo-instruction keeping callee-save registers alive
+	 */
+	X86_CALLEE_SAVE,
+	X86_BYTE,
+	X86_OPCODE_MAX
+};
+
+static const char *mnemonics[] = {
+	"movq",
+	"leaq",
+	"addq",
+	"subq",
+	"imulq",
+	"idivq",
+	"shlq",
+	"cqo",
+	"cmpq",
+	"je",
+	"jne",
+	"jl",
+	"jle",
+	"jg",
+	"jge",
+	"jb",
+	"jbe",
+	"ja",
+	"jae",
+	"jmp",
+	"call",
+	"push",
+	"ret",
+	"",
+	"# callee-save registers",
+	".byte",
+};
+
+/**
+ * Template trees in prefix notation: 'i' any integer, '2' to '9' that
+ * integer, 'l' label address, 'r' register, '+' '-' '*' '/' binary
+ * operation on the two trees that follow, 'm' memory at the tree that
+ * follows, '@' an address form and '#' an address form without an index
+ * register.
+ */
+static const char *address_forms[] = {
+	"i",
+	"l",
+	"r",
 	// reg + const, const + reg
-	memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, exp_register, exp_int));
-	memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, exp_int, exp_register));
+	"+ri",
+	"+ir",
 	// reg - const
-	memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, exp_register, exp_int));
-#if 0
-	// reg + reg
-	memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, exp_register, exp_register));
+	"-ri",
+	// base + index, index * scale, base + index * scale
+	"+rr",
+	"*r2", "*r4", "*r8",
+	"+r*r2", "+r*r4", "+r*r8",
+	// the same + const
+	"++rri",
+	"++r*r2i", "++r*r4i", "++r*r8i",
+};
+
+/**
+ * The address forms before the first one with an index register
+ */
+enum {SIMPLE_ADDRESS_FORMS = 6};
+
+/**
+ * Operand pairs of two operand instructions. A run of pairs with one
+ * address form is repeated for each form, a pair with two for each
+ * combination of forms.
+ */
+static const char *arithmetic_operands[] = {
+	"ri", "rr",
+	// Indexed forms here would multiply the matcher's states many times
+	// over, an indexed operand is loaded by a move instead
+	"rm#", "im#", "m#r", "m#i",
+	"m#m#",
+	NULL
+};
+
+static const char *comparison_operands[] = {
+	"ri", "rr",
+	"rm@", "im@", "m@r", "m@i",
+	NULL
+};
+
+static const char *move_operands[] = {
+	"ri", "rl", "rr",
+	// leaq for a bare address
+	"rm@", "r@", "m@r", "m@i", "m@l",
+	NULL
+};
+
+static const struct {
+	int instruction;
+	IR::BinaryOp operation;
+} arithmetic_instructions[] = {
+	{I_ADD, IR::OP_PLUS},
+	{I_SUB, IR::OP_MINUS},
+	// imul
+	{I_MUL, IR::OP_MUL},
+	// don't forget cqo!! and idivq
+	{I_DIV, IR::OP_DIV},
+};
+
+static const struct {
+	int instruction;
+	IR::ComparisonOp operation;
+} comparison_instructions[] = {
+	{I_CMPJE, IR::OP_EQUAL},
+	{I_CMPJNE, IR::OP_NONEQUAL},
+	{I_CMPJL, IR::OP_LESS},
+	{I_CMPJLE, IR::OP_LESSEQUAL},
+	{I_CMPJG, IR::OP_GREATER},
+	{I_CMPJGE, IR::OP_GREATEQUAL},
+	{I_CMPJUL, IR::OP_ULESS},
+	{I_CMPJULE, IR::OP_ULESSEQUAL},
+	{I_CMPJUG, IR::OP_UGREATER},
+	{I_CMPJUGE, IR::OP_UGREATEQUAL},
+};
+
+/**
+ * Node at the root of a two operand template
+ */
+enum TemplateRoot {
+	ROOT_BINARYOP,
+	ROOT_COND_JUMP,
+	ROOT_MOVE,
+};
+
+static int CountAddressForms(const char *operands)
+{
+	int count = 0;
+	for (; *operands != '\0'; operands++)
+		if ((*operands == '@') || (*operands == '#'))
+			count++;
+	return count;
+}
+
+/**
+ * How many of address_forms can take the place of the n-th form in operands
+ */
+static int FormChoices(const char *operands, int n)
+{
+	for (; *operands != '\0'; operands++)
+		if ((*operands == '@') || (*operands == '#')) {
+			if (n == 0)
+				return (*operands == '@') ?
+					(int)(sizeof(address_forms) / sizeof(address_forms[0])) :
+					SIMPLE_ADDRESS_FORMS;
+			n--;
+		}
+	assert(false);
+	return 0;
+}
+
+/**
+ * Templates built from the tables above, once for the process.
+ * Read-only after that and shared by all assemblers.
+ */
+class X86_64Templates {
+private:
+	Arena arena;
+	IR::Expression *exp_int, *exp_label, *exp_register;
 	
-	int mul_index[] = {1,2,4,8};
-	for (int i = 0; i < 3; i++) {
-		// reg*X, X*reg
-		exp_mul_index[i] = new IR::BinaryOpExpression(IR::OP_MUL, exp_register, new IR::IntegerExpression(mul_index[i]));
-		exp_mul_index[i+4] = new IR::BinaryOpExpression(IR::OP_MUL, new IR::IntegerExpression(mul_index[i]), exp_register);
-		// reg*X + itself = reg*(X+1), (X+1)*reg
-		exp_mul_index_plus[i] = new IR::BinaryOpExpression(IR::OP_MUL, exp_register, new IR::IntegerExpression(mul_index[i]+1));
-		exp_mul_index_plus[i+4] = new IR::BinaryOpExpression(IR::OP_MUL, new IR::IntegerExpression(mul_index[i]+1), exp_register);
-	}
-	for (int i = 1; i < 8; i++) if (i != 4) {
-		IR::Expression *mul = exp_mul_index[i];
-		IR::Expression *reg = exp_register;
-		IR::Expression *c = exp_int;
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, mul, reg));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, reg, mul));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, mul, c));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, mul, c));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, c, mul));
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_PLUS, mul, reg), c));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, new IR::BinaryOpExpression(IR::OP_PLUS, mul, reg), c));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, mul, new IR::BinaryOpExpression(IR::OP_PLUS, reg, c)));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, mul, new IR::BinaryOpExpression(IR::OP_MINUS, reg, c)));
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_PLUS, mul, c), reg));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_MINUS, mul, c), reg));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, mul, new IR::BinaryOpExpression(IR::OP_PLUS, c, reg)));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, mul, new IR::BinaryOpExpression(IR::OP_MINUS, c, reg)));
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_PLUS, reg, mul), c));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, new IR::BinaryOpExpression(IR::OP_PLUS, reg, mul), c));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, reg, new IR::BinaryOpExpression(IR::OP_PLUS, mul, c)));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, new IR::BinaryOpExpression(IR::OP_PLUS, reg, mul), c));
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_PLUS, reg, c), mul));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_MINUS, reg, c), mul));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, reg, new IR::BinaryOpExpression(IR::OP_PLUS, c, mul)));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, reg, new IR::BinaryOpExpression(IR::OP_MINUS, c, mul)));
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_PLUS, c, mul), reg));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, c, new IR::BinaryOpExpression(IR::OP_PLUS, mul, reg)));
-		
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, new IR::BinaryOpExpression(IR::OP_PLUS, c, reg), mul));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, c, new IR::BinaryOpExpression(IR::OP_PLUS, reg, mul)));
+	IR::Expression *parse(const char *&tree, const char **&forms);
+	void addOperands(int instruction, TemplateRoot root, int operation,
+		const char **operands);
+	void addTemplate(int instruction, TemplateRoot root, int operation,
+		const char *operands, const char **forms);
+	X86_64Templates();
+	
+	static X86_64Templates *instance;
+	static pthread_once_t instance_once;
+	static void CreateInstance() {instance = new X86_64Templates();}
+public:
+	TemplateMatcher matcher;
+	
+	static TemplateMatcher *getMatcher()
+	{
+		pthread_once(&instance_once, CreateInstance);
+		return &instance->matcher;
 	}
-	for (int i = 0; i < 8; i++) {
-		memory_exp.push_back(exp_mul_index_plus[i]);
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, exp_mul_index_plus[i], exp_int));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_MINUS, exp_mul_index_plus[i], exp_int));
-		memory_exp.push_back(new IR::BinaryOpExpression(IR::OP_PLUS, exp_int, exp_mul_index_plus[i]));
+};
+
+X86_64Templates *X86_64Templates::instance = NULL;
+pthread_once_t X86_64Templates::instance_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Parse one tree and advance past it, each '@' takes the next of forms
+ */
+IR::Expression *X86_64Templates::parse(const char *&tree, const char **&forms)
+{
+	char c = *tree++;
+	switch (c) {
+		case 'i':
+			return exp_int;
+		case 'l':
+			return exp_label;
+		case 'r':
+			return exp_register;
+		case 'm':
+			return new IR::MemoryExpression(parse(tree, forms));
+		case '@':
+		case '#': {
+			const char *form = *forms++;
+			const char **no_forms = NULL;
+			return parse(form, no_forms);
+		}
+		case '+':
+		case '-':
+		case '*':
+		case '/': {
+			IR::BinaryOp operation = (c == '+') ? IR::OP_PLUS :
+				(c == '-') ? IR::OP_MINUS :
+				(c == '*') ? IR::OP_MUL : IR::OP_DIV;
+			IR::Expression *left = parse(tree, forms);
+			IR::Expression *right = parse(tree, forms);
+			return new IR::BinaryOpExpression(operation, left, right);
+		}
+		default:
+			assert((c >= '2') && (c <= '9'));
+			return new IR::IntegerExpression(c - '0');
 	}
-#endif
+}
+
+void X86_64Templates::addTemplate(int instruction, TemplateRoot root, int operation,
+	const char *operands, const char **forms)
+{
+	IR::Expression *left = parse(operands, forms);
+	IR::Expression *right = parse(operands, forms);
+	switch (root) {
+		case ROOT_BINARYOP:
+			matcher.addTemplate(instruction, new IR::BinaryOpExpression(
+				(IR::BinaryOp)operation, left, right));
+			break;
+		case ROOT_COND_JUMP:
+			matcher.addTemplate(instruction, new IR::CondJumpStatement(
+				(IR::ComparisonOp)operation, left, right, NULL, NULL));
+			break;
+		case ROOT_MOVE:
+			matcher.addTemplate(instruction, new IR::MoveStatement(left, right));
+			break;
+		default:
+			assert(false);
+	}
+}
+
+void X86_64Templates::addOperands(int instruction, TemplateRoot root, int operation,
+	const char **operands)
+{
+	int form_count = sizeof(address_forms) / sizeof(address_forms[0]);
+	const char *forms[2];
+	int p = 0;
+	while (operands[p] != NULL) {
+		switch (CountAddressForms(operands[p])) {
+			case 0:
+				addTemplate(instruction, root, operation, operands[p], forms);
+				p++;
+				break;
+			case 1: {
+				int end = p;
+				while ((operands[end] != NULL) &&
+						(CountAddressForms(operands[end]) == 1))
+					end++;
+				for (int i = 0; i < form_count; i++)
+					for (int q = p; q < end; q++) {
+						if (i >= FormChoices(operands[q], 0))
+							continue;
+						forms[0] = address_forms[i];
+						addTemplate(instruction, root, operation, operands[q], forms);
+					}
+				p = end;
+				break;
+			}
+			default:
+				for (int i = 0; i < FormChoices(operands[p], 0); i++)
+					for (int j = 0; j < FormChoices(operands[p], 1); j++) {
+						forms[0] = address_forms[i];
+						forms[1] = address_forms[j];
+						addTemplate(instruction, root, operation, operands[p], forms);
+					}
+				p++;
+		}
+	}
+}
+
+X86_64Templates::X86_64Templates()
+{
+	Arena *ir_arena = IR::GetNodeArena();
+	IR::SetNodeArena(&arena);
 	
-	addTemplate(I_YIELD, exp_int);
-	addTemplate(I_YIELD, exp_label);
-	addTemplate(I_LABEL, new IR::LabelPlacementStatement(NULL));
-	addTemplate(I_YIELD, exp_register);
-	for (int i = 0; i < memory_exp.size(); i++)
-		addTemplate(I_YIELD, new IR::MemoryExpression(memory_exp[i]));
+	exp_int = new IR::IntegerExpression(0);
+	exp_label = new IR::LabelAddressExpression(NULL);
+	exp_register = new IR::RegisterExpression(NULL);
 	
-	make_arithmetic(I_ADD, IR::OP_PLUS);
-	make_arithmetic(I_SUB, IR::OP_MINUS);
-	// imul
-	make_arithmetic(I_MUL, IR::OP_MUL);
-	// don't forget cqo!! and idivq
-	make_arithmetic(I_DIV, IR::OP_DIV);
+	int form_count = sizeof(address_forms) / sizeof(address_forms[0]);
+	matcher.addTemplate(I_YIELD, exp_int);
+	matcher.addTemplate(I_YIELD, exp_label);
+	matcher.addTemplate(I_LABEL, new IR::LabelPlacementStatement(NULL));
+	matcher.addTemplate(I_YIELD, exp_register);
+	for (int i = 0; i < form_count; i++) {
+		const char *tree = address_forms[i];
+		const char **no_forms = NULL;
+		matcher.addTemplate(I_YIELD, new IR::MemoryExpression(parse(tree, no_forms)));
+	}
 	
-	make_comparison(I_CMPJE, IR::OP_EQUAL);
-	make_comparison(I_CMPJNE, IR::OP_NONEQUAL);
-	make_comparison(I_CMPJL, IR::OP_LESS);
-	make_comparison(I_CMPJLE, IR::OP_LESSEQUAL);
-	make_comparison(I_CMPJG, IR::OP_GREATER);
-	make_comparison(I_CMPJGE, IR::OP_GREATEQUAL);
-	make_comparison(I_CMPJUL, IR::OP_ULESS);
-	make_comparison(I_CMPJULE, IR::OP_ULESSEQUAL);
-	make_comparison(I_CMPJUG, IR::OP_UGREATER);
-	make_comparison(I_CMPJUGE, IR::OP_UGREATEQUAL);
-	make_assignment();
+	for (size_t i = 0; i < sizeof(arithmetic_instructions) /
+			sizeof(arithmetic_instructions[0]); i++)
+		addOperands(arithmetic_instructions[i].instruction, ROOT_BINARYOP,
+			arithmetic_instructions[i].operation, arithmetic_operands);
+	for (size_t i = 0; i < sizeof(comparison_instructions) /
+			sizeof(comparison_instructions[0]); i++)
+		addOperands(comparison_instructions[i].instruction, ROOT_COND_JUMP,
+			comparison_instructions[i].operation, comparison_operands);
+	addOperands(I_MOV, ROOT_MOVE, 0, move_operands);
 	
-	addTemplate(I_CALL, new IR::CallExpression(new IR::LabelAddressExpression(NULL), NULL));
-	addTemplate(I_CALL, new IR::CallExpression(new IR::RegisterExpression(NULL), NULL));
-	addTemplate(I_JMP, new IR::JumpStatement(new IR::LabelAddressExpression(NULL)));
-	addTemplate(I_JMP, new IR::JumpStatement(new IR::RegisterExpression(NULL)));
+	matcher.addTemplate(I_CALL, new IR::CallExpression(new IR::LabelAddressExpression(NULL), NULL));
+	matcher.addTemplate(I_CALL, new IR::CallExpression(new IR::RegisterExpression(NULL), NULL));
+	matcher.addTemplate(I_JMP, new IR::JumpStatement(new IR::LabelAddressExpression(NULL)));
+	matcher.addTemplate(I_JMP, new IR::JumpStatement(new IR::RegisterExpression(NULL)));
+	matcher.compile();
+	IR::SetNodeArena(ir_arena);
+}
+
+X86_64Assembler::X86_64Assembler(IR::IREnvironment *ir_env)
+	: Assembler(ir_env)
+{
+	main_label = program_labels.addLabel("main");
+	matcher = X86_64Templates::getMatcher();
 	
 	static const char *register_names[] = {
 		"%rax",
@@ -183,12 +445,24 @@ X86_64Assembler::X86_64Assembler(IR::IREnvironment *ir_env)
 		"fp",
 	};
 	
+	// Numbers in the ModRM byte and its REX extension
+	static const int register_numbers[] = {
+		0, 2, 1, 3, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 5, 4, -1,
+	};
+	
 	machine_registers.resize(LAST_REGISTER);
 	
 	for (int r = 0; r < LAST_REGISTER; r++) {
 		machine_registers[r] = IRenvironment->addRegister(register_names[r]);
 		if ((r != FP) && (r != RSP))
 			available_registers.push_back(machine_registers[r]);
+		size_t index = machine_registers[r]->getIndex();
+		if (register_codes.size() <= index)
+			register_codes.resize(index+1, -1);
+		register_codes[index] = register_numbers[r];
+		if (register_texts.size() <= index)
+			register_texts.resize(index+1, NULL);
+		register_texts[index] = register_names[r];
 	}
 	
 	callersave_registers.resize(callersave_count);
@@ -200,147 +474,152 @@ X86_64Assembler::X86_64Assembler(IR::IREnvironment *ir_env)
 		calleesave_registers[i] = machine_registers[calleesave_list[i]];
 }
 
-// IR::VirtualRegister* X86_64Assembler::getFramePointerRegister()
-// {
-// 	return machine_registers[FP];
-// }
-// 
-void X86_64Assembler::make_arithmetic(int asm_code, IR::BinaryOp ir_code)
-{
-	// don't forget cqo
-	addTemplate(asm_code, new IR::BinaryOpExpression(ir_code, exp_register, exp_int));
-	addTemplate(asm_code, new IR::BinaryOpExpression(ir_code, exp_register, exp_register));
-	for (int i = 0; i < memory_exp.size(); i++) {
-		addTemplate(asm_code, new IR::BinaryOpExpression(ir_code, exp_register,
-			new IR::MemoryExpression(memory_exp[i])));
-		addTemplate(asm_code, new IR::BinaryOpExpression(ir_code, exp_int,
-			new IR::MemoryExpression(memory_exp[i])));
-		addTemplate(asm_code, new IR::BinaryOpExpression(ir_code,
-			new IR::MemoryExpression(memory_exp[i]), exp_register));
-		addTemplate(asm_code, new IR::BinaryOpExpression(ir_code,
-			new IR::MemoryExpression(memory_exp[i]), exp_int));
-	}
-	for (int i = 0; i < memory_exp.size(); i++)
-		for (int j = 0; j < memory_exp.size(); j++)
-			addTemplate(asm_code, new IR::BinaryOpExpression(ir_code,
-				new IR::MemoryExpression(memory_exp[i]), new IR::MemoryExpression(memory_exp[j])));
-}
+/**
+ * Memory address taken apart into what one x86-64 operand can hold
+ */
+struct MemoryAddress {
+	IR::VirtualRegister *base, *index;
+	int scale;
+	int offset;
+	IR::Label *label;
+	
+	MemoryAddress() : base(NULL), index(NULL), scale(1), offset(0),
+		label(NULL) {}
+	
+	void add(IR::Expression *expression, bool negate);
+};
 
-void X86_64Assembler::make_comparison(int asm_code, IR::ComparisonOp ir_code)
+static void AddressTooComplicated()
 {
-	addTemplate(asm_code, new IR::CondJumpStatement(ir_code, exp_register, exp_int, NULL, NULL));
-	addTemplate(asm_code, new IR::CondJumpStatement(ir_code, exp_register, exp_register, NULL, NULL));
-	for (int i = 0; i < memory_exp.size(); i++) {
-		addTemplate(asm_code, new IR::CondJumpStatement(ir_code, exp_register,
-			new IR::MemoryExpression(memory_exp[i]), NULL, NULL));
-		addTemplate(asm_code, new IR::CondJumpStatement(ir_code, exp_int,
-			new IR::MemoryExpression(memory_exp[i]), NULL, NULL));
-		addTemplate(asm_code, new IR::CondJumpStatement(ir_code,
-			new IR::MemoryExpression(memory_exp[i]), exp_register, NULL, NULL));
-		addTemplate(asm_code, new IR::CondJumpStatement(ir_code,
-			new IR::MemoryExpression(memory_exp[i]), exp_int, NULL, NULL));
-	}
+	Error::fatalError("Too complicated x86_64 assembler memory address");
 }
 
-void X86_64Assembler::make_assignment()
+/**
+ * Add the expression, or subtract it if negate, to the address
+ */
+void MemoryAddress::add(IR::Expression *expression, bool negate)
 {
-	int asm_code = I_MOV;
-	addTemplate(asm_code, new IR::MoveStatement(exp_register, exp_int));
-	addTemplate(asm_code, new IR::MoveStatement(exp_register, exp_label));
-	addTemplate(asm_code, new IR::MoveStatement(exp_register, exp_register));
-	for (int i = 0; i < memory_exp.size(); i++) {
-		addTemplate(asm_code, new IR::MoveStatement(exp_register,
-			new IR::MemoryExpression(memory_exp[i])));
-		addTemplate(asm_code, new IR::MoveStatement(exp_register, memory_exp[i]));
-		addTemplate(asm_code, new IR::MoveStatement(
-			new IR::MemoryExpression(memory_exp[i]), exp_register));
-		addTemplate(asm_code, new IR::MoveStatement(
-			new IR::MemoryExpression(memory_exp[i]), exp_int));
-		addTemplate(asm_code, new IR::MoveStatement(
-			new IR::MemoryExpression(memory_exp[i]), exp_label));
+	switch (expression->kind) {
+		case IR::IR_INTEGER: {
+			int value = IR::ToIntegerExpression(expression)->value;
+			offset += negate ? -value : value;
+			break;
+		}
+		case IR::IR_LABELADDR:
+			if (negate || (label != NULL) || (base != NULL) || (index != NULL))
+				AddressTooComplicated();
+			label = IR::ToLabelAddressExpression(expression)->label;
+			break;
+		case IR::IR_REGISTER:
+			if (negate || (label != NULL))
+				AddressTooComplicated();
+			if (base == NULL)
+				base = IR::ToRegisterExpression(expression)->reg;
+			else if (index == NULL)
+				index = IR::ToRegisterExpression(expression)->reg;
+			else
+				AddressTooComplicated();
+			break;
+		case IR::IR_BINARYOP: {
+			IR::BinaryOpExpression *binop = IR::ToBinaryOpExpression(expression);
+			switch (binop->operation) {
+				case IR::OP_PLUS:
+					add(binop->left, negate);
+					add(binop->right, negate);
+					break;
+				case IR::OP_MINUS:
+					if (binop->right->kind != IR::IR_INTEGER)
+						AddressTooComplicated();
+					add(binop->left, negate);
+					add(binop->right, ! negate);
+					break;
+				case IR::OP_MUL: {
+					IR::Expression *reg = binop->left, *factor = binop->right;
+					if (reg->kind == IR::IR_INTEGER)
+						std::swap(reg, factor);
+					if (negate || (index != NULL) || (label != NULL) ||
+							(reg->kind != IR::IR_REGISTER) ||
+							(factor->kind != IR::IR_INTEGER))
+						AddressTooComplicated();
+					int value = IR::ToIntegerExpression(factor)->value;
+					if ((value != 1) && (value != 2) && (value != 4) && (value != 8))
+						AddressTooComplicated();
+					index = IR::ToRegisterExpression(reg)->reg;
+					scale = value;
+					break;
+				}
+				default:
+					AddressTooComplicated();
+			}
+			break;
+		}
+		default:
+			AddressTooComplicated();
 	}
 }
 
-static std::string IntToStr(int x)
-{
-	char buf[30];
-	sprintf(buf, "%d", x);
-	return std::string(buf);
-}
-
+// IR::VirtualRegister* X86_64Assembler::getFramePointerRegister()
+// {
+// 	return machine_registers[FP];
+// }
+// 
 void X86_64Assembler::makeOperand(IR::Expression *expression,
 	std::vector<IR::VirtualRegister *> &add_inputs,
-	std::string &notation)
+	Operand &operand)
 {
 	switch (expression->kind) {
 		case IR::IR_INTEGER:
-			notation = "$" + IntToStr(IR::ToIntegerExpression(expression)->value);
+			operand = Operand::Immediate(IR::ToIntegerExpression(expression)->value);
 			break;
 		case IR::IR_LABELADDR:
-			notation = "$" + IR::ToLabelAddressExpression(expression)->label->getName();
+			operand = Operand::LabelAddress(
+				IR::ToLabelAddressExpression(expression)->label);
 			break;
 		case IR::IR_REGISTER:
-			notation = Instruction::Input(add_inputs.size());
+			operand = Operand::Input(add_inputs.size());
 			add_inputs.push_back(IR::ToRegisterExpression(expression)->reg);
 			break;
-		case IR::IR_MEMORY:
-			IR::Expression *addr = IR::ToMemoryExpression(expression)->address;
-			switch (addr->kind) {
-				case IR::IR_REGISTER:
-					notation = "(" + Instruction::Input(add_inputs.size()) + ")";
-					add_inputs.push_back(IR::ToRegisterExpression(addr)->reg);
-					break;
-				case IR::IR_LABELADDR:
-					notation = std::string("(") +
-						IR::ToLabelAddressExpression(addr)->label->getName() + ")";
-					break;
-				case IR::IR_BINARYOP: {
-					IR::BinaryOpExpression *binop = IR::ToBinaryOpExpression(addr);
-					if (binop->operation == IR::OP_PLUS) {
-						if (binop->left->kind == IR::IR_INTEGER) {
-							IR::MemoryExpression base(binop->right);
-							int offset = IR::ToIntegerExpression(binop->left)->value;
-							makeOperand(&base, add_inputs, notation);
-							if (offset != 0)
-								notation = IntToStr(offset) + notation;
-						} else if (binop->right->kind == IR::IR_INTEGER) {
-							IR::MemoryExpression base(binop->left);
-							int offset = IR::ToIntegerExpression(binop->right)->value;
-							makeOperand(&base, add_inputs, notation);
-							if (offset != 0)
-								notation = IntToStr(offset) + notation;
-						} else
-							Error::fatalError("Too complicated x86_64 assembler memory address");
-					} else if (binop->operation == IR::OP_MINUS) {
-						if (binop->right->kind == IR::IR_INTEGER) {
-							IR::MemoryExpression base(binop->left);
-							int offset = -IR::ToIntegerExpression(binop->right)->value;
-							makeOperand(&base, add_inputs, notation);
-							if (offset != 0)
-								notation = IntToStr(offset) + notation;
-						} else
-							Error::fatalError("Too complicated x86_64 assembler memory address");
-					} else
-						Error::fatalError("Too complicated x86_64 assembler memory address");
-				}
+		case IR::IR_MEMORY: {
+			MemoryAddress address;
+			address.add(IR::ToMemoryExpression(expression)->address, false);
+			if (address.label != NULL) {
+				operand = Operand::Memory(address.label, address.offset);
 				break;
 			}
+			// A lone unscaled index is the base
+			if ((address.base == NULL) && (address.scale == 1)) {
+				address.base = address.index;
+				address.index = NULL;
+			}
+			int base = Operand::NO_REGISTER, index = Operand::NO_REGISTER;
+			if (address.base != NULL) {
+				base = add_inputs.size();
+				add_inputs.push_back(address.base);
+			}
+			if (address.index != NULL) {
+				index = add_inputs.size();
+				add_inputs.push_back(address.index);
+			}
+			operand = Operand::Memory(base, index, address.scale, address.offset);
 			break;
+		}
 	}
 }
 	
-void X86_64Assembler::addInstruction(Instructions &result,
-	const std::string &prefix, IR::Expression *operand,
-	const std::string &suffix, IR::VirtualRegister *output0,
+Instructions::iterator X86_64Assembler::addInstruction(Instructions &result,
+	int opcode, IR::Expression *operand, IR::VirtualRegister *output0,
 	IR::VirtualRegister *extra_input, IR::VirtualRegister *extra_output,
 	Instructions::iterator *insert_before)
 {
 	std::vector<IR::VirtualRegister *> inputs;
-	std::string notation;
-	makeOperand(operand, inputs, notation);
+	Operand operand0;
+	makeOperand(operand, inputs, operand0);
 	if (extra_input != NULL)
 		inputs.push_back(extra_input);
-	notation = prefix + notation + suffix;
+	// With extra registers this is a one-operand instruction like imulq
+	Operand operand1;
+	if ((output0 != NULL) && (extra_output == NULL))
+		operand1 = Operand::Output(0);
 	IR::VirtualRegister *outputs[] = {output0, extra_output};
 	int noutput = 0;
 	if (output0 != NULL) {
@@ -354,63 +633,80 @@ void X86_64Assembler::addInstruction(Instructions &result,
 		position = *insert_before;
 	
 	Instructions::iterator newinst = result.insert(position,
-		Instruction(notation, inputs.size(), inputs.data(),
+		Instruction(opcode, operand0, operand1, inputs.size(), inputs.data(),
 			noutput, outputs, 1, NULL,
-			(prefix == "movq ") && (operand->kind == IR::IR_REGISTER)));
+			(opcode == X86_MOVQ) && (operand->kind == IR::IR_REGISTER)));
 	if (insert_before != NULL)
-		debug("Spill: %s -> prepend %s", (*position).notation.c_str(),
-			  (*newinst).notation.c_str());
+		debugInstruction("Spill: prepend %s", *newinst);
+	return newinst;
 }
 
 void X86_64Assembler::addInstruction(Instructions &result,
-	const std::string &prefix, IR::Expression *operand0,
-	const std::string &suffix, IR::Expression *operand1)
+	int opcode, IR::Expression *operand0, IR::Expression *operand1)
 {
 	std::vector<IR::VirtualRegister *> inputs;
-	std::string s0;
-	makeOperand(operand0, inputs, s0);
-	std::string s1;
-	makeOperand(operand1, inputs, s1);
-	result.push_back(Instruction(prefix + s0 + suffix + s1,
+	Operand op0, op1;
+	makeOperand(operand0, inputs, op0);
+	makeOperand(operand1, inputs, op1);
+	result.push_back(Instruction(opcode, op0, op1,
 		inputs.size(), inputs.data(), 0, NULL));
 }
 
-void X86_64Assembler::placeCallArguments(const std::list<IR::Expression * >& arguments,
+void X86_64Assembler::addRegisterMove(Instructions &result,
+	IR::VirtualRegister *from, IR::VirtualRegister *to)
+{
+	result.push_back(Instruction(X86_MOVQ, Operand::Input(0), Operand::Output(0),
+		1, &from, 1, &to, 1, NULL, true));
+}
+
+void X86_64Assembler::placeCallArguments(const IR::ExpressionList & arguments,
 	Instructions &result)
 {
 	int arg_count = 0;
-	std::list<IR::Expression *>::const_iterator arg;
+	IR::ExpressionList::const_iterator arg;
 	for (arg = arguments.begin(); arg != arguments.end(); arg++) {
 		assert((*arg)->kind == IR::IR_REGISTER);
-		result.push_back(Instruction(
-			"movq " + Instruction::Input(0) + ", " + Instruction::Output(0),
-			1, &IR::ToRegisterExpression(*arg)->reg, 1,
-			&machine_registers[paramreg_list[arg_count]],
-			1, NULL, true));
+		addRegisterMove(result, IR::ToRegisterExpression(*arg)->reg,
+			machine_registers[paramreg_list[arg_count]]);
 		arg_count++;
 		if (arg_count == paramreg_count)
 			break;
 	}
 	if (arg_count == paramreg_count) {
-		std::list<IR::Expression *>::const_iterator extra_arg = arguments.end();
+		IR::ExpressionList::const_iterator extra_arg = arguments.end();
 		extra_arg--; 
 		while (extra_arg != arg) {
 			assert((*extra_arg)->kind == IR::IR_REGISTER);
-			result.push_back(Instruction(
-				"push " + Instruction::Input(0),
+			result.push_back(Instruction(X86_PUSH, Operand::Input(0), Operand(),
 				1, &IR::ToRegisterExpression(*extra_arg)->reg, 0, NULL));
 			extra_arg--;
 		}
 	}
 }
 
-void X86_64Assembler::removeCallArguments(const std::list< IR::Expression* >& arguments,
+void X86_64Assembler::removeCallArguments(const IR::ExpressionList &arguments,
 	Instructions &result)
 {
 	int stack_arg_count = arguments.size()-6;
 	if (stack_arg_count > 0)
- 		result.push_back(Instruction(std::string("add ") +
-			IntToStr(stack_arg_count*8) + std::string(", %rsp")));
+ 		result.push_back(Instruction(X86_ADDQ,
+			Operand::Immediate(stack_arg_count*8),
+			Operand::MachineRegister(machine_registers[RSP])));
+}
+
+static bool IsPowerOfTwo(int value)
+{
+	return (value > 1) && ((value & (value - 1)) == 0);
+}
+
+static int Log2(int value)
+{
+	int result = 0;
+	while (value > 1) {
+		value >>= 1;
+		result++;
+	}
+	return result;
 }
 
 void X86_64Assembler::translateExpressionTemplate(IR::Expression *templ,
@@ -423,10 +719,8 @@ void X86_64Assembler::translateExpressionTemplate(IR::Expression *templ,
 		case IR::IR_REGISTER:
 		case IR::IR_MEMORY:
 			if (value_storage != NULL) {
-				addInstruction(result, "movq ", templ,
-					", " + Instruction::Output(0), value_storage);
-				debug("Simple expression type %d, translated as %s", templ->kind,
-					result.back().notation.c_str());
+				addInstruction(result, X86_MOVQ, templ, value_storage);
+				debugInstruction("Simple expression translated as %s", result.back());
 			}
 			break;
 		case IR::IR_BINARYOP:
@@ -435,66 +729,70 @@ void X86_64Assembler::translateExpressionTemplate(IR::Expression *templ,
 				debug("Translating binary operation %d translated as:", bin_op->operation);
 				switch (bin_op->operation) {
 					case IR::OP_PLUS:
-						addInstruction(result, "movq ", bin_op->left,
-							", " + Instruction::Output(0), value_storage);
-						debug("\t%s", result.back().notation.c_str());
-						addInstruction(result, "addq ", bin_op->right,
-							", " + Instruction::Output(0), value_storage);
-						debug("\t%s", result.back().notation.c_str());
+						addInstruction(result, X86_MOVQ, bin_op->left, value_storage);
+						debugInstruction("\t%s", result.back());
+						addInstruction(result, X86_ADDQ, bin_op->right, value_storage,
+							value_storage);
+						debugInstruction("\t%s", result.back());
 						break;
 					case IR::OP_MINUS:
-						addInstruction(result, "movq ", bin_op->left,
-							", " + Instruction::Output(0), value_storage);
-						debug("\t%s", result.back().notation.c_str());
-						addInstruction(result, "subq ", bin_op->right,
-							", " + Instruction::Output(0), value_storage);
-						debug("\t%s", result.back().notation.c_str());
+						addInstruction(result, X86_MOVQ, bin_op->left, value_storage);
+						debugInstruction("\t%s", result.back());
+						addInstruction(result, X86_SUBQ, bin_op->right, value_storage,
+							value_storage);
+						debugInstruction("\t%s", result.back());
 						break;
 					case IR::OP_MUL:
-						addInstruction(result, "movq ", bin_op->left,
-							", " + Instruction::Output(0), machine_registers[RAX]);
-						debug("\t%s", result.back().notation.c_str());
+						if ((bin_op->right->kind == IR::IR_INTEGER) &&
+								IsPowerOfTwo(IR::ToIntegerExpression(bin_op->right)->value)) {
+							IR::IntegerExpression shift(Log2(
+								IR::ToIntegerExpression(bin_op->right)->value));
+							addInstruction(result, X86_MOVQ, bin_op->left, value_storage);
+							debugInstruction("\t%s", result.back());
+							addInstruction(result, X86_SHLQ, &shift, value_storage,
+								value_storage);
+							debugInstruction("\t%s", result.back());
+							break;
+						}
+						addInstruction(result, X86_MOVQ, bin_op->left,
+							machine_registers[RAX]);
+						debugInstruction("\t%s", result.back());
 						if ((bin_op->right->kind == IR::IR_INTEGER) ||
 							(bin_op->right->kind == IR::IR_LABELADDR)) {
 							IR::VirtualRegister *tmp_reg = IRenvironment->addRegister();
-							addInstruction(result, "movq ", bin_op->right,
-								", " + Instruction::Output(0), tmp_reg);
-							debug("\t%s", result.back().notation.c_str());
+							addInstruction(result, X86_MOVQ, bin_op->right, tmp_reg);
+							debugInstruction("\t%s", result.back());
 							IR::VirtualRegister *inputs[] = {
 								machine_registers[RAX],
 								tmp_reg};
 							IR::VirtualRegister *outputs[] = {
 								machine_registers[RAX],
 								machine_registers[RDX]};
-							result.push_back(Instruction(
-								"imulq " + Instruction::Input(1),
+							result.push_back(Instruction(X86_IMULQ,
+								Operand::Input(1), Operand(),
 								2, &inputs[0], 2, &outputs[0]));
-							debug("\t%s", result.back().notation.c_str());
+							debugInstruction("\t%s", result.back());
 						} else {
-							addInstruction(result, "imulq ", bin_op->right,
-								"", machine_registers[RAX],
+							addInstruction(result, X86_IMULQ, bin_op->right,
+								machine_registers[RAX],
 								machine_registers[RAX], machine_registers[RDX]);
-							debug("\t%s", result.back().notation.c_str());
+							debugInstruction("\t%s", result.back());
 						}
-						result.push_back(Instruction("movq " +
-							Instruction::Input(0) + ", " + Instruction::Output(0),
-							1, &machine_registers[RAX], 1, &value_storage,
-							1, NULL, true));
-						debug("\t%s", result.back().notation.c_str());
+						addRegisterMove(result, machine_registers[RAX], value_storage);
+						debugInstruction("\t%s", result.back());
 						break;
 					case IR::OP_DIV:
-						addInstruction(result, "movq ", bin_op->left,
-							", " + Instruction::Output(0), machine_registers[RAX]);
-						debug("\t%s", result.back().notation.c_str());
-						result.push_back(Instruction("cqo",
+						addInstruction(result, X86_MOVQ, bin_op->left,
+							machine_registers[RAX]);
+						debugInstruction("\t%s", result.back());
+						result.push_back(Instruction(X86_CQO, Operand(), Operand(),
 							0, NULL, 1, &machine_registers[RDX]));
-						debug("\t%s", result.back().notation.c_str());
+						debugInstruction("\t%s", result.back());
 						if ((bin_op->right->kind == IR::IR_INTEGER) ||
 							(bin_op->right->kind == IR::IR_LABELADDR)) {
 							IR::VirtualRegister *tmp_reg = IRenvironment->addRegister();
-							addInstruction(result, "movq ", bin_op->right,
-								", " + Instruction::Output(0), tmp_reg);
-							debug("\t%s", result.back().notation.c_str());
+							addInstruction(result, X86_MOVQ, bin_op->right, tmp_reg);
+							debugInstruction("\t%s", result.back());
 							IR::VirtualRegister *inputs[] = {
 								machine_registers[RAX],
 								machine_registers[RDX],
@@ -502,21 +800,18 @@ void X86_64Assembler::translateExpressionTemplate(IR::Expression *templ,
 							IR::VirtualRegister *outputs[] = {
 								machine_registers[RAX],
 								machine_registers[RDX]};
-							result.push_back(Instruction(
-								"idivq " + Instruction::Input(2),
+							result.push_back(Instruction(X86_IDIVQ,
+								Operand::Input(2), Operand(),
 								3, &inputs[0], 2, &outputs[0]));
-						debug("\t%s", result.back().notation.c_str());
+						debugInstruction("\t%s", result.back());
 						} else {
-							addInstruction(result, "idivq ", bin_op->right,
-								"", machine_registers[RAX],
+							addInstruction(result, X86_IDIVQ, bin_op->right,
+								machine_registers[RAX],
 								machine_registers[RAX], machine_registers[RDX]);
-							debug("\t%s", result.back().notation.c_str());
+							debugInstruction("\t%s", result.back());
 						}
-						result.push_back(Instruction("movq " +
-							Instruction::Input(0) + ", " + Instruction::Output(0),
-							1, &machine_registers[RAX], 1, &value_storage,
-							1, NULL, true));
-						debug("\t%s", result.back().notation.c_str());
+						addRegisterMove(result, machine_registers[RAX], value_storage);
+						debugInstruction("\t%s", result.back());
 						break;
 					default:
 						Error::fatalError("X86_64Assembler::translateExpressionTemplate unexpected binary operation");
@@ -532,15 +827,12 @@ void X86_64Assembler::translateExpressionTemplate(IR::Expression *templ,
 			placeCallArguments(call->arguments, result);
 			assert(call->function->kind == IR::IR_LABELADDR);
 			IR::VirtualRegister **callersave = callersave_registers.data();
-			result.push_back(Instruction("call " + 
-				IR::ToLabelAddressExpression(call->function)->label->getName(),
-				0, NULL, callersave_count, callersave));
+			result.push_back(Instruction(X86_CALL,
+				Operand::Label(IR::ToLabelAddressExpression(call->function)->label),
+				Operand(), 0, NULL, callersave_count, callersave));
 			removeCallArguments(call->arguments, result);
 			if (value_storage != NULL)
-				result.push_back(Instruction("movq " + Instruction::Input(0) +
-					", " + Instruction::Output(0),
-					1, &machine_registers[RAX], 1, &value_storage,
-					1, NULL, true));
+				addRegisterMove(result, machine_registers[RAX], value_storage);
 			break;
 		}
 		default:
@@ -548,19 +840,6 @@ void X86_64Assembler::translateExpressionTemplate(IR::Expression *templ,
 	}
 }
 
-const char *cond_jumps[] = {
-	"je",
-	"jne",
-	"jl",
-	"jle",
-	"jg",
-	"jge",
-	"jb",
-	"jbe",
-	"ja",
-	"jae",
-};
-
 void X86_64Assembler::translateStatementTemplate(IR::Statement *templ,
 	const std::list<TemplateChildInfo> &children, Instructions &result)
 {
@@ -568,49 +847,44 @@ void X86_64Assembler::translateStatementTemplate(IR::Statement *templ,
 		case IR::IR_JUMP: {
 			IR::JumpStatement *jump = IR::ToJumpStatement(templ);
 			assert(jump->dest->kind == IR::IR_LABELADDR);
-			result.push_back(Instruction("jmp " +
-				IR::ToLabelAddressExpression(jump->dest)->label->getName(),
-				0, NULL, 0, NULL, 1, &IR::ToLabelAddressExpression(jump->dest)->label));
+			result.push_back(Instruction(X86_JMP,
+				Operand::Label(IR::ToLabelAddressExpression(jump->dest)->label),
+				Operand(), 0, NULL, 0, NULL,
+				1, &IR::ToLabelAddressExpression(jump->dest)->label));
 			break;
 		}
 		case IR::IR_COND_JUMP: {
 			IR::CondJumpStatement *jump = IR::ToCondJumpStatement(templ);
-			addInstruction(result, "cmp ", jump->right, ", ", jump->left);
+			addInstruction(result, X86_CMP, jump->right, jump->left);
 			IR::Label *destinations[] = {NULL, jump->true_dest};
-			result.push_back(Instruction(std::string(cond_jumps[jump->comparison]) +
-				" " + jump->true_dest->getName(), 0, NULL, 0, NULL, 2, destinations));
+			result.push_back(Instruction(X86_JE + jump->comparison,
+				Operand::Label(jump->true_dest), Operand(),
+				0, NULL, 0, NULL, 2, destinations));
 			break;
 		}
 		case IR::IR_LABEL:
-			result.push_back(Instruction(
-				IR::ToLabelPlacementStatement(templ)->label->getName() + ":"));
+			result.push_back(Instruction(X86_LABEL,
+				Operand::Label(IR::ToLabelPlacementStatement(templ)->label)));
 			break;
 		case IR::IR_MOVE: {
 			IR::MoveStatement *move = IR::ToMoveStatement(templ);
-			const char *cmd = "movq ";
 			IR::Expression *from = move->from;
 			if (move->from->kind == IR::IR_BINARYOP) {
 				assert(move->to->kind == IR::IR_REGISTER);
-				IR::MemoryExpression *fake_addr = new IR::MemoryExpression(move->from);
-				addInstruction(result, "leaq ", fake_addr, ", "  + Instruction::Output(0),
+				IR::MemoryExpression fake_addr(move->from);
+				addInstruction(result, X86_LEAQ, &fake_addr,
 					ToRegisterExpression(move->to)->reg);
-				delete fake_addr;
 			} else if (move->from->kind == IR::IR_MEMORY) {
 				assert(move->to->kind == IR::IR_REGISTER);
-				addInstruction(result, "movq ", move->from, ", " + Instruction::Output(0),
+				addInstruction(result, X86_MOVQ, move->from,
 					ToRegisterExpression(move->to)->reg);
 			} else {
 				if (move->to->kind == IR::IR_REGISTER)
-					addInstruction(result, "movq ", move->from, ", " + Instruction::Output(0),
+					addInstruction(result, X86_MOVQ, move->from,
 						ToRegisterExpression(move->to)->reg);
 				else {
 					assert(move->to->kind == IR::IR_MEMORY);
-					std::vector<IR::VirtualRegister *> registers;
-					std::string operand0, operand1;
-					makeOperand(move->from, registers, operand0);
-					makeOperand(move->to, registers, operand1);
-					result.push_back(Instruction("movq " + operand0 + ", " +
-						operand1, registers.size(), registers.data(), 0, NULL));
+					addInstruction(result, X86_MOVQ, move->from, move->to);
 				}
 			}
 			break;
@@ -622,24 +896,575 @@ void X86_64Assembler::translateStatementTemplate(IR::Statement *templ,
 
 void X86_64Assembler::translateBlob(const IR::Blob& blob, Instructions& result)
 {
-	result.push_back(Instruction(blob.label->getName() + ":"));
-	std::string content = "";
-	for (int i = 0; i < blob.data.size(); i++) {
-		char buf[20];
-		sprintf(buf, ".byte 0x%.2x\n", blob.data[i]);
-		content += buf;
+	result.push_back(Instruction(X86_LABEL, Operand::Label(blob.label)));
+	for (size_t i = 0; i < blob.data.size(); i++)
+		result.push_back(Instruction(X86_BYTE,
+			Operand::Immediate((unsigned char)blob.data[i])));
+}
+
+static void AppendInteger(std::string &output, int value)
+{
+	char buf[12];
+	char *end = buf + sizeof(buf);
+	char *p = end;
+	unsigned int magnitude = (value < 0) ? 0U - value : value;
+	do {
+		*--p = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude != 0);
+	if (value < 0)
+		*--p = '-';
+	output.append(p, end - p);
+}
+
+void X86_64Assembler::appendRegister(std::string &output,
+	IR::VirtualRegister *reg)
+{
+	int index = reg->getIndex();
+	if (((size_t)index < register_texts.size()) && (register_texts[index] != NULL))
+		output += register_texts[index];
+	else
+		output += reg->getName();
+}
+
+void X86_64Assembler::formatOperand(const Instruction &inst,
+	const Operand &operand, const IR::RegisterMap *register_map,
+	std::string &output)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	switch (operand.kind) {
+		case OPERAND_REGISTER: {
+			const std::vector<IR::VirtualRegister *> &registers =
+				operand.is_output ? inst.outputs : inst.inputs;
+			if ((size_t)operand.reg >= registers.size())
+				Error::fatalError("Misformed instruction");
+			appendRegister(output, MapRegister(register_map, registers[operand.reg]));
+			break;
+		}
+		case OPERAND_MACHINE_REGISTER:
+			appendRegister(output, operand.machine_reg);
+			break;
+		case OPERAND_IMMEDIATE:
+			if (inst.opcode == X86_BYTE) {
+				output += "0x";
+				output += hex_digits[(operand.value >> 4) & 0xF];
+				output += hex_digits[operand.value & 0xF];
+			} else {
+				output += '$';
+				AppendInteger(output, operand.value);
+			}
+			break;
+		case OPERAND_LABEL_ADDRESS:
+			output += '$';
+			output += operand.label->getName();
+			break;
+		case OPERAND_LABEL:
+			output += operand.label->getName();
+			break;
+		case OPERAND_MEMORY:
+			if ((operand.reg == Operand::NO_REGISTER) &&
+					(operand.index == Operand::NO_REGISTER)) {
+				output += operand.label->getName();
+				if (operand.value > 0)
+					output += '+';
+				if (operand.value != 0)
+					AppendInteger(output, operand.value);
+			} else {
+				if ((operand.reg >= (int)inst.inputs.size()) ||
+						(operand.index >= (int)inst.inputs.size()))
+					Error::fatalError("Misformed instruction");
+				if (operand.value != 0)
+					AppendInteger(output, operand.value);
+				output += '(';
+				if (operand.reg != Operand::NO_REGISTER)
+					appendRegister(output, MapRegister(register_map, inst.inputs[operand.reg]));
+				if (operand.index != Operand::NO_REGISTER) {
+					output += ',';
+					appendRegister(output, MapRegister(register_map, inst.inputs[operand.index]));
+					output += ',';
+					output += (char)('0' + operand.scale);
+				}
+				output += ')';
+			}
+			break;
 	}
-	result.push_back(Instruction(content));
 }
 
+void X86_64Assembler::formatInstruction(const Instruction &inst,
+	const IR::RegisterMap *register_map, std::string &output)
+{
+	if (inst.opcode == X86_LABEL) {
+		formatOperand(inst, inst.operands[0], register_map, output);
+		output += ':';
+		return;
+	}
+	output += mnemonics[inst.opcode];
+	for (int i = 0; i < Instruction::MAX_OPERANDS; i++) {
+		if (inst.operands[i].kind == OPERAND_NONE)
+			break;
+		output += (i == 0) ? " " : ", ";
+		formatOperand(inst, inst.operands[i], register_map, output);
+	}
+}
+
+#ifdef DEBUG
+void X86_64Assembler::debugInstruction(const char *msg, const Instruction &inst)
+{
+	std::string text;
+	formatInstruction(inst, NULL, text);
+	debug(msg, text.c_str());
+}
+#endif
+
 void X86_64Assembler::getBlobSectionHeader(std::string& header)
 {
-	header = ".section\t.rodata\n";
+	header += ".section\t.rodata\n";
 }
 
 void X86_64Assembler::getCodeSectionHeader(std::string& header)
 {
-	header = ".text\n.global main\n";
+	header += ".text\n.global main\n";
+}
+
+/**
+ * Operand with registers replaced by their numbers in machine code
+ */
+struct X86_64Assembler::EncodedOperand {
+	enum {NONE, REGISTER, MEMORY, IMMEDIATE} kind;
+	/**
+	 * The register or the memory base, -1 for an absolute address
+	 */
+	int reg;
+	/**
+	 * Memory index register, -1 if none
+	 */
+	int index;
+	int scale;
+	int value;
+	/**
+	 * Label whose address is added to value, or NULL
+	 */
+	IR::Label *label;
+	
+	bool isRegisterOrMemory() const
+	{
+		return (kind == REGISTER) || (kind == MEMORY);
+	}
+};
+
+void X86_64Assembler::encodeOperand(const Instruction &inst,
+	const Operand &operand, const IR::RegisterMap *register_map,
+	EncodedOperand &result) const
+{
+	IR::VirtualRegister *reg = NULL;
+	result.reg = -1;
+	result.index = -1;
+	result.scale = operand.scale;
+	result.value = operand.value;
+	result.label = NULL;
+	switch (operand.kind) {
+		case OPERAND_NONE:
+			result.kind = EncodedOperand::NONE;
+			break;
+		case OPERAND_REGISTER: {
+			const std::vector<IR::VirtualRegister *> &registers =
+				operand.is_output ? inst.outputs : inst.inputs;
+			if ((size_t)operand.reg >= registers.size())
+				Error::fatalError("Misformed instruction");
+			result.kind = EncodedOperand::REGISTER;
+			reg = registers[operand.reg];
+			break;
+		}
+		case OPERAND_MACHINE_REGISTER:
+			result.kind = EncodedOperand::REGISTER;
+			reg = operand.machine_reg;
+			break;
+		case OPERAND_IMMEDIATE:
+			result.kind = EncodedOperand::IMMEDIATE;
+			break;
+		case OPERAND_LABEL_ADDRESS:
+			result.kind = EncodedOperand::IMMEDIATE;
+			result.value = 0;
+			result.label = operand.label;
+			break;
+		case OPERAND_MEMORY:
+			result.kind = EncodedOperand::MEMORY;
+			if ((operand.reg >= (int)inst.inputs.size()) ||
+					(operand.index >= (int)inst.inputs.size()))
+				Error::fatalError("Misformed instruction");
+			if (operand.index != Operand::NO_REGISTER) {
+				result.index = encodeRegister(inst.inputs[operand.index],
+					register_map);
+				// Index 100 means there is no index
+				if (result.index == 4)
+					Error::fatalError("%rsp cannot be an index register");
+			}
+			if (operand.reg != Operand::NO_REGISTER)
+				reg = inst.inputs[operand.reg];
+			else if (operand.index == Operand::NO_REGISTER)
+				result.label = operand.label;
+			break;
+		default:
+			Error::fatalError("Operand cannot be encoded");
+	}
+	if (reg != NULL)
+		result.reg = encodeRegister(reg, register_map);
+}
+
+int X86_64Assembler::encodeRegister(IR::VirtualRegister *reg,
+	const IR::RegisterMap *register_map) const
+{
+	IR::VirtualRegister *machine_reg = MapRegister(register_map, reg);
+	int index = machine_reg->getIndex();
+	if (((size_t)index >= register_codes.size()) || (register_codes[index] < 0))
+		Error::fatalError("Register " + machine_reg->getName() +
+			" is not a machine register");
+	return register_codes[index];
+}
+
+static bool FitsInByte(int value)
+{
+	return (value >= -128) && (value <= 127);
+}
+
+/**
+ * Little endian 32 bit value, taken from the label address at link time
+ * if there is a label
+ */
+static void EmitInt32(MachineCode &code, int value, IR::Label *label = NULL)
+{
+	if (label != NULL) {
+		code.references.push_back(MachineCode::Reference(
+			MachineCode::ADDRESS_32S, code.bytes.size(), label, value));
+		value = 0;
+	}
+	for (int i = 0; i < 4; i++)
+		code.bytes.push_back((value >> (8*i)) & 0xFF);
+}
+
+/**
+ * REX prefix if needed, one byte opcode, then ModRM byte with reg as its
+ * register field and whatever it takes to address rm
+ */
+void X86_64Assembler::emitModRM(MachineCode &code, bool wide, int opcode,
+	int reg, const EncodedOperand &rm)
+{
+	assert(rm.isRegisterOrMemory());
+	int base = (rm.reg < 0) ? 0 : rm.reg;
+	int index = (rm.index < 0) ? 0 : rm.index;
+	int rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) |
+		((base & 8) >> 3);
+	if (rex != 0x40)
+		code.bytes.push_back(rex);
+	code.bytes.push_back(opcode);
+	reg = (reg & 7) << 3;
+	if (rm.kind == EncodedOperand::REGISTER) {
+		code.bytes.push_back(0xC0 | reg | (rm.reg & 7));
+		return;
+	}
+	// SIB byte scale and index fields, index 100 meaning none
+	int scale_index = 0x20;
+	if (rm.index >= 0) {
+		int scale_bits = (rm.scale == 8) ? 3 : (rm.scale == 4) ? 2 :
+			(rm.scale == 2) ? 1 : 0;
+		scale_index = (scale_bits << 6) | ((rm.index & 7) << 3);
+	}
+	if (rm.reg < 0) {
+		// SIB byte with base 101 and mod 00 has no base, only a
+		// 32 bit displacement
+		code.bytes.push_back(0x04 | reg);
+		code.bytes.push_back(scale_index | 0x05);
+		EmitInt32(code, rm.value, rm.label);
+		return;
+	}
+	int mod;
+	// Base 101 without displacement would mean RIP relative or no base
+	if ((rm.value == 0) && ((rm.reg & 7) != 5))
+		mod = 0x00;
+	else if (FitsInByte(rm.value))
+		mod = 0x40;
+	else
+		mod = 0x80;
+	// Base 100 means there is a SIB byte, which also holds any index
+	if ((rm.index >= 0) || ((rm.reg & 7) == 4)) {
+		code.bytes.push_back(mod | reg | 0x04);
+		code.bytes.push_back(scale_index | (rm.reg & 7));
+	} else
+		code.bytes.push_back(mod | reg | (rm.reg & 7));
+	if (mod == 0x40)
+		code.bytes.push_back(rm.value & 0xFF);
+	else if (mod == 0x80)
+		EmitInt32(code, rm.value);
+}
+
+void X86_64Assembler::encodeInstruction(const Instruction &inst,
+	const IR::RegisterMap *register_map, MachineCode &result)
+{
+	switch (inst.opcode) {
+		case X86_LABEL:
+			result.labels.push_back(MachineCode::LabelPosition(
+				inst.operands[0].label, result.bytes.size()));
+			return;
+		case X86_CALLEE_SAVE:
+			return;
+		case X86_BYTE:
+			result.bytes.push_back(inst.operands[0].value);
+			return;
+		case X86_RET:
+			result.bytes.push_back(0xC3);
+			return;
+		case X86_CQO:
+			result.bytes.push_back(0x48);
+			result.bytes.push_back(0x99);
+			return;
+		case X86_CALL:
+			if (inst.operands[0].kind != OPERAND_LABEL)
+				Error::fatalError("Indirect call cannot be encoded");
+			result.bytes.push_back(0xE8);
+			result.references.push_back(MachineCode::Reference(
+				MachineCode::RELATIVE_32, result.bytes.size(),
+				inst.operands[0].label, -4));
+			EmitInt32(result, 0);
+			return;
+	}
+	
+	EncodedOperand op0, op1;
+	encodeOperand(inst, inst.operands[0], register_map, op0);
+	encodeOperand(inst, inst.operands[1], register_map, op1);
+	switch (inst.opcode) {
+		case X86_MOVQ:
+			if ((op0.kind == EncodedOperand::IMMEDIATE) && op1.isRegisterOrMemory()) {
+				emitModRM(result, true, 0xC7, 0, op1);
+				EmitInt32(result, op0.value, op0.label);
+				return;
+			} else if ((op0.kind == EncodedOperand::REGISTER) && op1.isRegisterOrMemory()) {
+				emitModRM(result, true, 0x89, op0.reg, op1);
+				return;
+			} else if ((op0.kind == EncodedOperand::MEMORY) &&
+					(op1.kind == EncodedOperand::REGISTER)) {
+				emitModRM(result, true, 0x8B, op1.reg, op0);
+				return;
+			}
+			break;
+		case X86_LEAQ:
+			if ((op0.kind == EncodedOperand::MEMORY) &&
+					(op1.kind == EncodedOperand::REGISTER)) {
+				emitModRM(result, true, 0x8D, op1.reg, op0);
+				return;
+			}
+			break;
+		case X86_ADDQ:
+		case X86_SUBQ:
+		case X86_CMP: {
+			// ModRM extension with an immediate, register to r/m,
+			// r/m to register, %rax with a 32 bit immediate
+			static const int opcodes[][4] = {
+				{0, 0x01, 0x03, 0x05},
+				{5, 0x29, 0x2B, 0x2D},
+				{7, 0x39, 0x3B, 0x3D},
+			};
+			const int *opcode = opcodes[(inst.opcode == X86_ADDQ) ? 0 :
+				(inst.opcode == X86_SUBQ) ? 1 : 2];
+			if ((op0.kind == EncodedOperand::IMMEDIATE) && op1.isRegisterOrMemory()) {
+				if ((op0.label == NULL) && FitsInByte(op0.value)) {
+					emitModRM(result, true, 0x83, opcode[0], op1);
+					result.bytes.push_back(op0.value & 0xFF);
+				} else if ((op1.kind == EncodedOperand::REGISTER) && (op1.reg == 0)) {
+					result.bytes.push_back(0x48);
+					result.bytes.push_back(opcode[3]);
+					EmitInt32(result, op0.value, op0.label);
+				} else {
+					emitModRM(result, true, 0x81, opcode[0], op1);
+					EmitInt32(result, op0.value, op0.label);
+				}
+				return;
+			} else if ((op0.kind == EncodedOperand::REGISTER) && op1.isRegisterOrMemory()) {
+				emitModRM(result, true, opcode[1], op0.reg, op1);
+				return;
+			} else if ((op0.kind == EncodedOperand::MEMORY) &&
+					(op1.kind == EncodedOperand::REGISTER)) {
+				emitModRM(result, true, opcode[2], op1.reg, op0);
+				return;
+			}
+			break;
+		}
+		case X86_SHLQ:
+			// The assembler has a shorter form for shifts by 1
+			if ((op0.kind == EncodedOperand::IMMEDIATE) && (op0.label == NULL) &&
+					op1.isRegisterOrMemory()) {
+				if (op0.value == 1)
+					emitModRM(result, true, 0xD1, 4, op1);
+				else {
+					emitModRM(result, true, 0xC1, 4, op1);
+					result.bytes.push_back(op0.value & 0xFF);
+				}
+				return;
+			}
+			break;
+		case X86_IMULQ:
+		case X86_IDIVQ:
+			if (op0.isRegisterOrMemory() && (op1.kind == EncodedOperand::NONE)) {
+				emitModRM(result, true, 0xF7,
+					(inst.opcode == X86_IMULQ) ? 5 : 7, op0);
+				return;
+			}
+			break;
+		case X86_PUSH:
+			if (op0.kind == EncodedOperand::REGISTER) {
+				if (op0.reg >= 8)
+					result.bytes.push_back(0x41);
+				result.bytes.push_back(0x50 + (op0.reg & 7));
+				return;
+			} else if (op0.kind == EncodedOperand::MEMORY) {
+				emitModRM(result, false, 0xFF, 6, op0);
+				return;
+			}
+			break;
+	}
+	std::string text;
+	formatInstruction(inst, register_map, text);
+	Error::fatalError("Cannot encode " + text);
+}
+
+/**
+ * Jump taken out of the code until the distance to its destination
+ * is known
+ */
+struct PendingJump {
+	/**
+	 * Position in the code without jumps
+	 */
+	size_t position;
+	int opcode;
+	IR::Label *destination;
+	/**
+	 * Index in the labels of the code, -1 if placed in other code
+	 */
+	int destination_index;
+	bool is_long;
+	
+	PendingJump(size_t _position, int _opcode, IR::Label *_destination) :
+		position(_position), opcode(_opcode), destination(_destination),
+		destination_index(-1), is_long(false) {}
+	
+	int getSize() const
+	{
+		if (! is_long)
+			return 2;
+		else if (opcode == X86_JMP)
+			return 5;
+		else
+			return 6;
+	}
+};
+
+/**
+ * Condition codes of X86_JE to X86_JAE
+ */
+static const unsigned char jump_conditions[] = {
+	0x4, 0x5, 0xC, 0xE, 0xF, 0xD, 0x2, 0x6, 0x7, 0x3,
+};
+
+void X86_64Assembler::encodeInstructions(const Instructions &code,
+	const IR::RegisterMap *register_map, MachineCode &result)
+{
+	// Everything but the jumps is encoded first. Jumps then start short
+	// and only grow when their destination is too far, as GNU as does it
+	MachineCode body;
+	std::vector<PendingJump> jumps;
+	// Number of jumps before each label and reference in body
+	std::vector<size_t> label_jumps, reference_jumps;
+	for (Instructions::const_iterator inst = code.begin();
+			inst != code.end(); inst++) {
+		if (isRedundantMove(*inst, register_map))
+			continue;
+		if (((*inst).opcode >= X86_JE) && ((*inst).opcode <= X86_JMP)) {
+			if ((*inst).operands[0].kind != OPERAND_LABEL)
+				Error::fatalError("Indirect jump cannot be encoded");
+			jumps.push_back(PendingJump(body.bytes.size(), (*inst).opcode,
+				(*inst).operands[0].label));
+			continue;
+		}
+		encodeInstruction(*inst, register_map, body);
+		label_jumps.resize(body.labels.size(), jumps.size());
+		reference_jumps.resize(body.references.size(), jumps.size());
+	}
+	
+	std::map<IR::Label *, int> label_index;
+	for (size_t i = 0; i < body.labels.size(); i++)
+		label_index[body.labels[i].label] = i;
+	for (size_t j = 0; j < jumps.size(); j++) {
+		std::map<IR::Label *, int>::iterator index =
+			label_index.find(jumps[j].destination);
+		if (index != label_index.end())
+			jumps[j].destination_index = index->second;
+		else
+			jumps[j].is_long = true;
+	}
+	
+	// Size of the first N jumps
+	std::vector<size_t> jumps_size(jumps.size() + 1, 0);
+	bool changed = true;
+	while (changed) {
+		for (size_t j = 0; j < jumps.size(); j++)
+			jumps_size[j+1] = jumps_size[j] + jumps[j].getSize();
+		changed = false;
+		for (size_t j = 0; j < jumps.size(); j++)
+			if (! jumps[j].is_long) {
+				int dest = jumps[j].destination_index;
+				long distance = 
+					(long)(body.labels[dest].offset + jumps_size[label_jumps[dest]]) -
+					(long)(jumps[j].position + jumps_size[j] + 2);
+				if ((distance < -128) || (distance > 127)) {
+					jumps[j].is_long = true;
+					changed = true;
+				}
+			}
+	}
+	
+	size_t base = result.bytes.size();
+	result.bytes.reserve(base + body.bytes.size() + jumps_size[jumps.size()]);
+	for (size_t i = 0; i < body.labels.size(); i++)
+		result.labels.push_back(MachineCode::LabelPosition(body.labels[i].label,
+			base + body.labels[i].offset + jumps_size[label_jumps[i]]));
+	size_t copied = 0;
+	size_t reference = 0;
+	for (size_t j = 0; j <= jumps.size(); j++) {
+		size_t end = (j < jumps.size()) ? jumps[j].position : body.bytes.size();
+		result.bytes.insert(result.bytes.end(), body.bytes.begin() + copied,
+			body.bytes.begin() + end);
+		copied = end;
+		for (; (reference < body.references.size()) &&
+				(reference_jumps[reference] <= j); reference++) {
+			MachineCode::Reference ref = body.references[reference];
+			ref.offset += base + jumps_size[j];
+			result.references.push_back(ref);
+		}
+		if (j == jumps.size())
+			break;
+		
+		const PendingJump &jump = jumps[j];
+		if (jump.opcode == X86_JMP)
+			result.bytes.push_back(jump.is_long ? 0xE9 : 0xEB);
+		else if (jump.is_long) {
+			result.bytes.push_back(0x0F);
+			result.bytes.push_back(0x80 | jump_conditions[jump.opcode - X86_JE]);
+		} else
+			result.bytes.push_back(0x70 | jump_conditions[jump.opcode - X86_JE]);
+		int distance = 0;
+		if (jump.destination_index >= 0) {
+			int dest = jump.destination_index;
+			distance = (body.labels[dest].offset + jumps_size[label_jumps[dest]]) -
+				(jump.position + jumps_size[j+1]);
+		} else
+			result.references.push_back(MachineCode::Reference(
+				MachineCode::RELATIVE_32, result.bytes.size(),
+				jump.destination, -4));
+		if (jump.is_long)
+			EmitInt32(result, distance);
+		else
+			result.bytes.push_back(distance & 0xFF);
+	}
 }
 
 void X86_64Assembler::framePrologue(IR::Label *fcn_label,
@@ -647,18 +1472,18 @@ void X86_64Assembler::framePrologue(IR::Label *fcn_label,
 {
 	int framesize = ((IR::X86_64Frame *)frame)->getFrameSize();
 	if (framesize > 0)
-		result.push_front(Instruction("subq $" + IntToStr(framesize) +
-			", %rsp"));
-	result.push_front(Instruction(fcn_label->getName() + ":"));
+		result.push_front(Instruction(X86_SUBQ, Operand::Immediate(framesize),
+			Operand::MachineRegister(machine_registers[RSP])));
+	result.push_front(Instruction(X86_LABEL, Operand::Label(fcn_label)));
 }
 
 void X86_64Assembler::frameEpilogue(IR::AbstractFrame *frame, Instructions &result)
 {
 	int framesize = ((IR::X86_64Frame *)frame)->getFrameSize();
 	if (framesize > 0)
-		result.push_back(Instruction("addq $" + IntToStr(framesize) +
-			", %rsp"));
-	result.push_back(Instruction("ret"));
+		result.push_back(Instruction(X86_ADDQ, Operand::Immediate(framesize),
+			Operand::MachineRegister(machine_registers[RSP])));
+	result.push_back(Instruction(X86_RET));
 }
 
 void X86_64Assembler::functionPrologue(IR::Label *fcn_label,
@@ -666,14 +1491,12 @@ void X86_64Assembler::functionPrologue(IR::Label *fcn_label,
 	std::vector<IR::VirtualRegister *> &prologue_regs)
 {
 	IR::VirtualRegister **calleesave = calleesave_registers.data();
-	result.push_back(Instruction("# callee-save registers",
+	result.push_back(Instruction(X86_CALLEE_SAVE, Operand(), Operand(),
 		0, NULL, calleesave_count, calleesave));
 	prologue_regs.resize(calleesave_count);
 	for (int i = 0; i < calleesave_count; i++) {
 		prologue_regs[i] = IRenvironment->addRegister();
-		result.push_back(Instruction("movq " + Instruction::Input(0) +
-			", " + Instruction::Output(0),
-			1, &calleesave_registers[i], 1, &prologue_regs[i], 1, NULL, true));
+		addRegisterMove(result, calleesave_registers[i], prologue_regs[i]);
 	}
 	
 	const std::list<IR::AbstractVarLocation *>parameters =
@@ -685,10 +1508,8 @@ void X86_64Assembler::functionPrologue(IR::Label *fcn_label,
 			assert((*param)->isRegister());
 			IR::VirtualRegister *storage_reg =
 				((IR::X86_64VarLocation *) *param)->getRegister();
-			result.push_back(Instruction(std::string("movq ") +
-				Instruction::Input(0) + ", " + Instruction::Output(0),
-				1, &machine_registers[paramreg_list[param_index]], 
-				1, &storage_reg, 1, NULL, true));
+			addRegisterMove(result, machine_registers[paramreg_list[param_index]],
+				storage_reg);
 		} else
 			assert(! (*param)->isRegister());
 		param_index++;
@@ -698,10 +1519,7 @@ void X86_64Assembler::functionPrologue(IR::Label *fcn_label,
 		assert(parent_fp->isRegister());
 		IR::VirtualRegister *storage_reg =
 			((IR::X86_64VarLocation *) parent_fp)->getRegister();
-		result.push_back(Instruction(std::string("movq ") +
-			Instruction::Input(0) + ", " + Instruction::Output(0),
-			1, &machine_registers[R10], 
-			1, &storage_reg, 1, NULL, true));
+		addRegisterMove(result, machine_registers[R10], storage_reg);
 	}
 }
 
@@ -711,138 +1529,101 @@ void X86_64Assembler::functionEpilogue(IR::AbstractFrame *frame,
 	Instructions &result)
 {
 	if (result_storage != NULL)
-		result.push_back(Instruction("movq " + Instruction::Input(0) + ", " +
-			Instruction::Output(0), 1, &result_storage, 1, &machine_registers[RAX],
-			1, NULL, true));
+		addRegisterMove(result, result_storage, machine_registers[RAX]);
 
 	IR::VirtualRegister **calleesave = calleesave_registers.data();
 	assert(prologue_regs.size() == calleesave_registers.size());
-	for (int i = 0; i < calleesave_count; i++) {
-		result.push_back(Instruction("movq " + Instruction::Input(0) +
-			", " + Instruction::Output(0),
-			1, &prologue_regs[i], 1, &calleesave_registers[i], 1, NULL, true));
-	}
-	result.push_back(Instruction("# callee-save registers",
+	for (int i = 0; i < calleesave_count; i++)
+		addRegisterMove(result, prologue_regs[i], calleesave_registers[i]);
+	result.push_back(Instruction(X86_CALLEE_SAVE, Operand(), Operand(),
 		calleesave_count, calleesave, 0, NULL));
 }
 
 void X86_64Assembler::programPrologue(IR::AbstractFrame *frame, Instructions &result)
 {
-	IR::Label label(0, "main");
-	framePrologue(&label, frame, result);
+	framePrologue(main_label, frame, result);
 }
 
 void X86_64Assembler::programEpilogue(IR::AbstractFrame *frame, Instructions &result)
 {
-	result.push_back(Instruction("movq $0, %rax"));
+	result.push_back(Instruction(X86_MOVQ, Operand::Immediate(0),
+		Operand::MachineRegister(machine_registers[RAX])));
 	frameEpilogue(frame, result);
 }
 
 /**
- * Replace &iX (X = inputreg_index) with (semantically) &iX + offset
+ * Make the operand using input register X (X = inputreg_index) use
+ * (semantically) register X + offset instead
  */
-void X86_64Assembler::addOffset(std::string &command, int inputreg_index, int offset)
-{
-	std::string p = std::string("&i") + IntToStr(inputreg_index);
-	assert(p.size() == 3);
-	const char *s = command.c_str();
-	const char *t = strstr(s, p.c_str());
-	assert(t != NULL);
-	int pos = t - s;
-	
-	assert((pos > 0) && (pos + p.size() < command.size()));
-	assert((s[pos-1] == ' ') || (s[pos-1] == '('));
-	std::string result;
+void X86_64Assembler::addOffset(Instruction &inst, int inputreg_index, int offset)
+{
+	Operand *operand = inst.findInputOperand(inputreg_index);
+	assert(operand != NULL);
 	
-	if (s[pos-1] == ' ') {
-		assert(! strncmp(s, "movq", 4));
-		result = "leaq " + IntToStr(offset) + "(" + p + ")" +
-			command.substr(pos + p.size(), command.size() - (pos + p.size()));
+	if (operand->kind == OPERAND_REGISTER) {
+		assert(inst.opcode == X86_MOVQ);
+		inst.opcode = X86_LEAQ;
+		inst.is_reg_to_reg_assign = false;
+		*operand = Operand::Memory(inputreg_index, offset);
 	} else {
-		assert(s[pos + p.size()] == ')');
-		int before_offset = pos;
-		while ((before_offset > 0) && (s[before_offset] != ' '))
-			before_offset--;
-		assert(before_offset > 0);
-		int existing_offset = 0;
-		if (before_offset < pos-1)
-			existing_offset = atoi(command.substr(before_offset+1,
-				pos - (before_offset+1)).c_str());
-		std::string offset_s;
-		if (existing_offset + offset == 0)
-			offset_s = "";
-		else
-			offset_s = IntToStr(existing_offset+offset);
-		result = command.substr(0, before_offset+1) +
-			offset_s + command.substr(pos-1, command.size() - (pos-1));
+		assert(operand->kind == OPERAND_MEMORY);
+		// The register is to become %rsp, which cannot be an index
+		if (operand->index == inputreg_index) {
+			if (operand->scale != 1)
+				Error::fatalError("Scaled frame pointer in a memory address");
+			std::swap(operand->reg, operand->index);
+		}
+		operand->value += offset;
 	}
-	debug("%s +%d -> %s", command.c_str(), offset, result.c_str());
-	command = result;
+	debugInstruction("+offset -> %s", inst);
 }
 
 void X86_64Assembler::implementFramePointer(IR::AbstractFrame* frame, Instructions& result)
 {
 	for (Instructions::iterator inst = result.begin(); inst != result.end(); inst++) {
-		debug("Inserting frame pointer: %s", (*inst).notation.c_str());
+		debugInstruction("Inserting frame pointer: %s", *inst);
 		for (int i = 0; i < (*inst).outputs.size(); i++)
 			if ((*inst).outputs[i]->getIndex() == frame->getFramePointer()->getIndex())
 				Error::fatalError("Cannot write to frame pointer");
 		for (int i = 0; i < (*inst).inputs.size(); i++)
 			if ((*inst).inputs[i]->getIndex() == frame->getFramePointer()->getIndex()) {
 				(*inst).inputs[i] = machine_registers[RSP];
-				addOffset((*inst).notation, i,
-					((IR::X86_64Frame *)frame)->getFrameSize());
+				addOffset(*inst, i, ((IR::X86_64Frame *)frame)->getFrameSize());
 				break;
 			}
 	}
 }
 
-int findRegister(const std::string &notation, bool input, int index)
-{
-	const char *s = notation.c_str();
-	std::string part;
-	if (input)
-		part = "&i" + IntToStr(index);
-	else
-		part = "&o" + IntToStr(index);
-	const char *t = strstr(s, part.c_str());
-	if (t == NULL)
-		return -1;
-	else
-		return t-s;
-}
-
 void X86_64Assembler::replaceRegisterUsage(Instructions &code,
 	std::list<Instruction>::iterator inst, IR::VirtualRegister *reg,
-	IR::MemoryExpression *replacement)
+	IR::MemoryExpression *replacement, SpillResult &spill_result)
 {
 	for (int i = 0; i < (*inst).inputs.size(); i++)
 		if ((*inst).inputs[i]->getIndex() == reg->getIndex()) {
 			bool need_splitting = true;
-			const std::string &original = (*inst).notation;
+			Operand *operand = NULL;
 			if (((*inst).outputs.size() > 0) &&
 					((*inst).outputs[0]->getIndex() != reg->getIndex()) &&
 					((*inst).inputs.size() == 1)) {
-				int pos = findRegister(original, true, 0);
-				assert(pos > 0);
-				need_splitting = original[pos-1] == '(';
+				operand = (*inst).findInputOperand(0);
+				assert(operand != NULL);
+				need_splitting = operand->kind == OPERAND_MEMORY;
 			}
 			if (! need_splitting) {
-				std::string storage_notation;
 				(*inst).inputs.clear();
-				makeOperand(replacement, (*inst).inputs, storage_notation);
-				int pos = findRegister(original, true, 0);
-				std::string new_command = original.substr(0, pos) +
-					storage_notation + original.substr(pos+3,
-					original.size() - (pos+3));
-				debug("spilling %s -> %s", original.c_str(), new_command.c_str());
-				(*inst).notation = new_command;
+				makeOperand(replacement, (*inst).inputs, *operand);
 				(*inst).is_reg_to_reg_assign = false;
+				debugInstruction("spilling -> %s", *inst);
 			} else {
 				IR::VirtualRegister *temp = IRenvironment->addRegister();
-				addInstruction(code, "movq ", replacement, ", " + Instruction::Output(0), temp,
-					NULL, NULL, &inst);
-				(*inst).inputs[i] = temp;
+				Instructions::iterator load = addInstruction(code, X86_MOVQ,
+					replacement, temp, NULL, NULL, &inst);
+				// The register may be both base and index of an address
+				for (size_t j = i; j < (*inst).inputs.size(); j++)
+					if ((*inst).inputs[j]->getIndex() == reg->getIndex())
+						(*inst).inputs[j] = temp;
+				spill_result.inserted.push_back(&*load);
+				spill_result.temporaries.push_back(temp);
 			}
 			return;
 		}
@@ -850,139 +1631,181 @@ void X86_64Assembler::replaceRegisterUsage(Instructions &code,
 
 void X86_64Assembler::replaceRegisterAssignment(Instructions &code,
 	std::list<Instruction>::iterator inst, IR::VirtualRegister *reg,
-	IR::MemoryExpression *replacement)
+	IR::MemoryExpression *replacement, SpillResult &spill_result)
 {
 	for (int i = 0; i < (*inst).outputs.size(); i++)
 		if ((*inst).outputs[i]->getIndex() == reg->getIndex()) {
 			bool need_splitting;
-			const std::string &original = (*inst).notation;
 			if ((*inst).inputs.size() > 1)
 				need_splitting = true;
 			else if ((*inst).inputs.size() == 0)
 				need_splitting = false;
 			else {
-				int pos = findRegister(original, true, 0);
-				assert(pos > 0);
-				need_splitting = original[pos-1] == '(';
+				Operand *operand = (*inst).findInputOperand(0);
+				assert(operand != NULL);
+				need_splitting = operand->kind == OPERAND_MEMORY;
 			}
 			if (! need_splitting) {
-				std::string storage_notation;
-				makeOperand(replacement, (*inst).inputs, storage_notation);
-				int pos = findRegister(original, false, 0);
-				assert(pos == original.size()-3);
-				std::string new_command = original.substr(0, pos) +
-					storage_notation;
-				debug("spilling %s -> %s", original.c_str(), new_command.c_str());
-				(*inst).notation = new_command;
+				Operand *operand = (*inst).findOutputOperand(0);
+				assert((operand != NULL) &&
+					(operand == &(*inst).operands[Instruction::MAX_OPERANDS-1]));
+				makeOperand(replacement, (*inst).inputs, *operand);
 				(*inst).is_reg_to_reg_assign = false;
+				debugInstruction("spilling -> %s", *inst);
 			} else {
 				IR::VirtualRegister *temp = IRenvironment->addRegister();
 				(*inst).outputs[i] = temp;
-				const std::string &original = (*inst).notation;
 				inst++;
 
 				std::vector<IR::VirtualRegister *> registers;
 				registers.push_back(temp);
-				std::string operand0 = Instruction::Input(0);
-				std::string operand1;
-				makeOperand(replacement, registers, operand1);
-				std::string new_command = "movq " + operand0 + ", " + operand1;
-				code.insert(inst, Instruction(new_command, registers.size(),
-					registers.data(), 0, NULL));
-				debug("spilling %s -> append %s", original.c_str(),
-					new_command.c_str());
+				Operand storage;
+				makeOperand(replacement, registers, storage);
+				Instructions::iterator store = code.insert(inst,
+					Instruction(X86_MOVQ, Operand::Input(0), storage,
+						registers.size(), registers.data(), 0, NULL));
+				debugInstruction("spilling -> append %s", *store);
+				spill_result.inserted.push_back(&*store);
+				spill_result.temporaries.push_back(temp);
 			}
 		}
 }
 
-void X86_64Assembler::spillRegister(IR::AbstractFrame *frame, Instructions &code,
-	IR::VirtualRegister *reg)
+struct X86_64Assembler::SpilledRegister {
+	IR::VirtualRegister *reg;
+	IR::Expression *storage_exp;
+	bool seen_usage, seen_assignment;
+};
+
+void X86_64Assembler::spillPrespilledAt(Instructions &code,
+	Instructions::iterator inst, SpilledRegister &spilled,
+	SpillResult &spill_result)
 {
-	if (reg->isPrespilled()) {
-		IR::X86_64VarLocation *stored_location =
-			(IR::X86_64VarLocation *)reg->getPrespilledLocation();
-		IR::Expression *storage_exp =
-			stored_location->createCode(stored_location->owner_frame);
-		
-		Instructions::iterator inst = code.begin();
-		bool seen_usage = false, seen_assignment = false;
-		for (Instructions::iterator inst = code.begin(); inst != code.end(); inst++) {
-			bool is_assigned = false;
-			for (int i = 0; i < (*inst).outputs.size(); i++)
-				if ((*inst).outputs[i]->getIndex() == reg->getIndex()) {
-					is_assigned = true;
-					seen_assignment = true;
-					assert((*inst).is_reg_to_reg_assign);
-					assert(! seen_usage);
-					assert(! seen_assignment);
-					assert((*inst).inputs.size() == 1);
-					assert((*inst).outputs.size() == 1);
-					std::string storage_notation;
-					makeOperand(storage_exp, (*inst).inputs, storage_notation);
-					
-					const std::string &s = (*inst).notation;
-					assert(s.substr(s.size()-3, 3) == "&o0");
-					std::string replacement = s.substr(0, s.size()-3) +
-						storage_notation;
-					debug("Spilling %s -> %s", s.c_str(),
-						  replacement.c_str());
-					(*inst).notation = replacement;
-					(*inst).is_reg_to_reg_assign = false;
-				}
-			
-			bool is_used = false;
-			for (int i = 0; i < (*inst).inputs.size(); i++)
-				if ((*inst).inputs[i]->getIndex() == reg->getIndex()) {
-					assert(! is_assigned);
-					assert(seen_assignment);
-					is_used = true;
-					seen_usage = true;
-					break;
-				}
-			if (is_used)
-				replaceRegisterUsage(code, inst, reg,
-					IR::ToMemoryExpression(storage_exp));
+	IR::VirtualRegister *reg = spilled.reg;
+	bool is_assigned = false;
+	for (size_t i = 0; i < (*inst).outputs.size(); i++)
+		if ((*inst).outputs[i]->getIndex() == reg->getIndex()) {
+			is_assigned = true;
+			spilled.seen_assignment = true;
+			assert((*inst).is_reg_to_reg_assign);
+			assert(! spilled.seen_usage);
+			assert(! spilled.seen_assignment);
+			assert((*inst).inputs.size() == 1);
+			assert((*inst).outputs.size() == 1);
+			Operand *operand = (*inst).findOutputOperand(0);
+			assert(operand != NULL);
+			makeOperand(spilled.storage_exp, (*inst).inputs, *operand);
+			(*inst).is_reg_to_reg_assign = false;
+			debugInstruction("Spilling -> %s", *inst);
 		}
-		IR::DestroyExpression(storage_exp);
-	} else {
-		IR::X86_64VarLocation *stored_location =
-			(IR::X86_64VarLocation *)frame->addVariable(".store." + reg->getName(),
-				8, true);
-		IR::Expression *storage_exp = IR::ToMemoryExpression(
-			stored_location->createCode(stored_location->owner_frame));
-		
-		for (Instructions::iterator inst = code.begin(); inst != code.end(); inst++) {
-			debug("Spilling: %s", (*inst).notation.c_str());
-			bool is_assigned = false, is_used = false;
-			for (int i = 0; i < (*inst).outputs.size(); i++)
-				if ((*inst).outputs[i]->getIndex() == reg->getIndex())
-					is_assigned = true;
+	
+	bool is_used = false;
+	for (size_t i = 0; i < (*inst).inputs.size(); i++)
+		if ((*inst).inputs[i]->getIndex() == reg->getIndex()) {
+			assert(! is_assigned);
+			assert(spilled.seen_assignment);
+			is_used = true;
+			spilled.seen_usage = true;
+			break;
+		}
+	if (is_used)
+		replaceRegisterUsage(code, inst, reg,
+			IR::ToMemoryExpression(spilled.storage_exp), spill_result);
+}
+
+void X86_64Assembler::spillAt(Instructions &code, Instructions::iterator inst,
+	SpilledRegister &spilled, SpillResult &spill_result)
+{
+	IR::VirtualRegister *reg = spilled.reg;
+	debugInstruction("Spilling: %s", *inst);
+	bool is_assigned = false, is_used = false;
+	for (size_t i = 0; i < (*inst).outputs.size(); i++)
+		if ((*inst).outputs[i]->getIndex() == reg->getIndex())
+			is_assigned = true;
+	for (size_t i = 0; i < (*inst).inputs.size(); i++)
+		if ((*inst).inputs[i]->getIndex() == reg->getIndex())
+			is_used = true;
+	if (is_used) {
+		if (! is_assigned)
+			replaceRegisterUsage(code, inst, reg,
+				IR::ToMemoryExpression(spilled.storage_exp), spill_result);
+		else {
+			IR::VirtualRegister *temp = IRenvironment->addRegister();
+			Instructions::iterator load = addInstruction(code, X86_MOVQ,
+				spilled.storage_exp, temp, NULL, NULL, &inst);
+			spill_result.inserted.push_back(&*load);
+			spill_result.temporaries.push_back(temp);
 			for (int i = 0; i < (*inst).inputs.size(); i++)
 				if ((*inst).inputs[i]->getIndex() == reg->getIndex())
-					is_used = true;
-			if (is_used) {
-				if (! is_assigned)
-					replaceRegisterUsage(code, inst, reg,
-						IR::ToMemoryExpression(storage_exp));
-				else {
-					IR::VirtualRegister *temp = IRenvironment->addRegister();
-					addInstruction(code, "movq ", storage_exp,
-						", " + Instruction::Output(0), temp,
-						NULL, NULL, &inst);
-					for (int i = 0; i < (*inst).inputs.size(); i++)
-						if ((*inst).inputs[i]->getIndex() == reg->getIndex())
-							(*inst).inputs[i] = temp;
-					replaceRegisterAssignment(code, inst, reg,
-						IR::ToMemoryExpression(storage_exp));
-				}
-			} else if (is_assigned) {
-				replaceRegisterAssignment(code, inst, reg,
-					IR::ToMemoryExpression(storage_exp));
-			}
+					(*inst).inputs[i] = temp;
+			replaceRegisterAssignment(code, inst, reg,
+				IR::ToMemoryExpression(spilled.storage_exp), spill_result);
 		}
+	} else if (is_assigned) {
+		replaceRegisterAssignment(code, inst, reg,
+			IR::ToMemoryExpression(spilled.storage_exp), spill_result);
+	}
+}
+
+void X86_64Assembler::spillRegisters(IR::AbstractFrame *frame,
+	Instructions &code, const std::vector<IR::VirtualRegister *> &registers,
+	SpillResult &result)
+{
+	std::vector<SpilledRegister> spilled(registers.size());
+	std::vector<int> spilled_by_id;
+	for (size_t i = 0; i < registers.size(); i++) {
+		IR::VirtualRegister *reg = registers[i];
+		spilled[i].reg = reg;
+		spilled[i].seen_usage = spilled[i].seen_assignment = false;
+		if (reg->isPrespilled()) {
+			IR::X86_64VarLocation *stored_location =
+				(IR::X86_64VarLocation *)reg->getPrespilledLocation();
+			spilled[i].storage_exp =
+				stored_location->createCode(stored_location->owner_frame);
+		} else {
+			IR::X86_64VarLocation *stored_location =
+				(IR::X86_64VarLocation *)frame->addVariable(
+					".store." + reg->getName(), 8, true);
+			spilled[i].storage_exp = IR::ToMemoryExpression(
+				stored_location->createCode(stored_location->owner_frame));
+		}
+		if ((size_t)reg->getIndex() >= spilled_by_id.size())
+			spilled_by_id.resize(reg->getIndex()+1, -1);
+		spilled_by_id[reg->getIndex()] = i;
+	}
+	
+	std::vector<int> spilled_here;
+	for (Instructions::iterator inst = code.begin(); inst != code.end(); inst++) {
+		spilled_here.clear();
+		for (size_t i = 0; i < (*inst).inputs.size(); i++) {
+			size_t id = (*inst).inputs[i]->getIndex();
+			if ((id < spilled_by_id.size()) && (spilled_by_id[id] >= 0))
+				spilled_here.push_back(spilled_by_id[id]);
+		}
+		for (size_t i = 0; i < (*inst).outputs.size(); i++) {
+			size_t id = (*inst).outputs[i]->getIndex();
+			if ((id < spilled_by_id.size()) && (spilled_by_id[id] >= 0))
+				spilled_here.push_back(spilled_by_id[id]);
+		}
+		if (spilled_here.empty())
+			continue;
+		std::sort(spilled_here.begin(), spilled_here.end());
+		spilled_here.erase(std::unique(spilled_here.begin(), spilled_here.end()),
+			spilled_here.end());
 		
-		IR::DestroyExpression(storage_exp);
+		// Same order as spilling the registers one by one
+		for (size_t i = 0; i < spilled_here.size(); i++) {
+			SpilledRegister &reg = spilled[spilled_here[i]];
+			if (reg.reg->isPrespilled())
+				spillPrespilledAt(code, inst, reg, result);
+			else
+				spillAt(code, inst, reg, result);
+		}
+		result.rewritten.push_back(&*inst);
 	}
+	
+	for (size_t i = 0; i < spilled.size(); i++)
+		IR::DestroyExpression(spilled[i].storage_exp);
 }
 
 }
@@ -7,39 +7,73 @@ namespace Asm {
 
 class X86_64Assembler: public Assembler {
 private:
-	std::vector<IR::Expression *> memory_exp;
-	IR::Expression *exp_int, *exp_label, *exp_register;
-	IR::Expression *exp_mul_index[8], *exp_mul_index_plus[8];
 	std::vector<IR::VirtualRegister *>machine_registers;
 	std::vector<IR::VirtualRegister *>available_registers,
 		callersave_registers, calleesave_registers;
+	/**
+	 * Holds main_label, which is outside the program's label numbering
+	 */
+	IR::LabelFactory program_labels;
+	IR::Label *main_label;
+	/**
+	 * Number in machine code of each machine register by its index,
+	 * -1 for other registers
+	 */
+	std::vector<int> register_codes;
+	/**
+	 * Names of the machine registers by index, NULL for other registers
+	 */
+	std::vector<const char *> register_texts;
 	
-	void make_arithmetic(int asm_code, IR::BinaryOp ir_code);
-	void make_comparison(int asm_code, IR::ComparisonOp ir_code);
-	void make_assignment();
-	void addInstruction(Instructions &result,
-		const std::string &prefix, IR::Expression *operand,
-		const std::string &suffix, IR::VirtualRegister *output0,
+	/**
+	 * Instruction with operand and, if output0 is the only output,
+	 * Output(0) as the second operand
+	 */
+	Instructions::iterator addInstruction(Instructions &result,
+		int opcode, IR::Expression *operand, IR::VirtualRegister *output0,
 		IR::VirtualRegister *extra_input = NULL,
 		IR::VirtualRegister *extra_output = NULL,
 		Instructions::iterator *insert_before = NULL);
 	void addInstruction(Instructions &result,
-		const std::string &prefix, IR::Expression *operand0,
-		const std::string &suffix, IR::Expression *operand1);
+		int opcode, IR::Expression *operand0, IR::Expression *operand1);
+	void addRegisterMove(Instructions &result, IR::VirtualRegister *from,
+		IR::VirtualRegister *to);
 	void makeOperand(IR::Expression *expression,
 		std::vector<IR::VirtualRegister *> &add_inputs,
-		std::string &notation);
-	void placeCallArguments(const std::list<IR::Expression *> &arguments,
+		Operand &operand);
+	void placeCallArguments(const IR::ExpressionList &arguments,
 		Instructions &result);
-	void removeCallArguments(const std::list<IR::Expression *> &arguments,
+	void removeCallArguments(const IR::ExpressionList &arguments,
 		Instructions &result);
-	void addOffset(std::string &command, int inputreg_index, int offset);
+	void addOffset(Instruction &inst, int inputreg_index, int offset);
+	void appendRegister(std::string &output, IR::VirtualRegister *reg);
+	void formatOperand(const Instruction &inst, const Operand &operand,
+		const IR::RegisterMap *register_map, std::string &output);
+#ifdef DEBUG
+	void debugInstruction(const char *msg, const Instruction &inst);
+#else
+	void debugInstruction(const char *, const Instruction &) {}
+#endif
 	void replaceRegisterUsage(Instructions &code,
 		std::list<Instruction>::iterator inst, IR::VirtualRegister *reg,
-		IR::MemoryExpression *replacement);
+		IR::MemoryExpression *replacement, SpillResult &spill_result);
 	void replaceRegisterAssignment(Instructions &code,
 		std::list<Instruction>::iterator inst, IR::VirtualRegister *reg,
-		IR::MemoryExpression *replacement);
+		IR::MemoryExpression *replacement, SpillResult &spill_result);
+	struct SpilledRegister;
+	void spillPrespilledAt(Instructions &code, Instructions::iterator inst,
+		SpilledRegister &spilled, SpillResult &spill_result);
+	void spillAt(Instructions &code, Instructions::iterator inst,
+		SpilledRegister &spilled, SpillResult &spill_result);
+	struct EncodedOperand;
+	void encodeOperand(const Instruction &inst, const Operand &operand,
+		const IR::RegisterMap *register_map, EncodedOperand &result) const;
+	int encodeRegister(IR::VirtualRegister *reg,
+		const IR::RegisterMap *register_map) const;
+	void encodeInstruction(const Instruction &inst,
+		const IR::RegisterMap *register_map, MachineCode &result);
+	static void emitModRM(MachineCode &code, bool wide, int opcode, int reg,
+		const EncodedOperand &rm);
 protected:
 	virtual void translateExpressionTemplate(IR::Expression *templ,
 		IR::AbstractFrame *frame, IR::VirtualRegister *value_storage,
@@ -47,6 +81,8 @@ protected:
 	virtual void translateStatementTemplate(IR::Statement *templ,
 		const std::list<TemplateChildInfo> &children, Instructions &result);
 	virtual void translateBlob(const IR::Blob &blob, Instructions &result);
+	virtual void formatInstruction(const Instruction &inst,
+		const IR::RegisterMap *register_map, std::string &output);
 	virtual void getCodeSectionHeader(std::string &header);
 	virtual void getBlobSectionHeader(std::string &header);
 	virtual void functionPrologue(IR::Label *fcn_label,
@@ -66,8 +102,12 @@ protected:
 public:
 	virtual const std::vector<IR::VirtualRegister *> &getAvailableRegisters()
 		{return available_registers;}
-	virtual void spillRegister(IR::AbstractFrame *frame, Instructions &code,
-		IR::VirtualRegister *reg);
+	virtual void spillRegisters(IR::AbstractFrame *frame, Instructions &code,
+		const std::vector<IR::VirtualRegister *> &registers,
+		SpillResult &result);
+	virtual void encodeInstructions(const Instructions &code,
+		const IR::RegisterMap *register_map, MachineCode &result);
+	virtual IR::Label *getProgramLabel() {return main_label;}
 
 	X86_64Assembler(IR::IREnvironment *ir_env);
 };